@@ -0,0 +1,98 @@
+#include "corpus.h"
+
+#include <capnp/message.h>
+#include <capnp/rpc.capnp.h>
+#include <kj/debug.h>
+
+#include <cstring>
+
+#include "reader_options.h"
+#include "test.capnp.h"
+
+namespace capnp_trace {
+namespace bench {
+
+// Small enough that every Data blob of a multi-segment message overflows into a new segment
+static const uint32_t kSmallSegmentWords = 16;
+
+static void AddMessage(kj::Vector<capnp::word>& stream, kj::Vector<size_t>& sizes,
+                       size_t& segment_count, capnp::MessageBuilder& builder) {
+  segment_count += builder.getSegmentsForOutput().size();
+  auto words = capnp::messageToFlatArray(builder);
+  stream.addAll(words);
+  sizes.add(words.asBytes().size());
+}
+
+static Corpus Finish(kj::Vector<capnp::word>&& stream, const kj::Vector<size_t>& sizes,
+                     size_t segment_count) {
+  Corpus corpus;
+  corpus.stream        = stream.releaseAsArray();
+  corpus.segment_count = segment_count;
+  auto bytes           = corpus.stream.asBytes();
+  size_t offset        = 0;
+  for (auto size : sizes) {
+    corpus.messages.add(bytes.slice(offset, offset + size));
+    offset += size;
+  }
+  return corpus;
+}
+
+kj::Vector<kj::Own<capnp::FlatArrayMessageReader>> Corpus::Read() const {
+  const auto options = GetUnlimitedReaderOptions();
+  kj::Vector<kj::Own<capnp::FlatArrayMessageReader>> readers(messages.size());
+  for (auto message : messages) {
+    auto words = kj::arrayPtr(reinterpret_cast<const capnp::word*>(message.begin()),
+                              message.size() / sizeof(capnp::word));
+    readers.add(kj::heap<capnp::FlatArrayMessageReader>(words, options));
+  }
+  return readers;
+}
+
+Corpus MakeCallCorpus(size_t count, size_t payload_size, size_t segments) {
+  KJ_REQUIRE(segments > 0, "message has at least one segment");
+  kj::Vector<capnp::word> stream;
+  kj::Vector<size_t> sizes(count);
+  size_t segment_count = 0;
+  // A single segment message is allocated at once like most of real messages
+  const uint32_t first_segment_words =
+      segments == 1 ? static_cast<uint32_t>(payload_size / sizeof(capnp::word) + 64)
+                    : kSmallSegmentWords;
+  const auto allocation_strategy = segments == 1 ? capnp::SUGGESTED_ALLOCATION_STRATEGY
+                                                 : capnp::AllocationStrategy::FIXED_SIZE;
+  for (size_t i = 0; i < count; i++) {
+    capnp::MallocMessageBuilder builder(first_segment_words, allocation_strategy);
+    auto call = builder.initRoot<capnp::rpc::Message>().initCall();
+    call.setQuestionId(static_cast<uint32_t>(i));
+    call.setInterfaceId(capnp::typeId<capnp_trace::test::TestInterface>());
+    call.setMethodId(0);
+    auto list = call.initParams().getContent().initAs<capnp::List<capnp::Data>>(segments);
+    for (size_t j = 0; j < segments; j++) {
+      auto blob = list.init(j, payload_size / segments);
+      memset(blob.begin(), static_cast<int>(i + j), blob.size());
+    }
+    AddMessage(stream, sizes, segment_count, builder);
+  }
+  return Finish(kj::mv(stream), sizes, segment_count);
+}
+
+Corpus MakeFooCallCorpus(size_t count) {
+  kj::Vector<capnp::word> stream;
+  kj::Vector<size_t> sizes(count);
+  size_t segment_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    capnp::MallocMessageBuilder builder;
+    auto call = builder.initRoot<capnp::rpc::Message>().initCall();
+    call.setQuestionId(static_cast<uint32_t>(i));
+    call.setInterfaceId(capnp::typeId<capnp_trace::test::TestInterface>());
+    call.setMethodId(0);
+    auto params =
+        call.initParams().getContent().initAs<capnp_trace::test::TestInterface::FooParams>();
+    params.setI(static_cast<uint32_t>(i));
+    params.setJ(i % 2 == 0);
+    AddMessage(stream, sizes, segment_count, builder);
+  }
+  return Finish(kj::mv(stream), sizes, segment_count);
+}
+
+}  // namespace bench
+}  // namespace capnp_trace
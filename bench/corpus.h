@@ -0,0 +1,40 @@
+#pragma once
+
+#include <capnp/common.h>
+#include <capnp/serialize.h>
+#include <kj/array.h>
+#include <kj/memory.h>
+#include <kj/vector.h>
+
+#include <cstddef>
+
+namespace capnp_trace {
+namespace bench {
+
+/// @brief Serialized Cap'n Proto RPC messages which are concatenated like a captured stream
+struct Corpus {
+  // Every message starts at a word boundary of the stream
+  kj::Array<capnp::word> stream;
+
+  // Each message in `stream`
+  kj::Vector<kj::ArrayPtr<kj::byte>> messages;
+
+  // Total number of segments of all messages
+  size_t segment_count = 0;
+
+  kj::ArrayPtr<kj::byte> bytes() { return stream.asBytes(); }
+
+  /// @brief Decode every message in place, e.g. to pass them to RpcMessageHandler
+  kj::Vector<kj::Own<capnp::FlatArrayMessageReader>> Read() const;
+};
+
+/// @brief CALL messages whose params contain `payload_size` bytes of Data
+/// @param segments Number of Data blobs in each message. Each blob is allocated in a new small
+/// segment if it is more than 1, so the actual number of segments is counted in segment_count.
+Corpus MakeCallCorpus(size_t count, size_t payload_size, size_t segments);
+
+/// @brief CALL messages of test.capnp:TestInterface.foo, which have real params to be formatted
+Corpus MakeFooCallCorpus(size_t count);
+
+}  // namespace bench
+}  // namespace capnp_trace
@@ -0,0 +1,41 @@
+#include "counters.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+static std::atomic<uint64_t> allocation_count{0};
+
+// Global operator new is replaced to count allocations of the code under benchmark
+void* operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  void* ptr = malloc(size > 0 ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+namespace capnp_trace {
+namespace bench {
+
+uint64_t GetAllocationCount() { return allocation_count.load(std::memory_order_relaxed); }
+
+void SetMessageCounters(benchmark::State& state, uint64_t messages, uint64_t bytes,
+                        uint64_t allocations) {
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+  state.counters["msgs/s"] =
+      benchmark::Counter(static_cast<double>(messages), benchmark::Counter::kIsRate);
+  state.counters["allocs/msg"] =
+      messages > 0 ? static_cast<double>(allocations) / static_cast<double>(messages) : 0;
+}
+
+}  // namespace bench
+}  // namespace capnp_trace
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+#include <stdint.h>
+
+#include <cstddef>
+
+namespace capnp_trace {
+namespace bench {
+
+/// @brief Number of operator new calls in this process so far
+/// @details Segments of capnp::MallocMessageBuilder are allocated by calloc(3) and not counted.
+uint64_t GetAllocationCount();
+
+/// @brief Report msgs/s, bytes/s and allocs/msg of a benchmark
+/// @param messages Number of messages handled in all iterations
+/// @param bytes Number of bytes of the messages
+/// @param allocations Number of operator new calls in all iterations
+void SetMessageCounters(benchmark::State& state, uint64_t messages, uint64_t bytes,
+                        uint64_t allocations);
+
+}  // namespace bench
+}  // namespace capnp_trace
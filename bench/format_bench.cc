@@ -0,0 +1,53 @@
+#include <benchmark/benchmark.h>
+#include <capnp/rpc.capnp.h>
+#include <kj/filesystem.h>
+
+#include <string>
+
+#include "corpus.h"
+#include "counters.h"
+#include "immutable_schema_registry.h"
+#include "output_sink.h"
+#include "rpc_message_formatter.h"
+
+static const size_t kMessageCount = 1024;
+
+// Format CALL messages like OutputRpcMessage of capnp_trace, i.e. format each message into a line
+// which is reused for every message and write it to OutputSink, which writes to /dev/null
+static void BM_FormatCall(benchmark::State& state) {
+  capnp_trace::ImmutableSchemaRegistry::Init();
+  capnp_trace::RpcMessageFormatter formatter;
+  formatter
+      .SetOutputFormat(state.range(0) ? capnp_trace::RpcMessageFormatter::OutputFormat::kJsonLines
+                                      : capnp_trace::RpcMessageFormatter::OutputFormat::kText)
+      .SetColor(state.range(1) != 0);
+  auto corpus  = capnp_trace::bench::MakeFooCallCorpus(kMessageCount);
+  auto readers = corpus.Read();
+  capnp_trace::OutputSink sink(kj::newDiskFilesystem()->getRoot().appendFile(
+      kj::Path({"dev", "null"}), kj::WriteMode::MODIFY));
+  capnp_trace::RpcMessageFormatter::State format_state;
+  capnp_trace::StreamInfo stream_info(1, 1, capnp_trace::StreamInfo::Direction::kOut, 3,
+                                      "/tmp/capnp_trace_bench.sock");
+  std::string line;
+
+  const uint64_t allocations = capnp_trace::bench::GetAllocationCount();
+  for (auto _ : state) {
+    for (size_t i = 0; i < readers.size(); i++) {
+      stream_info.timestamp_ = i + 1;
+      line.clear();
+      formatter.Format(format_state, stream_info, readers[i]->getRoot<capnp::rpc::Message>(),
+                       line);
+      line += '\n';
+      sink.Write(kj::arrayPtr(line.data(), line.size()));
+    }
+    // Questions are never answered in the corpus
+    format_state.answer_id_maps.clear();
+  }
+  sink.Flush();
+
+  capnp_trace::bench::SetMessageCounters(state, state.iterations() * kMessageCount,
+                                         state.iterations() * corpus.bytes().size(),
+                                         capnp_trace::bench::GetAllocationCount() - allocations);
+}
+// format 0: text, 1: jsonl
+BENCHMARK(BM_FormatCall)->ArgNames({"format", "color"})->ArgsProduct({{0, 1}, {0, 1}});
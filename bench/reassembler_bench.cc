@@ -0,0 +1,54 @@
+#include <benchmark/benchmark.h>
+#include <capnp/rpc.capnp.h>
+
+#include <algorithm>
+
+#include "corpus.h"
+#include "counters.h"
+#include "rpc_message_reassembler.h"
+
+// About 1 MiB of messages for each payload size
+static size_t GetMessageCount(size_t payload_size) {
+  return std::max<size_t>(16, (1 << 20) / payload_size);
+}
+
+static void BM_Reassemble(benchmark::State& state) {
+  const size_t payload_size = state.range(0);
+  const size_t chunk_size   = state.range(2);
+  auto corpus = capnp_trace::bench::MakeCallCorpus(GetMessageCount(payload_size), payload_size,
+                                                   state.range(1));
+  uint64_t handled = 0;
+  capnp_trace::RpcMessageReassembler reassembler(
+      [&handled](capnp_trace::StreamInfo, capnp::rpc::Message::Reader&& message,
+                 kj::ArrayPtr<kj::byte>) {
+        benchmark::DoNotOptimize(message.which());
+        handled++;
+      },
+      capnp_trace::StreamInfo(1, 1, capnp_trace::StreamInfo::Direction::kOut, 3,
+                              "/tmp/capnp_trace_bench.sock"));
+
+  const uint64_t allocations = capnp_trace::bench::GetAllocationCount();
+  for (auto _ : state) {
+    if (chunk_size == 0) {
+      for (auto message : corpus.messages) {
+        reassembler.Reassemble(reinterpret_cast<char*>(message.begin()), message.size());
+      }
+    } else {
+      auto bytes = corpus.bytes();
+      for (size_t offset = 0; offset < bytes.size(); offset += chunk_size) {
+        reassembler.Reassemble(reinterpret_cast<char*>(bytes.begin() + offset),
+                               std::min(chunk_size, bytes.size() - offset));
+      }
+    }
+  }
+
+  capnp_trace::bench::SetMessageCounters(state, handled, state.iterations() * corpus.bytes().size(),
+                                         capnp_trace::bench::GetAllocationCount() - allocations);
+  state.counters["segments/msg"] =
+      static_cast<double>(corpus.segment_count) / corpus.messages.size();
+}
+// Chunk size is the size of captured data. 0 means that each chunk is exactly one message, and
+// 1000 splits messages at unaligned points.
+BENCHMARK(BM_Reassemble)
+    ->ArgNames({"payload", "segments", "chunk"})
+    ->ArgsProduct({{64, 4096, 65536}, {1, 8}, {0, 1000, 65536}});
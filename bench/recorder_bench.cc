@@ -0,0 +1,86 @@
+#include <benchmark/benchmark.h>
+#include <capnp/rpc.capnp.h>
+#include <kj/filesystem.h>
+
+#include "corpus.h"
+#include "counters.h"
+#include "immutable_schema_registry.h"
+#include "rpc_message_recorder.h"
+
+static const size_t kMessageCount = 1024;
+static const size_t kBufferSize   = 1 << 20;
+
+static capnp_trace::StreamInfo GetStreamInfo(uint64_t timestamp) {
+  capnp_trace::StreamInfo stream_info(1, 1, capnp_trace::StreamInfo::Direction::kOut, 3,
+                                      "/tmp/capnp_trace_bench.sock");
+  stream_info.timestamp_ = timestamp;
+  return stream_info;
+}
+
+// Record every message of `corpus` to `recorder`
+static void RecordAll(capnp_trace::RpcMessageRecorder& recorder,
+                      capnp_trace::bench::Corpus& corpus,
+                      kj::Vector<kj::Own<capnp::FlatArrayMessageReader>>& readers) {
+  for (size_t i = 0; i < readers.size(); i++) {
+    recorder.Record(GetStreamInfo(i + 1), readers[i]->getRoot<capnp::rpc::Message>(),
+                    corpus.messages[i]);
+  }
+}
+
+// Records are written to /dev/null, so that only buffering and write(2) are measured
+static void BM_Record(benchmark::State& state) {
+  const auto compression = state.range(1) ? capnp_trace::RpcMessageRecorder::Compression::kPacked
+                                          : capnp_trace::RpcMessageRecorder::Compression::kNone;
+  auto corpus  = capnp_trace::bench::MakeCallCorpus(kMessageCount, state.range(0), 1);
+  auto readers = corpus.Read();
+  auto output  = kj::newDiskFilesystem()->getRoot().appendFile(kj::Path({"dev", "null"}),
+                                                               kj::WriteMode::MODIFY);
+  capnp_trace::RpcMessageRecorder recorder(kj::mv(output), compression);
+  recorder.SetFlushThreshold(kBufferSize, 0);
+
+  const uint64_t allocations = capnp_trace::bench::GetAllocationCount();
+  for (auto _ : state) {
+    RecordAll(recorder, corpus, readers);
+  }
+  recorder.Finish();
+
+  capnp_trace::bench::SetMessageCounters(state, state.iterations() * kMessageCount,
+                                         state.iterations() * corpus.bytes().size(),
+                                         capnp_trace::bench::GetAllocationCount() - allocations);
+}
+BENCHMARK(BM_Record)
+    ->ArgNames({"payload", "packed"})
+    ->ArgsProduct({{64, 4096, 65536}, {0, 1}});
+
+// Parse a file recorded in memory, which includes mmap and reading the index
+static void BM_ParseAll(benchmark::State& state) {
+  capnp_trace::ImmutableSchemaRegistry::Init();
+  const auto compression = state.range(1) ? capnp_trace::RpcMessageRecorder::Compression::kPacked
+                                          : capnp_trace::RpcMessageRecorder::Compression::kNone;
+  auto corpus  = capnp_trace::bench::MakeCallCorpus(kMessageCount, state.range(0), 1);
+  auto readers = corpus.Read();
+  auto file    = kj::newInMemoryFile(kj::nullClock());
+  {
+    capnp_trace::RpcMessageRecorder recorder(kj::newFileAppender(file->clone()), compression);
+    RecordAll(recorder, corpus, readers);
+    recorder.Finish();
+  }
+
+  uint64_t handled           = 0;
+  const uint64_t allocations = capnp_trace::bench::GetAllocationCount();
+  for (auto _ : state) {
+    capnp_trace::RpcMessageRecorder::Parser parser(
+        file->clone(), [&handled](capnp_trace::StreamInfo, capnp::rpc::Message::Reader&& message,
+                                  kj::ArrayPtr<kj::byte>) {
+          benchmark::DoNotOptimize(message.which());
+          handled++;
+        });
+    parser.ParseAll();
+  }
+
+  capnp_trace::bench::SetMessageCounters(state, handled, state.iterations() * corpus.bytes().size(),
+                                         capnp_trace::bench::GetAllocationCount() - allocations);
+}
+BENCHMARK(BM_ParseAll)
+    ->ArgNames({"payload", "packed"})
+    ->ArgsProduct({{64, 4096, 65536}, {0, 1}});
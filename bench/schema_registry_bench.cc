@@ -0,0 +1,38 @@
+#include <benchmark/benchmark.h>
+#include <capnp/schema-loader.h>
+
+#include "immutable_schema_registry.h"
+#include "method_table.h"
+#include "test.capnp.h"
+
+// Startup cost of the registry, which only sorts the table of compiled interfaces. The table has
+// hundreds of interfaces which are generated by bench/CMakeLists.txt.
+static void BM_RegistryInit(benchmark::State& state) {
+  for (auto _ : state) {
+    capnp_trace::ImmutableSchemaRegistry::Init();
+  }
+}
+BENCHMARK(BM_RegistryInit);
+
+// Cost of registering one interface, which was paid at startup for every compiled interface
+// before registration became lazy
+static void BM_LoadCompiledInterface(benchmark::State& state) {
+  for (auto _ : state) {
+    capnp::SchemaLoader loader;
+    loader.loadCompiledTypeAndDependencies<capnp_trace::test::TestInterface>();
+    capnp_trace::MethodTable methods;
+    methods.AddAll(loader);
+    benchmark::DoNotOptimize(methods.size());
+  }
+}
+BENCHMARK(BM_LoadCompiledInterface);
+
+// Cost of resolving the method of each CALL once its interface is registered
+static void BM_GetMethod(benchmark::State& state) {
+  capnp_trace::ImmutableSchemaRegistry::Init();
+  const uint64_t interface_id = capnp::typeId<capnp_trace::test::TestInterface>();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(&capnp_trace::ImmutableSchemaRegistry::GetMethod(interface_id, 0));
+  }
+}
+BENCHMARK(BM_GetMethod);
@@ -0,0 +1,343 @@
+// BPF program to capture unix domain socket streams of traced processes.
+//
+//   Arguments are saved at sys_enter_* and data is copied at sys_exit_* to ring buffer.
+//   Only processes in target_pids are traced. fds which are not unix domain sockets and fds which
+//   RpcBpfTracer marked as CAPNP_TRACE_BPF_FD_IGNORED are filtered in kernel.
+//
+#include <linux/bpf.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_helpers.h>
+#include <stddef.h>
+
+#include "capnp_trace_bpf.h"
+
+// bpf_probe_read_user requires GPL compatible license
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
+
+#define AF_UNIX 1
+#define S_IFMT 0170000
+#define S_IFSOCK 0140000
+
+// Kernel structures to find the socket of fd. Only used fields are declared, and their offsets
+// are relocated by libbpf with BTF of the running kernel (CO-RE).
+struct inode {
+  unsigned short i_mode;
+} __attribute__((preserve_access_index));
+
+struct sock_common {
+  unsigned short skc_family;
+} __attribute__((preserve_access_index));
+
+struct sock {
+  struct sock_common __sk_common;
+} __attribute__((preserve_access_index));
+
+struct socket {
+  struct sock* sk;
+} __attribute__((preserve_access_index));
+
+struct file {
+  struct inode* f_inode;
+  void* private_data;
+} __attribute__((preserve_access_index));
+
+struct fdtable {
+  unsigned int max_fds;
+  struct file** fd;
+} __attribute__((preserve_access_index));
+
+struct files_struct {
+  struct fdtable* fdt;
+} __attribute__((preserve_access_index));
+
+struct task_struct {
+  struct files_struct* files;
+} __attribute__((preserve_access_index));
+
+enum syscall_kind {
+  KIND_READ,  // read(2) and recvfrom(2)
+  KIND_READV,
+  KIND_WRITE,
+  KIND_WRITEV,
+  KIND_CONNECT,
+  KIND_CLOSE,
+};
+
+// See /sys/kernel/tracing/events/syscalls/sys_enter_*/format
+struct sys_enter_args {
+  __u64 common;
+  __s32 syscall_nr;
+  __u32 padding;
+  __u64 args[6];
+};
+
+// See /sys/kernel/tracing/events/syscalls/sys_exit_*/format
+struct sys_exit_args {
+  __u64 common;
+  __s32 syscall_nr;
+  __u32 padding;
+  __s64 ret;
+};
+
+struct inflight_syscall {
+  __s32 fd;
+  __u32 reserved;
+  __u64 buf;    // buffer, iovec or sockaddr
+  __u64 count;  // size or iovcnt
+};
+
+struct iovec64 {
+  __u64 base;
+  __u64 len;
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, 1024);
+  __type(key, __u32);
+  __type(value, __u8);
+} target_pids SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, 65536);
+  __type(key, struct capnp_trace_bpf_fd_key);
+  __type(value, __u8);
+} fd_states SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, 65536);
+  __type(key, __u32);
+  __type(value, struct inflight_syscall);
+} inflight_syscalls SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, 16 * 1024 * 1024);
+} events SEC(".maps");
+
+// capnp_trace_bpf_event is too large for BPF stack
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct capnp_trace_bpf_event);
+} scratch SEC(".maps");
+
+static __always_inline struct capnp_trace_bpf_event* make_event(__u64 pid_tgid, __s32 fd,
+                                                                __u32 type) {
+  __u32 zero                         = 0;
+  struct capnp_trace_bpf_event* event = bpf_map_lookup_elem(&scratch, &zero);
+  if (!event) {
+    return NULL;
+  }
+  event->tgid = pid_tgid >> 32;
+  event->tid  = (__u32)pid_tgid;
+  event->fd   = fd;
+  event->type = type;
+  event->len       = 0;
+  event->timestamp = bpf_ktime_get_ns() / 1000;
+  return event;
+}
+
+static __always_inline void emit_header(__u64 pid_tgid, __s32 fd, __u32 type) {
+  struct capnp_trace_bpf_event* event = make_event(pid_tgid, fd, type);
+  if (event) {
+    bpf_ringbuf_output(&events, event, offsetof(struct capnp_trace_bpf_event, data), 0);
+  }
+}
+
+// Emit `len` bytes of `buf` and return emitted size
+static __always_inline __u64 emit_buffer(__u64 pid_tgid, __s32 fd, __u32 type, __u64 buf,
+                                         __u64 len) {
+  struct capnp_trace_bpf_event* event = make_event(pid_tgid, fd, type);
+  if (!event) {
+    return 0;
+  }
+
+  __u64 emitted = 0;
+  for (int i = 0; i < CAPNP_TRACE_BPF_MAX_CHUNKS; i++) {
+    if (emitted >= len) {
+      break;
+    }
+    __u64 size = len - emitted;
+    if (size > CAPNP_TRACE_BPF_CHUNK_SIZE) {
+      size = CAPNP_TRACE_BPF_CHUNK_SIZE;
+    }
+    if (bpf_probe_read_user(event->data, size, (const void*)(buf + emitted)) != 0) {
+      break;
+    }
+    event->len = size;
+    bpf_ringbuf_output(&events, event, offsetof(struct capnp_trace_bpf_event, data) + size, 0);
+    emitted += size;
+  }
+  return emitted;
+}
+
+static __always_inline __u64 emit_iovec(__u64 pid_tgid, __s32 fd, __u32 type, __u64 iov_addr,
+                                        __u64 iovcnt, __u64 len) {
+  __u64 emitted = 0;
+  for (int i = 0; i < CAPNP_TRACE_BPF_MAX_IOV; i++) {
+    if (i >= iovcnt || emitted >= len) {
+      break;
+    }
+    struct iovec64 iov;
+    if (bpf_probe_read_user(&iov, sizeof(iov), (const void*)(iov_addr + i * sizeof(iov))) != 0) {
+      break;
+    }
+    __u64 size = len - emitted;
+    if (size > iov.len) {
+      size = iov.len;
+    }
+    __u64 iov_emitted = emit_buffer(pid_tgid, fd, type, iov.base, size);
+    emitted += iov_emitted;
+    if (iov_emitted != size) {
+      break;
+    }
+  }
+  return emitted;
+}
+
+// Whether fd of the current process is a unix domain socket, e.g. not a regular file or pipe
+static __always_inline int is_unix_socket(__s32 fd) {
+  struct task_struct* task = (struct task_struct*)bpf_get_current_task();
+  struct fdtable* fdt      = BPF_CORE_READ(task, files, fdt);
+  if (!fdt || fd < 0 || (__u32)fd >= BPF_CORE_READ(fdt, max_fds)) {
+    return 0;
+  }
+  struct file** fds = BPF_CORE_READ(fdt, fd);
+  struct file* file = NULL;
+  if (bpf_probe_read_kernel(&file, sizeof(file), &fds[fd]) != 0 || !file) {
+    return 0;
+  }
+  if ((BPF_CORE_READ(file, f_inode, i_mode) & S_IFMT) != S_IFSOCK) {
+    return 0;
+  }
+  struct socket* socket = BPF_CORE_READ(file, private_data);
+  return socket && BPF_CORE_READ(socket, sk, __sk_common.skc_family) == AF_UNIX;
+}
+
+static __always_inline void emit_truncated(__u64 pid_tgid, __s32 fd, __u32 type,
+                                           __u64 dropped_size) {
+  struct capnp_trace_bpf_event* event = make_event(pid_tgid, fd, CAPNP_TRACE_BPF_TRUNCATED);
+  if (!event) {
+    return;
+  }
+  struct capnp_trace_bpf_truncated truncated = {
+      .type         = type,
+      .dropped_size = dropped_size,
+  };
+  __builtin_memcpy(event->data, &truncated, sizeof(truncated));
+  event->len = sizeof(truncated);
+  bpf_ringbuf_output(&events, event,
+                     offsetof(struct capnp_trace_bpf_event, data) + sizeof(truncated), 0);
+}
+
+static __always_inline int on_enter(struct sys_enter_args* ctx) {
+  __u64 pid_tgid = bpf_get_current_pid_tgid();
+  __u32 tgid     = pid_tgid >> 32;
+  __u32 tid      = (__u32)pid_tgid;
+  if (!bpf_map_lookup_elem(&target_pids, &tgid)) {
+    return 0;
+  }
+
+  struct inflight_syscall inflight = {
+      .fd    = (__s32)ctx->args[0],
+      .buf   = ctx->args[1],
+      .count = ctx->args[2],
+  };
+  bpf_map_update_elem(&inflight_syscalls, &tid, &inflight, BPF_ANY);
+  return 0;
+}
+
+static __always_inline int on_exit(struct sys_exit_args* ctx, enum syscall_kind kind) {
+  __u64 pid_tgid = bpf_get_current_pid_tgid();
+  __u32 tid      = (__u32)pid_tgid;
+  struct inflight_syscall* saved = bpf_map_lookup_elem(&inflight_syscalls, &tid);
+  if (!saved) {
+    return 0;
+  }
+  struct inflight_syscall inflight = *saved;
+  bpf_map_delete_elem(&inflight_syscalls, &tid);
+  if (ctx->ret < 0) {
+    return 0;
+  }
+
+  struct capnp_trace_bpf_fd_key key = {
+      .tgid = pid_tgid >> 32,
+      .fd   = inflight.fd,
+  };
+  __u8* state = bpf_map_lookup_elem(&fd_states, &key);
+
+  if (kind == KIND_CLOSE) {
+    if (state && *state == CAPNP_TRACE_BPF_FD_TARGET) {
+      emit_header(pid_tgid, inflight.fd, CAPNP_TRACE_BPF_CLOSE);
+    }
+    bpf_map_delete_elem(&fd_states, &key);
+    return 0;
+  }
+
+  if (kind == KIND_CONNECT) {
+    // Check the socket again with the connected address
+    bpf_map_delete_elem(&fd_states, &key);
+    __u16 family = 0;
+    bpf_probe_read_user(&family, sizeof(family), (const void*)inflight.buf);
+    if (family == AF_UNIX && inflight.count > sizeof(family)) {
+      emit_buffer(pid_tgid, inflight.fd, CAPNP_TRACE_BPF_CONNECT, inflight.buf + sizeof(family),
+                  inflight.count - sizeof(family));
+    }
+    return 0;
+  }
+
+  if (state && *state == CAPNP_TRACE_BPF_FD_IGNORED) {
+    return 0;
+  }
+  if (!state && !is_unix_socket(inflight.fd)) {
+    // Regular files, pipes and other sockets are never sent to user space
+    __u8 ignored = CAPNP_TRACE_BPF_FD_IGNORED;
+    bpf_map_update_elem(&fd_states, &key, &ignored, BPF_ANY);
+    return 0;
+  }
+
+  __u64 len        = ctx->ret;
+  __u64 emitted    = 0;
+  const __u32 type = (kind == KIND_READ || kind == KIND_READV) ? CAPNP_TRACE_BPF_IN
+                                                               : CAPNP_TRACE_BPF_OUT;
+  switch (kind) {
+    case KIND_READ:
+      emitted = emit_buffer(pid_tgid, inflight.fd, CAPNP_TRACE_BPF_IN, inflight.buf, len);
+      break;
+    case KIND_READV:
+      emitted = emit_iovec(pid_tgid, inflight.fd, CAPNP_TRACE_BPF_IN, inflight.buf,
+                           inflight.count, len);
+      break;
+    case KIND_WRITE:
+      emitted = emit_buffer(pid_tgid, inflight.fd, CAPNP_TRACE_BPF_OUT, inflight.buf, len);
+      break;
+    case KIND_WRITEV:
+      emitted = emit_iovec(pid_tgid, inflight.fd, CAPNP_TRACE_BPF_OUT, inflight.buf,
+                           inflight.count, len);
+      break;
+    default:
+      return 0;
+  }
+  if (emitted != len) {
+    emit_truncated(pid_tgid, inflight.fd, type, len - emitted);
+  }
+  return 0;
+}
+
+#define DEFINE_SYSCALL_PROGRAMS(name, kind)                                  \
+  SEC("tracepoint/syscalls/sys_enter_" #name)                                \
+  int enter_##name(struct sys_enter_args* ctx) { return on_enter(ctx); }     \
+  SEC("tracepoint/syscalls/sys_exit_" #name)                                 \
+  int exit_##name(struct sys_exit_args* ctx) { return on_exit(ctx, kind); }
+
+DEFINE_SYSCALL_PROGRAMS(read, KIND_READ)
+DEFINE_SYSCALL_PROGRAMS(recvfrom, KIND_READ)
+DEFINE_SYSCALL_PROGRAMS(readv, KIND_READV)
+DEFINE_SYSCALL_PROGRAMS(write, KIND_WRITE)
+DEFINE_SYSCALL_PROGRAMS(writev, KIND_WRITEV)
+DEFINE_SYSCALL_PROGRAMS(connect, KIND_CONNECT)
+DEFINE_SYSCALL_PROGRAMS(close, KIND_CLOSE)
@@ -1,6 +1,5 @@
 #include <capnp/any.h>
 #include <capnp/common.h>
-#include <capnp/compat/json.h>
 #include <capnp/message.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/schema.h>
@@ -9,8 +8,10 @@
 #include <kj/debug.h>
 #include <kj/filesystem.h>
 #include <kj/main.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/ptrace.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
@@ -21,29 +22,75 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <iomanip>
-#include <iostream>
+#include <map>
+#include <regex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #include "immutable_schema_registry.h"
 #include "injection.h"
+#include "monotonic_clock.h"
+#include "output_sink.h"
+#include "record_index.h"
+#include "rpc_message_formatter.h"
+#include "rpc_message_merger.h"
 #include "rpc_message_reassembler.h"
 #include "rpc_message_recorder.h"
+#include "rpc_message_ring.h"
+#include "rpc_preload_tracer.h"
+#include "rpc_stats.h"
+#if defined(CAPNP_TRACE_ENABLE_BPF)
+#include "rpc_bpf_tracer.h"
+#endif
+#include "rpc_top_view.h"
 #include "rpc_tracer.h"
+#include "termination_signal.h"
+#include "tracer_metrics.h"
 
 namespace capnp_trace {
 
 static const char VERSION_STRING[] = "capnp_trace v0.1.1";
 
-static inline std::string GetTimeStamp() {
-  struct timespec tp;
-  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &tp));
-  std::ostringstream stream;
-  stream << std::setw(6) << std::setfill('0') << tp.tv_sec << "." << std::setw(4)
-         << (tp.tv_nsec / 100000);
-  return stream.str();
+// Buffered records are written when they exceed this size or --flush-interval elapses
+static const size_t kRecordBufferSize         = 1024 * 1024;
+static const uint64_t kDefaultRecordFlushMsec = 1000;
+
+// Number of rotated record files to keep by default
+static const uint64_t kDefaultRecordRotateCount = 10;
+
+// The seccomp filter is inherited by all threads and children, whose traced syscalls fail with
+// ENOSYS unless they are traced. For the same reason, they must not outlive capnp_trace.
+static const uint64_t kSeccompPtraceOptions = PTRACE_O_TRACESECCOMP | PTRACE_O_TRACECLONE |
+                                              PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                                              PTRACE_O_EXITKILL;
+
+// Set by SIGUSR1 to print --stats
+static volatile sig_atomic_t stats_signal_flag = 0;
+
+// Inverse of the timestamp of output lines, i.e. seconds to CLOCK_MONOTONIC in microseconds
+static kj::Maybe<uint64_t> ParseTimeStamp(kj::StringPtr seconds) {
+  char* end;
+  const double value = strtod(seconds.cStr(), &end);
+  if (seconds.size() == 0 || *end != '\0' || !(value >= 0)) {
+    return nullptr;
+  }
+  return static_cast<uint64_t>(std::llround(value * 1000000));
+}
+
+static kj::Maybe<std::regex> CompileRegex(kj::StringPtr pattern) {
+  try {
+    return std::regex(pattern.cStr());
+  } catch (const std::regex_error& e) {
+    KJ_LOG(ERROR, "invalid regular expression", pattern, e.what());
+    return nullptr;
+  }
 }
 
 class TraceMain final {
@@ -52,11 +99,31 @@ class TraceMain final {
       : context(context),
         handler_(KJ_BIND_METHOD(*this, OutputRpcMessage)),
         ptrace_options_(PTRACE_O_TRACESYSGOOD),
+        record_flush_msec_(kDefaultRecordFlushMsec),
+        record_rotate_size_(0),
+        record_rotate_count_(kDefaultRecordRotateCount),
+        ring_size_(0),
+        ring_max_age_usec_(0),
         argc_(0),
         is_follow_(false),
-        is_color_(false),
-        is_parse_raw_(false) {
+        is_seccomp_(false),
+        is_sync_(false),
+        is_preload_(false),
+        is_bpf_(false),
+        is_line_buffered_(false),
+        is_compress_(false),
+        is_trigger_abort_(false),
+        is_trigger_signal_(false),
+        is_stats_(false),
+        is_metrics_(false),
+        is_parse_raw_(false),
+        is_parse_merge_(false),
+        parse_jobs_(1),
+        top_sort_key_(RpcTopView::SortKey::kCalls),
+        top_interval_msec_(RpcTopView::kDefaultIntervalMsec),
+        metrics_interval_msec_(0) {
     capnp_trace::ImmutableSchemaRegistry::Init();
+    formatter_.SetCallHook(KJ_BIND_METHOD(*this, CheckInjection));
   }
 
   kj::MainFunc getMain() {
@@ -68,14 +135,24 @@ class TraceMain final {
                        "Fork and exec new process and trace it.")
         .addSubCommand("parse", KJ_BIND_METHOD(*this, GetParseMain),
                        "Parse recoreded/dumped files.")
+        .addSubCommand("top", KJ_BIND_METHOD(*this, GetTopMain),
+                       "Attach to the existing thread and show live RPC rates and latency.")
         .build();
   }
 
   kj::MainFunc GetAttachMain() {
     kj::MainBuilder builder(context, VERSION_STRING, "Attach to the existing thread and trace it.");
     builder.expectArg("SERVER_ADDRESS", KJ_BIND_METHOD(*this, SetAddress))
-        .expectArg("PID", KJ_BIND_METHOD(*this, SetPid))
+        .expectOneOrMoreArgs("PID", KJ_BIND_METHOD(*this, SetPid))
         .callAfterParsing(KJ_BIND_METHOD(*this, AttachMain));
+#if defined(CAPNP_TRACE_ENABLE_BPF)
+    builder.addOption({'b', "bpf"}, KJ_BIND_METHOD(*this, SetBpf),
+                      "Capture by eBPF instead of ptrace. Tracee never stops, and "
+                      "multiple PIDs can be traced at once. All threads are traced "
+                      "regardless of --follow. Data of a read/write beyond 64 KiB or 8 "
+                      "iovecs is not captured, so that the message is dropped with a warning. "
+                      "If the lost data spans messages, the stream is not traced until close.");
+#endif
     AddCommonOption(builder);
     AddOutputOption(builder);
     return builder.build();
@@ -86,6 +163,11 @@ class TraceMain final {
     builder.expectArg("SERVER_ADDRESS", KJ_BIND_METHOD(*this, SetAddress))
         .expectOneOrMoreArgs("command <args>", KJ_BIND_METHOD(*this, SetCommand))
         .callAfterParsing(KJ_BIND_METHOD(*this, ExecMain));
+    builder.addOption({'p', "preload"}, KJ_BIND_METHOD(*this, SetPreload),
+                      "Capture by LD_PRELOAD library and shared memory instead of ptrace. "
+                      "Tracee never stops at syscalls, but statically linked or "
+                      "raw syscall based programs cannot be traced. Address is matched when "
+                      "a socket is connected or accepted, or is open at start-up.");
     AddCommonOption(builder);
     AddOutputOption(builder);
     return builder.build();
@@ -100,6 +182,21 @@ class TraceMain final {
                    "  Don't trust timestamp information in this mode.\n"
                    "  It shows parsing time because raw dump file\n"
                    "  does not contain timestamp information.")
+        .addOption({'m', "merge"}, KJ_BIND_METHOD(*this, SetParseMerge),
+                   "Merge messages of all files into one timeline by timestamp, e.g. files "
+                   "recorded from client and server separately. --jobs is ignored.")
+        .addOptionWithArg({"since"}, KJ_BIND_METHOD(*this, SetParseSince), "<sec>",
+                          "Parse only messages at or after <sec> in timestamp of the output.")
+        .addOptionWithArg({"until"}, KJ_BIND_METHOD(*this, SetParseUntil), "<sec>",
+                          "Parse only messages at or before <sec> in timestamp of the output.")
+        .addOptionWithArg({"method"}, KJ_BIND_METHOD(*this, SetParseMethod), "<regex>",
+                          "Parse only CALL messages whose method (e.g. "
+                          "\"foo.capnp:Foo.bar\") matches <regex>, and RETURN/FINISH for them.")
+        .addOptionWithArg({"address"}, KJ_BIND_METHOD(*this, SetParseAddress), "<regex>",
+                          "Parse only messages whose whole address matches <regex>.")
+        .addOptionWithArg({'j', "jobs"}, KJ_BIND_METHOD(*this, SetParseJobs), "<count>",
+                          "Format messages on <count> threads (default: 1). 0 means the number "
+                          "of CPU cores. The output is in the same order as 1.")
         .expectOneOrMoreArgs("file", KJ_BIND_METHOD(*this, SetParseFile))
         .callAfterParsing(KJ_BIND_METHOD(*this, ParseMain));
     AddOutputOption(builder);
@@ -117,6 +214,7 @@ class TraceMain final {
     if (pid.size() == 0 || *end != '\0') {
       return "not an integer";
     }
+    pids_.add(pid_);
     return true;
   }
 
@@ -131,27 +229,167 @@ class TraceMain final {
     return true;
   }
 
+  kj::MainBuilder::Validity SetSeccomp() {
+    is_seccomp_ = true;
+    ptrace_options_ |= kSeccompPtraceOptions;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetSync() {
+    is_sync_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetPreload() {
+    is_preload_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetBpf() {
+    is_bpf_ = true;
+    return true;
+  }
+
   kj::MainBuilder::Validity SetColor() {
-    is_color_ = true;
+    formatter_.SetColor(true);
+    return true;
+  }
+
+  kj::MainFunc GetTopMain() {
+    kj::MainBuilder builder(context, VERSION_STRING,
+                            "Attach to the existing thread and show calls/s, bytes/s, in-flight "
+                            "calls and latency of each address, fd and method, refreshed every "
+                            "interval. Messages are not printed.");
+    builder.expectArg("SERVER_ADDRESS", KJ_BIND_METHOD(*this, SetAddress))
+        .expectOneOrMoreArgs("PID", KJ_BIND_METHOD(*this, SetPid))
+        .callAfterParsing(KJ_BIND_METHOD(*this, TopMain));
+#if defined(CAPNP_TRACE_ENABLE_BPF)
+    builder.addOption({'b', "bpf"}, KJ_BIND_METHOD(*this, SetBpf),
+                      "Capture by eBPF instead of ptrace. Tracee never stops, and "
+                      "multiple PIDs can be traced at once.");
+#endif
+    builder.addOption({'f', "follow"}, KJ_BIND_METHOD(*this, SetFollow),
+                      "Trace all threads of process PID.");
+    builder.addOptionWithArg({"sort"}, KJ_BIND_METHOD(*this, SetTopSort), "<calls|bytes|p99>",
+                             "Sort rows by calls/s, bytes/s or p99 latency (default: calls).");
+    builder.addOptionWithArg({"interval"}, KJ_BIND_METHOD(*this, SetTopInterval), "<msec>",
+                             "Refresh the view every <msec> milliseconds (default: 1000).");
+    builder.addOptionWithArg({"schema"}, KJ_BIND_METHOD(*this, AddSchemaFile), "<schema_file>",
+                             "Resolve methods also by <schema_file>, which is compiled by "
+                             "`capnp compile -o- <file.capnp>...`.");
+    return builder.build();
+  }
+
+  kj::MainBuilder::Validity SetOutput(kj::StringPtr output_path) {
+    output_path_ = kj::heapString(output_path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetFormat(kj::StringPtr format) {
+    if (format == "text") {
+      formatter_.SetOutputFormat(RpcMessageFormatter::OutputFormat::kText);
+    } else if (format == "jsonl") {
+      formatter_.SetOutputFormat(RpcMessageFormatter::OutputFormat::kJsonLines);
+    } else {
+      return "must be text or jsonl";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetStats() {
+    is_stats_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetMetrics() {
+    is_metrics_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetMetricsInterval(kj::StringPtr msec) {
+    char* end;
+    metrics_interval_msec_ = strtoull(msec.cStr(), &end, 0);
+    if (msec.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    is_metrics_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetLineBuffered() {
+    is_line_buffered_ = true;
     return true;
   }
 
   kj::MainBuilder::Validity SetRecord(kj::StringPtr record_path) {
-    kj::Own<kj::AppendableFile> record_file;
-    if (record_path[0] == '/') {
-      // Absolute path
-      //   `kj::Path::parse` doesn't support absolute path
-      record_file = kj::newDiskFilesystem()->getRoot().appendFile(
-          kj::Path(nullptr).eval(record_path),
-          kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT | kj::WriteMode::MODIFY);
+    // Recorder is created by StartRecording() because it depends on other options
+    record_path_ = kj::heapString(record_path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetRotateSize(kj::StringPtr mib) {
+    char* end;
+    record_rotate_size_ = strtoull(mib.cStr(), &end, 0) * 1024 * 1024;
+    if (mib.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetRotateCount(kj::StringPtr count) {
+    char* end;
+    record_rotate_count_ = strtoull(count.cStr(), &end, 0);
+    if (count.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    if (record_rotate_count_ < 2) {
+      // The file being written and the next file opened in advance
+      return "must be 2 or more";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetFlushInterval(kj::StringPtr msec) {
+    char* end;
+    record_flush_msec_ = strtoull(msec.cStr(), &end, 0);
+    if (msec.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetCompress() {
+    is_compress_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetRing(kj::StringPtr mib) {
+    char* end;
+    ring_size_ = strtoull(mib.cStr(), &end, 0) * 1024 * 1024;
+    if (mib.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetRingSeconds(kj::StringPtr seconds) {
+    KJ_IF_MAYBE (usec, ParseTimeStamp(seconds)) {
+      ring_max_age_usec_ = *usec;
+      return true;
+    }
+    return "not a number";
+  }
+
+  kj::MainBuilder::Validity SetTrigger(kj::StringPtr trigger) {
+    if (trigger == "ABORT") {
+      is_trigger_abort_ = true;
+    } else if (trigger == "SIGUSR1") {
+      is_trigger_signal_ = true;
+    } else if (trigger.findFirst('.') != nullptr) {
+      trigger_methods_.emplace(trigger.cStr());
     } else {
-      // Relative path
-      record_file = kj::newDiskFilesystem()->getCurrent().appendFile(
-          kj::Path::parse(record_path),
-          kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT | kj::WriteMode::MODIFY);
+      return "must be Interface.method, ABORT or SIGUSR1";
     }
-    recorder_ = kj::heap<RpcMessageRecorder>(kj::mv(record_file));
-    handler_  = KJ_BIND_METHOD(*recorder_, Record);
     return true;
   }
 
@@ -176,40 +414,228 @@ class TraceMain final {
     return true;
   }
 
+  kj::MainBuilder::Validity ExecPreloadMain() {
+    RpcPreloadTracer tracer(address_, handler_);
+    tracer.SetDumpDir(kj::mv(dump_dir_));
+
+    pid_t pid;
+    KJ_SYSCALL(pid = fork());
+    if (pid == 0) {
+      tracer.SetupTraceeEnvironment();
+      KJ_SYSCALL(execvp(command_[0], const_cast<char* const*>(command_)));
+    }
+
+    TerminationSignal::Watch();
+    tracer.Trace(pid);
+    FinishTrace();
+
+    return true;
+  }
+
   kj::MainBuilder::Validity ExecMain() {
+    if (ring_size_ > 0 && record_path_.size() == 0) {
+      return "--ring requires --record";
+    }
+    StartOutput();
+    StartRecording();
+    if (is_preload_) {
+      return ExecPreloadMain();
+    }
+
     pid_t pid;
     KJ_SYSCALL(pid = fork());
     if (pid == 0) {
       KJ_SYSCALL(ptrace(PTRACE_TRACEME, 0, nullptr, nullptr));
+      if (is_seccomp_) {
+        RpcTracer::InstallSeccompFilter();
+      }
       KJ_SYSCALL(execvp(command_[0], const_cast<char* const*>(command_)));
     }
     waitpid(-1, nullptr, __WALL);
 
     KJ_SYSCALL(ptrace(PTRACE_SETOPTIONS, pid, nullptr, ptrace_options_));
-    KJ_SYSCALL(ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr));
+    KJ_SYSCALL(ptrace(is_seccomp_ ? PTRACE_CONT : PTRACE_SYSCALL, pid, nullptr, nullptr));
 
-    RpcTracer(pid, address_, handler_).SetDumpDir(kj::mv(dump_dir_)).Trace();
+    TerminationSignal::Watch();
+    RpcTracer(pid, address_, handler_)
+        .SetDumpDir(kj::mv(dump_dir_))
+        .SetSeccomp(is_seccomp_)
+        .SetPipeline(IsPipeline())
+        .Trace();
+    FinishTrace();
 
     return true;
   }
 
+#if defined(CAPNP_TRACE_ENABLE_BPF)
+  kj::MainBuilder::Validity AttachBpfMain() {
+    RpcBpfTracer tracer(address_, handler_);
+    tracer.SetDumpDir(kj::mv(dump_dir_));
+    for (auto pid : pids_) {
+      tracer.AddPid(pid);
+    }
+
+    TerminationSignal::Watch();
+    tracer.Trace();
+    FinishTrace();
+
+    return true;
+  }
+#endif
+
   kj::MainBuilder::Validity AttachMain() {
+    if (ring_size_ > 0 && record_path_.size() == 0) {
+      return "--ring requires --record";
+    }
+    StartOutput();
+    StartRecording();
+#if defined(CAPNP_TRACE_ENABLE_BPF)
+    if (is_bpf_) {
+      return AttachBpfMain();
+    }
+#endif
+    if (pids_.size() > 1) {
+      return "multiple PIDs are supported only by --bpf";
+    }
+
+    if (is_seccomp_) {
+      // seccomp filter can be installed only by tracee itself
+      KJ_LOG(WARNING, "seccomp is not supported in attach mode. Fall back to trace all syscalls.");
+      is_seccomp_ = false;
+      ptrace_options_ &= ~kSeccompPtraceOptions;
+      if (is_follow_) {
+        ptrace_options_ |= PTRACE_O_TRACECLONE;
+      }
+    }
+
     if (is_follow_) {
       AttachAllThreads(pid_);
     } else {
       AttachThread(pid_);
     }
 
-    RpcTracer(pid_, address_, handler_).SetDumpDir(kj::mv(dump_dir_)).Trace();
+    TerminationSignal::Watch();
+    RpcTracer(pid_, address_, handler_)
+        .SetDumpDir(kj::mv(dump_dir_))
+        .SetPipeline(IsPipeline())
+        .Trace();
+    FinishTrace();
 
     return true;
   }
 
+  kj::MainBuilder::Validity SetTopSort(kj::StringPtr sort_key) {
+    if (sort_key == "calls") {
+      top_sort_key_ = RpcTopView::SortKey::kCalls;
+    } else if (sort_key == "bytes") {
+      top_sort_key_ = RpcTopView::SortKey::kBytes;
+    } else if (sort_key == "p99") {
+      top_sort_key_ = RpcTopView::SortKey::kP99;
+    } else {
+      return "must be calls, bytes or p99";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetTopInterval(kj::StringPtr msec) {
+    char* end;
+    top_interval_msec_ = strtoull(msec.cStr(), &end, 0);
+    if (msec.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    if (top_interval_msec_ == 0) {
+      return "must be positive";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity TopMain() {
+    // Rows are limited to the terminal height, excluding the header and the last line
+    size_t max_rows = 0;
+    struct winsize window_size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) == 0 && window_size.ws_row > 2) {
+      max_rows = window_size.ws_row - 2;
+    }
+    top_ = kj::heap<RpcTopView>(kj::heap<kj::FdOutputStream>(STDOUT_FILENO));
+    top_->SetSortKey(top_sort_key_).SetInterval(top_interval_msec_).SetMaxRows(max_rows);
+    // Messages are only counted, and never formatted
+    handler_ = KJ_BIND_METHOD(*top_, Handle);
+    top_->Start();
+    auto validity = AttachMain();
+    top_->Stop();
+    return validity;
+  }
+
   kj::MainBuilder::Validity SetParseRaw() {
     is_parse_raw_ = true;
     return true;
   }
 
+  kj::MainBuilder::Validity SetParseMerge() {
+    is_parse_merge_ = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity SetParseSince(kj::StringPtr seconds) {
+    KJ_IF_MAYBE (since, ParseTimeStamp(seconds)) {
+      record_filter_.since = *since;
+      return true;
+    }
+    return "not a timestamp";
+  }
+
+  kj::MainBuilder::Validity SetParseUntil(kj::StringPtr seconds) {
+    KJ_IF_MAYBE (until, ParseTimeStamp(seconds)) {
+      record_filter_.until = *until;
+      return true;
+    }
+    return "not a timestamp";
+  }
+
+  kj::MainBuilder::Validity SetParseMethod(kj::StringPtr pattern) {
+    KJ_IF_MAYBE (method_pattern, CompileRegex(pattern)) {
+      // Method name is resolved once for each method. Unknown method never matches.
+      record_filter_.method = [method_pattern = kj::mv(*method_pattern),
+                               matches = std::map<MethodKey, bool>()](MethodKey key) mutable {
+        auto it = matches.find(key);
+        if (it != matches.end()) {
+          return it->second;
+        }
+        bool is_matched = false;
+        KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                       auto& info = ImmutableSchemaRegistry::GetMethod(key.first, key.second);
+                       is_matched = std::regex_search(info.name.cStr(), method_pattern);
+                     })) {
+          KJ_LOG(INFO, "unknown method", key.first, key.second, *exception);
+        }
+        matches.emplace(key, is_matched);
+        return is_matched;
+      };
+      return true;
+    }
+    return "invalid regular expression";
+  }
+
+  kj::MainBuilder::Validity SetParseAddress(kj::StringPtr pattern) {
+    KJ_IF_MAYBE (address_pattern, CompileRegex(pattern)) {
+      record_filter_.address = kj::mv(*address_pattern);
+      return true;
+    }
+    return "invalid regular expression";
+  }
+
+  kj::MainBuilder::Validity SetParseJobs(kj::StringPtr count) {
+    char* end;
+    parse_jobs_ = strtoull(count.cStr(), &end, 0);
+    if (count.size() == 0 || *end != '\0') {
+      return "not an integer";
+    }
+    if (parse_jobs_ == 0) {
+      parse_jobs_ = kj::max(std::thread::hardware_concurrency(), 1u);
+    }
+    return true;
+  }
+
   kj::MainBuilder::Validity SetParseFile(kj::StringPtr parse_file) {
     if (parse_file[0] == '/') {
       // Absolute path
@@ -227,7 +653,6 @@ class TraceMain final {
   kj::MainBuilder::Validity ParseRawFormat() {
     for (auto& parse_file : parse_files_) {
       auto bytes = parse_file->readAllBytes();
-      AnswerIdMap answer_ids;
       // Use empty StreamInfo because raw dumped data does not contain StreamInfo
       RpcMessageReassembler reassembler(handler_, StreamInfo{});
       reassembler.Reassemble(bytes.asChars().begin(), bytes.size());
@@ -236,19 +661,238 @@ class TraceMain final {
   }
 
   kj::MainBuilder::Validity ParseMain() {
+    StartOutput();
     if (is_parse_raw_) {
-      return ParseRawFormat();
-    }
-
-    for (auto& parse_file : parse_files_) {
-      RpcMessageRecorder::Parser parser(kj::mv(parse_file),
-                                        KJ_BIND_METHOD(*this, OutputRpcMessage));
-      parser.ParseAll();
+      ParseRawFormat();
+    } else if (is_parse_merge_) {
+      RpcMessageMerger merger(KJ_BIND_METHOD(*this, OutputRpcMessage));
+      for (auto& parse_file : parse_files_) {
+        merger.Add(kj::mv(parse_file), record_filter_);
+      }
+      merger.MergeAll();
+    } else {
+      for (auto& parse_file : parse_files_) {
+        RpcMessageRecorder::Parser parser(kj::mv(parse_file),
+                                          KJ_BIND_METHOD(*this, OutputRpcMessage));
+        parser.SetFilter(record_filter_);
+        if (parse_jobs_ > 1) {
+          ParseParallel(parser);
+        } else {
+          parser.ParseAll();
+        }
+      }
     }
+    FinishTrace();
     return true;
   }
 
+  // Messages are formatted in chunks on parse_jobs_ threads, and written in order
+  void ParseParallel(RpcMessageRecorder::Parser& parser) {
+    struct Chunk {
+      RpcMessageFormatter::State state;
+      RpcStats stats;
+      std::string output;
+    };
+    kj::Vector<kj::Own<Chunk>> chunks;
+
+    RpcMessageRecorder::Parser::ParallelHandler handler;
+    // Scanning only registers types of CALL, which is much cheaper than formatting messages
+    handler.scan = [this](StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                          kj::ArrayPtr<kj::byte>) {
+      RpcMessageFormatter::Track(output_state_, stream_info, message);
+    };
+    handler.fork = [this, &chunks](size_t) -> RpcMessageHandler {
+      auto chunk   = kj::heap<Chunk>();
+      chunk->state = output_state_;
+      chunks.add(kj::mv(chunk));
+      return [this, chunk = chunks.back().get()](StreamInfo stream_info,
+                                                  capnp::rpc::Message::Reader&& message,
+                                                  kj::ArrayPtr<kj::byte> raw_message) {
+        formatter_.Format(chunk->state, stream_info, message, chunk->output);
+        chunk->output += '\n';
+        if (is_stats_) {
+          RecordStats(chunk->stats, chunk->state, stream_info, message, raw_message.size());
+        }
+      };
+    };
+    handler.join = [this, &chunks](size_t index) {
+      const auto& output = chunks[index]->output;
+      output_sink_->Write(kj::arrayPtr(output.data(), output.size()));
+      if (is_stats_) {
+        stats_.Merge(chunks[index]->stats);
+        PrintStatsIfSignaled();
+      }
+      chunks[index] = nullptr;
+    };
+    parser.ParseParallel(parse_jobs_, kj::mv(handler));
+  }
+
  private:
+  // Called after all options are parsed and before tracing starts
+  void StartRecording() {
+    if (record_path_.size() == 0) {
+      return;
+    }
+
+    const auto compression = is_compress_ ? RpcMessageRecorder::Compression::kPacked
+                                          : RpcMessageRecorder::Compression::kNone;
+    if (record_rotate_size_ == 0) {
+      recorder_ = kj::heap<RpcMessageRecorder>(OpenNewFile(record_path_), compression);
+    } else {
+      RemoveRotatedFiles();
+      recorder_ =
+          kj::heap<RpcMessageRecorder>(OpenNewFile(GetRecordFilePath(0)), compression);
+      // Called on the flush thread of recorder_, which also removes the oldest file
+      recorder_->SetRotation(record_rotate_size_, [this, index = uint64_t(1)]() mutable {
+        if (index >= record_rotate_count_) {
+          RemoveRecordFile(GetRecordFilePath(index - record_rotate_count_));
+        }
+        return OpenNewFile(GetRecordFilePath(index++));
+      });
+    }
+    // 0 means no buffering, i.e. every record is written immediately
+    recorder_->SetFlushThreshold(record_flush_msec_ ? kRecordBufferSize : 0, record_flush_msec_);
+    handler_ = KJ_BIND_METHOD(*recorder_, Record);
+
+    if (ring_size_ > 0) {
+      // Messages are recorded only when triggered
+      ring_ = kj::heap<RpcMessageRing>(ring_size_, KJ_BIND_METHOD(*recorder_, Record));
+      ring_->SetMaxAge(ring_max_age_usec_);
+      if (is_trigger_signal_) {
+        ring_->SetTriggerSignal(SIGUSR1);
+      }
+      handler_ = KJ_BIND_METHOD(*this, KeepRpcMessage);
+    }
+  }
+
+  void KeepRpcMessage(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                      kj::ArrayPtr<kj::byte> raw_message) {
+    // Keep the triggering message as well, and then record all kept messages
+    ring_->Push(stream_info, capnp::rpc::Message::Reader(message), raw_message);
+    if (IsTrigger(message)) {
+      KJ_LOG(WARNING, "triggered", stream_info, message.which(), ring_->Trigger());
+    }
+  }
+
+  bool IsTrigger(capnp::rpc::Message::Reader message) {
+    if (message.isAbort()) {
+      return is_trigger_abort_;
+    }
+    if (!message.isCall() || trigger_methods_.empty()) {
+      return false;
+    }
+
+    // Method name is resolved only once for each method
+    auto call = message.getCall();
+    const MethodKey key(call.getInterfaceId(), call.getMethodId());
+    auto it = trigger_method_cache_.find(key);
+    if (it == trigger_method_cache_.end()) {
+      bool is_trigger = false;
+      KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                     auto& info = ImmutableSchemaRegistry::GetMethod(key.first, key.second);
+                     is_trigger = trigger_methods_.count(info.name.cStr()) > 0;
+                   })) {
+        KJ_LOG(INFO, "unknown method", *exception);
+      }
+      it = trigger_method_cache_.emplace(key, is_trigger).first;
+    }
+    return it->second;
+  }
+
+  // Rotated files are numbered so that `parse <output_path>.*` reads them in order
+  kj::String GetRecordFilePath(uint64_t index) const {
+    std::ostringstream stream;
+    stream << record_path_.cStr() << "." << std::setw(6) << std::setfill('0') << index;
+    return kj::str(stream.str().c_str());
+  }
+
+  // Existing file is replaced, e.g. because records cannot follow the index of it
+  static kj::Own<kj::AppendableFile> OpenNewFile(kj::StringPtr record_path) {
+    auto filesystem = kj::newDiskFilesystem();
+    // eval() supports both absolute and relative path unlike `kj::Path::parse`
+    auto path  = filesystem->getCurrentPath().eval(record_path);
+    auto& root = filesystem->getRoot();
+    root.tryRemove(path);
+    return root.appendFile(
+        path, kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT | kj::WriteMode::MODIFY);
+  }
+
+  // Files rotated by a previous run are removed, because they are not overwritten if this run
+  // rotates fewer files and then `parse <output_path>.*` would read them as well
+  void RemoveRotatedFiles() const {
+    auto filesystem   = kj::newDiskFilesystem();
+    auto path         = filesystem->getCurrentPath().eval(record_path_);
+    const auto prefix = kj::str(path.basename()[0], ".");
+    KJ_IF_MAYBE (dir, filesystem->getRoot().tryOpenSubdir(path.parent())) {
+      for (auto& name : (*dir)->listNames()) {
+        const auto is_digit   = [](char c) { return c >= '0' && c <= '9'; };
+        const bool is_rotated = name.size() == prefix.size() + 6 && name.startsWith(prefix) &&
+                                std::all_of(name.begin() + prefix.size(), name.end(), is_digit);
+        if (is_rotated) {
+          (*dir)->tryRemove(kj::Path(kj::mv(name)));
+        }
+      }
+    }
+  }
+
+  static void RemoveRecordFile(kj::StringPtr record_path) {
+    auto filesystem = kj::newDiskFilesystem();
+    filesystem->getRoot().tryRemove(filesystem->getCurrentPath().eval(record_path));
+  }
+
+  // Called after all options are parsed and before any message is output
+  void StartOutput() {
+    kj::Own<kj::OutputStream> output;
+    bool is_interactive = false;
+    if (output_path_.size() > 0) {
+      output = OpenNewFile(output_path_);
+    } else {
+      output         = kj::heap<kj::FdOutputStream>(STDOUT_FILENO);
+      is_interactive = isatty(STDOUT_FILENO);
+    }
+    output_sink_ = kj::heap<OutputSink>(kj::mv(output));
+    if (is_line_buffered_ || is_interactive) {
+      // Every line is written immediately
+      output_sink_->SetFlushThreshold(0, 0);
+    }
+
+    if (is_stats_ && !is_trigger_signal_) {
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = [](int) { stats_signal_flag = 1; };
+      sigemptyset(&action.sa_mask);
+      action.sa_flags = SA_RESTART;
+      KJ_SYSCALL(sigaction(SIGUSR1, &action, nullptr));
+    }
+
+    if (is_metrics_) {
+      metrics_reporter_ = kj::heap<TracerMetricsReporter>(
+          TracerMetrics::Enable(), kj::heap<kj::FdOutputStream>(STDERR_FILENO));
+      metrics_reporter_->SetSignal(SIGUSR2).SetInterval(metrics_interval_msec_);
+      metrics_reporter_->Start();
+    }
+  }
+
+  // Called when tracing finished. Destructors are not called at exit by kj::MainBuilder.
+  void FinishTrace() {
+    // Messages kept by --ring are discarded unless triggered
+    if (recorder_) {
+      recorder_->Finish();
+    }
+    if (output_sink_) {
+      output_sink_->Flush();
+    }
+    if (is_stats_) {
+      PrintStats();
+    }
+    if (metrics_reporter_) {
+      metrics_reporter_->Stop();
+    }
+  }
+
+  // Injection must be checked before the tracee is resumed, so it requires synchronous output
+  bool IsPipeline() const { return !is_sync_ && injection_ == nullptr; }
+
   void AddCommonOption(kj::MainBuilder& builder) {
     builder.addOption({'f', "follow"}, KJ_BIND_METHOD(*this, SetFollow),
                       "Trace child threads as they are created by currently "
@@ -256,17 +900,95 @@ class TraceMain final {
                       "Note  that attach -f PID will attach "
                       "all threads of process PID if it is multi-threaded, not "
                       "only thread with thread_id = PID.");
+    builder.addOption({'s', "seccomp"}, KJ_BIND_METHOD(*this, SetSeccomp),
+                      "Stop tracee only at syscalls related to Cap'n Proto RPC by seccomp-BPF "
+                      "filter. It reduces tracing overhead drastically. "
+                      "Only exec supports it and attach falls back to stop at all syscalls. "
+                      "The filter is inherited by all threads and child processes, whose "
+                      "read/write/close fail with ENOSYS without a tracer. So they are all "
+                      "traced regardless of --follow, and killed when capnp_trace exits.");
+    builder.addOption({"sync"}, KJ_BIND_METHOD(*this, SetSync),
+                      "Reassemble and output messages while the tracee is stopped at syscalls "
+                      "instead of on worker threads. It is slower but the output is never "
+                      "behind the tracee. --inject implies it.");
     builder.addOptionWithArg({'r', "record"}, KJ_BIND_METHOD(*this, SetRecord), "<output_path>",
                              "Record Cap'n Proto RPC messages to <output_path>");
+    builder.addOptionWithArg({"rotate-size"}, KJ_BIND_METHOD(*this, SetRotateSize), "<MiB>",
+                             "Rotate recorded files every <MiB> mebibytes. Files are named "
+                             "<output_path>.000000, <output_path>.000001 and so on, and each of "
+                             "them can be parsed alone. Such files left by a previous run are "
+                             "removed at start.");
+    builder.addOptionWithArg({"rotate-count"}, KJ_BIND_METHOD(*this, SetRotateCount), "<count>",
+                             "Keep at most <count> files with --rotate-size by removing the "
+                             "oldest one (default: 10). It includes the file being written and "
+                             "the next one opened in advance.");
+    builder.addOptionWithArg({"flush-interval"}, KJ_BIND_METHOD(*this, SetFlushInterval),
+                             "<msec>",
+                             "Write recorded messages at least every <msec> milliseconds "
+                             "(default: 1000). Messages are buffered up to 1 MiB in the meantime, "
+                             "and written on exit or SIGINT/SIGTERM as well. "
+                             "0 writes every message immediately.");
+    builder.addOption({'z', "compress"}, KJ_BIND_METHOD(*this, SetCompress),
+                      "Record messages in Cap'n Proto packed encoding, and refer to repeated "
+                      "addresses by ID. The recorded file gets smaller at the cost of packing "
+                      "while the tracee is stopped.");
+    builder.addOptionWithArg({"ring"}, KJ_BIND_METHOD(*this, SetRing), "<MiB>",
+                             "Keep the last <MiB> mebibytes of messages in memory instead of "
+                             "recording all of them, and record the kept messages to "
+                             "<output_path> when --trigger fires. Requires --record.");
+    builder.addOptionWithArg({"ring-seconds"}, KJ_BIND_METHOD(*this, SetRingSeconds), "<sec>",
+                             "Keep only messages of the last <sec> seconds with --ring.");
+    builder.addOptionWithArg({"trigger"}, KJ_BIND_METHOD(*this, SetTrigger),
+                             "<Interface.method|ABORT|SIGUSR1>",
+                             "Record messages kept by --ring when a CALL of the method or an "
+                             "ABORT message is captured, or SIGUSR1 is received. It can be "
+                             "specified multiple times.");
     builder.addOptionWithArg({'d', "dump"}, KJ_BIND_METHOD(*this, SetDump), "<output_path>",
-                             "Dump unix domain socket communication raw data to <output_path>");
+                             "Dump unix domain socket communication raw data to <output_path>. "
+                             "Files are named capnp_trace.<pid>.<fd>.<in|out>.dump.");
     builder.addOptionWithArg({'i', "inject"}, KJ_BIND_METHOD(*this, SetInject),
                              "method;signal=sig;when=expr",
                              "Perform tampering for the specified method");
+    builder.addOption({"metrics"}, KJ_BIND_METHOD(*this, SetMetrics),
+                      "Print overhead of capnp_trace itself, i.e. ptrace stops of each syscall, "
+                      "time while tracees are stopped, bytes copied by process_vm_readv, "
+                      "reassembled and recorded, to stderr on exit or when SIGUSR2 is received.");
+    builder.addOptionWithArg({"metrics-interval"}, KJ_BIND_METHOD(*this, SetMetricsInterval),
+                             "<msec>",
+                             "Print --metrics also as a JSON line every <msec> milliseconds. "
+                             "It implies --metrics.");
+  }
+
+  kj::MainBuilder::Validity AddSchemaFile(kj::StringPtr schema_path) {
+    auto filesystem = kj::newDiskFilesystem();
+    // eval() supports both absolute and relative path unlike `kj::Path::parse`
+    auto path = filesystem->getCurrentPath().eval(schema_path);
+    KJ_IF_MAYBE (file, filesystem->getRoot().tryOpenFile(path)) {
+      auto count = ImmutableSchemaRegistry::AddSchemaFile(kj::mv(*file));
+      KJ_LOG(INFO, "schema file is added", schema_path, count);
+      return true;
+    }
+    return "no such file";
   }
 
   void AddOutputOption(kj::MainBuilder& builder) {
+    builder.addOptionWithArg({"schema"}, KJ_BIND_METHOD(*this, AddSchemaFile), "<schema_file>",
+                             "Decode messages also by <schema_file>, which is compiled by "
+                             "`capnp compile -o- <file.capnp>...`. Its schemas are loaded "
+                             "when they are used first. Can be specified multiple times.");
     builder.addOption({'c', "color"}, KJ_BIND_METHOD(*this, SetColor), "Colorize the output.");
+    builder.addOptionWithArg({'o', "output"}, KJ_BIND_METHOD(*this, SetOutput), "<output_path>",
+                             "Write the output to <output_path> instead of stdout.");
+    builder.addOptionWithArg({"format"}, KJ_BIND_METHOD(*this, SetFormat), "<text|jsonl>",
+                             "Output format (default: text). jsonl writes a JSON object per "
+                             "message, whose params and results are encoded by capnp::JsonCodec.");
+    builder.addOption({"stats"}, KJ_BIND_METHOD(*this, SetStats),
+                      "Print count, p50/p90/p99/max latency and bytes in/out of each method to "
+                      "stderr when tracing finishes or SIGUSR1 is received, unless SIGUSR1 is "
+                      "used by --trigger.");
+    builder.addOption({"line-buffered"}, KJ_BIND_METHOD(*this, SetLineBuffered),
+                      "Write the output every line. It is the default when stdout is a "
+                      "terminal. Otherwise, the output is written every 64 KiB or 100 msec.");
   }
 
   void AttachThread(int pid) {
@@ -317,259 +1039,113 @@ class TraceMain final {
     kill(pid, SIGCONT);
   }
 
-  enum Color { RED, GREEN, BLUE };
-
-  inline kj::String Colorize(Color color, kj::StringPtr message) {
-    kj::StringPtr start_color, end_color;
-    if (is_color_) {
-      switch (color) {
-        case RED:
-          start_color = "\033[0;1;31m";
-          break;
-        case GREEN:
-          start_color = "\033[0;1;32m";
-          break;
-        case BLUE:
-          start_color = "\033[0;1;34m";
-          break;
-      }
-      end_color = "\033[0m";
-    }
-
-    return kj::str(start_color, message, end_color);
-  }
-
-  inline kj::String GetMessageType(capnp::rpc::Message::Which type) {
-    // https://github.com/capnproto/capnproto/blob/v0.9.1/c%2B%2B/src/capnp/rpc.capnp#L215-L273
-    static const char* kTypeStrings[] = {
-        "UNIMPLEMENTED", "ABORT",   "CALL",          "RETURN",     "FINISH",
-        "RESOLVE",       "RELEASE", "OBSOLETE_SAVE", "BOOTSTRAP",  "OBSOLETE_DELETE",
-        "PROVIDE",       "ACCEPT",  "JOIN",          "DISEMBARGO",
-    };
-
-    switch (type) {
-      case capnp::rpc::Message::UNIMPLEMENTED:
-      case capnp::rpc::Message::ABORT:
-        return Colorize(RED, kTypeStrings[type]);
-
-      // Level 0 features
-      case capnp::rpc::Message::BOOTSTRAP:
-      case capnp::rpc::Message::CALL:
-      case capnp::rpc::Message::RETURN:
-      case capnp::rpc::Message::FINISH:
-        return Colorize(BLUE, kTypeStrings[type]);
-
-      // Level 1 features
-      case capnp::rpc::Message::RESOLVE:
-      case capnp::rpc::Message::RELEASE:
-      case capnp::rpc::Message::DISEMBARGO:
-        return Colorize(GREEN, kTypeStrings[type]);
-
-      // Level 2-4 features
-      default:
-        return Colorize(RED, kTypeStrings[type]);
-    }
-  }
-
-  inline kj::String MakePrefix(StreamInfo stream, capnp::rpc::Message::Which type) {
-    const char* direction = stream.direction_ == StreamInfo::Direction::kIn    ? " <- "
-                            : stream.direction_ == StreamInfo::Direction::kOut ? " -> "
-                                                                               : " - ";
-    return kj::str(GetTimeStamp(), " ", stream.pid_, "/", stream.tid_, direction, stream.address_,
-                   "(", stream.fd_, ") ", GetMessageType(type));
-  }
-
-  kj::String MakeOutputForBootstrap(capnp::rpc::Bootstrap::Reader bootstrap) {
-    return kj::str("(", bootstrap.getQuestionId(), ")");
-  }
-
-  // Stringify DynamicStruct without exception even if it contains external capability
-  kj::String Stringify(const capnp::DynamicStruct::Reader& value) {
-    auto schema = value.getSchema();
-    auto fields = schema.getFields();
-    kj::Vector<kj::StringTree> printed_fields(fields.size());
-    for (auto field : fields) {
-      if (field.getType().isInterface()) {
-        printed_fields.add(kj::strTree(field.getProto().getName(), " = <external capability>"));
-        continue;
-      }
-      kj::String field_value;
-      auto maybe_exception = kj::runCatchingExceptions([&value, &field, &field_value](){
-        field_value = kj::str(value.get(field));
-      });
-      KJ_IF_MAYBE(exception, maybe_exception) {
-        KJ_LOG(INFO, exception);
-        field_value = kj::str("<external capability>");
-      }
-      printed_fields.add(kj::strTree(field.getProto().getName(), " = ", field_value));
-    }
-
-    return kj::str("(", kj::StringTree(printed_fields.releaseAsArray(), ", "), ")");
-  }
-
-  kj::String MakeOutputForCall(capnp::rpc::Call::Reader call,
-                               kj::Maybe<capnp::StructSchema> detail_param_type) {
-    auto interface = capnp_trace::ImmutableSchemaRegistry::GetInterface(call.getInterfaceId());
-    auto method    = interface.getMethods()[call.getMethodId()];
-    auto content   = call.getParams().getContent();
-    auto param_value =
-        content.getAs<capnp::DynamicStruct>(detail_param_type.orDefault(method.getParamType()));
-
-    auto method_name =
-        kj::str(interface.getProto().getDisplayName(), ".", method.getProto().getName());
-
+  void CheckInjection(kj::StringPtr method_name) {
     KJ_IF_MAYBE (injection, injection_) {
       // When injection condition is satisfied, send SIGKILL to tracee process.
-      injection->Check(method_name, [injection, pid = pid_](int sig) {
+      injection->Check(method_name, [this, injection, pid = pid_](int sig) {
         KJ_LOG(WARNING, *injection, "fired");
         kill(pid, sig);
+        output_sink_->Flush();
         exit(EXIT_SUCCESS);
       });
     }
-
-    return kj::str("(", call.getQuestionId(), ") ", method_name, Stringify(param_value));
   }
 
-  kj::String MakeOutputForReturn(capnp::rpc::Return::Reader ret, capnp::StructSchema result_type) {
-    auto content = ret.getResults().getContent();
-    kj::String result_str;
-    if (content.isCapability()) {
-      result_str = kj::str("(<external capability>)");
-    } else if (content.isStruct()) {
-      result_str = Stringify(content.getAs<capnp::DynamicStruct>(result_type));
-    } else if (content.isNull()) {
-      result_str = kj::str("()");
-    } else if (content.isList()) {
-      result_str = kj::str("[List]");
-    } else {
-      KJ_UNIMPLEMENTED();
+  void OutputRpcMessage(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                        kj::ArrayPtr<kj::byte> raw_message) {
+    line_.clear();
+    formatter_.Format(output_state_, stream_info, message, line_);
+    line_ += '\n';
+    output_sink_->Write(kj::arrayPtr(line_.data(), line_.size()));
+    if (is_stats_) {
+      RecordStats(stats_, output_state_, stream_info, message, raw_message.size());
+      PrintStatsIfSignaled();
     }
-    return kj::str("(", ret.getAnswerId(), ") ", result_type.getProto().getDisplayName(), " ",
-                   result_str);
-  }
-
-  kj::String MakeOutputForFinish(capnp::rpc::Finish::Reader finish) {
-    return kj::str("(", finish.getQuestionId(), ")");
   }
 
-  void OutputRpcMessage(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
-                        [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
-    // NOTE: OutputRpcMessage cannot release answer_id_maps when fd is closed because this handler
-    // doesn't know the timing. It causes slight leak. And if fd and answer_id are re-used,
-    // answer_id_maps_ for them should be over-written before used so there should be no problem.
-    // The same applies to cap_descriptor_map.
-    AnswerIdMap& answer_id_map           = answer_id_maps_[stream_info.fd_];
-    CapDescriptorMap& cap_descriptor_map = cap_descriptor_maps_[stream_info.fd_];
-
-    // Only when target is imported capability and its registered,
-    // we decode parameter with registered type information (detail_param_type).
-    // It's because type information from ImmutableSchemaRegistry doesn't contain generics.
-    kj::Maybe<capnp::StructSchema> detail_param_type;
-
+  // Update `stats` by `message` which has been tracked in `state`
+  void RecordStats(RpcStats& stats, RpcMessageFormatter::State& state,
+                   const StreamInfo& stream_info, capnp::rpc::Message::Reader message,
+                   size_t message_size) {
+    auto& answer_id_map = state.answer_id_maps[stream_info.fd_];
     if (message.isCall()) {
-      // Register result type for RETURN
-      auto call      = message.getCall();
-      auto interface = capnp_trace::ImmutableSchemaRegistry::GetInterface(call.getInterfaceId());
-      auto method    = interface.getMethods()[call.getMethodId()];
-      answer_id_map.emplace(call.getQuestionId(), method.getResultType());
-
-      // If capabilities are passed as parameters
-      if (call.getParams().getCapTable().size() > 0) {
-        if (call.getParams().getCapTable().size() > 1) {
-          KJ_LOG(WARNING,
-                 "capnp_trace doesn't support multiple capabilities in one message so far.");
-        }
-
-        for (auto field : method.getParamType().getFields()) {
-          if (field.getType().isInterface()) {
-            // Register the passed capability into cap_descriptor_map
-            // TODO(t-kondo-tmc): Fix CapTable index according to the following specification:
-            //   https://github.com/capnproto/capnproto/blob/v0.9.1/doc/encoding.md#capabilities-interfaces
-            auto export_id = call.getParams().getCapTable()[0].getSenderHosted();
-            KJ_LOG(INFO, "Register cap_descriptor_maps[", stream_info.fd_, "][", export_id,
-                   "] = ", field.getProto().getName(), " of ",
-                   interface.getProto().getDisplayName(), ".", method.getProto().getName());
-            cap_descriptor_map.emplace(export_id, field.getType().asInterface());
-          }
-        }
+      auto call  = message.getCall();
+      auto& info = ImmutableSchemaRegistry::GetMethod(call.getInterfaceId(), call.getMethodId());
+      stats.AddCall(info);
+      stats.AddBytes(info, stream_info.direction_, message_size);
+    } else if (message.isReturn()) {
+      auto it = answer_id_map.find(message.getReturn().getAnswerId());
+      if (it == answer_id_map.end()) {
+        return;
       }
-
-      // If RPC is called to imported capability, search cap_descriptor_map for detail type
-      // information, like generics arguments
-      if (call.getTarget().isImportedCap()) {
-        auto import_id = call.getTarget().getImportedCap();
-        if (cap_descriptor_map.count(import_id)) {
-          auto cap = cap_descriptor_map.at(import_id);
-          KJ_IF_MAYBE (detail_method, cap.findMethodByName(method.getProto().getName())) {
-            detail_param_type = detail_method->getParamType();
-          } else {
-            KJ_LOG(INFO, "method", method.getProto().getName(), "is not found in ",
-                   cap.getShortDisplayName());
-          }
-        } else {
-          KJ_LOG(INFO, "import_id()", import_id, "is not found in cap_descriptor_map[",
-                 stream_info.fd_, "]");
-        }
+      KJ_IF_MAYBE (latency, RpcMessageFormatter::GetLatency(it->second, stream_info)) {
+        stats.AddLatency(*it->second.method, *latency);
       }
-    } else if (message.isFinish()) {
-      // Unregister result type
-      auto finish = message.getFinish();
-      answer_id_map.erase(finish.getQuestionId());
-    }
-
-    kj::String output = MakePrefix(stream_info, message.which());
-    switch (message.which()) {
-      case capnp::rpc::Message::UNIMPLEMENTED:
-      case capnp::rpc::Message::ABORT:
-        break;
-
-      // Level 0 features
-      case capnp::rpc::Message::BOOTSTRAP:
-        output = kj::str(output, MakeOutputForBootstrap(message.getBootstrap()));
-        break;
-      case capnp::rpc::Message::CALL:
-        output = kj::str(output, MakeOutputForCall(message.getCall(), detail_param_type));
-        break;
-      case capnp::rpc::Message::RETURN:
-        output =
-            kj::str(output, MakeOutputForReturn(message.getReturn(),
-                                                answer_id_map[message.getReturn().getAnswerId()]));
-        break;
-      case capnp::rpc::Message::FINISH:
-        output = kj::str(output, MakeOutputForFinish(message.getFinish()));
-        break;
-
-      // Level 1-4 features
-      default:
-        break;
-    }
-
-    std::cerr << output.cStr() << std::endl;
+      stats.AddBytes(*it->second.method, stream_info.direction_, message_size);
+    }
+  }
+
+  void PrintStats() {
+    auto text = kj::str("capnp_trace: RPC statistics (latency in usec)\n", stats_.Format());
+    kj::FdOutputStream(STDERR_FILENO).write(text.begin(), text.size());
+  }
+
+  // SIGUSR1 is checked when a message is output, because stats_ is updated on the output thread
+  void PrintStatsIfSignaled() {
+    if (stats_signal_flag) {
+      stats_signal_flag = 0;
+      PrintStats();
+    }
   }
 
   kj::ProcessContext& context;
   RpcMessageHandler handler_;
   kj::StringPtr address_;
   pid_t pid_;
+  kj::Vector<pid_t> pids_;
   uint64_t ptrace_options_;
+  uint64_t record_flush_msec_;
+  uint64_t record_rotate_size_;
+  uint64_t record_rotate_count_;
+  uint64_t ring_size_;
+  uint64_t ring_max_age_usec_;
   uint32_t argc_;
   const char* command_[1024];
   bool is_follow_;
-  bool is_color_;
+  bool is_seccomp_;
+  bool is_sync_;
+  bool is_preload_;
+  bool is_bpf_;
+  bool is_line_buffered_;
+  bool is_compress_;
+  bool is_trigger_abort_;
+  bool is_trigger_signal_;
+  bool is_stats_;
+  bool is_metrics_;
+  kj::String output_path_;
+  RpcMessageFormatter formatter_;
+  kj::Own<OutputSink> output_sink_;
+  // Reused for every line to avoid allocation
+  std::string line_;
+  kj::String record_path_;
   kj::Own<RpcMessageRecorder> recorder_;
+  kj::Own<RpcMessageRing> ring_;
+  std::set<std::string> trigger_methods_;
+  std::map<MethodKey, bool> trigger_method_cache_;
   kj::Own<const kj::Directory> dump_dir_;
   bool is_parse_raw_;
+  bool is_parse_merge_;
   kj::Vector<kj::Own<const kj::ReadableFile>> parse_files_;
-
-  // Map for Cap'n Proto answer ID (i.e. request ID) -> Return type StructSchema
-  using AnswerIdMap = std::unordered_map<uint64_t, capnp::StructSchema>;
-  // Map for fd -> AnswerIdMap
-  std::unordered_map<int, AnswerIdMap> answer_id_maps_;
-
-  // Map for CapDescriptor -> InterfaceSchema
-  using CapDescriptorMap = std::unordered_map<uint32_t, capnp::InterfaceSchema>;
-  // Map for fd -> CapDescriptorMap
-  std::unordered_map<int, CapDescriptorMap> cap_descriptor_maps_;
+  RecordFilter record_filter_;
+
+  uint64_t parse_jobs_;
+  RpcMessageFormatter::State output_state_;
+  RpcStats stats_;
+  RpcTopView::SortKey top_sort_key_;
+  uint64_t top_interval_msec_;
+  kj::Own<RpcTopView> top_;
+  uint64_t metrics_interval_msec_;
+  kj::Own<TracerMetricsReporter> metrics_reporter_;
 
   kj::Maybe<Injection> injection_;
 };
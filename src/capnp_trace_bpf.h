@@ -0,0 +1,49 @@
+#pragma once
+
+// Definitions shared between capnp_trace.bpf.c and RpcBpfTracer
+
+#include <linux/types.h>
+
+#define CAPNP_TRACE_BPF_CHUNK_SIZE 16384
+
+// Limits to keep BPF program verifiable. Data of a syscall beyond them (i.e. 64 KiB or 8 iovecs) is
+// dropped and reported as CAPNP_TRACE_BPF_TRUNCATED.
+#define CAPNP_TRACE_BPF_MAX_CHUNKS 4
+#define CAPNP_TRACE_BPF_MAX_IOV 8
+
+enum capnp_trace_bpf_type {
+  CAPNP_TRACE_BPF_IN = 1,
+  CAPNP_TRACE_BPF_OUT,
+  CAPNP_TRACE_BPF_CONNECT,    // data is sun_path of connected address
+  CAPNP_TRACE_BPF_CLOSE,      // no data
+  CAPNP_TRACE_BPF_TRUNCATED,  // data is capnp_trace_bpf_truncated
+};
+
+// Data of CAPNP_TRACE_BPF_TRUNCATED, which follows data emitted for the syscall
+struct capnp_trace_bpf_truncated {
+  __u32 type;  // CAPNP_TRACE_BPF_IN or CAPNP_TRACE_BPF_OUT
+  __u32 reserved;
+  __u64 dropped_size;
+};
+
+// Value of fd_states map. fd which is not in the map is reported to user space to be checked.
+enum capnp_trace_bpf_fd_state {
+  CAPNP_TRACE_BPF_FD_TARGET = 1,
+  CAPNP_TRACE_BPF_FD_IGNORED,
+};
+
+struct capnp_trace_bpf_fd_key {
+  __u32 tgid;
+  __s32 fd;
+};
+
+struct capnp_trace_bpf_event {
+  __u32 tgid;
+  __u32 tid;
+  __s32 fd;
+  __u32 type;
+  __u32 len;
+  __u32 reserved;
+  __u64 timestamp;  // CLOCK_MONOTONIC in microseconds
+  __u8 data[CAPNP_TRACE_BPF_CHUNK_SIZE];
+};
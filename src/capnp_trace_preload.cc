@@ -0,0 +1,441 @@
+// LD_PRELOAD library which captures Cap'n Proto RPC streams inside of the tracee.
+//
+//   Captured data is passed to capnp_trace via SharedRingBuffer on shared memory,
+//   so that tracee never stops at syscalls unlike ptrace.
+//
+#include "capnp_trace_preload.h"
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <regex>
+
+#include "shared_ring_buffer.h"
+
+namespace capnp_trace {
+namespace {
+
+enum FdState : uint8_t {
+  kUnknown,
+  kTarget,
+  kIgnored,
+};
+
+// Unix socket address in the same format as /proc/PID/net/unix, i.e. abstract socket starts with
+// '@'. It is kept in a fixed buffer because I/O wrappers may be called from signal handlers.
+struct UnixAddress {
+  size_t length;
+  char path[sizeof(sockaddr_un::sun_path) + 1];
+};
+
+// Addresses which have matched target_address, so that fds which are not created by connect() or
+// accept(), e.g. dup() or SCM_RIGHTS, are classified without regex
+const size_t kMaxTargetAddresses = 64;
+
+// Number of fds which fd_states and fd_gaps cover, i.e. fs.nr_open which is the limit of fd
+size_t max_fd      = 0;
+uint8_t* fd_states = nullptr;
+// Bits of (1 << type) for directions whose data was dropped, which are reported by kGapFlag of
+// the next record of the direction
+uint8_t* fd_gaps = nullptr;
+UnixAddress target_addresses[kMaxTargetAddresses];
+size_t target_address_count   = 0;
+pthread_mutex_t target_mutex  = PTHREAD_MUTEX_INITIALIZER;
+SharedRingBuffer* ring        = nullptr;
+std::regex* target_address    = nullptr;
+pid_t pid                     = 0;
+thread_local pid_t thread_tid = 0;
+
+#define CAPNP_TRACE_REAL(func) \
+  static auto real_##func = reinterpret_cast<decltype(&::func)>(dlsym(RTLD_NEXT, #func))
+
+pid_t GetTid() {
+  if (thread_tid == 0) {
+    thread_tid = static_cast<pid_t>(syscall(SYS_gettid));
+  }
+  return thread_tid;
+}
+
+void ResetAfterFork() {
+  pid        = getpid();
+  thread_tid = 0;
+}
+
+bool IsCachedFd(int fd) { return fd >= 0 && static_cast<size_t>(fd) < max_fd; }
+
+// @return false if `addr` is not unix socket address or it is unnamed
+bool GetUnixAddress(const struct sockaddr* addr, socklen_t len, UnixAddress& address) {
+  const socklen_t path_offset = offsetof(struct sockaddr_un, sun_path);
+  if (addr->sa_family != AF_UNIX || len <= path_offset) {
+    return false;
+  }
+  const auto* unix_addr = reinterpret_cast<const struct sockaddr_un*>(addr);
+  const size_t max_len  = std::min<size_t>(len - path_offset, sizeof(unix_addr->sun_path));
+  if (unix_addr->sun_path[0] == '\0') {
+    address.path[0] = '@';
+    memcpy(address.path + 1, unix_addr->sun_path + 1, max_len - 1);
+    address.length = max_len;
+  } else {
+    address.length = strnlen(unix_addr->sun_path, max_len);
+    memcpy(address.path, unix_addr->sun_path, address.length);
+  }
+  return true;
+}
+
+// Peer address for client side, and local address for server side (i.e. accepted socket)
+bool GetAddress(int fd, UnixAddress& address) {
+  struct sockaddr_un addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0 &&
+      GetUnixAddress(reinterpret_cast<struct sockaddr*>(&addr), len, address)) {
+    return true;
+  }
+  len = sizeof(addr);
+  return getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0 &&
+         GetUnixAddress(reinterpret_cast<struct sockaddr*>(&addr), len, address);
+}
+
+uint64_t GetMonotonicMicroSec() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+void PushRecord(int fd, uint32_t type, const struct iovec* iov, int iovcnt, size_t length) {
+  const bool has_gap_state =
+      IsCachedFd(fd) && (type == SharedRingBuffer::kIn || type == SharedRingBuffer::kOut);
+  const uint8_t gap_bit = static_cast<uint8_t>(1U << type);
+  uint32_t flags        = 0;
+  if (has_gap_state && (__atomic_load_n(&fd_gaps[fd], __ATOMIC_RELAXED) & gap_bit) != 0 &&
+      (__atomic_fetch_and(&fd_gaps[fd], ~gap_bit, __ATOMIC_RELAXED) & gap_bit) != 0) {
+    flags = SharedRingBuffer::kGapFlag;
+  }
+
+  const SharedRingBuffer::Record record{
+      pid, GetTid(), fd, type | flags, length, GetMonotonicMicroSec()};
+  if (!ring->Push(record, iov, iovcnt) && has_gap_state) {
+    // The rest of the data is lost, so the stream cannot be reassembled any more
+    __atomic_or_fetch(&fd_gaps[fd], gap_bit, __ATOMIC_RELAXED);
+  }
+}
+
+// Match by regex, which allocates memory. This is called only by connect() and accept().
+bool MatchTargetAddress(const UnixAddress& address) {
+  if (!std::regex_match(address.path, address.path + address.length, *target_address)) {
+    return false;
+  }
+  pthread_mutex_lock(&target_mutex);
+  const size_t count = __atomic_load_n(&target_address_count, __ATOMIC_RELAXED);
+  bool is_found      = false;
+  for (size_t i = 0; i < count && !is_found; i++) {
+    is_found = target_addresses[i].length == address.length &&
+               memcmp(target_addresses[i].path, address.path, address.length) == 0;
+  }
+  if (!is_found && count < kMaxTargetAddresses) {
+    target_addresses[count] = address;
+    __atomic_store_n(&target_address_count, count + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&target_mutex);
+  return true;
+}
+
+// Match by addresses which have been matched by MatchTargetAddress() without allocation
+bool FindTargetAddress(const UnixAddress& address) {
+  const size_t count = __atomic_load_n(&target_address_count, __ATOMIC_ACQUIRE);
+  for (size_t i = 0; i < count; i++) {
+    if (target_addresses[i].length == address.length &&
+        memcmp(target_addresses[i].path, address.path, address.length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SetFdState(int fd, FdState state) {
+  if (IsCachedFd(fd)) {
+    __atomic_store_n(&fd_states[fd], state, __ATOMIC_RELAXED);
+  }
+}
+
+void ResetFd(int fd) {
+  if (IsCachedFd(fd)) {
+    __atomic_store_n(&fd_states[fd], kUnknown, __ATOMIC_RELAXED);
+    __atomic_store_n(&fd_gaps[fd], 0, __ATOMIC_RELAXED);
+  }
+}
+
+// Classify new connection of fd by `address` and tell it to capnp_trace before any data
+void OpenFd(int fd, const UnixAddress& address, bool is_target) {
+  if (is_target) {
+    struct iovec iov = {const_cast<char*>(address.path), address.length};
+    PushRecord(fd, SharedRingBuffer::kOpen, &iov, 1, address.length);
+  }
+  SetFdState(fd, is_target ? kTarget : kIgnored);
+}
+
+// Classify fd which is not created by connect() or accept() when it is used first
+bool CheckAddress(int fd) {
+  if (IsCachedFd(fd)) {
+    const auto state = static_cast<FdState>(__atomic_load_n(&fd_states[fd], __ATOMIC_RELAXED));
+    if (state != kUnknown) {
+      return state == kTarget;
+    }
+  }
+
+  UnixAddress address;
+  const bool is_target = GetAddress(fd, address) && FindTargetAddress(address);
+  OpenFd(fd, address, is_target);
+  return is_target;
+}
+
+void Capture(int fd, uint32_t type, const struct iovec* iov, int iovcnt, ssize_t rc) {
+  if (ring == nullptr || rc <= 0 || fd < 0 || !CheckAddress(fd)) {
+    return;
+  }
+  PushRecord(fd, type, iov, iovcnt, static_cast<size_t>(rc));
+}
+
+void Capture(int fd, uint32_t type, const void* buf, ssize_t rc) {
+  struct iovec iov = {const_cast<void*>(buf), rc > 0 ? static_cast<size_t>(rc) : 0};
+  Capture(fd, type, &iov, 1, rc);
+}
+
+// Classify connection which is accepted by listening fd
+void OpenAcceptedFd(int fd) {
+  if (ring == nullptr || fd < 0) {
+    return;
+  }
+  ResetFd(fd);
+  UnixAddress address;
+  OpenFd(fd, address, GetAddress(fd, address) && MatchTargetAddress(address));
+}
+
+// The limit of fd, which is not changed by setrlimit() unlike RLIMIT_NOFILE
+size_t GetMaxFd() {
+  static const size_t kDefaultMaxFd = 1048576;
+  const int fd                      = open("/proc/sys/fs/nr_open", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return kDefaultMaxFd;
+  }
+  char buffer[32]  = {};
+  const ssize_t rc = ::read(fd, buffer, sizeof(buffer) - 1);
+  ::close(fd);
+  const long value = rc > 0 ? strtol(buffer, nullptr, 10) : 0;
+  return value > 0 ? static_cast<size_t>(value) : kDefaultMaxFd;
+}
+
+// Classify fds which have been opened before this library is loaded, e.g. inherited sockets
+void CheckOpenedFds() {
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    return;
+  }
+  const int dir_fd = dirfd(dir);
+  while (const struct dirent* entry = readdir(dir)) {
+    const int fd = atoi(entry->d_name);
+    if (entry->d_name[0] == '.' || fd == dir_fd) {
+      continue;
+    }
+    UnixAddress address;
+    SetFdState(fd, GetAddress(fd, address) && MatchTargetAddress(address) ? kUnknown : kIgnored);
+  }
+  closedir(dir);
+}
+
+__attribute__((constructor)) void Initialize() {
+  const char* ring_fd_env = getenv(kPreloadRingFdEnv);
+  const char* address_env = getenv(kPreloadAddressEnv);
+  if (ring_fd_env == nullptr || address_env == nullptr) {
+    return;
+  }
+
+  const int ring_fd = atoi(ring_fd_env);
+  struct stat st;
+  if (fstat(ring_fd, &st) != 0) {
+    return;
+  }
+  void* region = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+  if (region == MAP_FAILED) {
+    return;
+  }
+
+  static SharedRingBuffer instance(region, static_cast<size_t>(st.st_size));
+  if (!instance.IsValid()) {
+    return;
+  }
+  static std::regex address_regex(address_env);
+  target_address = &address_regex;
+
+  // States of all fds, whose pages are allocated only when they are touched
+  const size_t fd_count = GetMaxFd();
+  void* fd_tables       = mmap(nullptr, fd_count * 2, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (fd_tables == MAP_FAILED) {
+    return;
+  }
+  fd_states = static_cast<uint8_t*>(fd_tables);
+  fd_gaps   = fd_states + fd_count;
+  max_fd    = fd_count;
+  // Target addresses of opened fds are registered so that CheckAddress() finds them later
+  CheckOpenedFds();
+
+  pid = getpid();
+  pthread_atfork(nullptr, nullptr, ResetAfterFork);
+  ring = &instance;
+}
+
+}  // namespace
+}  // namespace capnp_trace
+
+using capnp_trace::Capture;
+using capnp_trace::GetUnixAddress;
+using capnp_trace::MatchTargetAddress;
+using capnp_trace::OpenAcceptedFd;
+using capnp_trace::OpenFd;
+using capnp_trace::ResetFd;
+using capnp_trace::SharedRingBuffer;
+using capnp_trace::UnixAddress;
+
+extern "C" {
+
+ssize_t read(int fd, void* buf, size_t count) {
+  CAPNP_TRACE_REAL(read);
+  const ssize_t rc = real_read(fd, buf, count);
+  Capture(fd, SharedRingBuffer::kIn, buf, rc);
+  return rc;
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+  CAPNP_TRACE_REAL(readv);
+  const ssize_t rc = real_readv(fd, iov, iovcnt);
+  Capture(fd, SharedRingBuffer::kIn, iov, iovcnt, rc);
+  return rc;
+}
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+  CAPNP_TRACE_REAL(recv);
+  const ssize_t rc = real_recv(fd, buf, len, flags);
+  if ((flags & MSG_PEEK) == 0) {
+    Capture(fd, SharedRingBuffer::kIn, buf, rc);
+  }
+  return rc;
+}
+
+ssize_t recvfrom(int fd, void* buf, size_t len, int flags, struct sockaddr* src_addr,
+                 socklen_t* addrlen) {
+  CAPNP_TRACE_REAL(recvfrom);
+  const ssize_t rc = real_recvfrom(fd, buf, len, flags, src_addr, addrlen);
+  if ((flags & MSG_PEEK) == 0) {
+    Capture(fd, SharedRingBuffer::kIn, buf, rc);
+  }
+  return rc;
+}
+
+ssize_t recvmsg(int fd, struct msghdr* msg, int flags) {
+  CAPNP_TRACE_REAL(recvmsg);
+  const ssize_t rc = real_recvmsg(fd, msg, flags);
+  if ((flags & MSG_PEEK) == 0) {
+    Capture(fd, SharedRingBuffer::kIn, msg->msg_iov, static_cast<int>(msg->msg_iovlen), rc);
+  }
+  return rc;
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  CAPNP_TRACE_REAL(write);
+  const ssize_t rc = real_write(fd, buf, count);
+  Capture(fd, SharedRingBuffer::kOut, buf, rc);
+  return rc;
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+  CAPNP_TRACE_REAL(writev);
+  const ssize_t rc = real_writev(fd, iov, iovcnt);
+  Capture(fd, SharedRingBuffer::kOut, iov, iovcnt, rc);
+  return rc;
+}
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+  CAPNP_TRACE_REAL(send);
+  const ssize_t rc = real_send(fd, buf, len, flags);
+  Capture(fd, SharedRingBuffer::kOut, buf, rc);
+  return rc;
+}
+
+ssize_t sendto(int fd, const void* buf, size_t len, int flags, const struct sockaddr* dest_addr,
+               socklen_t addrlen) {
+  CAPNP_TRACE_REAL(sendto);
+  const ssize_t rc = real_sendto(fd, buf, len, flags, dest_addr, addrlen);
+  Capture(fd, SharedRingBuffer::kOut, buf, rc);
+  return rc;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr* msg, int flags) {
+  CAPNP_TRACE_REAL(sendmsg);
+  const ssize_t rc = real_sendmsg(fd, msg, flags);
+  Capture(fd, SharedRingBuffer::kOut, msg->msg_iov, static_cast<int>(msg->msg_iovlen), rc);
+  return rc;
+}
+
+int connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+  CAPNP_TRACE_REAL(connect);
+  // Socket may have been checked before connect, i.e. without peer address
+  ResetFd(fd);
+  const int rc = real_connect(fd, addr, addrlen);
+  // Non-blocking socket has no peer address until it is connected, so that `addr` is used
+  UnixAddress address;
+  if (capnp_trace::ring != nullptr && (rc == 0 || errno == EINPROGRESS) &&
+      GetUnixAddress(addr, addrlen, address)) {
+    const int saved_errno = errno;
+    OpenFd(fd, address, MatchTargetAddress(address));
+    errno = saved_errno;
+  }
+  return rc;
+}
+
+int accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+  CAPNP_TRACE_REAL(accept);
+  const int rc = real_accept(fd, addr, addrlen);
+  OpenAcceptedFd(rc);
+  return rc;
+}
+
+int accept4(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+  CAPNP_TRACE_REAL(accept4);
+  const int rc = real_accept4(fd, addr, addrlen, flags);
+  OpenAcceptedFd(rc);
+  return rc;
+}
+
+int close(int fd) {
+  CAPNP_TRACE_REAL(close);
+  // Close the stream before fd is released, because another thread may get the same fd by
+  // accept() or connect() and push records of the new stream as soon as real_close() returns
+  if (capnp_trace::ring != nullptr && capnp_trace::IsCachedFd(fd)) {
+    const bool is_target = __atomic_load_n(&capnp_trace::fd_states[fd], __ATOMIC_RELAXED) ==
+                           capnp_trace::kTarget;
+    ResetFd(fd);
+    if (is_target) {
+      capnp_trace::PushRecord(fd, SharedRingBuffer::kClose, nullptr, 0, 0);
+    }
+  }
+  return real_close(fd);
+}
+
+}  // extern "C"
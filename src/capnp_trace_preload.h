@@ -0,0 +1,18 @@
+#pragma once
+
+// Environment variables to pass settings from capnp_trace to libcapnp_trace_preload.so
+
+namespace capnp_trace {
+
+// fd of shared memory for SharedRingBuffer, which is inherited from capnp_trace
+static const char kPreloadRingFdEnv[] = "CAPNP_TRACE_RING_FD";
+
+// Regular expression of server address to be traced
+static const char kPreloadAddressEnv[] = "CAPNP_TRACE_ADDRESS";
+
+// Path to libcapnp_trace_preload.so to override default search path
+static const char kPreloadLibraryEnv[] = "CAPNP_TRACE_PRELOAD_LIBRARY";
+
+static const char kPreloadLibraryName[] = "libcapnp_trace_preload.so";
+
+}  // namespace capnp_trace
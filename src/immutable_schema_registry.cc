@@ -0,0 +1,87 @@
+#include "immutable_schema_registry.h"
+
+#include <capnp/schema-loader.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "schema_file_loader.h"
+
+namespace capnp_trace {
+
+// Function to load a compiled interface, which is called when its ID is requested first
+using LoadCompiledFunc = void (*)(capnp::SchemaLoader& loader);
+
+template <typename T>
+static void LoadCompiledInterface(capnp::SchemaLoader& loader) {
+  loader.loadCompiledTypeAndDependencies<T>();
+}
+
+using CompiledInterface = std::pair<uint64_t, LoadCompiledFunc>;
+
+static bool CompareId(const CompiledInterface& lhs, const CompiledInterface& rhs) {
+  return lhs.first < rhs.first;
+}
+
+}  // namespace capnp_trace
+
+// Defines `compiled_interfaces`, the table of compiled interfaces which is generated from
+// immutable_schema_registry.inc.in at build time. It is sorted by ID in Init() since IDs are not
+// known until the generated headers are compiled.
+#include "immutable_schema_registry.inc"
+
+namespace capnp_trace {
+
+// Load compiled interfaces and compiled schema files on demand
+class LazyLoader final : public capnp::SchemaLoader::LazyLoadCallback {
+ public:
+  void load(const capnp::SchemaLoader& loader, uint64_t id) const override;
+};
+
+static SchemaFileLoader schema_files;
+static LazyLoader lazy_loader;
+static capnp::SchemaLoader loader(lazy_loader);
+static MethodTable methods;
+
+void LazyLoader::load(const capnp::SchemaLoader&, uint64_t id) const {
+  auto it = std::lower_bound(compiled_interfaces.begin(), compiled_interfaces.end(),
+                             CompiledInterface(id, nullptr), CompareId);
+  if (it != compiled_interfaces.end() && it->first == id) {
+    // Compiled types can be loaded only by the non-const loader
+    it->second(loader);
+    return;
+  }
+  schema_files.Load(loader, id);
+}
+
+void ImmutableSchemaRegistry::Init() {
+  // Interfaces are not loaded until they are requested, which takes long for many schemas
+  std::sort(compiled_interfaces.begin(), compiled_interfaces.end(), CompareId);
+}
+
+size_t ImmutableSchemaRegistry::AddSchemaFile(kj::Own<const kj::ReadableFile>&& file) {
+  return schema_files.AddFile(kj::mv(file));
+}
+
+capnp::InterfaceSchema ImmutableSchemaRegistry::GetInterface(uint64_t id) {
+  return loader.get(id).asInterface();
+}
+
+const MethodInfo& ImmutableSchemaRegistry::GetMethod(uint64_t interface_id, uint16_t method_id) {
+  KJ_IF_MAYBE (info, methods.Find(interface_id, method_id)) {
+    return *info;
+  }
+  // Interface is loaded lazily from compiled schemas or a compiled schema file
+  KJ_IF_MAYBE (schema, loader.tryGet(interface_id)) {
+    if (schema->getProto().isInterface()) {
+      methods.Add(schema->asInterface());
+      KJ_IF_MAYBE (info, methods.Find(interface_id, method_id)) {
+        return *info;
+      }
+    }
+  }
+  KJ_FAIL_REQUIRE("unknown method", interface_id, method_id);
+}
+}  // namespace capnp_trace
@@ -1,12 +1,20 @@
 #pragma once
 
 #include <capnp/schema.h>
+#include <kj/filesystem.h>
+
+#include "method_table.h"
 
 namespace capnp_trace {
 class ImmutableSchemaRegistry final {
  public:
   static void Init();
+  // Load schemas of a compiled schema file lazily, in addition to ones built into the binary.
+  // Must be called before tracing starts. Returns the number of added nodes.
+  static size_t AddSchemaFile(kj::Own<const kj::ReadableFile>&& file);
   static capnp::InterfaceSchema GetInterface(uint64_t id);
+  // Throws if the method is unknown like GetInterface()
+  static const MethodInfo& GetMethod(uint64_t interface_id, uint16_t method_id);
 
  private:
   ImmutableSchemaRegistry()                                          = delete;
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <kj/debug.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace capnp_trace {
+
+/// @brief Find a file installed with capnp_trace, e.g. libcapnp_trace_preload.so
+/// @param name file name
+/// @param env environment variable which overrides the path
+/// @details Search build tree (same directory as capnp_trace) and install tree (../lib)
+inline std::string FindInstalledFile(const char* name, const char* env) {
+  const char* env_path = getenv(env);
+  if (env_path != nullptr) {
+    return env_path;
+  }
+
+  char exe_path[PATH_MAX] = {0};
+  KJ_SYSCALL(readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1));
+  std::string exe_dir(exe_path);
+  exe_dir = exe_dir.substr(0, exe_dir.rfind('/'));
+  for (auto& candidate : {exe_dir + "/" + name, exe_dir + "/../lib/" + name}) {
+    struct stat st;
+    if (stat(candidate.c_str(), &st) == 0) {
+      return candidate;
+    }
+  }
+  KJ_FAIL_REQUIRE("file is not found. Set environment variable.", name, env);
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,108 @@
+#include "latency_histogram.h"
+
+#include <cmath>
+
+namespace capnp_trace {
+
+const uint32_t LatencyHistogram::kSubBucketBits;
+const uint32_t LatencyHistogram::kSubBucketCount;
+const size_t LatencyHistogram::kBucketCount;
+
+LatencyHistogram::LatencyHistogram() : buckets_(), count_(0), max_(0) {}
+
+void LatencyHistogram::Record(uint64_t value) {
+  buckets_[GetBucketIndex(value)]++;
+  count_++;
+  if (value > max_) {
+    max_ = value;
+  }
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (size_t i = 0; i < kBucketCount; i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  if (other.max_ > max_) {
+    max_ = other.max_;
+  }
+}
+
+void LatencyHistogram::Subtract(const LatencyHistogram& older) {
+  uint64_t max = 0;
+  for (size_t i = 0; i < kBucketCount; i++) {
+    buckets_[i] -= older.buckets_[i];
+    if (buckets_[i] > 0) {
+      max = GetBucketUpperBound(i);
+    }
+  }
+  count_ -= older.count_;
+  max_ = max < max_ ? max : max_;
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  auto target = static_cast<uint64_t>(std::ceil(static_cast<double>(count_) * percentile / 100));
+  if (target == 0) {
+    target = 1;
+  }
+  uint64_t accumulated = 0;
+  for (size_t i = 0; i < kBucketCount; i++) {
+    accumulated += buckets_[i];
+    if (accumulated >= target) {
+      // The largest value of the bucket never exceeds the max
+      const uint64_t upper_bound = GetBucketUpperBound(i);
+      return upper_bound < max_ ? upper_bound : max_;
+    }
+  }
+  return max_;
+}
+
+size_t LatencyHistogram::GetBucketIndex(uint64_t value) {
+  if (value < kSubBucketCount) {
+    return static_cast<size_t>(value);
+  }
+  // Position of the highest set bit, which is kSubBucketBits or more
+  const uint32_t exponent = 63 - static_cast<uint32_t>(__builtin_clzll(value));
+  const uint32_t shift    = exponent - kSubBucketBits;
+  return (exponent - kSubBucketBits + 1) * kSubBucketCount +
+         static_cast<size_t>((value >> shift) - kSubBucketCount);
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(size_t index) {
+  if (index < kSubBucketCount) {
+    return index;
+  }
+  const uint32_t shift     = static_cast<uint32_t>(index / kSubBucketCount) - 1;
+  const uint64_t sub_index = kSubBucketCount + index % kSubBucketCount;
+  return (sub_index << shift) + ((uint64_t(1) << shift) - 1);
+}
+
+ConcurrentLatencyHistogram::ConcurrentLatencyHistogram() : max_(0) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void ConcurrentLatencyHistogram::Record(uint64_t value) {
+  // Read-modify-write doesn't need to be atomic because there is only one writer
+  auto& bucket = buckets_[LatencyHistogram::GetBucketIndex(value)];
+  bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+}
+
+LatencyHistogram ConcurrentLatencyHistogram::Snapshot() const {
+  LatencyHistogram histogram;
+  for (size_t i = 0; i < LatencyHistogram::kBucketCount; i++) {
+    histogram.buckets_[i] = buckets_[i].load(std::memory_order_relaxed);
+    histogram.count_ += histogram.buckets_[i];
+  }
+  histogram.max_ = max_.load(std::memory_order_relaxed);
+  return histogram;
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+
+namespace capnp_trace {
+
+/// @brief Histogram of latencies in log-scale buckets like HdrHistogram
+/// @details Each power of 2 is divided into 16 buckets, so that a percentile is accurate within
+/// 1/16 of the value with a fixed size of memory and O(1) recording.
+class LatencyHistogram final {
+ public:
+  LatencyHistogram();
+
+  void Record(uint64_t value);
+
+  /// @brief Add values recorded in `other`
+  void Merge(const LatencyHistogram& other);
+
+  /// @brief Remove values recorded in `older`, which is an earlier copy of this histogram
+  /// @details The max becomes the upper bound of the largest remaining bucket.
+  void Subtract(const LatencyHistogram& older);
+
+  /// @param percentile 0 to 100
+  /// @return Upper bound of the bucket which contains the percentile, or 0 if nothing is recorded
+  uint64_t GetPercentile(double percentile) const;
+
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+
+ private:
+  friend class ConcurrentLatencyHistogram;
+
+  static const uint32_t kSubBucketBits  = 4;
+  static const uint32_t kSubBucketCount = 1u << kSubBucketBits;
+  // Values below 2 * kSubBucketCount have their own buckets, and each larger power of 2 has
+  // kSubBucketCount buckets
+  static const size_t kBucketCount = (64 - kSubBucketBits + 1) * kSubBucketCount;
+
+  static size_t GetBucketIndex(uint64_t value);
+  static uint64_t GetBucketUpperBound(size_t index);
+
+  std::array<uint64_t, kBucketCount> buckets_;
+  uint64_t count_;
+  uint64_t max_;
+};
+
+/// @brief LatencyHistogram which one thread records and other threads can copy at any time
+class ConcurrentLatencyHistogram final {
+ public:
+  ConcurrentLatencyHistogram();
+
+  /// @brief Record a value, which must be called only by one thread
+  void Record(uint64_t value);
+
+  LatencyHistogram Snapshot() const;
+
+ private:
+  std::array<std::atomic<uint64_t>, LatencyHistogram::kBucketCount> buckets_;
+  std::atomic<uint64_t> max_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,57 @@
+#include "method_table.h"
+
+#include <kj/vector.h>
+
+#include <mutex>
+#include <utility>
+
+namespace capnp_trace {
+
+void MethodTable::Add(capnp::InterfaceSchema interface) {
+  const uint64_t interface_id = interface.getProto().getId();
+  for (auto method : interface.getMethods()) {
+    // Types are resolved without the lock because they may be loaded lazily
+    MethodInfo info;
+    info.interface   = interface;
+    info.method      = method;
+    info.name        = kj::str(interface.getProto().getDisplayName(), ".",
+                               method.getProto().getName());
+    info.param_type  = method.getParamType();
+    info.result_type = method.getResultType();
+
+    kj::Vector<capnp::StructSchema::Field> capability_params;
+    for (auto field : info.param_type.getFields()) {
+      if (field.getType().isInterface()) {
+        capability_params.add(field);
+      }
+    }
+    info.capability_params = capability_params.releaseAsArray();
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    methods_.emplace(MethodKey(interface_id, method.getIndex()), kj::mv(info));
+  }
+}
+
+void MethodTable::AddAll(const capnp::SchemaLoader& loader) {
+  for (auto schema : loader.getAllLoaded()) {
+    if (schema.getProto().isInterface()) {
+      Add(schema.asInterface());
+    }
+  }
+}
+
+kj::Maybe<const MethodInfo&> MethodTable::Find(uint64_t interface_id, uint16_t method_id) const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  auto it = methods_.find(MethodKey(interface_id, method_id));
+  if (it == methods_.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+size_t MethodTable::size() const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return methods_.size();
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <capnp/schema-loader.h>
+#include <capnp/schema.h>
+#include <kj/array.h>
+#include <kj/string.h>
+#include <stdint.h>
+
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "record_index.h"
+
+namespace capnp_trace {
+
+/// @brief Schema information of a method which is resolved once instead of for every message
+struct MethodInfo {
+  capnp::InterfaceSchema interface;
+  capnp::InterfaceSchema::Method method;
+  // "<interface display name>.<method name>" which --method, --trigger and injection match
+  kj::String name;
+  capnp::StructSchema param_type;
+  capnp::StructSchema result_type;
+  // Fields of param_type which pass capabilities
+  kj::Array<capnp::StructSchema::Field> capability_params;
+};
+
+/// @brief Hash table of methods keyed by interface ID and method ID
+/// @details An interface is added the first time one of its methods is looked up, after it is
+/// loaded lazily by SchemaLoader. Following lookups take one hash lookup and no allocation instead
+/// of a SchemaLoader lookup and building the method name for every message, but every lookup
+/// takes the shared lock because interfaces can be added while other threads look up methods.
+class MethodTable final {
+ public:
+  /// @brief Add all methods of `interface`. Methods which are already added are kept.
+  void Add(capnp::InterfaceSchema interface);
+
+  /// @brief Add all methods of all interfaces loaded by `loader`
+  void AddAll(const capnp::SchemaLoader& loader);
+
+  /// @return null if the method is unknown
+  kj::Maybe<const MethodInfo&> Find(uint64_t interface_id, uint16_t method_id) const;
+
+  size_t size() const;
+
+ private:
+  struct MethodKeyHash {
+    size_t operator()(const MethodKey& key) const {
+      return std::hash<uint64_t>()(key.first ^ (uint64_t(key.second) * 0x9e3779b97f4a7c15ull));
+    }
+  };
+
+  // References to values are stable while more methods are added
+  std::unordered_map<MethodKey, MethodInfo, MethodKeyHash> methods_;
+  mutable std::shared_timed_mutex mutex_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <kj/debug.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace capnp_trace {
+
+/// @brief Get CLOCK_MONOTONIC time in microseconds, which is used as timestamp of messages
+inline uint64_t GetMonotonicMicroSec() {
+  struct timespec tp;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &tp));
+  return tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/// @brief Get CLOCK_MONOTONIC time in nanoseconds to measure short durations
+inline uint64_t GetMonotonicNanoSec() {
+  struct timespec tp;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &tp));
+  return tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+}  // namespace capnp_trace
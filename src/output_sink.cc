@@ -0,0 +1,104 @@
+#include "output_sink.h"
+
+#include <kj/debug.h>
+
+#include <chrono>
+
+namespace capnp_trace {
+
+const size_t OutputSink::kDefaultBufferSize;
+const uint64_t OutputSink::kDefaultFlushIntervalMsec;
+
+OutputSink::OutputSink(kj::Own<kj::OutputStream>&& output)
+    : output_(kj::mv(output)),
+      is_writing_(false),
+      buffer_size_(kDefaultBufferSize),
+      flush_interval_msec_(kDefaultFlushIntervalMsec),
+      is_stopping_(false) {
+  buffer_.reserve(buffer_size_);
+  flush_thread_ = std::thread(&OutputSink::FlushLoop, this);
+}
+
+OutputSink::~OutputSink() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopping_ = true;
+  }
+  flush_condition_.notify_one();
+  flush_thread_.join();
+  // Destructor must not throw, e.g. when stdout is closed by the reader
+  KJ_IF_MAYBE (exception, kj::runCatchingExceptions([this]() { Flush(); })) {
+    KJ_LOG(ERROR, "failed to write output", *exception);
+  }
+}
+
+OutputSink& OutputSink::SetFlushThreshold(size_t buffer_size, uint64_t interval_msec) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer_size_         = buffer_size;
+    flush_interval_msec_ = interval_msec;
+    buffer_.reserve(buffer_size_);
+    spare_buffer_.reserve(buffer_size_);
+  }
+  flush_condition_.notify_one();
+  return *this;
+}
+
+void OutputSink::Write(kj::ArrayPtr<const char> text) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  buffer_.append(text.begin(), text.size());
+  // Output is written by the thread which is writing if any
+  if (buffer_.size() >= buffer_size_ && !is_writing_) {
+    FlushLocked(lock);
+  }
+}
+
+void OutputSink::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  FlushLocked(lock);
+}
+
+void OutputSink::FlushLocked(std::unique_lock<std::mutex>& lock) {
+  write_condition_.wait(lock, [this]() { return !is_writing_; });
+  // Output which is buffered while writing is written again if it exceeds the threshold, because
+  // Write() doesn't write it while another thread is writing
+  do {
+    if (buffer_.empty()) {
+      return;
+    }
+    // Swap with the spare buffer to keep capacity for following output
+    std::string buffer;
+    buffer.swap(spare_buffer_);
+    buffer.swap(buffer_);
+
+    is_writing_ = true;
+    lock.unlock();
+    auto maybe_exception =
+        kj::runCatchingExceptions([&]() { output_->write(buffer.data(), buffer.size()); });
+    lock.lock();
+    is_writing_ = false;
+    write_condition_.notify_all();
+
+    buffer.clear();
+    spare_buffer_.swap(buffer);
+    KJ_IF_MAYBE (exception, maybe_exception) {
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  } while (buffer_.size() >= buffer_size_);
+}
+
+void OutputSink::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!is_stopping_) {
+    if (flush_interval_msec_ == 0) {
+      flush_condition_.wait(lock);
+    } else {
+      flush_condition_.wait_for(lock, std::chrono::milliseconds(flush_interval_msec_));
+    }
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() { FlushLocked(lock); })) {
+      KJ_LOG(ERROR, "failed to write output", *exception);
+    }
+  }
+}
+
+}  // namespace capnp_trace
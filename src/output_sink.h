@@ -0,0 +1,71 @@
+#pragma once
+
+#include <kj/array.h>
+#include <kj/io.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace capnp_trace {
+
+/// @brief Buffered writer of formatted output
+/// @details Output is buffered and written by one write(2) when it exceeds the buffer size or the
+/// flush interval elapses, instead of flushing every line to an unbuffered stream.
+class OutputSink final {
+ public:
+  /// @param output Stream to write, e.g. kj::FdOutputStream of stdout or a file
+  explicit OutputSink(kj::Own<kj::OutputStream>&& output);
+
+  /// @brief Write buffered output. Failure is logged instead of thrown.
+  ~OutputSink();
+  OutputSink(const OutputSink&)            = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+  OutputSink(OutputSink&&)                 = delete;
+  OutputSink& operator=(OutputSink&&)      = delete;
+
+  /// @brief Set when buffered output is written
+  /// @param buffer_size Output is written when it exceeds this size in bytes.
+  /// 0 means that every Write() is written immediately, e.g. for interactive use.
+  /// @param interval_msec Output is written at least every `interval_msec` milliseconds.
+  /// 0 means that output is written only by `buffer_size`.
+  OutputSink& SetFlushThreshold(size_t buffer_size, uint64_t interval_msec);
+
+  /// @brief Write `text`, which usually consists of whole lines
+  void Write(kj::ArrayPtr<const char> text);
+
+  /// @brief Write buffered output
+  void Flush();
+
+  static const size_t kDefaultBufferSize          = 64 * 1024;
+  static const uint64_t kDefaultFlushIntervalMsec = 100;
+
+ private:
+  // Write buffer_ without lock. Only one thread writes at a time so that output is written in
+  // order.
+  void FlushLocked(std::unique_lock<std::mutex>& lock);
+  void FlushLoop();
+
+  kj::Own<kj::OutputStream> output_;
+
+  // Output which is not written yet, guarded by mutex_
+  std::string buffer_;
+  // Written buffer which is swapped with buffer_ to reuse its capacity, guarded by mutex_
+  std::string spare_buffer_;
+  // Whether a thread is writing output without lock, guarded by mutex_
+  bool is_writing_;
+  size_t buffer_size_;
+  uint64_t flush_interval_msec_;
+  bool is_stopping_;
+
+  std::mutex mutex_;
+  std::condition_variable flush_condition_;
+  std::condition_variable write_condition_;
+
+  // Thread which flushes buffer_ every flush_interval_msec_
+  std::thread flush_thread_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <capnp/message.h>
+#include <kj/common.h>
+
+namespace capnp_trace {
+
+/// @brief ReaderOptions of all messages which capnp_trace reads
+/// @details Since this is a debug tool, lift the usual security limits. Worse case is the process
+/// crashes or has to be killed.
+inline capnp::ReaderOptions GetUnlimitedReaderOptions() {
+  capnp::ReaderOptions options;
+  options.nestingLimit          = kj::maxValue;
+  options.traversalLimitInWords = kj::maxValue;
+  return options;
+}
+
+}  // namespace capnp_trace
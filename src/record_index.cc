@@ -0,0 +1,299 @@
+#include "record_index.h"
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace capnp_trace {
+
+static const uint32_t kIndexMagicNumber = 0xCAB91DE7;
+
+const uint64_t RecordIndex::kDefaultBlockSize;
+
+// Fixed size trailer at the end of a recorded file to find the index
+struct IndexTrailer {
+  uint64_t index_offset;
+  uint32_t reserved;
+  uint32_t magic_number;
+};
+static_assert(sizeof(IndexTrailer) == 16, "IndexTrailer must not be padded");
+
+// Serialized method in the index
+struct IndexMethod {
+  uint64_t interface_id;
+  uint16_t method_id;
+  uint16_t reserved0;
+  uint32_t reserved1;
+};
+static_assert(sizeof(IndexMethod) == 16, "IndexMethod must not be padded");
+
+static_assert(sizeof(RecordIndex::Block) == 32, "RecordIndex::Block must not be padded");
+
+template <typename T>
+static void Append(std::vector<kj::byte>& buffer, const T* data, size_t size) {
+  auto bytes = reinterpret_cast<const kj::byte*>(data);
+  buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+// Bounds checked reader of serialized index
+class IndexReader final {
+ public:
+  explicit IndexReader(kj::ArrayPtr<const kj::byte> data) : data_(data), offset_(0) {}
+
+  bool Read(void* value, size_t size) {
+    if (size > GetRemaining()) {
+      return false;
+    }
+    memcpy(value, data_.begin() + offset_, size);
+    offset_ += size;
+    return true;
+  }
+
+  template <typename T>
+  bool Read(T& value) {
+    return Read(&value, sizeof(value));
+  }
+
+  size_t GetRemaining() const { return data_.size() - offset_; }
+
+ private:
+  kj::ArrayPtr<const kj::byte> data_;
+  size_t offset_;
+};
+
+static StreamInfo::Direction Reverse(StreamInfo::Direction direction) {
+  switch (direction) {
+    case StreamInfo::Direction::kIn:
+      return StreamInfo::Direction::kOut;
+    case StreamInfo::Direction::kOut:
+      return StreamInfo::Direction::kIn;
+    default:
+      return direction;
+  }
+}
+
+kj::Maybe<MethodKey> CallMethodTracker::Track(const StreamInfo& stream_info,
+                                              capnp::rpc::Message::Reader message) {
+  switch (message.which()) {
+    case capnp::rpc::Message::CALL: {
+      auto call = message.getCall();
+      const MethodKey method(call.getInterfaceId(), call.getMethodId());
+      questions_[QuestionKey(stream_info.pid_, stream_info.fd_, stream_info.direction_,
+                             call.getQuestionId())] = method;
+      return method;
+    }
+    case capnp::rpc::Message::RETURN: {
+      // RETURN is sent in the opposite direction of CALL
+      auto it = questions_.find(QuestionKey(stream_info.pid_, stream_info.fd_,
+                                            Reverse(stream_info.direction_),
+                                            message.getReturn().getAnswerId()));
+      if (it == questions_.end()) {
+        return nullptr;
+      }
+      return it->second;
+    }
+    case capnp::rpc::Message::FINISH: {
+      // FINISH is sent in the same direction as CALL, and releases the question ID
+      auto it = questions_.find(QuestionKey(stream_info.pid_, stream_info.fd_,
+                                            stream_info.direction_,
+                                            message.getFinish().getQuestionId()));
+      if (it == questions_.end()) {
+        return nullptr;
+      }
+      const MethodKey method = it->second;
+      questions_.erase(it);
+      return method;
+    }
+    default:
+      return nullptr;
+  }
+}
+
+RecordIndex::RecordIndex(uint64_t block_size) : block_size_(block_size), index_offset_(0) {}
+
+bool RecordIndex::Add(uint64_t offset, uint64_t timestamp, const std::string& address,
+                      kj::Maybe<MethodKey> method) {
+  const bool is_new_block = blocks_.empty() || offset - blocks_.back().offset >= block_size_;
+  if (is_new_block) {
+    blocks_.push_back(Block{offset, timestamp, timestamp, 0, 0});
+  }
+  auto& block         = blocks_.back();
+  block.min_timestamp = std::min(block.min_timestamp, timestamp);
+  block.max_timestamp = std::max(block.max_timestamp, timestamp);
+  block.record_count++;
+
+  const size_t block_index = blocks_.size() - 1;
+  SetBit(address_blocks_[address], block_index);
+  KJ_IF_MAYBE (key, method) {
+    SetBit(method_blocks_[*key], block_index);
+  }
+  return is_new_block;
+}
+
+std::vector<kj::byte> RecordIndex::Serialize(uint64_t index_offset) const {
+  std::vector<kj::byte> buffer;
+  const auto block_count   = static_cast<uint32_t>(blocks_.size());
+  const auto address_count = static_cast<uint32_t>(address_blocks_.size());
+  const auto method_count  = static_cast<uint32_t>(method_blocks_.size());
+  const size_t word_count  = (blocks_.size() + 63) / 64;
+
+  Append(buffer, &kIndexMagicNumber, sizeof(kIndexMagicNumber));
+  Append(buffer, &block_count, sizeof(block_count));
+  Append(buffer, blocks_.data(), sizeof(Block) * blocks_.size());
+
+  Append(buffer, &address_count, sizeof(address_count));
+  Append(buffer, &method_count, sizeof(method_count));
+  for (const auto& entry : address_blocks_) {
+    const auto length = static_cast<uint32_t>(entry.first.length());
+    Append(buffer, &length, sizeof(length));
+    Append(buffer, entry.first.data(), length);
+  }
+  for (const auto& entry : method_blocks_) {
+    const IndexMethod method{entry.first.first, entry.first.second, 0, 0};
+    Append(buffer, &method, sizeof(method));
+  }
+
+  // Bitmaps are padded to the same length because trailing blocks may have no bit
+  auto append_bitmap = [&buffer, word_count](const Bitmap& bitmap) {
+    Append(buffer, bitmap.data(), sizeof(uint64_t) * bitmap.size());
+    const uint64_t zero = 0;
+    for (size_t i = bitmap.size(); i < word_count; i++) {
+      Append(buffer, &zero, sizeof(zero));
+    }
+  };
+  for (const auto& entry : address_blocks_) {
+    append_bitmap(entry.second);
+  }
+  for (const auto& entry : method_blocks_) {
+    append_bitmap(entry.second);
+  }
+
+  const IndexTrailer trailer{index_offset, 0, kIndexMagicNumber};
+  Append(buffer, &trailer, sizeof(trailer));
+  return buffer;
+}
+
+kj::Maybe<RecordIndex> RecordIndex::Deserialize(kj::ArrayPtr<const kj::byte> file) {
+  IndexTrailer trailer;
+  if (file.size() < sizeof(trailer)) {
+    return nullptr;
+  }
+  const size_t trailer_offset = file.size() - sizeof(trailer);
+  memcpy(&trailer, file.begin() + trailer_offset, sizeof(trailer));
+  if (trailer.magic_number != kIndexMagicNumber || trailer.index_offset > trailer_offset) {
+    return nullptr;
+  }
+
+  IndexReader reader(file.slice(trailer.index_offset, trailer_offset));
+  uint32_t magic_number;
+  uint32_t block_count;
+  if (!reader.Read(magic_number) || magic_number != kIndexMagicNumber ||
+      !reader.Read(block_count) || block_count > reader.GetRemaining() / sizeof(Block)) {
+    KJ_LOG(WARNING, "broken index", trailer.index_offset);
+    return nullptr;
+  }
+
+  RecordIndex index;
+  index.index_offset_ = trailer.index_offset;
+  index.blocks_.resize(block_count);
+  reader.Read(index.blocks_.data(), sizeof(Block) * block_count);
+
+  uint32_t address_count;
+  uint32_t method_count;
+  if (!reader.Read(address_count) || !reader.Read(method_count)) {
+    KJ_LOG(WARNING, "broken index", trailer.index_offset);
+    return nullptr;
+  }
+
+  // Keys are read at first, and then bitmaps in the same order
+  std::vector<Bitmap*> bitmaps;
+  for (uint32_t i = 0; i < address_count; i++) {
+    uint32_t length;
+    if (!reader.Read(length) || length > reader.GetRemaining()) {
+      KJ_LOG(WARNING, "broken index", trailer.index_offset);
+      return nullptr;
+    }
+    std::string address(length, '\0');
+    reader.Read(&address[0], length);
+    bitmaps.push_back(&index.address_blocks_[kj::mv(address)]);
+  }
+  for (uint32_t i = 0; i < method_count; i++) {
+    IndexMethod method;
+    if (!reader.Read(method)) {
+      KJ_LOG(WARNING, "broken index", trailer.index_offset);
+      return nullptr;
+    }
+    bitmaps.push_back(&index.method_blocks_[MethodKey(method.interface_id, method.method_id)]);
+  }
+
+  const size_t word_count = (block_count + 63) / 64;
+  for (auto bitmap : bitmaps) {
+    bitmap->resize(word_count);
+    if (!reader.Read(bitmap->data(), sizeof(uint64_t) * word_count)) {
+      KJ_LOG(WARNING, "broken index", trailer.index_offset);
+      return nullptr;
+    }
+  }
+  return kj::mv(index);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> RecordIndex::Select(const RecordFilter& filter) const {
+  // Blocks which have any address and method matching filter
+  Bitmap addresses;
+  Bitmap methods;
+  KJ_IF_MAYBE (pattern, filter.address) {
+    for (const auto& entry : address_blocks_) {
+      if (std::regex_match(entry.first, *pattern)) {
+        addresses.resize(std::max(addresses.size(), entry.second.size()));
+        for (size_t i = 0; i < entry.second.size(); i++) {
+          addresses[i] |= entry.second[i];
+        }
+      }
+    }
+  }
+  if (filter.method) {
+    for (const auto& entry : method_blocks_) {
+      if (filter.method(entry.first)) {
+        methods.resize(std::max(methods.size(), entry.second.size()));
+        for (size_t i = 0; i < entry.second.size(); i++) {
+          methods[i] |= entry.second[i];
+        }
+      }
+    }
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    const auto& block = blocks_[i];
+    // Blocks before the time range are read with method filter to track CALL before RETURN
+    const bool is_before_time_range = block.max_timestamp < filter.since && !filter.method;
+    if (is_before_time_range || block.min_timestamp > filter.until ||
+        (filter.address != nullptr && !GetBit(addresses, i)) ||
+        (filter.method && !GetBit(methods, i))) {
+      continue;
+    }
+
+    // Adjacent blocks are merged into one range
+    const uint64_t end = i + 1 < blocks_.size() ? blocks_[i + 1].offset : index_offset_;
+    if (!ranges.empty() && ranges.back().second == block.offset) {
+      ranges.back().second = end;
+    } else {
+      ranges.emplace_back(block.offset, end);
+    }
+  }
+  return ranges;
+}
+
+void RecordIndex::SetBit(Bitmap& bitmap, size_t index) {
+  if (bitmap.size() <= index / 64) {
+    bitmap.resize(index / 64 + 1);
+  }
+  bitmap[index / 64] |= uint64_t(1) << (index % 64);
+}
+
+bool RecordIndex::GetBit(const Bitmap& bitmap, size_t index) {
+  return index / 64 < bitmap.size() && (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <capnp/rpc.capnp.h>
+#include <kj/common.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <map>
+#include <regex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief Method which is identified by interface ID and method ID
+using MethodKey = std::pair<uint64_t, uint16_t>;
+
+/// @brief Condition to select recorded messages
+struct RecordFilter {
+  // Range of CLOCK_MONOTONIC timestamp in microseconds, both inclusive
+  uint64_t since = 0;
+  uint64_t until = UINT64_MAX;
+
+  // Whole address of the stream must match it if set
+  kj::Maybe<std::regex> address;
+
+  // Method of CALL, or of the CALL which RETURN/FINISH belongs to, must satisfy it if set.
+  // Messages without method (e.g. BOOTSTRAP) are not selected in that case. CALL before `since`
+  // is tracked as well, so that RETURN/FINISH in the time range are selected by its method.
+  std::function<bool(MethodKey)> method;
+};
+
+/// @brief Tracker of CALL messages to find the method which RETURN/FINISH belongs to
+class CallMethodTracker final {
+ public:
+  /// @return method of CALL, or of the CALL which RETURN/FINISH belongs to.
+  /// null for other messages or if the CALL has not been tracked.
+  kj::Maybe<MethodKey> Track(const StreamInfo& stream_info, capnp::rpc::Message::Reader message);
+
+ private:
+  // pid, fd, direction of CALL and question ID
+  using QuestionKey = std::tuple<pid_t, int, StreamInfo::Direction, uint32_t>;
+
+  std::map<QuestionKey, MethodKey> questions_;
+};
+
+/// @brief Sparse index of recorded messages which is written as the footer of a recorded file
+/// @details Records are grouped into blocks by file offset. The index holds the timestamp range
+/// of each block and bitmaps of blocks which contain each address and method, so that a parser
+/// can seek to blocks which may have records matching RecordFilter instead of reading whole file.
+class RecordIndex final {
+ public:
+  struct Block {
+    uint64_t offset;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    uint32_t record_count;
+    uint32_t reserved;
+  };
+
+  /// @param block_size A new block is started when records of current block exceed this size
+  explicit RecordIndex(uint64_t block_size = kDefaultBlockSize);
+  ~RecordIndex()                             = default;
+  RecordIndex(const RecordIndex&)            = delete;
+  RecordIndex& operator=(const RecordIndex&) = delete;
+  RecordIndex(RecordIndex&&)                 = default;
+  RecordIndex& operator=(RecordIndex&&)      = default;
+
+  /// @brief Add a record which starts at `offset` of the file
+  /// @details Records must be added in order of offset
+  /// @return true if the record starts a new block
+  bool Add(uint64_t offset, uint64_t timestamp, const std::string& address,
+           kj::Maybe<MethodKey> method);
+
+  /// @brief Serialize the index followed by a fixed size trailer
+  /// @param index_offset Offset where the index is written, i.e. end of records
+  std::vector<kj::byte> Serialize(uint64_t index_offset) const;
+
+  /// @brief Deserialize the index from the trailer at the end of `file`
+  /// @return null if `file` has no valid index, e.g. recording was killed before writing it
+  static kj::Maybe<RecordIndex> Deserialize(kj::ArrayPtr<const kj::byte> file);
+
+  /// @return Offset where records end, which is valid only for a deserialized index
+  uint64_t GetIndexOffset() const { return index_offset_; }
+
+  /// @return Ranges of file offset [begin, end) which may contain records matching `filter`
+  std::vector<std::pair<uint64_t, uint64_t>> Select(const RecordFilter& filter) const;
+
+  static const uint64_t kDefaultBlockSize = 1024 * 1024;
+
+ private:
+  using Bitmap = std::vector<uint64_t>;
+
+  static void SetBit(Bitmap& bitmap, size_t index);
+  static bool GetBit(const Bitmap& bitmap, size_t index);
+
+  uint64_t block_size_;
+  uint64_t index_offset_;
+  std::vector<Block> blocks_;
+
+  // Bitmaps of blocks which contain records of each address and method
+  std::map<std::string, Bitmap> address_blocks_;
+  std::map<MethodKey, Bitmap> method_blocks_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,87 @@
+#include "remote_memory_reader.h"
+
+#include <errno.h>
+#include <kj/debug.h>
+#include <string.h>
+
+#include "tracer_metrics.h"
+
+namespace capnp_trace {
+
+kj::ArrayPtr<char> RemoteMemoryReader::Read(pid_t pid, uint64_t addr, size_t size) {
+  if (buffer_.size() < size) {
+    buffer_.resize(size);
+  }
+  struct iovec remote = {reinterpret_cast<void*>(addr), size};
+  return kj::arrayPtr(buffer_.data(), ReadRemote(pid, buffer_.data(), &remote, 1));
+}
+
+kj::ArrayPtr<char> RemoteMemoryReader::ReadIovec(pid_t pid, uint64_t iov_addr, size_t iov_count,
+                                                 size_t size) {
+  // Copy iovec array itself at first
+  remote_iovs_.resize(iov_count);
+  const size_t iovs_size = sizeof(struct iovec) * iov_count;
+  struct iovec remote    = {reinterpret_cast<void*>(iov_addr), iovs_size};
+  if (ReadRemote(pid, reinterpret_cast<char*>(remote_iovs_.data()), &remote, 1) < iovs_size) {
+    return kj::arrayPtr(buffer_.data(), 0);
+  }
+
+  // Trim iovecs to `size` because only the head of them is filled (or sent) by the syscall
+  size_t total = 0;
+  size_t count = 0;
+  for (; count < iov_count && total < size; count++) {
+    auto& iov = remote_iovs_[count];
+    if (iov.iov_len > size - total) {
+      iov.iov_len = size - total;
+    }
+    total += iov.iov_len;
+  }
+
+  if (buffer_.size() < total) {
+    buffer_.resize(total);
+  }
+  return kj::arrayPtr(buffer_.data(),
+                      ReadRemote(pid, buffer_.data(), remote_iovs_.data(), count));
+}
+
+size_t RemoteMemoryReader::ReadRemote(pid_t pid, char* buf, struct iovec* remote,
+                                      size_t remote_count) {
+  size_t total = 0;
+  for (size_t i = 0; i < remote_count; i++) {
+    total += remote[i].iov_len;
+  }
+
+  size_t done  = 0;
+  size_t index = 0;
+  while (done < total) {
+    struct iovec local = {buf + done, total - done};
+    const ssize_t rc   = process_vm_readv(pid, &local, 1, remote + index, remote_count - index, 0);
+    if (auto metrics = TracerMetrics::GetIfEnabled()) {
+      metrics->AddRemoteRead(rc > 0 ? rc : 0);
+    }
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      // e.g. EFAULT for unmapped address, ESRCH if the thread has gone
+      KJ_LOG(INFO, "process_vm_readv failed", pid, done, total, strerror(errno));
+      break;
+    }
+    done += rc;
+
+    // Skip transferred part of remote iovecs to continue partial read
+    for (size_t rest = rc; rest > 0 && index < remote_count;) {
+      if (rest >= remote[index].iov_len) {
+        rest -= remote[index].iov_len;
+        index++;
+      } else {
+        remote[index].iov_base = static_cast<char*>(remote[index].iov_base) + rest;
+        remote[index].iov_len -= rest;
+        rest = 0;
+      }
+    }
+  }
+  return done;
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <kj/common.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+namespace capnp_trace {
+
+/// @brief Reader of another process's memory by process_vm_readv(2)
+/// @details Read data is stored into a buffer which is reused by following reads, so that
+/// capturing syscalls doesn't allocate memory once the buffer has grown enough.
+class RemoteMemoryReader final {
+ public:
+  RemoteMemoryReader()                                     = default;
+  ~RemoteMemoryReader()                                    = default;
+  RemoteMemoryReader(const RemoteMemoryReader&)            = delete;
+  RemoteMemoryReader& operator=(const RemoteMemoryReader&) = delete;
+  RemoteMemoryReader(RemoteMemoryReader&&)                 = default;
+  RemoteMemoryReader& operator=(RemoteMemoryReader&&)      = default;
+
+  /// @brief Read `size` bytes at `addr` of `pid`
+  /// @return read data which is valid until the next read. It is shorter than `size` if a part
+  /// of the range is not readable (e.g. EFAULT) or the process has gone.
+  kj::ArrayPtr<char> Read(pid_t pid, uint64_t addr, size_t size);
+
+  /// @brief Read data scattered by iovec array at `iov_addr` of `pid` by one process_vm_readv(2)
+  /// @param size total bytes to be read from the head of iovecs, e.g. return value of readv(2)
+  /// @return gathered data which is valid until the next read. It is shorter than `size` if
+  /// a part of the data is not readable or iovecs are shorter than `size`.
+  kj::ArrayPtr<char> ReadIovec(pid_t pid, uint64_t iov_addr, size_t iov_count, size_t size);
+
+ private:
+  size_t ReadRemote(pid_t pid, char* buf, struct iovec* remote, size_t remote_count);
+
+  // Buffer for read data, which only grows
+  std::vector<char> buffer_;
+
+  // iovecs copied from remote process and trimmed to requested size
+  std::vector<struct iovec> remote_iovs_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,188 @@
+#include "rpc_bpf_tracer.h"
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <kj/debug.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "install_path.h"
+#include "termination_signal.h"
+#include "unix_socket_address.h"
+
+namespace capnp_trace {
+
+static const char kBpfObjectName[] = "capnp_trace.bpf.o";
+static const char kBpfObjectEnv[]  = "CAPNP_TRACE_BPF_OBJECT";
+
+// Timeout to check whether traced processes are alive
+static const int kPollTimeoutMsec = 100;
+
+static uint64_t MakeKey(pid_t pid, int fd) {
+  return (static_cast<uint64_t>(pid) << 32) | static_cast<uint32_t>(fd);
+}
+
+static int FindMapFd(struct bpf_object* object, const char* name) {
+  auto map = bpf_object__find_map_by_name(object, name);
+  KJ_REQUIRE(map != nullptr, "map is not found", name);
+  return bpf_map__fd(map);
+}
+
+RpcBpfTracer::RpcBpfTracer(kj::StringPtr address, RpcMessageHandler handler)
+    : target_address_(address.cStr()),
+      object_(nullptr),
+      ring_buffer_(nullptr),
+      target_pids_fd_(-1),
+      fd_states_fd_(-1),
+      reassemblers_(handler) {
+  auto path = FindInstalledFile(kBpfObjectName, kBpfObjectEnv);
+  object_   = bpf_object__open_file(path.c_str(), nullptr);
+  KJ_REQUIRE(libbpf_get_error(object_) == 0, "failed to open BPF object", path);
+  KJ_REQUIRE(bpf_object__load(object_) == 0, "failed to load BPF object", path);
+
+  struct bpf_program* program;
+  bpf_object__for_each_program(program, object_) {
+    auto link = bpf_program__attach(program);
+    KJ_REQUIRE(libbpf_get_error(link) == 0, "failed to attach", bpf_program__name(program));
+    links_.push_back(link);
+  }
+
+  target_pids_fd_ = FindMapFd(object_, "target_pids");
+  fd_states_fd_   = FindMapFd(object_, "fd_states");
+  ring_buffer_ = ring_buffer__new(FindMapFd(object_, "events"), HandleEventCallback, this, nullptr);
+  KJ_REQUIRE(libbpf_get_error(ring_buffer_) == 0, "failed to create ring buffer");
+}
+
+RpcBpfTracer::~RpcBpfTracer() {
+  ring_buffer__free(ring_buffer_);
+  for (auto link : links_) {
+    bpf_link__destroy(link);
+  }
+  bpf_object__close(object_);
+}
+
+RpcBpfTracer& RpcBpfTracer::SetDumpDir(kj::Own<const kj::Directory> dump_dir) {
+  reassemblers_.SetDumpDir(kj::mv(dump_dir));
+  return *this;
+}
+
+RpcBpfTracer& RpcBpfTracer::AddPid(pid_t pid) {
+  const uint32_t tgid = static_cast<uint32_t>(pid);
+  const uint8_t value = 1;
+  KJ_SYSCALL(bpf_map_update_elem(target_pids_fd_, &tgid, &value, BPF_ANY), pid);
+  pids_.push_back(pid);
+  return *this;
+}
+
+void RpcBpfTracer::SetFdState(pid_t pid, int fd, bool is_target) {
+  const capnp_trace_bpf_fd_key key{static_cast<__u32>(pid), fd};
+  const uint8_t state = is_target ? CAPNP_TRACE_BPF_FD_TARGET : CAPNP_TRACE_BPF_FD_IGNORED;
+  bpf_map_update_elem(fd_states_fd_, &key, &state, BPF_ANY);
+}
+
+const RpcBpfTracer::FdInfo& RpcBpfTracer::CheckAddress(pid_t pid, int fd) {
+  const auto key = MakeKey(pid, fd);
+  auto it        = fds_.find(key);
+  if (it == fds_.end()) {
+    // Socket which has been opened before tracing or accepted by server
+    std::string address;
+    KJ_IF_MAYBE (exception,
+                 kj::runCatchingExceptions([&]() { address = GetUnixSocketAddress(pid, fd); })) {
+      KJ_LOG(INFO, "failed to get address", pid, fd, *exception);
+    }
+    const bool is_target = std::regex_match(address, target_address_);
+    KJ_LOG(INFO, pid, fd, address, is_target);
+    SetFdState(pid, fd, is_target);
+    it = fds_.emplace(key, FdInfo{address, is_target}).first;
+  }
+  return it->second;
+}
+
+int RpcBpfTracer::HandleEventCallback(void* ctx, void* data, size_t size) {
+  auto& event = *static_cast<const capnp_trace_bpf_event*>(data);
+  if (size < offsetof(capnp_trace_bpf_event, data) + event.len) {
+    KJ_LOG(WARNING, "broken event", size);
+    return 0;
+  }
+  static_cast<RpcBpfTracer*>(ctx)->HandleEvent(event);
+  return 0;
+}
+
+void RpcBpfTracer::HandleEvent(const capnp_trace_bpf_event& event) {
+  const auto pid = static_cast<pid_t>(event.tgid);
+  const auto tid = static_cast<pid_t>(event.tid);
+  char* data     = const_cast<char*>(reinterpret_cast<const char*>(event.data));
+
+  switch (event.type) {
+    case CAPNP_TRACE_BPF_CONNECT: {
+      const auto address   = FormatUnixSocketPath(data, event.len);
+      const bool is_target = std::regex_match(address, target_address_);
+      KJ_LOG(INFO, pid, event.fd, address, is_target);
+      SetFdState(pid, event.fd, is_target);
+      fds_[MakeKey(pid, event.fd)] = FdInfo{address, is_target};
+      break;
+    }
+    case CAPNP_TRACE_BPF_IN:
+    case CAPNP_TRACE_BPF_OUT: {
+      const auto& fd_info = CheckAddress(pid, event.fd);
+      if (!fd_info.is_target) {
+        break;
+      }
+      const auto direction = event.type == CAPNP_TRACE_BPF_IN ? StreamInfo::Direction::kIn
+                                                              : StreamInfo::Direction::kOut;
+      reassemblers_.Reassemble(pid, tid, direction, event.fd, fd_info.address, data, event.len,
+                               event.timestamp);
+      break;
+    }
+    case CAPNP_TRACE_BPF_CLOSE:
+      reassemblers_.Close(pid, event.fd);
+      fds_.erase(MakeKey(pid, event.fd));
+      break;
+    case CAPNP_TRACE_BPF_TRUNCATED: {
+      if (event.len < sizeof(capnp_trace_bpf_truncated) || !CheckAddress(pid, event.fd).is_target) {
+        break;
+      }
+      capnp_trace_bpf_truncated truncated;
+      memcpy(&truncated, event.data, sizeof(truncated));
+      const auto direction = truncated.type == CAPNP_TRACE_BPF_IN ? StreamInfo::Direction::kIn
+                                                                  : StreamInfo::Direction::kOut;
+      // The message which is truncated is dropped, and the stream is resynchronised at its end
+      if (reassemblers_.Skip(pid, event.fd, direction, truncated.dropped_size)) {
+        KJ_LOG(WARNING, "too large data is truncated. Drop the message.", pid, event.fd,
+               truncated.dropped_size);
+      } else {
+        KJ_LOG(WARNING, "too large data is truncated across messages. Discard the stream.", pid,
+               event.fd, direction, truncated.dropped_size);
+      }
+      break;
+    }
+    default:
+      KJ_LOG(WARNING, "unknown event type", event.type);
+      break;
+  }
+}
+
+void RpcBpfTracer::Trace() {
+  while (!pids_.empty() && !TerminationSignal::IsRaised()) {
+    auto rc = ring_buffer__poll(ring_buffer_, kPollTimeoutMsec);
+    if (rc < 0 && rc != -EINTR) {
+      KJ_FAIL_SYSCALL("ring_buffer__poll", -rc);
+    }
+
+    pids_.erase(std::remove_if(pids_.begin(), pids_.end(),
+                               [](pid_t pid) {
+                                 if (kill(pid, 0) != 0 && errno == ESRCH) {
+                                   KJ_LOG(INFO, pid, "exited");
+                                   return true;
+                                 }
+                                 return false;
+                               }),
+                pids_.end());
+  }
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <kj/filesystem.h>
+#include <kj/string.h>
+#include <sys/types.h>
+
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "capnp_trace_bpf.h"
+#include "rpc_message_reassembler.h"
+#include "rpc_stream_reassemblers.h"
+
+struct bpf_object;
+struct bpf_link;
+struct ring_buffer;
+
+namespace capnp_trace {
+
+/// @brief Tracer which receives Cap'n Proto RPC streams from BPF program (capnp_trace.bpf.o)
+/// @details Unlike RpcTracer, tracees are neither stopped by attaching nor at syscalls.
+/// CAP_BPF and CAP_PERFMON (or root) are required.
+class RpcBpfTracer final {
+ public:
+  RpcBpfTracer(kj::StringPtr address, RpcMessageHandler handler);
+  RpcBpfTracer(const RpcBpfTracer&)            = delete;
+  RpcBpfTracer& operator=(const RpcBpfTracer&) = delete;
+  RpcBpfTracer(RpcBpfTracer&&)                 = delete;
+  RpcBpfTracer& operator=(RpcBpfTracer&&)      = delete;
+  ~RpcBpfTracer();
+
+  /// @brief Enable dump raw unix domain socket data for debug
+  /// @param dump_dir Directory where the dump data will be stored
+  RpcBpfTracer& SetDumpDir(kj::Own<const kj::Directory> dump_dir);
+
+  /// @brief Add process to be traced. All threads of the process are traced.
+  RpcBpfTracer& AddPid(pid_t pid);
+
+  /// @brief Start Cap'n Proto RPC tracing
+  /// @details This method returns after all traced processes exited or TerminationSignal is raised
+  void Trace();
+
+ private:
+  struct FdInfo {
+    std::string address;
+    bool is_target;
+  };
+
+  static int HandleEventCallback(void* ctx, void* data, size_t size);
+  void HandleEvent(const capnp_trace_bpf_event& event);
+  const FdInfo& CheckAddress(pid_t pid, int fd);
+  void SetFdState(pid_t pid, int fd, bool is_target);
+
+  // server address to be traced
+  std::regex target_address_;
+
+  // Processes to be traced
+  std::vector<pid_t> pids_;
+
+  struct bpf_object* object_;
+  std::vector<struct bpf_link*> links_;
+  struct ring_buffer* ring_buffer_;
+  int target_pids_fd_;
+  int fd_states_fd_;
+
+  // Map for (pid, fd) -> server address
+  std::unordered_map<uint64_t, FdInfo> fds_;
+
+  // Reassemblers for each fd and direction
+  RpcStreamReassemblers reassemblers_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,596 @@
+#include "rpc_message_formatter.h"
+
+#include <capnp/message.h>
+#include <kj/debug.h>
+
+#include <cstring>
+
+#include "immutable_schema_registry.h"
+#include "monotonic_clock.h"
+#include "static_formatter.h"
+
+namespace capnp_trace {
+
+// Size of the scratch segment on the stack for JsonValue of params or results
+static const size_t kJsonScratchWords = 1024;
+
+// timestamp is CLOCK_MONOTONIC in microseconds, and 0 means now
+static void AppendTimeStamp(std::string& output, uint64_t timestamp) {
+  if (timestamp == 0) {
+    timestamp = GetMonotonicMicroSec();
+  }
+  AppendUnsigned(output, timestamp / 1000000, 6);
+  output += '.';
+  AppendUnsigned(output, timestamp % 1000000 / 100, 4);
+}
+
+static const char* GetMessageTypeString(capnp::rpc::Message::Which type) {
+  // https://github.com/capnproto/capnproto/blob/v0.9.1/c%2B%2B/src/capnp/rpc.capnp#L215-L273
+  static const char* kTypeStrings[] = {
+      "UNIMPLEMENTED", "ABORT",   "CALL",          "RETURN",     "FINISH",
+      "RESOLVE",       "RELEASE", "OBSOLETE_SAVE", "BOOTSTRAP",  "OBSOLETE_DELETE",
+      "PROVIDE",       "ACCEPT",  "JOIN",          "DISEMBARGO",
+  };
+  if (static_cast<size_t>(type) >= kj::size(kTypeStrings)) {
+    return "UNKNOWN";
+  }
+  return kTypeStrings[type];
+}
+
+// Append `value` as a JSON string with escape
+static void AppendJsonString(std::string& output, kj::ArrayPtr<const char> value) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  output += '"';
+  for (char c : value) {
+    switch (c) {
+      case '"':
+        output += "\\\"";
+        break;
+      case '\\':
+        output += "\\\\";
+        break;
+      case '\b':
+        output += "\\b";
+        break;
+      case '\f':
+        output += "\\f";
+        break;
+      case '\n':
+        output += "\\n";
+        break;
+      case '\r':
+        output += "\\r";
+        break;
+      case '\t':
+        output += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          // Including '\0' of abstract socket address
+          output += "\\u00";
+          output += kHexDigits[c >> 4];
+          output += kHexDigits[c & 0xf];
+        } else {
+          output += c;
+        }
+        break;
+    }
+  }
+  output += '"';
+}
+
+// Append `value` in the same text as capnp::JsonCodec::encode() without pretty print
+static void AppendJsonValue(std::string& output, capnp::JsonValue::Reader value) {
+  switch (value.which()) {
+    case capnp::JsonValue::NULL_:
+      output += "null";
+      break;
+    case capnp::JsonValue::BOOLEAN:
+      output += value.getBoolean() ? "true" : "false";
+      break;
+    case capnp::JsonValue::NUMBER: {
+      // Formatted on the stack like kj::str()
+      auto number = kj::toCharSequence(value.getNumber());
+      output.append(number.begin(), number.size());
+      break;
+    }
+    case capnp::JsonValue::STRING:
+      AppendJsonString(output, value.getString());
+      break;
+    case capnp::JsonValue::ARRAY: {
+      output += '[';
+      bool is_first = true;
+      for (auto element : value.getArray()) {
+        output += is_first ? "" : ",";
+        AppendJsonValue(output, element);
+        is_first = false;
+      }
+      output += ']';
+      break;
+    }
+    case capnp::JsonValue::OBJECT: {
+      output += '{';
+      bool is_first = true;
+      for (auto field : value.getObject()) {
+        output += is_first ? "" : ",";
+        AppendJsonString(output, field.getName());
+        output += ':';
+        AppendJsonValue(output, field.getValue());
+        is_first = false;
+      }
+      output += '}';
+      break;
+    }
+    case capnp::JsonValue::CALL: {
+      auto call = value.getCall();
+      output += call.getFunction().cStr();
+      output += '(';
+      bool is_first = true;
+      for (auto param : call.getParams()) {
+        output += is_first ? "" : ",";
+        AppendJsonValue(output, param);
+        is_first = false;
+      }
+      output += ')';
+      break;
+    }
+    default:
+      KJ_UNIMPLEMENTED("unknown JsonValue", static_cast<int>(value.which()));
+  }
+}
+
+RpcMessageFormatter::RpcMessageFormatter()
+    : output_format_(OutputFormat::kText), is_color_(false) {}
+
+RpcMessageFormatter& RpcMessageFormatter::SetOutputFormat(OutputFormat output_format) {
+  output_format_ = output_format;
+  return *this;
+}
+
+RpcMessageFormatter& RpcMessageFormatter::SetColor(bool is_color) {
+  is_color_ = is_color;
+  return *this;
+}
+
+RpcMessageFormatter& RpcMessageFormatter::SetCallHook(
+    std::function<void(kj::StringPtr method_name)> call_hook) {
+  call_hook_ = kj::mv(call_hook);
+  return *this;
+}
+
+void RpcMessageFormatter::AppendColored(std::string& line, Color color,
+                                        const char* message) const {
+  if (!is_color_) {
+    line += message;
+    return;
+  }
+  switch (color) {
+    case RED:
+      line += "\033[0;1;31m";
+      break;
+    case GREEN:
+      line += "\033[0;1;32m";
+      break;
+    case BLUE:
+      line += "\033[0;1;34m";
+      break;
+  }
+  line += message;
+  line += "\033[0m";
+}
+
+void RpcMessageFormatter::AppendMessageType(std::string& line,
+                                            capnp::rpc::Message::Which type) const {
+  const char* type_string = GetMessageTypeString(type);
+  switch (type) {
+    case capnp::rpc::Message::UNIMPLEMENTED:
+    case capnp::rpc::Message::ABORT:
+      AppendColored(line, RED, type_string);
+      break;
+
+    // Level 0 features
+    case capnp::rpc::Message::BOOTSTRAP:
+    case capnp::rpc::Message::CALL:
+    case capnp::rpc::Message::RETURN:
+    case capnp::rpc::Message::FINISH:
+      AppendColored(line, BLUE, type_string);
+      break;
+
+    // Level 1 features
+    case capnp::rpc::Message::RESOLVE:
+    case capnp::rpc::Message::RELEASE:
+    case capnp::rpc::Message::DISEMBARGO:
+      AppendColored(line, GREEN, type_string);
+      break;
+
+    // Level 2-4 features
+    default:
+      AppendColored(line, RED, type_string);
+      break;
+  }
+}
+
+void RpcMessageFormatter::AppendPrefix(std::string& line, const StreamInfo& stream,
+                                       capnp::rpc::Message::Which type) const {
+  const char* direction = stream.direction_ == StreamInfo::Direction::kIn    ? " <- "
+                          : stream.direction_ == StreamInfo::Direction::kOut ? " -> "
+                                                                             : " - ";
+  AppendTimeStamp(line, stream.timestamp_);
+  line += ' ';
+  AppendSigned(line, stream.pid_);
+  line += '/';
+  AppendSigned(line, stream.tid_);
+  line += direction;
+  line += stream.address_;
+  line += '(';
+  AppendSigned(line, stream.fd_);
+  line += ") ";
+  AppendMessageType(line, type);
+}
+
+void RpcMessageFormatter::AppendBootstrap(std::string& line,
+                                          capnp::rpc::Bootstrap::Reader bootstrap) const {
+  line += '(';
+  AppendUnsigned(line, bootstrap.getQuestionId());
+  line += ')';
+}
+
+// Stringify DynamicStruct without exception even if it contains external capability
+void RpcMessageFormatter::AppendStringified(std::string& line,
+                                            const capnp::DynamicStruct::Reader& value) const {
+  auto schema = value.getSchema();
+  KJ_IF_MAYBE (formatter, FindStaticFormatter(schema.getProto().getId())) {
+    (*formatter)(value, line);
+    return;
+  }
+
+  line += '(';
+  bool is_first = true;
+  for (auto field : schema.getFields()) {
+    line += is_first ? "" : ", ";
+    line += field.getProto().getName().cStr();
+    is_first = false;
+    if (field.getType().isInterface()) {
+      line += " = <external capability>";
+      continue;
+    }
+    kj::String field_value;
+    auto maybe_exception = kj::runCatchingExceptions([&value, &field, &field_value](){
+      field_value = kj::str(value.get(field));
+    });
+    KJ_IF_MAYBE(exception, maybe_exception) {
+      KJ_LOG(INFO, exception);
+      field_value = kj::str("<external capability>");
+    }
+    line += " = ";
+    line += field_value.cStr();
+  }
+  line += ')';
+}
+
+// Append `value` as JSON. Capabilities which JsonCodec cannot encode are replaced with
+// "<external capability>" like AppendStringified().
+// JsonCodec encodes into JsonValue on the stack and AppendJsonValue() writes it to `line`, so that
+// no string is allocated unless JsonValue exceeds the scratch segment.
+void RpcMessageFormatter::AppendJson(std::string& line,
+                                     const capnp::DynamicStruct::Reader& value) const {
+  // The first segment of MallocMessageBuilder must be zero-filled
+  capnp::word scratch[kJsonScratchWords];
+  memset(scratch, 0, sizeof(scratch));
+  capnp::MallocMessageBuilder json_message(kj::arrayPtr(scratch, kJsonScratchWords));
+
+  auto schema          = value.getSchema();
+  auto json            = json_message.initRoot<capnp::JsonValue>();
+  auto maybe_exception = kj::runCatchingExceptions([&]() {
+    json_codec_.encode(capnp::DynamicValue::Reader(value), schema, json);
+  });
+  if (maybe_exception == nullptr) {
+    AppendJsonValue(line, json.asReader());
+    return;
+  }
+
+  // Encode fields one by one to replace only fields which contain capability
+  line += '{';
+  bool is_first = true;
+  for (auto field : schema.getFields()) {
+    if (field.getProto().getDiscriminantValue() != capnp::schema::Field::NO_DISCRIMINANT) {
+      KJ_IF_MAYBE (active_field, value.which()) {
+        if (*active_field != field) {
+          continue;
+        }
+      } else {
+        continue;
+      }
+    }
+    line += is_first ? "" : ",";
+    AppendJsonString(line, field.getProto().getName());
+    line += ':';
+    is_first = false;
+    if (field.getType().isInterface()) {
+      line += "\"<external capability>\"";
+      continue;
+    }
+    // Space of the previous field is left in the message, which is released at once
+    auto field_json = json_message.initRoot<capnp::JsonValue>();
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                   json_codec_.encode(value.get(field), field.getType(), field_json);
+                 })) {
+      KJ_LOG(INFO, *exception);
+      line += "\"<external capability>\"";
+      continue;
+    }
+    AppendJsonValue(line, field_json.asReader());
+  }
+  line += '}';
+}
+
+void RpcMessageFormatter::AppendCall(std::string& line, capnp::rpc::Call::Reader call,
+                                     kj::Maybe<capnp::StructSchema> detail_param_type) const {
+  auto& info =
+      capnp_trace::ImmutableSchemaRegistry::GetMethod(call.getInterfaceId(), call.getMethodId());
+  auto content = call.getParams().getContent();
+  auto param_value =
+      content.getAs<capnp::DynamicStruct>(detail_param_type.orDefault(info.param_type));
+  if (call_hook_) {
+    call_hook_(info.name);
+  }
+
+  line += '(';
+  AppendUnsigned(line, call.getQuestionId());
+  line += ") ";
+  line += info.name.cStr();
+  AppendStringified(line, param_value);
+}
+
+void RpcMessageFormatter::AppendReturn(std::string& line, capnp::rpc::Return::Reader ret,
+                                       kj::Maybe<capnp::StructSchema> maybe_result_type) const {
+  line += '(';
+  AppendUnsigned(line, ret.getAnswerId());
+  line += ") ";
+
+  // CALL may not be parsed, e.g. it is filtered out by --since
+  capnp::StructSchema result_type;
+  KJ_IF_MAYBE (type, maybe_result_type) {
+    result_type = *type;
+  } else {
+    line += "<unknown result type>";
+    return;
+  }
+
+  line += result_type.getProto().getDisplayName().cStr();
+  line += ' ';
+  auto content = ret.getResults().getContent();
+  if (content.isCapability()) {
+    line += "(<external capability>)";
+  } else if (content.isStruct()) {
+    AppendStringified(line, content.getAs<capnp::DynamicStruct>(result_type));
+  } else if (content.isNull()) {
+    line += "()";
+  } else if (content.isList()) {
+    line += "[List]";
+  } else {
+    KJ_UNIMPLEMENTED();
+  }
+}
+
+void RpcMessageFormatter::AppendFinish(std::string& line,
+                                       capnp::rpc::Finish::Reader finish) const {
+  line += '(';
+  AppendUnsigned(line, finish.getQuestionId());
+  line += ')';
+}
+
+kj::Maybe<uint64_t> RpcMessageFormatter::GetLatency(const Question& question,
+                                                   const StreamInfo& stream_info) {
+  const uint64_t timestamp = GetCaptureTime(stream_info);
+  if (timestamp < question.timestamp) {
+    return nullptr;
+  }
+  return timestamp - question.timestamp;
+}
+
+kj::Maybe<capnp::StructSchema> RpcMessageFormatter::Track(State& state,
+                                                          const StreamInfo& stream_info,
+                                                          capnp::rpc::Message::Reader message) {
+  // NOTE: TrackRpcMessage cannot release answer_id_maps when fd is closed because this handler
+  // doesn't know the timing. It causes slight leak. And if fd and answer_id are re-used,
+  // answer_id_maps_ for them should be over-written before used so there should be no problem.
+  // The same applies to cap_descriptor_map.
+  AnswerIdMap& answer_id_map           = state.answer_id_maps[stream_info.fd_];
+  CapDescriptorMap& cap_descriptor_map = state.cap_descriptor_maps[stream_info.fd_];
+
+  // Only when target is imported capability and its registered,
+  // we decode parameter with registered type information (detail_param_type).
+  // It's because type information from ImmutableSchemaRegistry doesn't contain generics.
+  kj::Maybe<capnp::StructSchema> detail_param_type;
+
+  if (message.isCall()) {
+    // Register result type for RETURN
+    auto call  = message.getCall();
+    auto& info = capnp_trace::ImmutableSchemaRegistry::GetMethod(call.getInterfaceId(),
+                                                                 call.getMethodId());
+    answer_id_map.emplace(call.getQuestionId(), Question{&info, GetCaptureTime(stream_info)});
+
+    // If capabilities are passed as parameters
+    if (call.getParams().getCapTable().size() > 0) {
+      if (call.getParams().getCapTable().size() > 1) {
+        KJ_LOG(WARNING,
+               "capnp_trace doesn't support multiple capabilities in one message so far.");
+      }
+
+      for (auto field : info.capability_params) {
+        // Register the passed capability into cap_descriptor_map
+        // TODO(t-kondo-tmc): Fix CapTable index according to the following specification:
+        //   https://github.com/capnproto/capnproto/blob/v0.9.1/doc/encoding.md#capabilities-interfaces
+        auto export_id = call.getParams().getCapTable()[0].getSenderHosted();
+        KJ_LOG(INFO, "Register cap_descriptor_maps[", stream_info.fd_, "][", export_id,
+               "] = ", field.getProto().getName(), " of ", info.name);
+        cap_descriptor_map.emplace(export_id, field.getType().asInterface());
+      }
+    }
+
+    // If RPC is called to imported capability, search cap_descriptor_map for detail type
+    // information, like generics arguments
+    if (call.getTarget().isImportedCap()) {
+      auto import_id = call.getTarget().getImportedCap();
+      if (cap_descriptor_map.count(import_id)) {
+        auto cap = cap_descriptor_map.at(import_id);
+        KJ_IF_MAYBE (detail_method, cap.findMethodByName(info.method.getProto().getName())) {
+          detail_param_type = detail_method->getParamType();
+        } else {
+          KJ_LOG(INFO, "method", info.method.getProto().getName(), "is not found in ",
+                 cap.getShortDisplayName());
+        }
+      } else {
+        KJ_LOG(INFO, "import_id()", import_id, "is not found in cap_descriptor_map[",
+               stream_info.fd_, "]");
+      }
+    }
+  } else if (message.isFinish()) {
+    // Unregister question
+    auto finish = message.getFinish();
+    answer_id_map.erase(finish.getQuestionId());
+  }
+  return detail_param_type;
+}
+
+void RpcMessageFormatter::Format(State& state, const StreamInfo& stream_info,
+                                 capnp::rpc::Message::Reader message, std::string& line) const {
+  if (output_format_ == OutputFormat::kJsonLines) {
+    FormatAsJson(state, stream_info, message, line);
+    return;
+  }
+
+  auto detail_param_type = Track(state, stream_info, message);
+  auto& answer_id_map    = state.answer_id_maps[stream_info.fd_];
+
+  AppendPrefix(line, stream_info, message.which());
+  switch (message.which()) {
+    case capnp::rpc::Message::UNIMPLEMENTED:
+    case capnp::rpc::Message::ABORT:
+      break;
+
+    // Level 0 features
+    case capnp::rpc::Message::BOOTSTRAP:
+      AppendBootstrap(line, message.getBootstrap());
+      break;
+    case capnp::rpc::Message::CALL:
+      AppendCall(line, message.getCall(), detail_param_type);
+      break;
+    case capnp::rpc::Message::RETURN: {
+      auto ret = message.getReturn();
+      kj::Maybe<capnp::StructSchema> result_type;
+      auto it = answer_id_map.find(ret.getAnswerId());
+      if (it != answer_id_map.end()) {
+        result_type = it->second.method->result_type;
+      }
+      AppendReturn(line, ret, result_type);
+      if (it != answer_id_map.end()) {
+        KJ_IF_MAYBE (latency, GetLatency(it->second, stream_info)) {
+          line += " (+";
+          AppendUnsigned(line, *latency);
+          line += "us)";
+        }
+      }
+      break;
+    }
+    case capnp::rpc::Message::FINISH:
+      AppendFinish(line, message.getFinish());
+      break;
+
+    // Level 1-4 features
+    default:
+      break;
+  }
+}
+
+// Append a JSON object of `message` without newline to `line`
+void RpcMessageFormatter::FormatAsJson(State& state, const StreamInfo& stream_info,
+                                       capnp::rpc::Message::Reader message,
+                                       std::string& line) const {
+  auto detail_param_type = Track(state, stream_info, message);
+  auto& answer_id_map    = state.answer_id_maps[stream_info.fd_];
+
+  line += "{\"timestamp\":";
+  AppendUnsigned(line, GetCaptureTime(stream_info));
+  line += ",\"pid\":";
+  AppendSigned(line, stream_info.pid_);
+  line += ",\"tid\":";
+  AppendSigned(line, stream_info.tid_);
+  line += stream_info.direction_ == StreamInfo::Direction::kIn    ? ",\"direction\":\"in\""
+          : stream_info.direction_ == StreamInfo::Direction::kOut ? ",\"direction\":\"out\""
+                                                                  : ",\"direction\":\"unknown\"";
+  line += ",\"address\":";
+  AppendJsonString(line, kj::arrayPtr(stream_info.address_.data(), stream_info.address_.size()));
+  line += ",\"fd\":";
+  AppendSigned(line, stream_info.fd_);
+  line += ",\"type\":\"";
+  line += GetMessageTypeString(message.which());
+  line += '"';
+
+  switch (message.which()) {
+    case capnp::rpc::Message::BOOTSTRAP:
+      line += ",\"questionId\":";
+      AppendUnsigned(line, message.getBootstrap().getQuestionId());
+      break;
+    case capnp::rpc::Message::CALL: {
+      auto call  = message.getCall();
+      auto& info = ImmutableSchemaRegistry::GetMethod(call.getInterfaceId(), call.getMethodId());
+      if (call_hook_) {
+        call_hook_(info.name);
+      }
+
+      line += ",\"questionId\":";
+      AppendUnsigned(line, call.getQuestionId());
+      line += ",\"interface\":";
+      AppendJsonString(line, info.interface.getProto().getDisplayName());
+      line += ",\"method\":";
+      AppendJsonString(line, info.method.getProto().getName());
+      line += ",\"params\":";
+      AppendJson(line, call.getParams().getContent().getAs<capnp::DynamicStruct>(
+                           detail_param_type.orDefault(info.param_type)));
+      break;
+    }
+    case capnp::rpc::Message::RETURN: {
+      auto ret = message.getReturn();
+      auto it  = answer_id_map.find(ret.getAnswerId());
+      line += ",\"answerId\":";
+      AppendUnsigned(line, ret.getAnswerId());
+      if (it != answer_id_map.end()) {
+        KJ_IF_MAYBE (latency, GetLatency(it->second, stream_info)) {
+          line += ",\"latencyUsec\":";
+          AppendUnsigned(line, *latency);
+        }
+      }
+      if (ret.isException()) {
+        line += ",\"exception\":";
+        AppendJsonString(line, ret.getException().getReason());
+        break;
+      }
+      if (!ret.isResults() || it == answer_id_map.end()) {
+        // CALL may not be parsed, e.g. it is filtered out by --since
+        break;
+      }
+      auto content     = ret.getResults().getContent();
+      auto result_type = it->second.method->result_type;
+      line += ",\"resultType\":";
+      AppendJsonString(line, result_type.getProto().getDisplayName());
+      if (content.isStruct()) {
+        line += ",\"results\":";
+        AppendJson(line, content.getAs<capnp::DynamicStruct>(result_type));
+      } else if (content.isCapability()) {
+        line += ",\"results\":\"<external capability>\"";
+      }
+      break;
+    }
+    case capnp::rpc::Message::FINISH:
+      line += ",\"questionId\":";
+      AppendUnsigned(line, message.getFinish().getQuestionId());
+      break;
+    default:
+      break;
+  }
+  line += '}';
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <capnp/compat/json.h>
+#include <capnp/dynamic.h>
+#include <capnp/rpc.capnp.h>
+#include <capnp/schema.h>
+#include <kj/string.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include "method_table.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief Formatter of Cap'n Proto RPC messages into lines of text or JSON
+/// @details Format() only reads the formatter, so that it can be called on several threads with
+/// their own State, e.g. for parallel parsing.
+class RpcMessageFormatter final {
+ public:
+  enum class OutputFormat {
+    kText,
+    kJsonLines,
+  };
+
+  // Outstanding CALL which RETURN answers
+  struct Question {
+    const MethodInfo* method;
+    uint64_t timestamp;
+  };
+
+  // Map for Cap'n Proto answer ID (i.e. request ID) -> Question
+  using AnswerIdMap = std::unordered_map<uint64_t, Question>;
+
+  // Map for CapDescriptor -> InterfaceSchema
+  using CapDescriptorMap = std::unordered_map<uint32_t, capnp::InterfaceSchema>;
+
+  /// @brief State of formatting which is carried over between messages
+  struct State {
+    // Map for fd -> AnswerIdMap
+    std::unordered_map<int, AnswerIdMap> answer_id_maps;
+    // Map for fd -> CapDescriptorMap
+    std::unordered_map<int, CapDescriptorMap> cap_descriptor_maps;
+  };
+
+  RpcMessageFormatter();
+  ~RpcMessageFormatter()                                     = default;
+  RpcMessageFormatter(const RpcMessageFormatter&)            = delete;
+  RpcMessageFormatter& operator=(const RpcMessageFormatter&) = delete;
+  RpcMessageFormatter(RpcMessageFormatter&&)                 = delete;
+  RpcMessageFormatter& operator=(RpcMessageFormatter&&)      = delete;
+
+  RpcMessageFormatter& SetOutputFormat(OutputFormat output_format);
+
+  /// @brief Colorize message types of text output by ANSI escape sequences
+  RpcMessageFormatter& SetColor(bool is_color);
+
+  /// @brief Set a function which is called with the method name of each CALL before it is
+  /// formatted, e.g. to check injection
+  RpcMessageFormatter& SetCallHook(std::function<void(kj::StringPtr method_name)> call_hook);
+
+  /// @brief Append a line of `message` without newline to `line`
+  /// @details `state` is updated like Track()
+  void Format(State& state, const StreamInfo& stream_info, capnp::rpc::Message::Reader message,
+              std::string& line) const;
+
+  /// @brief Update `state` by CALL/FINISH without formatting
+  /// @return Parameter type of CALL with generics if it is known
+  static kj::Maybe<capnp::StructSchema> Track(State& state, const StreamInfo& stream_info,
+                                              capnp::rpc::Message::Reader message);
+
+  /// @brief Latency from CALL to RETURN, or null if they were captured out of order
+  static kj::Maybe<uint64_t> GetLatency(const Question& question, const StreamInfo& stream_info);
+
+ private:
+  enum Color { RED, GREEN, BLUE };
+
+  void AppendColored(std::string& line, Color color, const char* message) const;
+  void AppendMessageType(std::string& line, capnp::rpc::Message::Which type) const;
+  void AppendPrefix(std::string& line, const StreamInfo& stream,
+                    capnp::rpc::Message::Which type) const;
+  void AppendBootstrap(std::string& line, capnp::rpc::Bootstrap::Reader bootstrap) const;
+  void AppendStringified(std::string& line, const capnp::DynamicStruct::Reader& value) const;
+  void AppendJson(std::string& line, const capnp::DynamicStruct::Reader& value) const;
+  void AppendCall(std::string& line, capnp::rpc::Call::Reader call,
+                  kj::Maybe<capnp::StructSchema> detail_param_type) const;
+  void AppendReturn(std::string& line, capnp::rpc::Return::Reader ret,
+                    kj::Maybe<capnp::StructSchema> maybe_result_type) const;
+  void AppendFinish(std::string& line, capnp::rpc::Finish::Reader finish) const;
+  void FormatAsJson(State& state, const StreamInfo& stream_info,
+                    capnp::rpc::Message::Reader message, std::string& line) const;
+
+  OutputFormat output_format_;
+  bool is_color_;
+  std::function<void(kj::StringPtr method_name)> call_hook_;
+  // Thread-safe because encode() is const
+  capnp::JsonCodec json_codec_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,73 @@
+#include "rpc_message_merger.h"
+
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#include "reader_options.h"
+
+namespace capnp_trace {
+
+const size_t RpcMessageMerger::kDefaultReadAhead;
+
+RpcMessageMerger::RpcMessageMerger(RpcMessageHandler handler, size_t read_ahead)
+    : handler_(handler), read_ahead_(kj::max(read_ahead, size_t(1))) {}
+
+RpcMessageMerger& RpcMessageMerger::Add(kj::Own<const kj::ReadableFile>&& input_file,
+                                        RecordFilter filter) {
+  auto source    = kj::heap<Source>();
+  auto& messages = source->messages;
+
+  // Parsed message is copied because the parser reuses its buffer for the next one
+  auto read_ahead = [&messages](StreamInfo stream_info, capnp::rpc::Message::Reader&&,
+                                kj::ArrayPtr<kj::byte> raw_message) {
+    auto words = kj::heapArray<capnp::word>((raw_message.size() + sizeof(capnp::word) - 1) /
+                                            sizeof(capnp::word));
+    memcpy(words.begin(), raw_message.begin(), raw_message.size());
+    messages.push_back(Message{kj::mv(stream_info), kj::mv(words), raw_message.size()});
+  };
+  source->parser = kj::heap<RpcMessageRecorder::Parser>(kj::mv(input_file), read_ahead);
+  source->parser->SetFilter(kj::mv(filter));
+  sources_.push_back(kj::mv(source));
+  return *this;
+}
+
+void RpcMessageMerger::MergeAll() {
+  const auto options = GetUnlimitedReaderOptions();
+
+  // Min-heap of the timestamp of the first message in each source, and index of the source
+  using Head = std::pair<uint64_t, size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  auto push_head = [&](size_t index) {
+    auto& source = *sources_[index];
+    if (source.messages.empty()) {
+      source.parser->ParseNext(read_ahead_);
+    }
+    if (!source.messages.empty()) {
+      heads.emplace(source.messages.front().stream_info.timestamp_, index);
+    }
+  };
+  for (size_t i = 0; i < sources_.size(); i++) {
+    push_head(i);
+  }
+
+  while (!heads.empty()) {
+    const size_t index = heads.top().second;
+    heads.pop();
+    auto& source = *sources_[index];
+    {
+      auto& message = source.messages.front();
+      capnp::FlatArrayMessageReader reader(message.words, options);
+      auto raw_bytes = message.words.asBytes().slice(0, message.size);
+      handler_(message.stream_info, reader.getRoot<capnp::rpc::Message>(), raw_bytes);
+    }
+    source.messages.pop_front();
+    push_head(index);
+  }
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <capnp/common.h>
+#include <kj/array.h>
+#include <kj/filesystem.h>
+
+#include <deque>
+#include <vector>
+
+#include "record_index.h"
+#include "rpc_message_reassembler.h"
+#include "rpc_message_recorder.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief K-way merge of recorded files into one timeline by timestamp
+/// @details Each file is read ahead by at most `read_ahead` messages, so that memory usage does
+/// not depend on the size or the number of records of the files. Messages in the same file are
+/// passed in recorded order, and messages with the same timestamp are passed in added order.
+class RpcMessageMerger final {
+ public:
+  /// @param handler Callback function to be called for merged messages
+  /// @param read_ahead Max number of messages which are read ahead from each file
+  explicit RpcMessageMerger(RpcMessageHandler handler, size_t read_ahead = kDefaultReadAhead);
+  ~RpcMessageMerger()                                  = default;
+  RpcMessageMerger(const RpcMessageMerger&)            = delete;
+  RpcMessageMerger& operator=(const RpcMessageMerger&) = delete;
+  RpcMessageMerger(RpcMessageMerger&&)                 = delete;
+  RpcMessageMerger& operator=(RpcMessageMerger&&)      = delete;
+
+  /// @brief Add a recorded file to be merged
+  /// @param filter Condition to select messages of the file
+  RpcMessageMerger& Add(kj::Own<const kj::ReadableFile>&& input_file, RecordFilter filter = {});
+
+  /// @brief Pass messages of all added files to the handler in order of timestamp
+  void MergeAll();
+
+  static const size_t kDefaultReadAhead = 64;
+
+ private:
+  struct Message {
+    StreamInfo stream_info;
+    kj::Array<capnp::word> words;
+    size_t size;
+  };
+
+  struct Source {
+    kj::Own<RpcMessageRecorder::Parser> parser;
+    // Messages which are read ahead from the file
+    std::deque<Message> messages;
+  };
+
+  RpcMessageHandler handler_;
+  size_t read_ahead_;
+  std::vector<kj::Own<Source>> sources_;
+};
+
+}  // namespace capnp_trace
@@ -4,32 +4,54 @@
 #include <capnp/message.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/serialize.h>
+#include <endian.h>
 #include <kj/debug.h>
 
-#include <cassert>
-#include <cstdio>
-#include <iostream>
+#include <cstring>
+
+#include "reader_options.h"
+#include "tracer_metrics.h"
 
 namespace capnp_trace {
-void RpcMessageReassembler::CallbackRpcMessageHandler(kj::ArrayPtr<kj::byte> buf) {
-  // Since this is a debug tool, lift the usual security limits.  Worse case is
-  // the process crashes or has to be killed.
-  capnp::ReaderOptions options;
-  options.nestingLimit          = kj::maxValue;
-  options.traversalLimitInWords = kj::maxValue;
 
-  kj::ArrayInputStream input_stream(buf);
-  capnp::InputStreamMessageReader reader(input_stream, options);
+// https://github.com/capnproto/capnproto/blob/v0.9.1/doc/encoding.md#serialization-over-a-stream
+static uint32_t ReadLe32(const kj::byte* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return le32toh(value);
+}
 
-  auto message = reader.getRoot<capnp::rpc::Message>();
+static size_t GetSegmentNum(const kj::byte* data) {
+  return static_cast<size_t>(ReadLe32(data)) + 1;
+}
 
-  handler_(stream_info_, kj::mv(message), buf);
+// Size of segment table, i.e. segment count and sizes padded to 8 bytes
+static size_t GetHeaderSize(const kj::byte* data) {
+  return (GetSegmentNum(data) / 2 + 1) * sizeof(capnp::word);
+}
+
+// Number of bytes required to complete the message which starts at `data`.
+// Until the whole segment table is available, it is the size to know the message size.
+static size_t GetRequiredSize(const kj::byte* data, size_t size) {
+  const size_t header_segment_num_size = 4;
+  if (size < header_segment_num_size) {
+    return header_segment_num_size;
+  }
+  const size_t header_size = GetHeaderSize(data);
+  if (size < header_size) {
+    return header_size;
+  }
+
+  const size_t segment_num = GetSegmentNum(data);
+  size_t payload_size      = 0;
+  for (size_t i = 0; i < segment_num; i++) {
+    payload_size += static_cast<size_t>(ReadLe32(data + 4 * (i + 1))) * sizeof(capnp::word);
+  }
+  return header_size + payload_size;
 }
 
 RpcMessageReassembler::RpcMessageReassembler(RpcMessageHandler handler, StreamInfo stream_info)
-    : stream_info_(stream_info),
-      carry_buf_(kj::heap<kj::VectorOutputStream>()),
-      handler_(handler) {}
+    : stream_info_(stream_info), carry_size_(0), drop_size_(0), handler_(handler) {}
 
 RpcMessageReassembler::~RpcMessageReassembler() {}
 
@@ -38,69 +60,146 @@ RpcMessageReassembler& RpcMessageReassembler::SetDumpFile(kj::Own<kj::Appendable
   return *this;
 }
 
-// https://github.com/capnproto/capnproto/blob/v0.9.1/doc/encoding.md
-void RpcMessageReassembler::Reassemble(char* buf, size_t len) {
-  if (dump_file_) {
-    dump_file_->write(buf, len);
-    return;
+void RpcMessageReassembler::CallbackRpcMessageHandler(kj::ArrayPtr<kj::byte> buf) {
+  const auto options = GetUnlimitedReaderOptions();
+
+  // Segments are read in place, so they must be word-aligned. Messages in the carry buffer always
+  // are, but messages in captured data are not if the data doesn't start at message boundary.
+  kj::ArrayPtr<const kj::byte> frame = buf;
+  if (reinterpret_cast<uintptr_t>(buf.begin()) % sizeof(capnp::word) != 0) {
+    const size_t words = (buf.size() + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+    if (aligned_buf_.size() < words) {
+      aligned_buf_ = kj::heapArray<capnp::word>(words);
+    }
+    memcpy(aligned_buf_.begin(), buf.begin(), buf.size());
+    frame = aligned_buf_.asBytes().slice(0, buf.size());
   }
 
-  const uint32_t header_segment_num_size = 4;
-  uint32_t header_segment_size_size      = 0;
-  uint32_t payload_size                  = 0;
+  // Reuse the segment table which has been validated by GetRequiredSize()
+  const size_t header_size = GetHeaderSize(frame.begin());
+  const size_t segment_num = GetSegmentNum(frame.begin());
+  auto segment             = reinterpret_cast<const capnp::word*>(frame.begin() + header_size);
+  segments_.clear();
+  for (size_t i = 0; i < segment_num; i++) {
+    const size_t segment_size = ReadLe32(frame.begin() + 4 * (i + 1));
+    segments_.push_back(kj::arrayPtr(segment, segment_size));
+    segment += segment_size;
+  }
 
-  // Copy whole incoming data to carry_buf_
-  carry_buf_->write(buf, len);
-  const auto carry_size = carry_buf_->getArray().size();
+  capnp::SegmentArrayMessageReader reader(kj::arrayPtr(segments_.data(), segments_.size()),
+                                          options);
 
-  if (carry_size < header_segment_num_size) {
-    // KJ_LOG(INFO, "carry because header(segment num) is incomplete", carry_size);
-    return;
-  }
+  auto message = reader.getRoot<capnp::rpc::Message>();
 
-  // Parse segment num
-  uint32_t segment_num = le32toh((reinterpret_cast<uint32_t*>(&carry_buf_->getArray()[0]))[0]) + 1;
+  if (auto metrics = TracerMetrics::GetIfEnabled()) {
+    metrics->AddDecodedMessage(buf.size());
+  }
+  handler_(stream_info_, kj::mv(message), buf);
+}
 
-  header_segment_size_size = (((segment_num + 2) & ~1) - 1) * 4;
-  if (carry_size < header_segment_num_size + header_segment_size_size) {
-    // KJ_LOG(INFO, "carry because header(segment size) is incomplete", carry_size);
-    return;
+void RpcMessageReassembler::HandleFrame(kj::ArrayPtr<kj::byte> frame) {
+  // Parse rpc::Message only if payload exists
+  if (frame.size() > GetHeaderSize(frame.begin())) {
+    CallbackRpcMessageHandler(frame);
   }
+}
 
-  // Parse segment sizes
-  uint32_t* segment_sizes = reinterpret_cast<uint32_t*>(alloca(segment_num * sizeof(uint32_t)));
-  for (uint32_t i = 0; i < segment_num; i++) {
-    segment_sizes[i] =
-        le32toh((reinterpret_cast<uint32_t*>(&carry_buf_->getArray()[0]))[i + 1]) * 8;
-    payload_size += segment_sizes[i];
+void RpcMessageReassembler::Carry(const kj::byte* data, size_t size) {
+  const size_t required = carry_size_ + size;
+  if (required > carry_buf_.asBytes().size()) {
+    // Grow geometrically so that a large message arriving in small pieces is not copied often
+    const size_t capacity = kj::max(required, carry_buf_.asBytes().size() * 2);
+    auto new_buf =
+        kj::heapArray<capnp::word>((capacity + sizeof(capnp::word) - 1) / sizeof(capnp::word));
+    if (carry_size_ > 0) {
+      memcpy(new_buf.begin(), carry_buf_.begin(), carry_size_);
+    }
+    carry_buf_ = kj::mv(new_buf);
+  }
+  memcpy(carry_buf_.asBytes().begin() + carry_size_, data, size);
+  carry_size_ = required;
+  if (auto metrics = TracerMetrics::GetIfEnabled()) {
+    metrics->AddCarry(size, carry_size_);
   }
+}
+
+void RpcMessageReassembler::Reassemble(char* buf, size_t len, uint64_t timestamp) {
+  // Messages completed by this data are regarded as captured at this time
+  stream_info_.timestamp_ = timestamp;
 
-  const uint32_t total_message_size =
-      header_segment_num_size + header_segment_size_size + payload_size;
-  if (carry_size < total_message_size) {
-    // KJ_LOG(INFO, "carry because payload is incomplete", carry_size);
+  if (dump_file_) {
+    dump_file_->write(buf, len);
     return;
   }
 
-  // Parse ONE rpc::Message if payload exists
-  if (payload_size > 0) {
-    auto message = kj::arrayPtr<kj::byte>(&carry_buf_->getArray()[0], total_message_size);
-    CallbackRpcMessageHandler(message);
+  auto data   = reinterpret_cast<kj::byte*>(buf);
+  size_t rest = len;
+
+  // The rest of a message broken by Skip()
+  const size_t drop_size = kj::min(drop_size_, rest);
+  drop_size_ -= drop_size;
+  data += drop_size;
+  rest -= drop_size;
+
+  // Complete the carried message at first. Copy only bytes which belong to it.
+  while (carry_size_ > 0 && rest > 0) {
+    const auto carry    = carry_buf_.asBytes().begin();
+    const auto required = GetRequiredSize(carry, carry_size_);
+    const auto size     = kj::min(required - carry_size_, rest);
+    Carry(data, size);
+    data += size;
+    rest -= size;
+
+    const auto completed = carry_buf_.asBytes().begin();
+    if (carry_size_ >= GetRequiredSize(completed, carry_size_)) {
+      // carry_buf_ is not touched until the handler returns
+      const auto frame = kj::arrayPtr(completed, carry_size_);
+      carry_size_      = 0;
+      HandleFrame(frame);
+    }
   }
 
-  // Carry rest data if remains
-  auto next_carry_buf = kj::heap<kj::VectorOutputStream>();
-  if (carry_size > total_message_size) {
-    next_carry_buf->write(&carry_buf_->getArray()[total_message_size],
-                          carry_size - total_message_size);
+  // Messages which are complete in buf are handled in place
+  while (rest > 0) {
+    const auto required = GetRequiredSize(data, rest);
+    if (rest < required) {
+      Carry(data, rest);
+      break;
+    }
+    HandleFrame(kj::arrayPtr(data, required));
+    data += required;
+    rest -= required;
+  }
+}
+
+bool RpcMessageReassembler::Skip(size_t len) {
+  if (len == 0) {
+    return true;
+  }
+  if (dump_file_) {
+    // Raw dump cannot represent the gap
+    return false;
+  }
+  if (drop_size_ > 0) {
+    const size_t drop_size = kj::min(drop_size_, len);
+    drop_size_ -= drop_size;
+    len -= drop_size;
+    return len == 0;
+  }
+  if (carry_size_ == 0) {
+    // The gap starts at a message boundary, i.e. it covers the segment table of the next message
+    return false;
   }
-  carry_buf_ = kj::mv(next_carry_buf);
 
-  // Reassemble rest data recursively if remains
-  if (carry_buf_->getArray().size() > 0) {
-    KJ_LOG(INFO, "Reassemble rest data recursively", len);
-    Reassemble(nullptr, 0);
+  const auto carry      = carry_buf_.asBytes().begin();
+  const size_t required = GetRequiredSize(carry, carry_size_);
+  if (carry_size_ < 4 || carry_size_ < GetHeaderSize(carry) || carry_size_ + len > required) {
+    // The size of the message is unknown, or the gap covers the next message
+    return false;
   }
+  drop_size_  = required - carry_size_ - len;
+  carry_size_ = 0;
+  return true;
 }
 
 }  // namespace capnp_trace
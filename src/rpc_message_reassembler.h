@@ -1,5 +1,6 @@
 #pragma once
 
+#include <capnp/common.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/schema.h>
 #include <kj/filesystem.h>
@@ -8,6 +9,7 @@
 #include <array>
 #include <functional>
 #include <unordered_map>
+#include <vector>
 
 #include "stream_info.h"
 
@@ -31,15 +33,39 @@ class RpcMessageReassembler final {
   RpcMessageReassembler& SetDumpFile(kj::Own<kj::AppendableFile> dump_file);
 
   /// @brief Reassemble Cap'n Proto RPC message from divided stream
+  /// @details Messages which are complete in `buf` are passed to the handler without copy.
+  /// Only an incomplete message at the end of `buf` is carried to the next call.
   /// @param buf stream data to be reassembled
   /// @param len size of `buf` in bytes
-  void Reassemble(char* buf, size_t len);
+  /// @param timestamp capture time of `buf`, which is passed as StreamInfo::timestamp_
+  void Reassemble(char* buf, size_t len, uint64_t timestamp = 0);
+
+  /// @brief Skip `len` bytes of the stream which were lost in capturing
+  /// @details The message which the gap lies in is dropped, and reassembly resumes at the end of
+  /// it. The gap must not cover a message boundary, because the size of the next message is lost.
+  /// @return false if the stream cannot be resynchronised, i.e. following data must be dropped
+  bool Skip(size_t len);
 
  private:
   void CallbackRpcMessageHandler(kj::ArrayPtr<kj::byte> buf);
+  void HandleFrame(kj::ArrayPtr<kj::byte> frame);
+  void Carry(const kj::byte* data, size_t size);
 
   StreamInfo stream_info_;
-  kj::Own<kj::VectorOutputStream> carry_buf_;
+
+  // Head of a message which is not complete yet. It holds at most one message.
+  kj::Array<capnp::word> carry_buf_;
+  size_t carry_size_;
+
+  // Bytes of a message broken by Skip() which are dropped before the next message
+  size_t drop_size_;
+
+  // Word-aligned copy of a message which is not aligned in captured data
+  kj::Array<capnp::word> aligned_buf_;
+
+  // Segments of the message being handled, which point into the message
+  std::vector<kj::ArrayPtr<const capnp::word>> segments_;
+
   RpcMessageHandler handler_;
   kj::Own<kj::AppendableFile> dump_file_;
 };
@@ -1,123 +1,749 @@
 #include "rpc_message_recorder.h"
 
+#include <capnp/serialize-packed.h>
 #include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <kj/io.h>
 
+#include <chrono>
+#include <cstring>
 #include <string>
 
 #include "immutable_schema_registry.h"
+#include "monotonic_clock.h"
+#include "reader_options.h"
+#include "tracer_metrics.h"
 
 namespace capnp_trace {
 
 static const uint32_t kMagicNumber   = 0xCAB92ACE;
-static const uint32_t kFormatVersion = 1;
+static const uint32_t kFormatVersion = 2;
 
-RpcMessageRecorder::RpcMessageRecorder(kj::Own<kj::AppendableFile>&& output_file)
-    : output_file_(kj::mv(output_file)) {
-  output_file_->write(&kMagicNumber, sizeof(kMagicNumber));
-  output_file_->write(&kFormatVersion, sizeof(kFormatVersion));
+// Format version 1 has no index and its payload is not aligned
+static const uint32_t kFormatVersionWithoutIndex = 1;
+
+// Format version 3 is version 2 with packed payload and address ID
+static const uint32_t kFormatVersionPacked = 3;
+
+// address_length of a record in packed format which refers to an address stored before
+static const uint32_t kAddressReference = UINT32_MAX;
+
+// Default threshold to write buffered records
+static const size_t kDefaultBufferSize          = 1024 * 1024;
+static const uint64_t kDefaultFlushIntervalMsec = 1000;
+
+// Fixed part of a record which is followed by address, padding, payload size and payload.
+// In packed format, address ID precedes address, and unpacked size follows payload size.
+struct __attribute__((packed)) RecordHeader {
+  uint32_t magic_number;
+  uint64_t timestamp;
+  uint64_t pid;
+  uint64_t tid;
+  uint64_t fd;
+  uint32_t direction;
+  uint32_t address_length;
+};
+static_assert(sizeof(RecordHeader) == 44, "RecordHeader must not be padded");
+
+// Length of padding after `length` bytes from the head of a record to align the next field
+static size_t GetPaddingLength(uint32_t format_version, size_t length) {
+  if (format_version == kFormatVersionWithoutIndex) {
+    // 4-byte align to find magic_number easily
+    return (4 - length % 4) % 4;
+  }
+  // 8-byte align payload to read it in place, given that the record starts 8-byte aligned
+  return (8 - length % 8) % 8;
+}
+
+// Length of padding after payload, which keeps the next record 8-byte aligned
+static size_t GetPayloadPaddingLength(uint32_t format_version, uint64_t payload_size) {
+  if (format_version == kFormatVersionWithoutIndex) {
+    return 0;
+  }
+  return GetPaddingLength(format_version, payload_size);
 }
 
-RpcMessageRecorder::~RpcMessageRecorder() {}
+// Packed encoding of raw bytes, which are a whole message including the segment table.
+// capnp::writePackedMessage() and capnp::PackedMessageReader take segments instead, so that a
+// message would be split into segments and serialized again, and the unpacked segment table would
+// not be contiguous with segments. The internal packed streams of capnp encode bytes as they are,
+// and their use is limited to these two functions.
+// @return Packed size, which never exceeds 10 bytes per word of `input`
+static size_t PackBytes(kj::ArrayPtr<const kj::byte> input, kj::ArrayPtr<kj::byte> output) {
+  kj::ArrayOutputStream output_stream(output);
+  {
+    capnp::_::PackedOutputStream packer(output_stream);
+    packer.write(input.begin(), input.size());
+  }
+  return output_stream.getArray().size();
+}
 
-static inline uint64_t GetMonotonicMicroSec() {
-  struct timespec tp;
-  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &tp));
-  return tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+static void UnpackBytes(kj::ArrayPtr<const kj::byte> input, kj::ArrayPtr<kj::byte> output) {
+  kj::ArrayInputStream input_stream(input);
+  capnp::_::PackedInputStream unpacker(input_stream);
+  unpacker.read(output.begin(), output.size());
 }
 
-#define RECORD_VAR(type, val)                                             \
-  do {                                                                    \
-    type tmp_var_for_record = val;                                        \
-    output_file_->write(&tmp_var_for_record, sizeof(tmp_var_for_record)); \
-  } while (false)
+// Size of magic number and format version at the head of a file
+static const uint64_t kFileHeaderSize = sizeof(kMagicNumber) + sizeof(kFormatVersion);
+
+static void WriteFileHeader(kj::AppendableFile& file, uint32_t format_version) {
+  file.write(&kMagicNumber, sizeof(kMagicNumber));
+  file.write(&format_version, sizeof(format_version));
+}
 
-void RpcMessageRecorder::Record(StreamInfo stream_info,
-                                [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+RpcMessageRecorder::RpcMessageRecorder(kj::Own<kj::AppendableFile>&& output_file,
+                                       Compression compression)
+    : output_file_(kj::mv(output_file)),
+      compression_(compression),
+      is_writing_(false),
+      buffer_size_(kDefaultBufferSize),
+      flush_interval_msec_(kDefaultFlushIntervalMsec),
+      is_stopping_(false),
+      file_offset_(kFileHeaderSize),
+      is_finished_(false),
+      max_file_size_(0),
+      is_opening_next_file_(false) {
+  WriteFileHeader(*output_file_, GetFormatVersion());
+  flush_thread_ = std::thread(&RpcMessageRecorder::FlushLoop, this);
+}
+
+RpcMessageRecorder::~RpcMessageRecorder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopping_ = true;
+  }
+  flush_condition_.notify_one();
+  flush_thread_.join();
+  Finish();
+}
+
+RpcMessageRecorder& RpcMessageRecorder::SetFlushThreshold(size_t buffer_size,
+                                                          uint64_t interval_msec) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer_size_         = buffer_size;
+    flush_interval_msec_ = interval_msec;
+  }
+  flush_condition_.notify_one();
+  return *this;
+}
+
+RpcMessageRecorder& RpcMessageRecorder::SetRotation(
+    uint64_t max_file_size, std::function<kj::Own<kj::AppendableFile>()> open_next_file) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_file_size_  = max_file_size;
+    open_next_file_ = kj::mv(open_next_file);
+  }
+  // Open the next file in advance
+  flush_condition_.notify_one();
+  return *this;
+}
+
+uint32_t RpcMessageRecorder::GetFormatVersion() const {
+  return compression_ == Compression::kPacked ? kFormatVersionPacked : kFormatVersion;
+}
+
+template <typename T>
+static void Append(std::vector<kj::byte>& buffer, const T* data, size_t size) {
+  auto bytes = reinterpret_cast<const kj::byte*>(data);
+  buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+void RpcMessageRecorder::Record(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
                                 kj::ArrayPtr<kj::byte> raw_message) {
-  auto timestamp = GetMonotonicMicroSec();
-  RECORD_VAR(uint32_t, kMagicNumber);
-  RECORD_VAR(uint64_t, timestamp);
-  RECORD_VAR(uint64_t, stream_info.pid_);
-  RECORD_VAR(uint64_t, stream_info.tid_);
-  RECORD_VAR(uint64_t, stream_info.fd_);
-  RECORD_VAR(uint32_t, stream_info.direction_);
-  RECORD_VAR(uint32_t, static_cast<uint32_t>(stream_info.address_.length()));
-  output_file_->write(stream_info.address_.c_str(), stream_info.address_.length());
-  auto padding_len = stream_info.address_.length() % 4;
-  if (padding_len) {
-    // 4-byte align to find magic_number easily
-    uint8_t* padding = reinterpret_cast<uint8_t*>(alloca(padding_len));
-    memset(padding, 0, padding_len);
-    output_file_->write(padding, padding_len);
+  auto timestamp = stream_info.timestamp_ ? stream_info.timestamp_ : GetMonotonicMicroSec();
+  const bool is_packed          = compression_ == Compression::kPacked;
+  const uint32_t format_version = GetFormatVersion();
+  const uint8_t padding[8]      = {0};
+  const uint64_t payload_size   = raw_message.size();
+  KJ_REQUIRE(!is_packed || payload_size % sizeof(capnp::word) == 0,
+             "message must consist of words to be packed", stream_info, payload_size);
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    KJ_REQUIRE(!is_finished_, "recording has finished", stream_info);
+    if (max_file_size_ > 0 && file_offset_ >= max_file_size_) {
+      RotateLocked(lock);
+    }
+
+    // Empty message (e.g. for test) has no method
+    kj::Maybe<MethodKey> method;
+    if (payload_size > 0) {
+      method = method_tracker_.Track(stream_info, message);
+    }
+    if (index_.Add(file_offset_, timestamp, stream_info.address_, method)) {
+      // Addresses are stored again in each block so that a parser can start at any block
+      address_ids_.clear();
+    }
+
+    // Address which has been stored in current block is referred by ID in packed format
+    uint32_t address_id       = 0;
+    bool is_address_reference = false;
+    if (is_packed) {
+      auto result          = address_ids_.emplace(stream_info.address_, address_ids_.size());
+      address_id           = result.first->second;
+      is_address_reference = !result.second;
+    }
+    const auto address_length =
+        is_address_reference ? 0 : static_cast<uint32_t>(stream_info.address_.length());
+    const RecordHeader header{kMagicNumber,
+                              timestamp,
+                              static_cast<uint64_t>(stream_info.pid_),
+                              static_cast<uint64_t>(stream_info.tid_),
+                              static_cast<uint64_t>(stream_info.fd_),
+                              static_cast<uint32_t>(stream_info.direction_),
+                              is_address_reference ? kAddressReference : address_length};
+
+    const size_t record_offset = buffer_.size();
+    Append(buffer_, &header, sizeof(header));
+    if (is_packed) {
+      Append(buffer_, &address_id, sizeof(address_id));
+    }
+    Append(buffer_, stream_info.address_.data(), address_length);
+    Append(buffer_, padding, GetPaddingLength(format_version, buffer_.size() - record_offset));
+    Append(buffer_, &payload_size, sizeof(payload_size));
+    if (is_packed) {
+      // Packed size is filled after packing
+      const size_t size_offset = buffer_.size() - sizeof(payload_size);
+      Append(buffer_, &payload_size, sizeof(payload_size));
+
+      // Pack into buffer_ directly. Packed encoding never exceeds 10 bytes per word.
+      const size_t packed_offset = buffer_.size();
+      buffer_.resize(packed_offset + payload_size / sizeof(capnp::word) * 10);
+      const uint64_t packed_size =
+          PackBytes(raw_message, kj::arrayPtr(buffer_.data() + packed_offset,
+                                              buffer_.size() - packed_offset));
+      buffer_.resize(packed_offset + packed_size);
+      memcpy(buffer_.data() + size_offset, &packed_size, sizeof(packed_size));
+      Append(buffer_, padding, GetPayloadPaddingLength(format_version, packed_size));
+    } else {
+      Append(buffer_, raw_message.begin(), raw_message.size());
+      Append(buffer_, padding, GetPayloadPaddingLength(format_version, payload_size));
+    }
+    file_offset_ += buffer_.size() - record_offset;
+    // Records are written by the thread which is writing if any
+    if (buffer_.size() >= buffer_size_ && !is_writing_) {
+      FlushLocked(lock);
+    }
   }
-  RECORD_VAR(uint64_t, raw_message.size());
-  output_file_->write(raw_message.begin(), raw_message.size());
   KJ_LOG(INFO, timestamp, stream_info, raw_message.size());
 }
 
-#define PARSE_VAR(type, var) \
-  type var;                  \
-  offset_ +=                 \
-      input_file_->read(offset_, kj::arrayPtr(reinterpret_cast<kj::byte*>(&var), sizeof(var)));
+void RpcMessageRecorder::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  FlushLocked(lock);
+}
+
+void RpcMessageRecorder::Finish() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (is_finished_) {
+    return;
+  }
+  // No record is added while the lock is released to write records below
+  is_finished_ = true;
+  write_condition_.wait(lock, [this]() { return !is_writing_; });
+  // The next file being opened by the flush thread is installed before this, so that it is
+  // finished below instead of being left without the index
+  next_file_condition_.wait(lock, [this]() { return !is_opening_next_file_; });
+  // Retired files which the flush thread has not taken yet are finished here
+  for (auto& retired_file : retired_files_) {
+    FinishRetiredFile(retired_file);
+  }
+  retired_files_.clear();
+  FinishFileLocked(lock);
+  if (next_file_) {
+    // Opened in advance, so leave it as a valid file without records
+    auto index = RecordIndex().Serialize(kFileHeaderSize);
+    next_file_->write(index.data(), index.size());
+  }
+}
+
+void RpcMessageRecorder::FinishFileLocked(std::unique_lock<std::mutex>& lock) {
+  FlushLocked(lock);
+  auto index = index_.Serialize(file_offset_);
+  output_file_->write(index.data(), index.size());
+}
+
+void RpcMessageRecorder::FinishRetiredFile(RetiredFile& retired_file) {
+  if (!retired_file.buffer.empty()) {
+    retired_file.file->write(retired_file.buffer.data(), retired_file.buffer.size());
+    if (auto metrics = TracerMetrics::GetIfEnabled()) {
+      metrics->AddRecorderFlush(retired_file.buffer.size());
+    }
+  }
+  auto index = retired_file.index.Serialize(retired_file.file_size);
+  retired_file.file->write(index.data(), index.size());
+}
+
+void RpcMessageRecorder::RotateLocked(std::unique_lock<std::mutex>& lock) {
+  // The next file is opened by the flush thread in advance, so this waits only if files are
+  // rotated faster than they are opened
+  while (!next_file_ && max_file_size_ > 0) {
+    flush_condition_.notify_one();
+    next_file_condition_.wait(lock);
+  }
+  if (next_file_) {
+    // Buffered records and the index are handed over to the flush thread, which writes them and
+    // closes the file
+    retired_files_.push_back(
+        RetiredFile{kj::mv(output_file_), std::vector<kj::byte>(), kj::mv(index_), file_offset_});
+    retired_files_.back().buffer.swap(buffer_);
+    output_file_ = kj::mv(next_file_);
+    index_       = RecordIndex();
+    file_offset_ = kFileHeaderSize;
+    address_ids_.clear();
+    flush_condition_.notify_one();
+  }
+}
+
+void RpcMessageRecorder::PrepareNextFileLocked(std::unique_lock<std::mutex>& lock) {
+  if (!retired_files_.empty()) {
+    // Records of a retired file may be being written
+    write_condition_.wait(lock, [this]() { return !is_writing_; });
+  }
+  std::vector<RetiredFile> retired_files;
+  retired_files.swap(retired_files_);
+  auto open_next_file   = open_next_file_;
+  // No next file is opened after Finish(), which would be left without the index
+  const bool needs_next = max_file_size_ > 0 && !next_file_ && !is_finished_;
+
+  // File operations are done without lock not to block Record()
+  if (!retired_files.empty()) {
+    is_writing_ = true;
+    lock.unlock();
+    auto maybe_exception = kj::runCatchingExceptions([&]() {
+      for (auto& retired_file : retired_files) {
+        FinishRetiredFile(retired_file);
+      }
+    });
+    retired_files.clear();
+    lock.lock();
+    is_writing_ = false;
+    write_condition_.notify_all();
+    KJ_IF_MAYBE (exception, maybe_exception) {
+      KJ_LOG(ERROR, "failed to finish rotated file", *exception);
+    }
+  }
+  if (!needs_next) {
+    return;
+  }
+
+  is_opening_next_file_ = true;
+  lock.unlock();
+  kj::Own<kj::AppendableFile> next_file;
+  auto maybe_exception = kj::runCatchingExceptions([&]() {
+    next_file = open_next_file();
+    WriteFileHeader(*next_file, GetFormatVersion());
+  });
+  lock.lock();
+  is_opening_next_file_ = false;
+
+  KJ_IF_MAYBE (exception, maybe_exception) {
+    KJ_LOG(ERROR, "failed to open next file, so that rotation is stopped", *exception);
+    max_file_size_ = 0;
+  } else {
+    next_file_ = kj::mv(next_file);
+  }
+  next_file_condition_.notify_all();
+}
+
+void RpcMessageRecorder::FlushLocked(std::unique_lock<std::mutex>& lock) {
+  write_condition_.wait(lock, [this]() { return !is_writing_; });
+  // Records which are buffered while writing are written again if they exceed the threshold,
+  // because Record() doesn't write them while another thread is writing
+  do {
+    if (buffer_.empty()) {
+      return;
+    }
+    // Swap with the spare buffer to keep capacity for following records
+    std::vector<kj::byte> buffer;
+    buffer.swap(spare_buffer_);
+    buffer.swap(buffer_);
+    auto& output_file = *output_file_;
+
+    is_writing_ = true;
+    lock.unlock();
+    auto maybe_exception =
+        kj::runCatchingExceptions([&]() { output_file.write(buffer.data(), buffer.size()); });
+    lock.lock();
+    is_writing_ = false;
+    write_condition_.notify_all();
+
+    if (auto metrics = TracerMetrics::GetIfEnabled()) {
+      metrics->AddRecorderFlush(buffer.size());
+    }
+    buffer.clear();
+    spare_buffer_.swap(buffer);
+    KJ_IF_MAYBE (exception, maybe_exception) {
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  } while (buffer_.size() >= buffer_size_);
+}
+
+void RpcMessageRecorder::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!is_stopping_) {
+    // Files for rotation are handled without waiting
+    const bool has_file_operation =
+        !retired_files_.empty() || (max_file_size_ > 0 && !next_file_ && !is_finished_);
+    if (!has_file_operation) {
+      if (flush_interval_msec_ == 0) {
+        flush_condition_.wait(lock);
+      } else {
+        flush_condition_.wait_for(lock, std::chrono::milliseconds(flush_interval_msec_));
+      }
+    }
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() { FlushLocked(lock); })) {
+      KJ_LOG(ERROR, "failed to write records", *exception);
+    }
+    PrepareNextFileLocked(lock);
+  }
+}
 
 RpcMessageRecorder::Parser::Parser(kj::Own<const kj::ReadableFile>&& input_file,
                                    RpcMessageHandler handler)
-    : input_file_(kj::mv(input_file)), handler_(handler), offset_(0) {
-  PARSE_VAR(uint32_t, magic_number);
+    : input_file_(kj::mv(input_file)),
+      handler_(handler),
+      offset_(0),
+      format_version_(0),
+      next_range_index_(0) {
+  const auto size = input_file_->stat().size;
+  KJ_REQUIRE(size >= sizeof(kMagicNumber) + sizeof(kFormatVersion), "too small file", size);
+  // Records are read in place, so memory usage is bounded by page cache instead of file size
+  mapping_ = input_file_->mmap(0, size);
+
+  uint32_t magic_number;
+  memcpy(&magic_number, mapping_.begin(), sizeof(magic_number));
   KJ_REQUIRE(kMagicNumber == magic_number);
+  offset_ += sizeof(magic_number);
+
+  memcpy(&format_version_, mapping_.begin() + offset_, sizeof(format_version_));
+  KJ_REQUIRE(format_version_ == kFormatVersion || format_version_ == kFormatVersionWithoutIndex ||
+                 format_version_ == kFormatVersionPacked,
+             "unsupported format version", format_version_);
+  offset_ += sizeof(format_version_);
 
-  PARSE_VAR(uint32_t, format_version);
-  KJ_REQUIRE(kFormatVersion == format_version);
+  if (format_version_ != kFormatVersionWithoutIndex) {
+    index_ = RecordIndex::Deserialize(mapping_);
+    if (index_ == nullptr) {
+      KJ_LOG(WARNING, "index is not found, so that whole file is read. Recording was aborted?");
+    }
+  }
 }
 
 RpcMessageRecorder::Parser::~Parser() {}
 
+const uint64_t RpcMessageRecorder::Parser::kDefaultChunkSize;
+
+RpcMessageRecorder::Parser& RpcMessageRecorder::Parser::SetFilter(RecordFilter filter) {
+  filter_       = kj::mv(filter);
+  state_.filter = filter_;
+  state_.address_matches.clear();
+  return *this;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> RpcMessageRecorder::Parser::GetRanges() const {
+  KJ_IF_MAYBE (index, index_) {
+    auto ranges = index->Select(filter_);
+    for (auto& range : ranges) {
+      range.first = kj::max(range.first, offset_);
+    }
+    return ranges;
+  }
+  return {{offset_, mapping_.size()}};
+}
+
 void RpcMessageRecorder::Parser::ParseAll() {
-  // Since this is a debug tool, lift the usual security limits.  Worse case is
-  // the process crashes or has to be killed.
-  capnp::ReaderOptions options;
-  options.nestingLimit          = kj::maxValue;
-  options.traversalLimitInWords = kj::maxValue;
-
-  size_t size = input_file_->stat().size;
-  while (offset_ < size) {
-    PARSE_VAR(uint32_t, magic_number);
+  for (const auto& range : GetRanges()) {
+    ParseRange(range.first, range.second, state_, handler_);
+  }
+}
+
+size_t RpcMessageRecorder::Parser::ParseNext(size_t max_count) {
+  if (next_ranges_ == nullptr) {
+    next_ranges_ = GetRanges();
+  }
+  auto& ranges = KJ_ASSERT_NONNULL(next_ranges_);
+
+  size_t count = 0;
+  while (count < max_count && next_range_index_ < ranges.size()) {
+    const auto& range = ranges[next_range_index_];
+    state_.offset     = kj::max(state_.offset, range.first);
+    if (ParseRecord(range.second, state_, handler_)) {
+      count++;
+    } else {
+      next_range_index_++;
+    }
+  }
+  return count;
+}
+
+void RpcMessageRecorder::Parser::ParseParallel(size_t thread_count, ParallelHandler handler,
+                                               uint64_t chunk_size) {
+  thread_count = kj::max(thread_count, size_t(1));
+  struct Chunk {
+    uint64_t begin;
+    RpcMessageHandler handler;
+    ParseState state;
+    kj::Maybe<kj::Exception> exception;
+    bool is_done;
+  };
+  std::vector<Chunk> chunks;
+  auto start_chunk = [&](uint64_t begin) {
+    chunks.emplace_back();
+    auto& chunk                = chunks.back();
+    chunk.begin                = begin;
+    chunk.handler              = handler.fork(chunks.size() - 1);
+    chunk.state.filter         = filter_;
+    chunk.state.method_tracker = state_.method_tracker;
+    chunk.state.addresses      = state_.addresses;
+    chunk.is_done              = false;
+  };
+
+  // Scan all records in order to take the state at the start of each chunk. A chunk is closed
+  // after a record, so that the next chunk starts at a record boundary.
+  const auto ranges = GetRanges();
+  start_chunk(ranges.empty() ? offset_ : ranges.front().first);
+  auto scan = [&](StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                  kj::ArrayPtr<kj::byte> raw_message) {
+    handler.scan(stream_info, kj::mv(message), raw_message);
+    if (state_.offset - chunks.back().begin >= chunk_size) {
+      start_chunk(state_.offset);
+    }
+  };
+  for (const auto& range : ranges) {
+    ParseRange(range.first, range.second, state_, scan);
+  }
+
+  // Parse chunks on workers. Workers don't go too far ahead of join to bound buffered output.
+  std::mutex mutex;
+  std::condition_variable condition;
+  size_t next_chunk   = 0;
+  size_t joined_chunk = 0;
+
+  auto work = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      condition.wait(lock, [&]() {
+        return next_chunk >= chunks.size() || next_chunk < joined_chunk + thread_count * 2;
+      });
+      if (next_chunk >= chunks.size()) {
+        break;
+      }
+      const size_t i     = next_chunk++;
+      auto& chunk        = chunks[i];
+      const uint64_t end = i + 1 < chunks.size() ? chunks[i + 1].begin : UINT64_MAX;
+      lock.unlock();
+      auto exception = kj::runCatchingExceptions([&]() {
+        for (const auto& range : ranges) {
+          const uint64_t range_begin = kj::max(range.first, chunk.begin);
+          const uint64_t range_end   = kj::min(range.second, end);
+          if (range_begin < range_end) {
+            ParseRange(range_begin, range_end, chunk.state, chunk.handler);
+          }
+        }
+      });
+      lock.lock();
+      chunk.exception = kj::mv(exception);
+      chunk.is_done   = true;
+      condition.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < thread_count; i++) {
+    workers.emplace_back(work);
+  }
+
+  kj::Maybe<kj::Exception> exception;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (joined_chunk < chunks.size()) {
+      auto& chunk = chunks[joined_chunk];
+      condition.wait(lock, [&]() { return chunk.is_done; });
+      // Following chunks are not parsed after failure like ParseAll()
+      KJ_IF_MAYBE (e, chunk.exception) {
+        exception  = kj::mv(*e);
+        next_chunk = chunks.size();
+        condition.notify_all();
+        break;
+      }
+      lock.unlock();
+      handler.join(joined_chunk);
+      chunk.handler = nullptr;
+      lock.lock();
+      joined_chunk++;
+      condition.notify_all();
+    }
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  KJ_IF_MAYBE (e, exception) {
+    kj::throwFatalException(kj::mv(*e));
+  }
+}
+
+bool RpcMessageRecorder::Parser::MatchAddress(ParseState& state, const std::regex& pattern,
+                                              const std::string& address) {
+  auto it = state.address_matches.find(address);
+  if (it == state.address_matches.end()) {
+    it = state.address_matches.emplace(address, std::regex_match(address, pattern)).first;
+  }
+  return it->second;
+}
+
+void RpcMessageRecorder::Parser::ParseRange(uint64_t begin, uint64_t end, ParseState& state,
+                                            const RpcMessageHandler& handler) const {
+  state.offset = begin;
+  while (ParseRecord(end, state, handler)) {
+  }
+}
+
+bool RpcMessageRecorder::Parser::ParseRecord(uint64_t end, ParseState& state,
+                                             const RpcMessageHandler& handler) const {
+  const auto options = GetUnlimitedReaderOptions();
+
+  StreamInfo& stream_info = state.stream_info;
+
+  const bool is_packed = format_version_ == kFormatVersionPacked;
+  const size_t size    = kj::min(end, mapping_.size());
+  while (state.offset < size) {
+    uint32_t magic_number = 0;
+    memcpy(&magic_number, mapping_.begin() + state.offset,
+           kj::min(sizeof(magic_number), size - state.offset));
     if (magic_number != kMagicNumber) {
-      KJ_LOG(WARNING, "Magic Number not found", offset_);
+      state.offset += sizeof(magic_number);
+      KJ_LOG(WARNING, "Magic Number not found", state.offset);
       continue;
     }
-    PARSE_VAR(uint64_t, timestamp);
-    PARSE_VAR(uint64_t, pid);
-    PARSE_VAR(uint64_t, tid);
-    PARSE_VAR(uint64_t, fd);
-    PARSE_VAR(uint32_t, direction);
-    PARSE_VAR(uint32_t, address_length);
-    uint32_t aligned_address_length = (address_length + 3) & ~3;  // 4-byte align
-    char* aligned_address_buf       = reinterpret_cast<char*>(alloca(aligned_address_length));
-    offset_ += input_file_->read(
-        offset_,
-        kj::arrayPtr(reinterpret_cast<kj::byte*>(aligned_address_buf), aligned_address_length));
-    std::string address{aligned_address_buf, address_length};
-    PARSE_VAR(uint64_t, payload_size);
-
-    StreamInfo stream_info(static_cast<pid_t>(pid), static_cast<pid_t>(tid),
-                           static_cast<StreamInfo::Direction>(direction), static_cast<int>(fd),
-                           address);
+
+    RecordHeader header;
+    uint32_t address_id = 0;
+    uint64_t payload_size;
+    uint64_t unpacked_size;
+    const size_t header_size = sizeof(header) + (is_packed ? sizeof(address_id) : 0);
+    if (size - state.offset < header_size) {
+      KJ_LOG(WARNING, "record is truncated", state.offset);
+      state.offset = size;
+      return false;
+    }
+    memcpy(&header, mapping_.begin() + state.offset, sizeof(header));
+    if (is_packed) {
+      memcpy(&address_id, mapping_.begin() + state.offset + sizeof(header), sizeof(address_id));
+    }
+    const bool is_address_reference = is_packed && header.address_length == kAddressReference;
+    const size_t address_length     = is_address_reference ? 0 : header.address_length;
+    const size_t sizes_offset =
+        state.offset + header_size + address_length +
+        GetPaddingLength(format_version_, header_size + address_length);
+    const size_t payload_offset =
+        sizes_offset + sizeof(payload_size) + (is_packed ? sizeof(unpacked_size) : 0);
+    if (payload_offset > size) {
+      KJ_LOG(WARNING, "record is truncated", state.offset);
+      state.offset = size;
+      return false;
+    }
+    memcpy(&payload_size, mapping_.begin() + sizes_offset, sizeof(payload_size));
+    unpacked_size = payload_size;
+    if (is_packed) {
+      memcpy(&unpacked_size, mapping_.begin() + sizes_offset + sizeof(payload_size),
+             sizeof(unpacked_size));
+    }
+    if (payload_size > size - payload_offset) {
+      KJ_LOG(WARNING, "record is truncated", state.offset, payload_size);
+      state.offset = size;
+      return false;
+    }
+    const size_t payload_padding_length = GetPayloadPaddingLength(format_version_, payload_size);
+
+    auto address = reinterpret_cast<const char*>(mapping_.begin() + state.offset + header_size);
+    stream_info.pid_       = static_cast<pid_t>(header.pid);
+    stream_info.tid_       = static_cast<pid_t>(header.tid);
+    stream_info.direction_ = static_cast<StreamInfo::Direction>(header.direction);
+    stream_info.fd_        = static_cast<int>(header.fd);
+    stream_info.timestamp_ = header.timestamp;
+    state.offset           = payload_offset + payload_size + payload_padding_length;
+    if (!is_packed) {
+      stream_info.address_.assign(address, address_length);
+    } else if (address_id > state.addresses.size() ||
+               (is_address_reference && address_id == state.addresses.size())) {
+      // IDs are assigned in order, so the address has been skipped or broken
+      KJ_LOG(WARNING, "address is not found", state.offset, address_id);
+      continue;
+    } else if (is_address_reference) {
+      stream_info.address_ = state.addresses[address_id];
+    } else {
+      if (address_id == state.addresses.size()) {
+        state.addresses.emplace_back();
+      }
+      state.addresses[address_id].assign(address, address_length);
+      stream_info.address_ = state.addresses[address_id];
+    }
+
     if (payload_size == 0) {
-      KJ_LOG(WARNING, "Skip because of no payload", stream_info, aligned_address_length,
-             address_length);
+      KJ_LOG(WARNING, "Skip because of no payload", stream_info, header.address_length);
+      continue;
+    }
+    // Messages out of the time range are still decoded to track CALL/FINISH with method filter
+    const bool is_in_time_range =
+        header.timestamp >= state.filter.since && header.timestamp <= state.filter.until;
+    if (!is_in_time_range && !state.filter.method) {
       continue;
     }
+    KJ_IF_MAYBE (pattern, state.filter.address) {
+      if (!MatchAddress(state, *pattern, stream_info.address_)) {
+        continue;
+      }
+    }
+    KJ_LOG(INFO, header.timestamp, stream_info, payload_size, state.offset);
 
-    auto buf = kj::heapArray<kj::byte>(payload_size);
-    offset_ += input_file_->read(offset_, buf);
-    KJ_LOG(INFO, timestamp, stream_info, payload_size, offset_);
+    // Segments are read in place if the payload is word-aligned in the file
+    auto payload = mapping_.slice(payload_offset, payload_offset + payload_size);
+    kj::ArrayPtr<const capnp::word> words;
+    if (is_packed) {
+      const size_t word_count = unpacked_size / sizeof(capnp::word);
+      if (state.aligned_buf.size() < word_count) {
+        state.aligned_buf = kj::heapArray<capnp::word>(word_count);
+      }
+      UnpackBytes(payload, state.aligned_buf.slice(0, word_count).asBytes());
+      words = state.aligned_buf.slice(0, word_count);
+    } else if (reinterpret_cast<uintptr_t>(payload.begin()) % sizeof(capnp::word) == 0) {
+      words = kj::arrayPtr(reinterpret_cast<const capnp::word*>(payload.begin()),
+                           payload_size / sizeof(capnp::word));
+    } else {
+      const size_t word_count = (payload_size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+      if (state.aligned_buf.size() < word_count) {
+        state.aligned_buf = kj::heapArray<capnp::word>(word_count);
+      }
+      memcpy(state.aligned_buf.begin(), payload.begin(), payload_size);
+      words = state.aligned_buf.slice(0, word_count);
+    }
 
-    kj::ArrayInputStream input_stream(buf);
-    capnp::InputStreamMessageReader reader(input_stream, options);
+    capnp::FlatArrayMessageReader reader(words, options);
     auto message = reader.getRoot<capnp::rpc::Message>();
+    if (state.filter.method) {
+      // RETURN in the time range belongs to the method of CALL even if the CALL is before it
+      auto maybe_method = state.method_tracker.Track(stream_info, message);
+      if (!is_in_time_range) {
+        continue;
+      }
+      KJ_IF_MAYBE (method, maybe_method) {
+        if (!state.filter.method(*method)) {
+          continue;
+        }
+      } else {
+        continue;
+      }
+    }
 
-    handler_(stream_info, kj::mv(message), buf);
+    // Handlers never modify raw message
+    auto raw_bytes   = is_packed ? words.asBytes() : payload;
+    auto raw_message = kj::arrayPtr(const_cast<kj::byte*>(raw_bytes.begin()), raw_bytes.size());
+    handler(stream_info, kj::mv(message), raw_message);
+    return true;
   }
+  return false;
 }
 }  // namespace capnp_trace
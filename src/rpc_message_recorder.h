@@ -1,46 +1,229 @@
 #pragma once
 
+#include <capnp/common.h>
 #include <kj/filesystem.h>
 
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "record_index.h"
 #include "rpc_message_reassembler.h"
 
 namespace capnp_trace {
 
-/// @brief Reassembler for Cap'n Proto RPC Message
+/// @brief Recorder of Cap'n Proto RPC messages into a file which capnp_trace can parse later
+/// @details Records are buffered and written by a flush thread, and the file ends with the index
+/// of records when it is finished.
 class RpcMessageRecorder final {
  public:
-  /// @param answer_id_map RPC message context which is identified by answer ID
-  /// @note answer_id_map must be shared between reassemblers for same
-  /// session(fd)
-  RpcMessageRecorder(kj::Own<kj::AppendableFile>&& output_file);
+  enum class Compression {
+    // Raw message and address are stored as is
+    kNone,
+    // Message is stored in Cap'n Proto packed encoding, and address is referred by ID once it
+    // has been stored in the same index block
+    kPacked,
+  };
+
+  /// @param output_file File to which the file header, records and the index are appended
+  /// @param compression Encoding of messages and addresses in records
+  RpcMessageRecorder(kj::Own<kj::AppendableFile>&& output_file,
+                     Compression compression = Compression::kNone);
+
+  /// @brief Finish recording
   ~RpcMessageRecorder();
   RpcMessageRecorder(const RpcMessageRecorder&)            = delete;
   RpcMessageRecorder& operator=(const RpcMessageRecorder&) = delete;
   RpcMessageRecorder(RpcMessageRecorder&&)                 = delete;
   RpcMessageRecorder& operator=(RpcMessageRecorder&&)      = delete;
 
+  /// @brief Set when buffered records are written to the file
+  /// @param buffer_size Records are written when buffered records exceed this size in bytes.
+  /// 0 means that every record is written immediately.
+  /// @param interval_msec Records are written at least every `interval_msec` milliseconds.
+  /// 0 means that records are written only by `buffer_size`.
+  RpcMessageRecorder& SetFlushThreshold(size_t buffer_size, uint64_t interval_msec);
+
+  /// @brief Rotate the output file when it exceeds `max_file_size` bytes
+  /// @details Each file starts with the file header and ends with the index, so that it can be
+  /// parsed alone. The size is approximate because a record is not split across files.
+  /// @param open_next_file Called to open the next file. It is called on the flush thread in
+  /// advance of rotation, so that it may also remove old files without blocking Record().
+  /// The rest of records and the index of the rotated file are also written by the flush thread.
+  RpcMessageRecorder& SetRotation(uint64_t max_file_size,
+                                  std::function<kj::Own<kj::AppendableFile>()> open_next_file);
+
   /// @brief Record Cap'n Proto RPC message
+  /// @details Record is buffered and written by one write(2) together with other records
   void Record(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
               kj::ArrayPtr<kj::byte> raw_message);
 
+  /// @brief Write buffered records to the file
+  void Flush();
+
+  /// @brief Write buffered records and the index footer to the file
+  /// @details No record can be recorded after this. Calling this again does nothing.
+  void Finish();
+
  private:
+  // File which is rotated out with records and the index which are not written yet
+  struct RetiredFile {
+    kj::Own<kj::AppendableFile> file;
+    std::vector<kj::byte> buffer;
+    RecordIndex index;
+    uint64_t file_size;
+  };
+
+  static void FinishRetiredFile(RetiredFile& retired_file);
+  uint32_t GetFormatVersion() const;
+  // Write buffer_ without lock. Only one thread writes at a time so that records are written in
+  // order.
+  void FlushLocked(std::unique_lock<std::mutex>& lock);
+  void FlushLoop();
+  void FinishFileLocked(std::unique_lock<std::mutex>& lock);
+  void RotateLocked(std::unique_lock<std::mutex>& lock);
+  void PrepareNextFileLocked(std::unique_lock<std::mutex>& lock);
+
   kj::Own<kj::AppendableFile> output_file_;
+  const Compression compression_;
+
+  // Records which are not written yet, guarded by mutex_
+  std::vector<kj::byte> buffer_;
+  // Written buffer which is swapped with buffer_ to reuse its capacity, guarded by mutex_
+  std::vector<kj::byte> spare_buffer_;
+  // Whether a thread is writing records or retired files without lock, guarded by mutex_
+  bool is_writing_;
+  size_t buffer_size_;
+  uint64_t flush_interval_msec_;
+  bool is_stopping_;
+
+  // File offset where the next record starts, guarded by mutex_
+  uint64_t file_offset_;
+
+  // Index which is written by Finish(), guarded by mutex_
+  RecordIndex index_;
+  CallMethodTracker method_tracker_;
+  bool is_finished_;
+
+  // IDs of addresses which are stored in current index block, guarded by mutex_
+  std::unordered_map<std::string, uint32_t> address_ids_;
+
+  // Rotation of the output file, guarded by mutex_. 0 max_file_size_ means no rotation.
+  uint64_t max_file_size_;
+  std::function<kj::Own<kj::AppendableFile>()> open_next_file_;
+  // Opened with file header by the flush thread before rotation
+  kj::Own<kj::AppendableFile> next_file_;
+  // Rotated out, and finished and closed by the flush thread
+  std::vector<RetiredFile> retired_files_;
+  // Whether the flush thread is opening the next file without lock, which Finish() waits for
+  bool is_opening_next_file_;
+
+  std::mutex mutex_;
+  std::condition_variable flush_condition_;
+  std::condition_variable next_file_condition_;
+  std::condition_variable write_condition_;
+
+  // Thread which flushes buffer_ every flush_interval_msec_
+  std::thread flush_thread_;
 
  public:
   class Parser final {
    public:
+    /// @brief Handlers of ParseParallel()
+    struct ParallelHandler {
+      // Called for all selected records in order on the calling thread at first. It should only
+      // track state which is carried over between records (e.g. CALL/FINISH) as cheap as
+      // possible.
+      RpcMessageHandler scan;
+      // Called on the calling thread at the start of each chunk while scanning records. It
+      // returns the handler of records in the chunk, which is called on a worker thread with the
+      // copy of the state at that time.
+      std::function<RpcMessageHandler(size_t chunk)> fork;
+      // Called on the calling thread for each parsed chunk in file order, e.g. to write output
+      std::function<void(size_t chunk)> join;
+    };
+
     Parser(kj::Own<const kj::ReadableFile>&& input_file, RpcMessageHandler handler);
     ~Parser();
     Parser(const Parser&)            = delete;
     Parser& operator=(const Parser&) = delete;
     Parser(Parser&&)                 = delete;
     Parser& operator=(Parser&&)      = delete;
+
+    /// @brief Select messages to be parsed
+    /// @details Blocks which have no matching record are skipped by the index of the file if it
+    /// exists. Otherwise, all records are read and filtered.
+    Parser& SetFilter(RecordFilter filter);
+
     void ParseAll();
 
+    /// @brief Parse at most `max_count` selected records following the previous call
+    /// @return Number of parsed records. 0 means that all selected records have been parsed.
+    size_t ParseNext(size_t max_count);
+
+    /// @brief Parse selected records in chunks on `thread_count` threads
+    /// @details Records are split into chunks of about `chunk_size` bytes at record boundaries
+    /// while they are scanned, and then each chunk is parsed again from the state at its start.
+    void ParseParallel(size_t thread_count, ParallelHandler handler,
+                       uint64_t chunk_size = kDefaultChunkSize);
+
+    static const uint64_t kDefaultChunkSize = 4 * 1024 * 1024;
+
    private:
+    // State of parsing records in order, which is owned by each thread
+    struct ParseState {
+      RecordFilter filter;
+      CallMethodTracker method_tracker;
+
+      // Cache of filter.address results for each address
+      std::map<std::string, bool> address_matches;
+
+      // Addresses which are referred by ID in packed format
+      std::vector<std::string> addresses;
+
+      // Word-aligned copy of a payload which is not aligned in the file
+      kj::Array<capnp::word> aligned_buf;
+
+      // File offset of the next record
+      uint64_t offset = 0;
+
+      // Reused for all records to avoid allocation unless the address gets longer
+      StreamInfo stream_info;
+    };
+
+    std::vector<std::pair<uint64_t, uint64_t>> GetRanges() const;
+    void ParseRange(uint64_t begin, uint64_t end, ParseState& state,
+                    const RpcMessageHandler& handler) const;
+    // Parse records from state.offset until one of them is passed to `handler` or `end`
+    // @return false if no record is passed
+    bool ParseRecord(uint64_t end, ParseState& state, const RpcMessageHandler& handler) const;
+    static bool MatchAddress(ParseState& state, const std::regex& pattern,
+                             const std::string& address);
+
     kj::Own<const kj::ReadableFile> input_file_;
     RpcMessageHandler handler_;
+    // File offset where records start
     uint64_t offset_;
+    uint32_t format_version_;
+
+    RecordFilter filter_;
+    ParseState state_;
+
+    // Ranges which are being parsed by ParseNext(), and the index of current one
+    kj::Maybe<std::vector<std::pair<uint64_t, uint64_t>>> next_ranges_;
+    size_t next_range_index_;
+
+    // Index at the end of the file, which is missing for format version 1 or aborted recording
+    kj::Maybe<RecordIndex> index_;
+
+    // Whole input file mapped by mmap(2)
+    kj::Array<const kj::byte> mapping_;
   };
 };
 
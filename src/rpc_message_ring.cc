@@ -0,0 +1,163 @@
+#include "rpc_message_ring.h"
+
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <signal.h>
+
+#include <chrono>
+#include <cstring>
+
+#include "monotonic_clock.h"
+#include "reader_options.h"
+
+namespace capnp_trace {
+
+// Interval to check the trigger signal
+static const uint64_t kWatchIntervalMsec = 100;
+
+// Fixed part of a kept message which is followed by address and payload, both padded to words
+struct EntryHeader {
+  uint64_t timestamp;
+  int32_t pid;
+  int32_t tid;
+  int32_t fd;
+  uint32_t direction;
+  uint32_t address_length;
+  uint32_t payload_size;
+};
+static_assert(sizeof(EntryHeader) % sizeof(capnp::word) == 0, "EntryHeader must be word-aligned");
+
+static volatile sig_atomic_t trigger_signal_flag = 0;
+
+static size_t RoundUpToWord(size_t size) {
+  return (size + sizeof(capnp::word) - 1) / sizeof(capnp::word) * sizeof(capnp::word);
+}
+
+RpcMessageRing::RpcMessageRing(size_t capacity, RpcMessageHandler handler)
+    : handler_(handler),
+      buffer_(kj::heapArray<capnp::word>(capacity / sizeof(capnp::word))),
+      tail_(0),
+      max_age_usec_(0),
+      is_stopping_(false) {}
+
+RpcMessageRing::~RpcMessageRing() {
+  is_stopping_ = true;
+  if (watch_thread_.joinable()) {
+    watch_thread_.join();
+  }
+}
+
+RpcMessageRing& RpcMessageRing::SetMaxAge(uint64_t max_age_usec) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_age_usec_ = max_age_usec;
+  return *this;
+}
+
+RpcMessageRing& RpcMessageRing::SetTriggerSignal(int signum) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = [](int) { trigger_signal_flag = 1; };
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  KJ_SYSCALL(sigaction(signum, &action, nullptr));
+
+  if (!watch_thread_.joinable()) {
+    watch_thread_ = std::thread(&RpcMessageRing::WatchLoop, this);
+  }
+  return *this;
+}
+
+void RpcMessageRing::Push(StreamInfo stream_info,
+                          [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                          kj::ArrayPtr<kj::byte> raw_message) {
+  const size_t address_size = RoundUpToWord(stream_info.address_.size());
+  const size_t size = sizeof(EntryHeader) + address_size + RoundUpToWord(raw_message.size());
+  const size_t capacity = buffer_.asBytes().size();
+  if (size > capacity) {
+    KJ_LOG(WARNING, "message is larger than ring buffer", stream_info, size, capacity);
+    return;
+  }
+  const EntryHeader header{
+      stream_info.timestamp_ ? stream_info.timestamp_ : GetMonotonicMicroSec(),
+      stream_info.pid_,
+      stream_info.tid_,
+      stream_info.fd_,
+      static_cast<uint32_t>(stream_info.direction_),
+      static_cast<uint32_t>(stream_info.address_.size()),
+      static_cast<uint32_t>(raw_message.size())};
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t offset = tail_;
+  if (offset + size > capacity) {
+    // Wrap around. Messages after the tail are the oldest, and dropped with the unused space.
+    while (!entries_.empty() && entries_.front().offset >= tail_) {
+      entries_.pop_front();
+    }
+    offset = 0;
+  }
+  // Drop the oldest messages which are overwritten
+  while (!entries_.empty() && entries_.front().offset < offset + size &&
+         offset < entries_.front().offset + entries_.front().size) {
+    entries_.pop_front();
+  }
+  // Drop too old messages
+  while (!entries_.empty() && max_age_usec_ > 0 &&
+         entries_.front().timestamp + max_age_usec_ < header.timestamp) {
+    entries_.pop_front();
+  }
+
+  auto bytes = buffer_.asBytes().begin() + offset;
+  memcpy(bytes, &header, sizeof(header));
+  memcpy(bytes + sizeof(header), stream_info.address_.data(), stream_info.address_.size());
+  memcpy(bytes + sizeof(header) + address_size, raw_message.begin(), raw_message.size());
+  entries_.push_back(Entry{offset, size, header.timestamp});
+  tail_ = offset + size;
+}
+
+size_t RpcMessageRing::Trigger() {
+  const auto options = GetUnlimitedReaderOptions();
+
+  // Pushing waits until kept messages are passed, which happens only on rare triggers
+  std::lock_guard<std::mutex> lock(mutex_);
+  StreamInfo stream_info;
+  for (const auto& entry : entries_) {
+    auto bytes = buffer_.asBytes().begin() + entry.offset;
+    EntryHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    stream_info.pid_       = header.pid;
+    stream_info.tid_       = header.tid;
+    stream_info.direction_ = static_cast<StreamInfo::Direction>(header.direction);
+    stream_info.fd_        = header.fd;
+    stream_info.timestamp_ = header.timestamp;
+    stream_info.address_.assign(reinterpret_cast<const char*>(bytes + sizeof(header)),
+                                header.address_length);
+
+    auto payload = bytes + sizeof(header) + RoundUpToWord(header.address_length);
+    auto words   = kj::arrayPtr(reinterpret_cast<const capnp::word*>(payload),
+                                RoundUpToWord(header.payload_size) / sizeof(capnp::word));
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                   capnp::FlatArrayMessageReader reader(words, options);
+                   handler_(stream_info, reader.getRoot<capnp::rpc::Message>(),
+                            kj::arrayPtr(payload, header.payload_size));
+                 })) {
+      KJ_LOG(ERROR, "failed to pass kept message", stream_info, *exception);
+    }
+  }
+
+  const size_t count = entries_.size();
+  entries_.clear();
+  tail_ = 0;
+  return count;
+}
+
+void RpcMessageRing::WatchLoop() {
+  while (!is_stopping_) {
+    if (trigger_signal_flag) {
+      trigger_signal_flag = 0;
+      KJ_LOG(WARNING, "triggered by signal", Trigger());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(kWatchIntervalMsec));
+  }
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <capnp/common.h>
+#include <kj/array.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "rpc_message_reassembler.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief Fixed size in-memory ring of recent Cap'n Proto RPC messages
+/// @details Pushed messages are copied into a buffer which is allocated at construction, and the
+/// oldest ones are dropped when the buffer is full or they get older than the max age. They are
+/// passed to the handler (e.g. RpcMessageRecorder::Record) only when Trigger() is called, so that
+/// the context before a rare failure can be recorded without writing anything in normal times.
+class RpcMessageRing final {
+ public:
+  /// @param capacity Size of the buffer in bytes
+  /// @param handler Callback function to be called for kept messages by Trigger()
+  RpcMessageRing(size_t capacity, RpcMessageHandler handler);
+  ~RpcMessageRing();
+  RpcMessageRing(const RpcMessageRing&)            = delete;
+  RpcMessageRing& operator=(const RpcMessageRing&) = delete;
+  RpcMessageRing(RpcMessageRing&&)                 = delete;
+  RpcMessageRing& operator=(RpcMessageRing&&)      = delete;
+
+  /// @brief Drop messages which are older than the newest one by more than `max_age_usec`
+  /// @param max_age_usec Age in microseconds. 0 means that messages are dropped only by size.
+  RpcMessageRing& SetMaxAge(uint64_t max_age_usec);
+
+  /// @brief Call Trigger() when `signum` (e.g. SIGUSR1) is received
+  /// @details The signal is checked on a watcher thread because no message may be pushed after it
+  RpcMessageRing& SetTriggerSignal(int signum);
+
+  /// @brief Keep a message, which has the same signature as RpcMessageHandler
+  void Push(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+            kj::ArrayPtr<kj::byte> raw_message);
+
+  /// @brief Pass all kept messages to the handler in pushed order, and drop them
+  /// @return Number of passed messages
+  size_t Trigger();
+
+ private:
+  struct Entry {
+    size_t offset;
+    size_t size;
+    uint64_t timestamp;
+  };
+
+  void WatchLoop();
+
+  RpcMessageHandler handler_;
+
+  // Messages are stored in word-aligned buffer to be read in place. Entries are in pushed order.
+  kj::Array<capnp::word> buffer_;
+  std::deque<Entry> entries_;
+  // Offset where the next message is stored
+  size_t tail_;
+  uint64_t max_age_usec_;
+  std::mutex mutex_;
+
+  std::atomic<bool> is_stopping_;
+  std::thread watch_thread_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,131 @@
+#include "rpc_pipeline.h"
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+
+#include <cstring>
+
+#include "reader_options.h"
+
+namespace capnp_trace {
+
+// Number of queued syscalls and messages. The capturing thread waits when the queue is full.
+static const size_t kChunkQueueSize   = 4096;
+static const size_t kMessageQueueSize = 4096;
+
+// Minimum size of buffers for chunks, so that a recycled buffer fits most of syscalls
+static const size_t kMinChunkBufferSize = 4096;
+
+RpcPipeline::RpcPipeline(RpcMessageHandler handler)
+    : handler_(handler),
+      reassemblers_(KJ_BIND_METHOD(*this, QueueMessage)),
+      chunks_(kChunkQueueSize),
+      free_buffers_(kChunkQueueSize),
+      messages_(kMessageQueueSize),
+      decode_thread_(&RpcPipeline::DecodeLoop, this),
+      output_thread_(&RpcPipeline::OutputLoop, this) {}
+
+RpcPipeline::~RpcPipeline() {
+  chunks_.Close();
+  decode_thread_.join();
+  messages_.Close();
+  output_thread_.join();
+}
+
+RpcPipeline& RpcPipeline::SetDumpDir(kj::Own<const kj::Directory> dump_dir) {
+  reassemblers_.SetDumpDir(kj::mv(dump_dir));
+  return *this;
+}
+
+void RpcPipeline::Reassemble(pid_t pid, pid_t tid, StreamInfo::Direction direction, int fd,
+                             const std::string& address, const char* buf, size_t len,
+                             uint64_t timestamp) {
+  if (queued_addresses_.insert(MakeKey(pid, fd)).second) {
+    PushData(Chunk::Op::kAddress, pid, tid, direction, fd, address.data(), address.size(), 0);
+  }
+  PushData(Chunk::Op::kData, pid, tid, direction, fd, buf, len, timestamp);
+}
+
+void RpcPipeline::Close(pid_t pid, int fd) {
+  queued_addresses_.erase(MakeKey(pid, fd));
+  chunks_.Push(Chunk{Chunk::Op::kClose, pid, 0, StreamInfo::Direction::kUnknown, fd, 0,
+                     kj::Array<char>(), 0});
+}
+
+void RpcPipeline::Discard(pid_t pid, int fd, StreamInfo::Direction direction) {
+  chunks_.Push(Chunk{Chunk::Op::kDiscard, pid, 0, direction, fd, 0, kj::Array<char>(), 0});
+}
+
+kj::Array<char> RpcPipeline::TakeBuffer(size_t len) {
+  kj::Array<char> buffer;
+  if (free_buffers_.TryPop(buffer) && buffer.size() >= len) {
+    return buffer;
+  }
+  return kj::heapArray<char>(kj::max(len, kMinChunkBufferSize));
+}
+
+void RpcPipeline::PushData(Chunk::Op op, pid_t pid, pid_t tid, StreamInfo::Direction direction,
+                           int fd, const char* buf, size_t len, uint64_t timestamp) {
+  auto data = TakeBuffer(len);
+  memcpy(data.begin(), buf, len);
+  chunks_.Push(Chunk{op, pid, tid, direction, fd, timestamp, kj::mv(data), len});
+}
+
+void RpcPipeline::DecodeLoop() {
+  Chunk chunk;
+  while (chunks_.Pop(chunk)) {
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                   const auto key = MakeKey(chunk.pid, chunk.fd);
+                   switch (chunk.op) {
+                     case Chunk::Op::kAddress:
+                       addresses_[key] = std::string(chunk.data.begin(), chunk.length);
+                       break;
+                     case Chunk::Op::kData:
+                       reassemblers_.Reassemble(chunk.pid, chunk.tid, chunk.direction, chunk.fd,
+                                                addresses_[key], chunk.data.begin(),
+                                                chunk.length, chunk.timestamp);
+                       break;
+                     case Chunk::Op::kClose:
+                       addresses_.erase(key);
+                       reassemblers_.Close(chunk.pid, chunk.fd);
+                       break;
+                     case Chunk::Op::kDiscard:
+                       reassemblers_.Discard(chunk.pid, chunk.fd, chunk.direction);
+                       break;
+                   }
+                 })) {
+      KJ_LOG(ERROR, "failed to reassemble", chunk.pid, chunk.fd, *exception);
+    }
+    // The buffer is dropped if the capturing thread has enough buffers
+    if (chunk.data != nullptr) {
+      free_buffers_.TryPush(chunk.data);
+    }
+  }
+}
+
+void RpcPipeline::QueueMessage(StreamInfo stream_info,
+                               [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                               kj::ArrayPtr<kj::byte> raw_message) {
+  // Reassembled message is a sequence of words, i.e. segment table is padded to 8 bytes
+  auto words = kj::heapArray<capnp::word>(raw_message.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw_message.begin(), words.asBytes().size());
+  messages_.Push(Message{kj::mv(stream_info), kj::mv(words)});
+}
+
+void RpcPipeline::OutputLoop() {
+  const auto options = GetUnlimitedReaderOptions();
+
+  Message message;
+  while (messages_.Pop(message)) {
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                   capnp::FlatArrayMessageReader reader(message.words, options);
+                   handler_(message.stream_info, reader.getRoot<capnp::rpc::Message>(),
+                            message.words.asBytes());
+                 })) {
+      KJ_LOG(ERROR, "failed to output", message.stream_info, *exception);
+    }
+  }
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <capnp/common.h>
+#include <kj/array.h>
+#include <kj/filesystem.h>
+#include <sys/types.h>
+
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "rpc_message_reassembler.h"
+#include "rpc_stream_reassemblers.h"
+#include "spsc_queue.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief Capture -> decode -> output pipeline which runs reassembly and output on worker threads
+/// @details The capturing thread only copies data into a bounded queue. A decode thread reassembles
+/// Cap'n Proto RPC messages and an output thread calls RpcMessageHandler for them, so that the
+/// capturing thread (e.g. ptrace loop) can resume the tracee as soon as possible.
+/// Data is copied into buffers which the decode thread returns to the capturing thread, and the
+/// address of a stream is queued only once until it is closed, so that the capturing thread doesn't
+/// allocate memory in the steady state.
+/// Messages of each stream are handled in captured order because every stage has one thread.
+class RpcPipeline final {
+ public:
+  explicit RpcPipeline(RpcMessageHandler handler);
+  RpcPipeline(const RpcPipeline&)            = delete;
+  RpcPipeline& operator=(const RpcPipeline&) = delete;
+  RpcPipeline(RpcPipeline&&)                 = delete;
+  RpcPipeline& operator=(RpcPipeline&&)      = delete;
+
+  /// @brief Wait until all queued data is handled
+  ~RpcPipeline();
+
+  /// @brief Enable dump raw unix domain socket data for debug
+  /// @details This must be called before Reassemble()
+  /// @param dump_dir Directory where the dump data will be stored
+  RpcPipeline& SetDumpDir(kj::Own<const kj::Directory> dump_dir);
+
+  /// @brief Queue data which is read from or written to fd
+  /// @details Same as RpcStreamReassemblers::Reassemble() except that `buf` is copied and
+  /// reassembled on the decode thread
+  void Reassemble(pid_t pid, pid_t tid, StreamInfo::Direction direction, int fd,
+                  const std::string& address, const char* buf, size_t len, uint64_t timestamp);
+
+  /// @brief Queue discarding reassemblers for closed fd
+  void Close(pid_t pid, int fd);
+
+  /// @brief Queue dropping data of the stream until fd is closed
+  /// @details Same as RpcStreamReassemblers::Discard()
+  void Discard(pid_t pid, int fd, StreamInfo::Direction direction);
+
+ private:
+  struct Chunk {
+    enum class Op {
+      kAddress,
+      kData,
+      kClose,
+      kDiscard,
+    };
+
+    Op op;
+    pid_t pid;
+    pid_t tid;
+    StreamInfo::Direction direction;
+    int fd;
+    uint64_t timestamp;
+    // Address for kAddress or captured data for kData, whose capacity may exceed `length`
+    kj::Array<char> data;
+    size_t length;
+  };
+
+  struct Message {
+    StreamInfo stream_info;
+    kj::Array<capnp::word> words;
+  };
+
+  static uint64_t MakeKey(pid_t pid, int fd) {
+    return (static_cast<uint64_t>(pid) << 32) | static_cast<uint32_t>(fd);
+  }
+
+  kj::Array<char> TakeBuffer(size_t len);
+  void PushData(Chunk::Op op, pid_t pid, pid_t tid, StreamInfo::Direction direction, int fd,
+                const char* buf, size_t len, uint64_t timestamp);
+  void DecodeLoop();
+  void OutputLoop();
+  void QueueMessage(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                    kj::ArrayPtr<kj::byte> raw_message);
+
+  // Callback function to be called on the output thread
+  RpcMessageHandler handler_;
+
+  // Used only by the decode thread after it starts
+  RpcStreamReassemblers reassemblers_;
+
+  // Map for (pid, fd) -> address, which is used only by the decode thread
+  std::unordered_map<uint64_t, std::string> addresses_;
+
+  // (pid, fd) whose address has been queued, which is used only by the capturing thread
+  std::unordered_set<uint64_t> queued_addresses_;
+
+  SpscQueue<Chunk> chunks_;
+  // Buffers of handled chunks which are returned from the decode thread to the capturing thread
+  SpscQueue<kj::Array<char>> free_buffers_;
+  SpscQueue<Message> messages_;
+
+  std::thread decode_thread_;
+  std::thread output_thread_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,152 @@
+#include "rpc_preload_tracer.h"
+
+#include <kj/debug.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "capnp_trace_preload.h"
+#include "install_path.h"
+#include "monotonic_clock.h"
+#include "termination_signal.h"
+
+namespace capnp_trace {
+
+// Must be power of 2
+static const size_t kRingCapacity = 16 * 1024 * 1024;
+
+// Interval to poll ring buffer when it is empty
+static const useconds_t kPollIntervalUsec = 1000;
+
+// Time until a reserved but unpublished record is reported as a stall, e.g. by a dead producer
+static const uint64_t kStallWarningUsec = 1000000;
+
+static uint64_t MakeKey(pid_t pid, int fd) {
+  return (static_cast<uint64_t>(pid) << 32) | static_cast<uint32_t>(fd);
+}
+
+static void* CreateRingRegion(int* fd, size_t size) {
+  // fd is not CLOEXEC to be inherited by the tracee
+  KJ_SYSCALL(*fd = memfd_create("capnp_trace_ring", 0));
+  KJ_SYSCALL(ftruncate(*fd, static_cast<off_t>(size)));
+  void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  KJ_REQUIRE(region != MAP_FAILED, "failed to map ring buffer");
+  return region;
+}
+
+RpcPreloadTracer::RpcPreloadTracer(kj::StringPtr address, RpcMessageHandler handler)
+    : target_address_(kj::str(address)),
+      ring_fd_(-1),
+      ring_size_(SharedRingBuffer::GetRegionSize(kRingCapacity)),
+      ring_region_(CreateRingRegion(&ring_fd_, ring_size_)),
+      ring_(ring_region_, ring_size_),
+      dropped_bytes_(0),
+      stall_start_(0),
+      is_stall_reported_(false),
+      reassemblers_(handler) {}
+
+RpcPreloadTracer::~RpcPreloadTracer() {
+  munmap(ring_region_, ring_size_);
+  close(ring_fd_);
+}
+
+RpcPreloadTracer& RpcPreloadTracer::SetDumpDir(kj::Own<const kj::Directory> dump_dir) {
+  reassemblers_.SetDumpDir(kj::mv(dump_dir));
+  return *this;
+}
+
+void RpcPreloadTracer::SetupTraceeEnvironment() {
+  auto preload     = FindInstalledFile(kPreloadLibraryName, kPreloadLibraryEnv);
+  const char* prev = getenv("LD_PRELOAD");
+  if (prev != nullptr && prev[0] != '\0') {
+    preload += std::string(":") + prev;
+  }
+  KJ_SYSCALL(setenv("LD_PRELOAD", preload.c_str(), 1));
+  KJ_SYSCALL(setenv(kPreloadRingFdEnv, std::to_string(ring_fd_).c_str(), 1));
+  KJ_SYSCALL(setenv(kPreloadAddressEnv, target_address_.cStr(), 1));
+}
+
+size_t RpcPreloadTracer::Drain() {
+  auto count = ring_.Consume([this](const SharedRingBuffer::Record& record, char* payload) {
+    const auto key = MakeKey(record.pid, record.fd);
+    if ((record.type & SharedRingBuffer::kGapFlag) != 0) {
+      // Data before this record was dropped, so following data cannot be reassembled until close
+      const auto direction = (record.type & ~SharedRingBuffer::kGapFlag) == SharedRingBuffer::kIn
+                                 ? StreamInfo::Direction::kIn
+                                 : StreamInfo::Direction::kOut;
+      KJ_LOG(WARNING, "data is dropped by ring buffer overflow. Discard the stream.", record.pid,
+             record.fd);
+      reassemblers_.Discard(record.pid, record.fd, direction);
+      return;
+    }
+    switch (record.type) {
+      case SharedRingBuffer::kOpen:
+        addresses_[key] = std::string(payload, record.length);
+        KJ_LOG(INFO, record.pid, record.fd, addresses_[key]);
+        break;
+      case SharedRingBuffer::kIn:
+        reassemblers_.Reassemble(record.pid, record.tid, StreamInfo::Direction::kIn, record.fd,
+                                 addresses_[key], payload, record.length, record.timestamp);
+        break;
+      case SharedRingBuffer::kOut:
+        reassemblers_.Reassemble(record.pid, record.tid, StreamInfo::Direction::kOut, record.fd,
+                                 addresses_[key], payload, record.length, record.timestamp);
+        break;
+      case SharedRingBuffer::kClose:
+        reassemblers_.Close(record.pid, record.fd);
+        addresses_.erase(key);
+        break;
+      default:
+        KJ_LOG(WARNING, "unknown record type", record.type);
+        break;
+    }
+  });
+
+  auto dropped_bytes = ring_.GetDroppedBytes();
+  if (dropped_bytes != dropped_bytes_) {
+    KJ_LOG(WARNING, "ring buffer overflowed and following messages may be broken",
+           dropped_bytes - dropped_bytes_);
+    dropped_bytes_ = dropped_bytes;
+  }
+  return count;
+}
+
+void RpcPreloadTracer::Trace(pid_t pid) {
+  while (!TerminationSignal::IsRaised()) {
+    if (Drain() > 0) {
+      stall_start_ = 0;
+      continue;
+    }
+    CheckStall();
+
+    int status{-1};
+    if (waitpid(pid, &status, WNOHANG) == pid && (WIFEXITED(status) || WIFSIGNALED(status))) {
+      KJ_LOG(INFO, pid, "exited");
+      Drain();
+      return;
+    }
+    usleep(kPollIntervalUsec);
+  }
+  Drain();
+}
+
+void RpcPreloadTracer::CheckStall() {
+  if (ring_.IsEmpty()) {
+    stall_start_ = 0;
+    return;
+  }
+  const uint64_t now = GetMonotonicMicroSec();
+  if (stall_start_ == 0) {
+    stall_start_       = now;
+    is_stall_reported_ = false;
+  } else if (!is_stall_reported_ && now - stall_start_ >= kStallWarningUsec) {
+    KJ_LOG(WARNING, "ring buffer is stalled by an unpublished record. A tracee thread may have "
+                    "died while capturing.");
+    is_stall_reported_ = true;
+  }
+}
+
+}  // namespace capnp_trace
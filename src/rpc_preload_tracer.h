@@ -0,0 +1,67 @@
+#pragma once
+
+#include <kj/filesystem.h>
+#include <kj/string.h>
+#include <sys/types.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "rpc_message_reassembler.h"
+#include "rpc_stream_reassemblers.h"
+#include "shared_ring_buffer.h"
+
+namespace capnp_trace {
+
+/// @brief Tracer which receives Cap'n Proto RPC streams from libcapnp_trace_preload.so
+/// @details Unlike RpcTracer, tracee doesn't stop at syscalls. Only `exec` is supported because
+/// the library must be loaded by LD_PRELOAD when the tracee starts.
+class RpcPreloadTracer final {
+ public:
+  RpcPreloadTracer(kj::StringPtr address, RpcMessageHandler handler);
+  RpcPreloadTracer(const RpcPreloadTracer&)            = delete;
+  RpcPreloadTracer& operator=(const RpcPreloadTracer&) = delete;
+  RpcPreloadTracer(RpcPreloadTracer&&)                 = delete;
+  RpcPreloadTracer& operator=(RpcPreloadTracer&&)      = delete;
+  ~RpcPreloadTracer();
+
+  /// @brief Enable dump raw unix domain socket data for debug
+  /// @param dump_dir Directory where the dump data will be stored
+  RpcPreloadTracer& SetDumpDir(kj::Own<const kj::Directory> dump_dir);
+
+  /// @brief Set environment variables to load libcapnp_trace_preload.so
+  /// @details This must be called in the forked child before execvp
+  void SetupTraceeEnvironment();
+
+  /// @brief Start Cap'n Proto RPC tracing
+  /// @details This method returns after the tracee exited or TerminationSignal is raised
+  void Trace(pid_t pid);
+
+ private:
+  size_t Drain();
+
+  // Warn if a record stays unpublished for a long time
+  void CheckStall();
+
+  // server address to be traced
+  kj::String target_address_;
+
+  // shared memory for ring_
+  int ring_fd_;
+  size_t ring_size_;
+  void* ring_region_;
+  SharedRingBuffer ring_;
+  uint64_t dropped_bytes_;
+
+  // Time when the ring is found stalled by an unpublished record, or 0 if it is not stalled
+  uint64_t stall_start_;
+  bool is_stall_reported_;
+
+  // Map for (pid, fd) -> server address
+  std::unordered_map<uint64_t, std::string> addresses_;
+
+  // Reassemblers for each fd and direction
+  RpcStreamReassemblers reassemblers_;
+};
+
+}  // namespace capnp_trace
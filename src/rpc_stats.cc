@@ -0,0 +1,64 @@
+#include "rpc_stats.h"
+
+#include <kj/vector.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <utility>
+
+namespace capnp_trace {
+
+void RpcStats::AddCall(const MethodInfo& method) { methods_[&method].calls++; }
+
+void RpcStats::AddLatency(const MethodInfo& method, uint64_t latency_usec) {
+  methods_[&method].latency.Record(latency_usec);
+}
+
+void RpcStats::AddBytes(const MethodInfo& method, StreamInfo::Direction direction, size_t size) {
+  auto& stats = methods_[&method];
+  if (direction == StreamInfo::Direction::kIn) {
+    stats.bytes_in += size;
+  } else if (direction == StreamInfo::Direction::kOut) {
+    stats.bytes_out += size;
+  }
+}
+
+void RpcStats::Merge(const RpcStats& other) {
+  for (const auto& method : other.methods_) {
+    auto& stats = methods_[method.first];
+    stats.calls += method.second.calls;
+    stats.bytes_in += method.second.bytes_in;
+    stats.bytes_out += method.second.bytes_out;
+    stats.latency.Merge(method.second.latency);
+  }
+}
+
+kj::String RpcStats::Format() const {
+  kj::Vector<std::pair<const MethodInfo*, const MethodStats*>> sorted;
+  for (const auto& method : methods_) {
+    sorted.add(method.first, &method.second);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const auto& lhs, const auto& rhs) {
+    return strcmp(lhs.first->name.cStr(), rhs.first->name.cStr()) < 0;
+  });
+
+  // Latencies are in microseconds
+  std::ostringstream stream;
+  stream << std::setw(10) << "calls" << std::setw(10) << "p50" << std::setw(10) << "p90"
+         << std::setw(10) << "p99" << std::setw(10) << "max" << std::setw(14) << "bytes_in"
+         << std::setw(14) << "bytes_out"
+         << "  method\n";
+  for (const auto& method : sorted) {
+    const auto& stats = *method.second;
+    stream << std::setw(10) << stats.calls << std::setw(10) << stats.latency.GetPercentile(50)
+           << std::setw(10) << stats.latency.GetPercentile(90) << std::setw(10)
+           << stats.latency.GetPercentile(99) << std::setw(10) << stats.latency.max()
+           << std::setw(14) << stats.bytes_in << std::setw(14) << stats.bytes_out << "  "
+           << method.first->name.cStr() << "\n";
+  }
+  return kj::str(stream.str().c_str());
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <kj/string.h>
+#include <stdint.h>
+
+#include <unordered_map>
+
+#include "latency_histogram.h"
+#include "method_table.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief Statistics of RPC for each method, which are printed by `--stats`
+class RpcStats final {
+ public:
+  /// @brief Count a CALL of `method`
+  void AddCall(const MethodInfo& method);
+
+  /// @brief Record latency from CALL to RETURN of `method`
+  void AddLatency(const MethodInfo& method, uint64_t latency_usec);
+
+  /// @brief Add size of a message of `method` to bytes in or out by `direction`
+  void AddBytes(const MethodInfo& method, StreamInfo::Direction direction, size_t size);
+
+  /// @brief Add statistics in `other`, e.g. of a chunk parsed in parallel
+  void Merge(const RpcStats& other);
+
+  /// @brief Table of statistics of each method sorted by method name
+  kj::String Format() const;
+
+ private:
+  struct MethodStats {
+    uint64_t calls     = 0;
+    uint64_t bytes_in  = 0;
+    uint64_t bytes_out = 0;
+    LatencyHistogram latency;
+  };
+
+  // MethodInfo is never freed by MethodTable
+  std::unordered_map<const MethodInfo*, MethodStats> methods_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,79 @@
+#include "rpc_stream_reassemblers.h"
+
+#include <kj/debug.h>
+#include <kj/string.h>
+
+namespace capnp_trace {
+
+RpcStreamReassemblers& RpcStreamReassemblers::SetDumpDir(kj::Own<const kj::Directory> dump_dir) {
+  dump_dir_ = kj::mv(dump_dir);
+  return *this;
+}
+
+void RpcStreamReassemblers::Reassemble(pid_t pid, pid_t tid, StreamInfo::Direction direction,
+                                       int fd, const std::string& address, char* buf,
+                                       size_t len, uint64_t timestamp) {
+  auto& reassemblers =
+      direction == StreamInfo::Direction::kIn ? reassemblers_in_ : reassemblers_out_;
+  auto& discarded = direction == StreamInfo::Direction::kIn ? discarded_in_ : discarded_out_;
+  const auto key  = MakeKey(pid, fd);
+  if (discarded.count(key) > 0) {
+    return;
+  }
+
+  auto it = reassemblers.find(key);
+  if (it == reassemblers.end()) {
+    const StreamInfo stream_info(pid, tid, direction, fd, address);
+    RpcMessageReassembler reassembler(handler_, stream_info);
+    if (dump_dir_) {
+      // fd numbers are reused across processes, so that the pid is a part of the name
+      const char* suffix = direction == StreamInfo::Direction::kIn ? "in" : "out";
+      reassembler.SetDumpFile(dump_dir_->appendFile(
+          kj::Path::parse(kj::str("capnp_trace.", pid, ".", fd, ".", suffix, ".dump")),
+          kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT));
+    }
+    it = reassemblers.emplace(key, kj::mv(reassembler)).first;
+  }
+
+  it->second.Reassemble(buf, len, timestamp);
+}
+
+void RpcStreamReassemblers::Close(pid_t pid, int fd) {
+  const auto key = MakeKey(pid, fd);
+  reassemblers_in_.erase(key);
+  reassemblers_out_.erase(key);
+  discarded_in_.erase(key);
+  discarded_out_.erase(key);
+}
+
+void RpcStreamReassemblers::Discard(pid_t pid, int fd, StreamInfo::Direction direction) {
+  const auto key = MakeKey(pid, fd);
+  if (direction != StreamInfo::Direction::kOut) {
+    reassemblers_in_.erase(key);
+    discarded_in_.insert(key);
+  }
+  if (direction != StreamInfo::Direction::kIn) {
+    reassemblers_out_.erase(key);
+    discarded_out_.insert(key);
+  }
+}
+
+bool RpcStreamReassemblers::Skip(pid_t pid, int fd, StreamInfo::Direction direction,
+                                 size_t len) {
+  auto& reassemblers =
+      direction == StreamInfo::Direction::kIn ? reassemblers_in_ : reassemblers_out_;
+  auto& discarded = direction == StreamInfo::Direction::kIn ? discarded_in_ : discarded_out_;
+  const auto key  = MakeKey(pid, fd);
+  if (discarded.count(key) > 0) {
+    return false;
+  }
+
+  auto it = reassemblers.find(key);
+  if (it != reassemblers.end() && it->second.Skip(len)) {
+    return true;
+  }
+  Discard(pid, fd, direction);
+  return false;
+}
+
+}  // namespace capnp_trace
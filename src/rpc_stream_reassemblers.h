@@ -0,0 +1,74 @@
+#pragma once
+
+#include <kj/filesystem.h>
+#include <sys/types.h>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "rpc_message_reassembler.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief RpcMessageReassembler set for each stream, which is identified by pid, fd and direction
+class RpcStreamReassemblers final {
+ public:
+  explicit RpcStreamReassemblers(RpcMessageHandler handler) : handler_(handler) {}
+  ~RpcStreamReassemblers()                                       = default;
+  RpcStreamReassemblers(const RpcStreamReassemblers&)            = delete;
+  RpcStreamReassemblers& operator=(const RpcStreamReassemblers&) = delete;
+  RpcStreamReassemblers(RpcStreamReassemblers&&)                 = delete;
+  RpcStreamReassemblers& operator=(RpcStreamReassemblers&&)      = delete;
+
+  /// @brief Enable dump raw unix domain socket data for debug
+  /// @param dump_dir Directory where the dump data will be stored as
+  /// capnp_trace.<pid>.<fd>.<in|out>.dump
+  RpcStreamReassemblers& SetDumpDir(kj::Own<const kj::Directory> dump_dir);
+
+  /// @brief Reassemble data which is read from or written to fd
+  /// @details StreamInfo is made from arguments only when the stream appears first time
+  /// @param timestamp capture time of `buf` in CLOCK_MONOTONIC microseconds (0 if unknown)
+  void Reassemble(pid_t pid, pid_t tid, StreamInfo::Direction direction, int fd,
+                  const std::string& address, char* buf, size_t len, uint64_t timestamp);
+
+  /// @brief Discard reassemblers for closed fd
+  void Close(pid_t pid, int fd);
+
+  /// @brief Drop data of the stream until fd is closed
+  /// @details Used when a part of the stream is lost, because following data starts in the middle
+  /// of a message and cannot be reassembled
+  /// @param direction kUnknown discards both directions
+  void Discard(pid_t pid, int fd, StreamInfo::Direction direction);
+
+  /// @brief Skip `len` bytes of the stream which were lost in capturing
+  /// @details Same as RpcMessageReassembler::Skip(). The stream is discarded like Discard() if it
+  /// cannot be resynchronised.
+  /// @param direction kIn or kOut
+  /// @return false if the stream is discarded
+  bool Skip(pid_t pid, int fd, StreamInfo::Direction direction, size_t len);
+
+ private:
+  static uint64_t MakeKey(pid_t pid, int fd) {
+    return (static_cast<uint64_t>(pid) << 32) | static_cast<uint32_t>(fd);
+  }
+
+  // Callback function to be called when read/write Cap'n Proto RPC messages
+  RpcMessageHandler handler_;
+
+  // Directory where raw data is dumped
+  kj::Own<const kj::Directory> dump_dir_;
+
+  // Map for (pid, fd) -> incoming message RpcMessageReassembler
+  std::unordered_map<uint64_t, RpcMessageReassembler> reassemblers_in_;
+
+  // Map for (pid, fd) -> outgoing message RpcMessageReassembler
+  std::unordered_map<uint64_t, RpcMessageReassembler> reassemblers_out_;
+
+  // (pid, fd) whose data is dropped until close
+  std::unordered_set<uint64_t> discarded_in_;
+  std::unordered_set<uint64_t> discarded_out_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,222 @@
+#include "rpc_top_view.h"
+
+#include <kj/debug.h>
+#include <kj/vector.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#include "immutable_schema_registry.h"
+#include "monotonic_clock.h"
+
+namespace capnp_trace {
+
+const uint64_t RpcTopView::kDefaultIntervalMsec;
+
+// Direction of CALL which is answered by RETURN in `direction`
+static StreamInfo::Direction GetCallDirection(StreamInfo::Direction direction) {
+  return direction == StreamInfo::Direction::kIn    ? StreamInfo::Direction::kOut
+         : direction == StreamInfo::Direction::kOut ? StreamInfo::Direction::kIn
+                                                    : StreamInfo::Direction::kUnknown;
+}
+
+RpcTopView::RpcTopView(kj::Own<kj::OutputStream>&& output)
+    : output_(kj::mv(output)),
+      sort_key_(SortKey::kCalls),
+      interval_msec_(kDefaultIntervalMsec),
+      max_rows_(0),
+      is_stopping_(false) {}
+
+RpcTopView::~RpcTopView() { Stop(); }
+
+RpcTopView& RpcTopView::SetSortKey(SortKey sort_key) {
+  sort_key_ = sort_key;
+  return *this;
+}
+
+RpcTopView& RpcTopView::SetInterval(uint64_t interval_msec) {
+  KJ_REQUIRE(interval_msec > 0, "interval must be positive");
+  interval_msec_ = interval_msec;
+  return *this;
+}
+
+RpcTopView& RpcTopView::SetMaxRows(size_t max_rows) {
+  max_rows_ = max_rows;
+  return *this;
+}
+
+void RpcTopView::Start() {
+  KJ_REQUIRE(!refresh_thread_.joinable(), "already started");
+  refresh_thread_ = std::thread(&RpcTopView::RefreshLoop, this);
+}
+
+void RpcTopView::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(refresh_mutex_);
+    is_stopping_ = true;
+  }
+  refresh_condition_.notify_one();
+  if (refresh_thread_.joinable()) {
+    refresh_thread_.join();
+  }
+}
+
+void RpcTopView::Handle(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                        kj::ArrayPtr<kj::byte> raw_message) {
+  if (message.isCall()) {
+    auto call      = message.getCall();
+    auto& counters = GetCounters(stream_info,
+                                 GetMethod(MethodKey(call.getInterfaceId(), call.getMethodId())));
+    counters.calls.store(counters.calls.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+    counters.bytes.store(counters.bytes.load(std::memory_order_relaxed) + raw_message.size(),
+                         std::memory_order_relaxed);
+    counters.in_flight.store(counters.in_flight.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+    const QuestionKey key(stream_info.pid_, stream_info.fd_, stream_info.direction_,
+                          call.getQuestionId());
+    questions_[key] = Question{&counters, GetCaptureTime(stream_info)};
+  } else if (message.isReturn()) {
+    const QuestionKey key(stream_info.pid_, stream_info.fd_,
+                          GetCallDirection(stream_info.direction_),
+                          message.getReturn().getAnswerId());
+    auto it = questions_.find(key);
+    if (it == questions_.end()) {
+      return;
+    }
+    auto& counters = *it->second.counters;
+    counters.bytes.store(counters.bytes.load(std::memory_order_relaxed) + raw_message.size(),
+                         std::memory_order_relaxed);
+    counters.in_flight.store(counters.in_flight.load(std::memory_order_relaxed) - 1,
+                             std::memory_order_relaxed);
+    const uint64_t timestamp = GetCaptureTime(stream_info);
+    // Messages captured by different threads can be out of order
+    if (timestamp >= it->second.timestamp) {
+      counters.latency.Record(timestamp - it->second.timestamp);
+    }
+    questions_.erase(it);
+  }
+}
+
+kj::String RpcTopView::Render(uint64_t elapsed_usec) {
+  struct Row {
+    const CountersKey* key;
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t in_flight;
+    LatencyHistogram latency;
+  };
+
+  kj::Vector<std::pair<const CountersKey*, const Counters*>> counters;
+  {
+    std::lock_guard<std::mutex> lock(counters_mutex_);
+    for (const auto& entry : counters_) {
+      counters.add(&entry.first, entry.second.get());
+    }
+  }
+
+  // Rates are computed from differences to the previous refresh
+  kj::Vector<Row> rows;
+  for (const auto& entry : counters) {
+    auto& previous = snapshots_[entry.second];
+    Snapshot current;
+    current.calls   = entry.second->calls.load(std::memory_order_relaxed);
+    current.bytes   = entry.second->bytes.load(std::memory_order_relaxed);
+    current.latency = entry.second->latency.Snapshot();
+
+    Row row{entry.first, current.calls - previous.calls, current.bytes - previous.bytes,
+            entry.second->in_flight.load(std::memory_order_relaxed), current.latency};
+    row.latency.Subtract(previous.latency);
+    previous = kj::mv(current);
+    rows.add(kj::mv(row));
+  }
+
+  auto sort_key = sort_key_;
+  std::sort(rows.begin(), rows.end(), [sort_key](const Row& lhs, const Row& rhs) {
+    switch (sort_key) {
+      case SortKey::kBytes:
+        return lhs.bytes > rhs.bytes;
+      case SortKey::kP99:
+        return lhs.latency.GetPercentile(99) > rhs.latency.GetPercentile(99);
+      case SortKey::kCalls:
+      default:
+        return lhs.calls > rhs.calls;
+    }
+  });
+
+  // Rates are per second, and latencies are in microseconds
+  const double elapsed_sec = elapsed_usec > 0 ? elapsed_usec / 1000000.0 : 1.0;
+  std::ostringstream stream;
+  stream << std::fixed << std::setprecision(1);
+  stream << std::setw(10) << "calls/s" << std::setw(14) << "bytes/s" << std::setw(10)
+         << "inflight" << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10)
+         << "max"
+         << "  address fd method\n";
+  const size_t row_count = max_rows_ > 0 ? std::min(rows.size(), max_rows_) : rows.size();
+  for (size_t i = 0; i < row_count; i++) {
+    const auto& row = rows[i];
+    const auto* method = std::get<2>(*row.key);
+    stream << std::setw(10) << row.calls / elapsed_sec << std::setw(14)
+           << row.bytes / elapsed_sec << std::setw(10) << row.in_flight << std::setw(10)
+           << row.latency.GetPercentile(50) << std::setw(10) << row.latency.GetPercentile(99)
+           << std::setw(10) << row.latency.max() << "  " << std::get<0>(*row.key) << " "
+           << std::get<1>(*row.key) << " "
+           << (method != nullptr ? method->name.cStr() : "<unknown method>") << "\n";
+  }
+  return kj::str(stream.str().c_str());
+}
+
+RpcTopView::Counters& RpcTopView::GetCounters(const StreamInfo& stream_info,
+                                              const MethodInfo* method) {
+  // Only this thread inserts to counters_, so it can be found without locking
+  auto it = counters_.find(std::tie(stream_info.address_, stream_info.fd_, method));
+  if (it != counters_.end()) {
+    return *it->second;
+  }
+  std::lock_guard<std::mutex> lock(counters_mutex_);
+  auto inserted = counters_.emplace(CountersKey(stream_info.address_, stream_info.fd_, method),
+                                    kj::heap<Counters>());
+  return *inserted.first->second;
+}
+
+const MethodInfo* RpcTopView::GetMethod(MethodKey key) {
+  // Unknown method is cached too, to avoid an exception for each CALL
+  auto it = methods_.find(key);
+  if (it != methods_.end()) {
+    return it->second;
+  }
+  const MethodInfo* method = nullptr;
+  KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                 method = &ImmutableSchemaRegistry::GetMethod(key.first, key.second);
+               })) {
+    KJ_LOG(INFO, "unknown method", key.first, key.second, *exception);
+  }
+  methods_.emplace(key, method);
+  return method;
+}
+
+void RpcTopView::RefreshLoop() {
+  static const char kClearScreen[] = "\x1b[H\x1b[2J";
+  uint64_t last_time = GetMonotonicMicroSec();
+  std::unique_lock<std::mutex> lock(refresh_mutex_);
+  while (true) {
+    const bool is_stopping = refresh_condition_.wait_for(
+        lock, std::chrono::milliseconds(interval_msec_), [this]() { return is_stopping_; });
+    const uint64_t now = GetMonotonicMicroSec();
+    KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                   auto text = Render(now - last_time);
+                   output_->write(kClearScreen, sizeof(kClearScreen) - 1);
+                   output_->write(text.begin(), text.size());
+                 })) {
+      KJ_LOG(ERROR, "failed to render", *exception);
+    }
+    last_time = now;
+    if (is_stopping) {
+      break;
+    }
+  }
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <capnp/rpc.capnp.h>
+#include <kj/array.h>
+#include <kj/io.h>
+#include <kj/string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#include "latency_histogram.h"
+#include "method_table.h"
+#include "record_index.h"
+#include "stream_info.h"
+
+namespace capnp_trace {
+
+/// @brief Live view of RPC rates and latency for each address, fd and method
+/// @details Messages are only counted without formatting. Counters are written by the thread
+/// which calls Handle() and read by the refresh thread without locking, and the table is
+/// rendered every interval with rates since the previous refresh.
+class RpcTopView final {
+ public:
+  enum class SortKey {
+    kCalls,
+    kBytes,
+    kP99,
+  };
+
+  static const uint64_t kDefaultIntervalMsec = 1000;
+
+  /// @param output Stream to render the view, e.g. kj::FdOutputStream of stdout
+  explicit RpcTopView(kj::Own<kj::OutputStream>&& output);
+
+  /// @brief Stop refreshing
+  ~RpcTopView();
+  RpcTopView(const RpcTopView&)            = delete;
+  RpcTopView& operator=(const RpcTopView&) = delete;
+  RpcTopView(RpcTopView&&)                 = delete;
+  RpcTopView& operator=(RpcTopView&&)      = delete;
+
+  RpcTopView& SetSortKey(SortKey sort_key);
+  RpcTopView& SetInterval(uint64_t interval_msec);
+
+  /// @brief Limit the number of rows, e.g. to the height of the terminal. 0 means unlimited.
+  RpcTopView& SetMaxRows(size_t max_rows);
+
+  /// @brief Start refreshing the view every interval on a thread
+  void Start();
+
+  /// @brief Stop refreshing, and render the last view
+  void Stop();
+
+  /// @brief Count a message, which has the same signature as RpcMessageHandler
+  void Handle(StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+              kj::ArrayPtr<kj::byte> raw_message);
+
+  /// @brief Render the table of rates since the previous call
+  /// @param elapsed_usec Time since the previous call
+  kj::String Render(uint64_t elapsed_usec);
+
+ private:
+  // Written only by Handle()
+  struct Counters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> in_flight{0};
+    ConcurrentLatencyHistogram latency;
+  };
+
+  // Values of Counters at the previous refresh, which are used only by Render()
+  struct Snapshot {
+    uint64_t calls = 0;
+    uint64_t bytes = 0;
+    LatencyHistogram latency;
+  };
+
+  struct Question {
+    Counters* counters;
+    uint64_t timestamp;
+  };
+
+  // Address, fd and method. The method is null if its schema is unknown.
+  using CountersKey = std::tuple<std::string, int, const MethodInfo*>;
+  // pid, fd, direction of CALL and question ID
+  using QuestionKey = std::tuple<pid_t, int, StreamInfo::Direction, uint32_t>;
+
+  Counters& GetCounters(const StreamInfo& stream_info, const MethodInfo* method);
+  const MethodInfo* GetMethod(MethodKey key);
+  void RefreshLoop();
+
+  kj::Own<kj::OutputStream> output_;
+  SortKey sort_key_;
+  uint64_t interval_msec_;
+  size_t max_rows_;
+
+  // Counters are added only by Handle(), which locks the mutex only to add them
+  std::map<CountersKey, kj::Own<Counters>, std::less<>> counters_;
+  std::mutex counters_mutex_;
+  std::map<QuestionKey, Question> questions_;
+  std::map<MethodKey, const MethodInfo*> methods_;
+
+  std::map<const Counters*, Snapshot> snapshots_;
+
+  bool is_stopping_;
+  std::mutex refresh_mutex_;
+  std::condition_variable refresh_condition_;
+  std::thread refresh_thread_;
+};
+
+}  // namespace capnp_trace
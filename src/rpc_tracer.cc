@@ -4,7 +4,13 @@
 #include <kj/debug.h>
 #include <kj/string.h>
 #include <limits.h>
+#include <linux/audit.h>
 #include <linux/elf.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
@@ -13,73 +19,97 @@
 #include <sys/un.h>
 #include <sys/wait.h>
 
+#include <cerrno>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "immutable_schema_registry.h"
-#include "rpc_message_reassembler.h"
+#include "monotonic_clock.h"
+#include "rpc_stream_reassemblers.h"
 #include "stream_info.h"
+#include "termination_signal.h"
+#include "tracer_metrics.h"
+#include "unix_socket_address.h"
 
 namespace capnp_trace {
 
-static void ReadProcessMemory(pid_t pid, uint64_t addr, uint64_t size, char* buf) {
-  struct iovec local, remote;
-  local.iov_base  = buf;
-  local.iov_len   = size;
-  remote.iov_base = reinterpret_cast<void*>(addr);
-  remote.iov_len  = size;
-  KJ_SYSCALL(process_vm_readv(pid, &local, 1, &remote, 1, 0));
-}
+// Syscalls handled by DispatchSyscallHandler
+static const uint32_t kTracedSyscalls[] = {
+    SYS_connect, SYS_read, SYS_readv, SYS_write, SYS_writev, SYS_recvfrom, SYS_close,
+};
 
-static std::string GetPathFromFd(int pid, int fd) {
-  // Get socket inode from /proc/PID/fd/FD
-  //
-  //   # readlink /proc/$(pidof app_management)/fd/8
-  //   socket:[8633537]
-  //
-  std::string fd_dir_path =
-      std::string("/proc/") + std::to_string(pid) + "/fd/" + std::to_string(fd);
-  char buf[PATH_MAX] = {0};
-  readlink(fd_dir_path.c_str(), buf, sizeof(buf) - 1);
-  uint64_t inode;
-  auto count = sscanf(buf, "socket:[%" PRIu64 "]", &inode);
-  if (count != 1) {
-    // fd is not socket
-    return "";
-  }
+#if defined(__aarch64__)
+static const uint32_t kAuditArch = AUDIT_ARCH_AARCH64;
+#else
+static const uint32_t kAuditArch = AUDIT_ARCH_X86_64;
+#endif
 
-  // Get socket path from socket inode and /proc/PID/net/unix
-  //
-  //   # cat /proc/$(pidof app_management)/net/unix
-  //   Num       RefCount Protocol Flags    Type St Inode Path
-  //   ...
-  //   ffff8fc2d4492640: 00000003 00000000 00000000 0001 03 8637583
-  //   /run/arene/share/capnp.appmng.sock
-  //
-  std::string uds_path = std::string("/proc/") + std::to_string(pid) + "/net/unix";
-  std::ifstream uds_file(uds_path);
-  KJ_REQUIRE(uds_file.is_open());
+bool RpcTracer::CheckAddress(int fd) {
+  if (addresses_.count(fd) == 0) {
+    addresses_.emplace(fd, GetUnixSocketAddress(pid_, fd));
+    KJ_LOG(INFO, addresses_[fd]);
+  }
+  return std::regex_match(addresses_[fd], target_address_);
+}
 
+// Thread group ID (i.e. PID) of `tid`, or -1 if it has gone
+static pid_t GetThreadGroupId(pid_t tid) {
+  std::ifstream status("/proc/" + std::to_string(tid) + "/status");
   std::string line;
-  std::regex re(".* " + std::to_string(inode) + R"( ([^ ]+))");
-  std::smatch m;
-  while (std::getline(uds_file, line)) {
-    if (std::regex_match(line, m, re)) {
-      return m[1].str();
+  while (std::getline(status, line)) {
+    if (line.compare(0, 5, "Tgid:") == 0) {
+      return static_cast<pid_t>(std::stol(line.substr(5)));
     }
   }
+  return -1;
+}
 
-  return "";
+bool RpcTracer::IsThreadOfTracedProcess(pid_t tid) {
+  auto it = is_traced_threads_.find(tid);
+  if (it == is_traced_threads_.end()) {
+    it = is_traced_threads_.emplace(tid, GetThreadGroupId(tid) == pid_).first;
+  }
+  return it->second;
 }
 
-bool RpcTracer::CheckAddress(int fd) {
-  if (addresses_.count(fd) == 0) {
-    addresses_.emplace(fd, GetPathFromFd(pid_, fd));
-    KJ_LOG(INFO, addresses_[fd]);
+void RpcTracer::Feed(pid_t tid, StreamInfo::Direction direction, int fd, char* buf, size_t len) {
+  const auto timestamp = GetMonotonicMicroSec();
+  if (pipeline_) {
+    pipeline_->Reassemble(pid_, tid, direction, fd, addresses_[fd], buf, len, timestamp);
+  } else {
+    reassemblers_.Reassemble(pid_, tid, direction, fd, addresses_[fd], buf, len, timestamp);
   }
-  return std::regex_match(addresses_[fd], target_address_);
+}
+
+void RpcTracer::CloseStream(int fd) {
+  if (pipeline_) {
+    pipeline_->Close(pid_, fd);
+  } else {
+    reassemblers_.Close(pid_, fd);
+  }
+}
+
+void RpcTracer::DiscardStream(StreamInfo::Direction direction, int fd) {
+  if (pipeline_) {
+    pipeline_->Discard(pid_, fd, direction);
+  } else {
+    reassemblers_.Discard(pid_, fd, direction);
+  }
+}
+
+void RpcTracer::FeedRemote(pid_t tid, StreamInfo::Direction direction, int fd,
+                           kj::ArrayPtr<char> data, size_t size) {
+  if (data.size() < size) {
+    // Following data starts in the middle of a message, so it is dropped until close(2)
+    KJ_LOG(WARNING, "failed to read tracee memory. Discard the stream.", tid, fd, data.size(),
+           size);
+    DiscardStream(direction, fd);
+    return;
+  }
+  Feed(tid, direction, fd, data.begin(), data.size());
 }
 
 void RpcTracer::HandleLeaveConnect(pid_t tid, int fd, uint64_t addr, uint64_t size, int rc) {
@@ -88,19 +118,23 @@ void RpcTracer::HandleLeaveConnect(pid_t tid, int fd, uint64_t addr, uint64_t si
     return;
   }
 
-  std::vector<char> buf(size);
-  ReadProcessMemory(tid, addr, size, buf.data());
-  const struct sockaddr* saddr = reinterpret_cast<const struct sockaddr*>(buf.data());
+  auto buf = reader_.Read(tid, addr, size);
+  if (buf.size() <= offsetof(struct sockaddr_un, sun_path)) {
+    return;
+  }
+  const struct sockaddr* saddr = reinterpret_cast<const struct sockaddr*>(buf.begin());
   if (saddr->sa_family != AF_UNIX) {
     return;
   }
   const struct sockaddr_un* saddr_un = reinterpret_cast<const struct sockaddr_un*>(saddr);
-  KJ_LOG(INFO, saddr_un->sun_path);
+  const size_t path_size = buf.size() - offsetof(struct sockaddr_un, sun_path);
+  std::string path = FormatUnixSocketPath(saddr_un->sun_path, path_size);
+  KJ_LOG(INFO, path);
 
-  addresses_.emplace(fd, saddr_un->sun_path);
+  addresses_.emplace(fd, kj::mv(path));
 }
 
-void RpcTracer::HandleLeaveWrite(pid_t tid, int fd, uint64_t addr, uint64_t count, int rc) {
+void RpcTracer::HandleLeaveWrite(pid_t tid, int fd, uint64_t addr, int rc) {
   if (rc < 0) {
     KJ_LOG(INFO, "failed write", rc);
     return;
@@ -110,29 +144,8 @@ void RpcTracer::HandleLeaveWrite(pid_t tid, int fd, uint64_t addr, uint64_t coun
     return;
   }
 
-  if (reassemblers_out_.count(fd) == 0) {
-    const StreamInfo stream_info(pid_, tid, StreamInfo::Direction::kOut, fd, addresses_[fd]);
-    RpcMessageReassembler reassembler(handler_, stream_info);
-    if (dump_dir_) {
-      reassembler.SetDumpFile(dump_dir_->appendFile(
-          kj::Path::parse(kj::str("capnp_trace.", fd, ".out.dump")),
-          kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT));
-    }
-    reassemblers_out_.emplace(fd, kj::mv(reassembler));
-  }
-
-  std::vector<char> buf(count);
-  ReadProcessMemory(tid, addr, count, buf.data());
-
-#if 0
-  for (int i = 0; i < count; i += 8) {
-    fprintf(stdout, "write(%d): %02x %02x %02x %02x %02x %02x %02x %02x, %lld\n", fd, buf[i + 0],
-            buf[i + 1], buf[i + 2], buf[i + 3], buf[i + 4], buf[i + 5], buf[i + 6], buf[i + 7],
-            count);
-  }
-#endif
-
-  reassemblers_out_.at(fd).Reassemble(buf.data(), count);
+  // Only `rc` bytes have been written, not the whole buffer
+  FeedRemote(tid, StreamInfo::Direction::kOut, fd, reader_.Read(tid, addr, rc), rc);
 }
 
 void RpcTracer::HandleLeaveWritev(pid_t tid, int fd, uint64_t iov_addr, uint64_t iov_count,
@@ -146,38 +159,12 @@ void RpcTracer::HandleLeaveWritev(pid_t tid, int fd, uint64_t iov_addr, uint64_t
     return;
   }
 
-  if (reassemblers_out_.count(fd) == 0) {
-    const StreamInfo stream_info(pid_, tid, StreamInfo::Direction::kOut, fd, addresses_[fd]);
-    RpcMessageReassembler reassembler(handler_, stream_info);
-    if (dump_dir_) {
-      reassembler.SetDumpFile(dump_dir_->appendFile(
-          kj::Path::parse(kj::str("capnp_trace.", fd, ".out.dump")),
-          kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT));
-    }
-    reassemblers_out_.emplace(fd, kj::mv(reassembler));
-  }
-
-  struct iovec* iov = reinterpret_cast<struct iovec*>(alloca(sizeof(struct iovec) * iov_count));
-
-  ReadProcessMemory(tid, iov_addr, sizeof(struct iovec) * iov_count, reinterpret_cast<char*>(iov));
-  for (auto i = 0U; i < iov_count; i++) {
-    std::vector<char> buf(iov[i].iov_len);
-    ReadProcessMemory(tid, reinterpret_cast<uint64_t>(iov[i].iov_base), iov[i].iov_len, buf.data());
-
-#if 0
-    for (int j = 0; j < iov[i].iov_len; j += 8) {
-      fprintf(stdout, "writev(%d): %02x %02x %02x %02x %02x %02x %02x %02x, %ld\n", fd, buf[j + 0],
-              buf[j + 1], buf[j + 2], buf[j + 3], buf[j + 4], buf[j + 5], buf[j + 6], buf[j + 7],
-              iov[i].iov_len);
-    }
-#endif
-
-    reassemblers_out_.at(fd).Reassemble(buf.data(), iov[i].iov_len);
-  }
+  FeedRemote(tid, StreamInfo::Direction::kOut, fd, reader_.ReadIovec(tid, iov_addr, iov_count, rc),
+             rc);
 }
 
 // read(2) and recvfrom(2) have same arguments until argv[2]
-void RpcTracer::HandleLeaveReadRecvfrom(pid_t tid, int fd, uint64_t addr, uint64_t count, int rc) {
+void RpcTracer::HandleLeaveReadRecvfrom(pid_t tid, int fd, uint64_t addr, int rc) {
   if (rc < 0) {
     KJ_LOG(INFO, "failed read/recvfrom");
     return;
@@ -187,29 +174,8 @@ void RpcTracer::HandleLeaveReadRecvfrom(pid_t tid, int fd, uint64_t addr, uint64
     return;
   }
 
-  if (reassemblers_in_.count(fd) == 0) {
-    const StreamInfo stream_info(pid_, tid, StreamInfo::Direction::kIn, fd, addresses_[fd]);
-    RpcMessageReassembler reassembler(handler_, stream_info);
-    if (dump_dir_) {
-      reassembler.SetDumpFile(dump_dir_->appendFile(
-          kj::Path::parse(kj::str("capnp_trace.", fd, ".in.dump")),
-          kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT));
-    }
-    reassemblers_in_.emplace(fd, kj::mv(reassembler));
-  }
-
-  std::vector<char> buf(count);
-  ReadProcessMemory(tid, addr, count, buf.data());
-
-#if 0
-  for (int i = 0; i < count; i += 8) {
-    fprintf(stdout, "read(%d): %02x %02x %02x %02x %02x %02x %02x %02x, %lld\n", fd, buf[i + 0],
-            buf[i + 1], buf[i + 2], buf[i + 3], buf[i + 4], buf[i + 5], buf[i + 6], buf[i + 7],
-            count);
-  }
-#endif
-
-  reassemblers_in_.at(fd).Reassemble(buf.data(), count);
+  // Only `rc` bytes have been filled, not the whole buffer
+  FeedRemote(tid, StreamInfo::Direction::kIn, fd, reader_.Read(tid, addr, rc), rc);
 }
 
 void RpcTracer::HandleLeaveReadv(pid_t tid, int fd, uint64_t iov_addr, uint64_t iov_count, int rc) {
@@ -222,26 +188,8 @@ void RpcTracer::HandleLeaveReadv(pid_t tid, int fd, uint64_t iov_addr, uint64_t
     return;
   }
 
-  if (reassemblers_in_.count(fd) == 0) {
-    const StreamInfo stream_info(pid_, tid, StreamInfo::Direction::kIn, fd, addresses_[fd]);
-    RpcMessageReassembler reassembler(handler_, stream_info);
-    if (dump_dir_) {
-      reassembler.SetDumpFile(dump_dir_->appendFile(
-          kj::Path::parse(kj::str("capnp_trace.", fd, ".in.dump")),
-          kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT));
-    }
-    reassemblers_in_.emplace(fd, kj::mv(reassembler));
-  }
-
-  struct iovec* iov = reinterpret_cast<struct iovec*>(alloca(sizeof(struct iovec) * iov_count));
-
-  ReadProcessMemory(tid, iov_addr, sizeof(struct iovec) * iov_count, reinterpret_cast<char*>(iov));
-  for (auto i = 0U; i < iov_count; i++) {
-    std::vector<char> buf(iov[i].iov_len);
-    ReadProcessMemory(tid, (uint64_t)iov[i].iov_base, iov[i].iov_len, buf.data());
-
-    reassemblers_in_.at(fd).Reassemble(buf.data(), iov[i].iov_len);
-  }
+  FeedRemote(tid, StreamInfo::Direction::kIn, fd, reader_.ReadIovec(tid, iov_addr, iov_count, rc),
+             rc);
 }
 
 void RpcTracer::HandleLeaveClose([[maybe_unused]] pid_t tid, int fd, int rc) {
@@ -250,8 +198,7 @@ void RpcTracer::HandleLeaveClose([[maybe_unused]] pid_t tid, int fd, int rc) {
     return;
   }
 
-  reassemblers_in_.erase(fd);
-  reassemblers_out_.erase(fd);
+  CloseStream(fd);
   addresses_.erase(fd);
 }
 
@@ -262,16 +209,16 @@ void RpcTracer::DispatchSyscallHandler(pid_t tid, uint64_t syscall, bool is_ente
     HandleLeaveConnect(tid, static_cast<int>(arg0), arg1, arg2, static_cast<int>(rc));
   } else if (syscall == SYS_read && !is_enter) {
     // for Cap'n Proto C++
-    HandleLeaveReadRecvfrom(tid, static_cast<int>(arg0), arg1, arg2, static_cast<int>(rc));
+    HandleLeaveReadRecvfrom(tid, static_cast<int>(arg0), arg1, static_cast<int>(rc));
   } else if (syscall == SYS_writev && !is_enter) {
     // for Cap'n Proto C++
     HandleLeaveWritev(tid, static_cast<int>(arg0), arg1, arg2, static_cast<int>(rc));
   } else if (syscall == SYS_recvfrom && !is_enter) {
     // for Cap'n Proto Rust
-    HandleLeaveReadRecvfrom(tid, static_cast<int>(arg0), arg1, arg2, static_cast<int>(rc));
+    HandleLeaveReadRecvfrom(tid, static_cast<int>(arg0), arg1, static_cast<int>(rc));
   } else if (syscall == SYS_write && !is_enter) {
     // for Cap'n Proto Rust
-    HandleLeaveWrite(tid, static_cast<int>(arg0), arg1, arg2, static_cast<int>(rc));
+    HandleLeaveWrite(tid, static_cast<int>(arg0), arg1, static_cast<int>(rc));
   } else if (syscall == SYS_readv && !is_enter) {
     HandleLeaveReadv(tid, static_cast<int>(arg0), arg1, arg2, static_cast<int>(rc));
   } else if (syscall == SYS_close && !is_enter) {
@@ -280,28 +227,105 @@ void RpcTracer::DispatchSyscallHandler(pid_t tid, uint64_t syscall, bool is_ente
 }
 
 RpcTracer& RpcTracer::SetDumpDir(kj::Own<const kj::Directory> dump_dir) {
-  this->dump_dir_ = kj::mv(dump_dir);
+  dump_dir_ = kj::mv(dump_dir);
   return *this;
 }
 
+RpcTracer& RpcTracer::SetSeccomp(bool is_seccomp) {
+  this->is_seccomp_ = is_seccomp;
+  return *this;
+}
+
+RpcTracer& RpcTracer::SetPipeline(bool is_pipeline) {
+  this->is_pipeline_ = is_pipeline;
+  return *this;
+}
+
+void RpcTracer::InstallSeccompFilter() {
+  const auto syscall_num = sizeof(kTracedSyscalls) / sizeof(kTracedSyscalls[0]);
+  std::vector<struct sock_filter> filter;
+
+  // Allow syscalls of foreign architecture as is because syscall numbers are different
+  filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)));
+  filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kAuditArch, 1, 0));
+  filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+
+  // Jump to SECCOMP_RET_TRACE (the last instruction) if syscall is traced
+  filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)));
+  for (auto i = 0U; i < syscall_num; i++) {
+    const auto jump_to_trace = static_cast<uint8_t>(syscall_num - i);
+    filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kTracedSyscalls[i], jump_to_trace, 0));
+  }
+  filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+  filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE));
+
+  struct sock_fprog prog;
+  prog.len    = static_cast<uint16_t>(filter.size());
+  prog.filter = filter.data();
+
+  // PR_SET_NO_NEW_PRIVS is required to install seccomp filter without CAP_SYS_ADMIN
+  KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+  KJ_SYSCALL(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog));
+}
+
 void RpcTracer::Trace() {
+  if (is_pipeline_) {
+    pipeline_ = kj::heap<RpcPipeline>(handler_);
+    if (dump_dir_) {
+      pipeline_->SetDumpDir(kj::mv(dump_dir_));
+    }
+  } else if (dump_dir_) {
+    reassemblers_.SetDumpDir(kj::mv(dump_dir_));
+  }
+
+  // Stops are timed only with --metrics, which is enabled before tracing starts
+  auto metrics = TracerMetrics::GetIfEnabled();
+
 #if defined(__aarch64__)
   // Map for thread ID -> arg0
   std::unordered_map<pid_t, uint64_t> arg0s;
 #endif
 
-  while (1) {
+  while (!TerminationSignal::IsRaised()) {
     int status{-1};
     pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ECHILD) {
+        KJ_LOG(INFO, "all tracees exited");
+        return;
+      }
+      KJ_FAIL_SYSCALL("waitpid", errno);
+    }
+    // The tracee is stopped until it is resumed at the end of this loop
+    const uint64_t stop_time = metrics ? GetMonotonicNanoSec() : 0;
+    uint64_t stopped_syscall = ~uint64_t(0);
+
+    // In seccomp mode, tracees run freely until the next seccomp stop
+    enum __ptrace_request resume_request = is_seccomp_ ? PTRACE_CONT : PTRACE_SYSCALL;
+    // Signal which is delivered to the tracee on resuming, 0 to suppress. It is long because
+    // ptrace(2) reads the data argument as a pointer.
+    long resume_signal = 0;
     if (WIFEXITED(status)) {
       KJ_LOG(INFO, tid, "exited", WEXITSTATUS(status));
+      is_traced_threads_.erase(tid);
       continue;
     } else if (WIFSIGNALED(status)) {
       KJ_LOG(WARNING, "terminated by signal", WTERMSIG(status));
+      is_traced_threads_.erase(tid);
+      continue;
     } else if (WIFSTOPPED(status)) {
       struct __ptrace_syscall_info syscall_info;
       KJ_SYSCALL(ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(syscall_info), &syscall_info));
-      bool is_enter = syscall_info.op == PTRACE_SYSCALL_INFO_ENTRY;
+      // seccomp stop is reported instead of syscall-enter-stop in seccomp mode
+      bool is_enter = syscall_info.op == PTRACE_SYSCALL_INFO_ENTRY ||
+                      syscall_info.op == PTRACE_SYSCALL_INFO_SECCOMP;
+      if (is_seccomp_ && syscall_info.op == PTRACE_SYSCALL_INFO_SECCOMP) {
+        // Stop again when leaving this syscall
+        resume_request = PTRACE_SYSCALL;
+      }
 
 #if defined(__aarch64__)
       struct user_regs_struct regs;
@@ -333,10 +357,26 @@ void RpcTracer::Trace() {
       uint64_t arg2    = regs.rdx;
 #endif
 
-      DispatchSyscallHandler(tid, syscall, is_enter, arg0, arg1, arg2, rc);
+      if (syscall_info.op != PTRACE_SYSCALL_INFO_NONE) {
+        stopped_syscall = syscall;
+        if (IsThreadOfTracedProcess(tid)) {
+          DispatchSyscallHandler(tid, syscall, is_enter, arg0, arg1, arg2, rc);
+        }
+      } else if ((status >> 16) == 0) {
+        // Signal-delivery-stop, whose signal must be passed on or the tracee never receives it.
+        // SIGSTOP of attaching and new threads, and SIGTRAP after execve(2) are caused by
+        // tracing, so that they are suppressed.
+        const int signal = WSTOPSIG(status);
+        if (signal != SIGSTOP && signal != SIGTRAP) {
+          resume_signal = signal;
+        }
+      }
     }
 
-    KJ_SYSCALL(ptrace(PTRACE_SYSCALL, tid, nullptr, nullptr));
+    if (metrics) {
+      metrics->AddStop(stopped_syscall, GetMonotonicNanoSec() - stop_time);
+    }
+    KJ_SYSCALL(ptrace(resume_request, tid, nullptr, resume_signal));
   }
 }
 }  // namespace capnp_trace
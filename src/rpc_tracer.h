@@ -11,13 +11,21 @@
 #include <unordered_map>
 #include <vector>
 
+#include "remote_memory_reader.h"
 #include "rpc_message_reassembler.h"
+#include "rpc_pipeline.h"
+#include "rpc_stream_reassemblers.h"
 
 namespace capnp_trace {
 class RpcTracer final {
  public:
   RpcTracer(pid_t pid, kj::StringPtr address, RpcMessageHandler handler)
-      : pid_(pid), target_address_(address.cStr()), handler_(handler) {}
+      : pid_(pid),
+        target_address_(address.cStr()),
+        is_seccomp_(false),
+        is_pipeline_(false),
+        handler_(handler),
+        reassemblers_(handler) {}
   RpcTracer(const RpcTracer&)            = delete;
   RpcTracer& operator=(const RpcTracer&) = delete;
   RpcTracer(RpcTracer&&)                 = delete;
@@ -28,18 +36,39 @@ class RpcTracer final {
   /// @param dump_dir Directory where the dump data will be stored
   RpcTracer& SetDumpDir(kj::Own<const kj::Directory> dump_dir);
 
+  /// @brief Stop tracees only at syscalls which are handled by RpcTracer
+  /// @param is_seccomp Tracees have the filter installed by InstallSeccompFilter() and are traced
+  /// with PTRACE_O_TRACESECCOMP
+  RpcTracer& SetSeccomp(bool is_seccomp);
+
+  /// @brief Install seccomp-BPF filter which returns SECCOMP_RET_TRACE only for traced syscalls
+  /// @details This must be called in the tracee itself, e.g. in the forked child before execvp.
+  static void InstallSeccompFilter();
+
+  /// @brief Reassemble and output messages on worker threads instead of the tracing thread
+  /// @param is_pipeline Tracees are resumed right after captured data is copied into RpcPipeline.
+  /// RpcMessageHandler is called on the output thread.
+  RpcTracer& SetPipeline(bool is_pipeline);
+
   /// @brief Start Cap'n Proto RPC tracing
-  /// @details This method does not return
+  /// @details This method returns after all tracees exited or TerminationSignal is raised.
+  /// Syscalls of traced child processes (e.g. by PTRACE_O_TRACEFORK) are not captured.
   void Trace();
 
  private:
   bool CheckAddress(int fd);
+  bool IsThreadOfTracedProcess(pid_t tid);
   void HandleLeaveConnect(pid_t tid, int fd, uint64_t addr, uint64_t size, int rc);
-  void HandleLeaveWrite(pid_t tid, int fd, uint64_t addr, uint64_t count, int rc);
+  void HandleLeaveWrite(pid_t tid, int fd, uint64_t addr, int rc);
   void HandleLeaveWritev(pid_t tid, int fd, uint64_t iov_addr, uint64_t iov_count, int rc);
-  void HandleLeaveReadRecvfrom(pid_t tid, int fd, uint64_t addr, uint64_t count, int rc);
+  void HandleLeaveReadRecvfrom(pid_t tid, int fd, uint64_t addr, int rc);
   void HandleLeaveReadv(pid_t tid, int fd, uint64_t iov_addr, uint64_t iov_count, int rc);
   void HandleLeaveClose(pid_t tid, int fd, int rc);
+  void Feed(pid_t tid, StreamInfo::Direction direction, int fd, char* buf, size_t len);
+  void FeedRemote(pid_t tid, StreamInfo::Direction direction, int fd, kj::ArrayPtr<char> data,
+                  size_t size);
+  void CloseStream(int fd);
+  void DiscardStream(StreamInfo::Direction direction, int fd);
   void DispatchSyscallHandler(pid_t tid, uint64_t syscall, bool is_enter, uint64_t arg0,
                               uint64_t arg1, uint64_t arg2, uint64_t rc);
 
@@ -49,19 +78,32 @@ class RpcTracer final {
   // server address to be traced
   std::regex target_address_;
 
+  // Whether tracees stop only at seccomp events instead of every syscall
+  bool is_seccomp_;
+
+  // Whether captured data is handed over to pipeline_
+  bool is_pipeline_;
+
   // Callback function to be called when read/write Cap'n Proto RPC messages
   RpcMessageHandler handler_;
 
-  // server address to be traced
+  // Directory where raw data is dumped, which is passed to reassemblers_ or pipeline_
   kj::Own<const kj::Directory> dump_dir_;
 
+  // Map for thread ID -> whether it belongs to pid_. Child processes are traced only to let
+  // their syscalls pass the inherited seccomp filter, and their fds are not of pid_.
+  std::unordered_map<pid_t, bool> is_traced_threads_;
+
   // Map for fd -> server address
   std::unordered_map<int, std::string> addresses_;
 
-  // Map for fd -> incoming message RpcMessageReassembler
-  std::unordered_map<int, RpcMessageReassembler> reassemblers_in_;
+  // Reader of tracee memory which reuses its buffer
+  RemoteMemoryReader reader_;
+
+  // Reassemblers for each fd and direction, which are used without pipeline
+  RpcStreamReassemblers reassemblers_;
 
-  // Map for fd -> outgoing message RpcMessageReassembler
-  std::unordered_map<int, RpcMessageReassembler> reassemblers_out_;
+  // Worker threads which are created by Trace() if is_pipeline_
+  kj::Own<RpcPipeline> pipeline_;
 };
 }  // namespace capnp_trace
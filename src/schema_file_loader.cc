@@ -0,0 +1,44 @@
+#include "schema_file_loader.h"
+
+#include <kj/debug.h>
+
+#include "reader_options.h"
+
+namespace capnp_trace {
+
+size_t SchemaFileLoader::AddFile(kj::Own<const kj::ReadableFile>&& file) {
+  const auto options = GetUnlimitedReaderOptions();
+
+  const size_t size = file->stat().size;
+  KJ_REQUIRE(size % sizeof(capnp::word) == 0, "compiled schema file is truncated", size);
+  // mmap() returns page-aligned memory, so messages can be read in place
+  auto mapping = file->mmap(0, size);
+  auto words   = kj::arrayPtr(reinterpret_cast<const capnp::word*>(mapping.begin()),
+                              size / sizeof(capnp::word));
+
+  size_t count = 0;
+  while (words.size() > 0) {
+    auto reader  = kj::heap<capnp::FlatArrayMessageReader>(words, options);
+    auto request = reader->getRoot<capnp::schema::CodeGeneratorRequest>();
+    for (auto node : request.getNodes()) {
+      // The first file wins like SchemaLoader::loadOnce()
+      count += nodes_.emplace(node.getId(), node).second ? 1 : 0;
+    }
+    words = kj::arrayPtr(reader->getEnd(), words.end());
+    readers_.add(kj::mv(reader));
+  }
+  mappings_.add(kj::mv(mapping));
+  return count;
+}
+
+bool SchemaFileLoader::Load(const capnp::SchemaLoader& loader, uint64_t id) const {
+  auto it = nodes_.find(id);
+  if (it == nodes_.end()) {
+    return false;
+  }
+  KJ_LOG(INFO, "load schema lazily", it->second.getDisplayName());
+  loader.loadOnce(it->second);
+  return true;
+}
+
+}  // namespace capnp_trace
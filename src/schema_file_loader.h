@@ -0,0 +1,46 @@
+#pragma once
+
+#include <capnp/schema-loader.h>
+#include <capnp/schema.capnp.h>
+#include <capnp/serialize.h>
+#include <kj/array.h>
+#include <kj/filesystem.h>
+#include <kj/vector.h>
+#include <stdint.h>
+
+#include <unordered_map>
+
+namespace capnp_trace {
+
+/// @brief Lazy loader of schemas from compiled schema files
+/// @details A compiled schema file is a serialized CodeGeneratorRequest, e.g. the output of
+/// `capnp compile -o- foo.capnp`. Files are mapped into memory and their nodes are only indexed by
+/// ID, so that a node is loaded into SchemaLoader the first time its ID is requested. Load() is
+/// called by the LazyLoadCallback of the SchemaLoader. Files must be added before the SchemaLoader
+/// is used by multiple threads.
+class SchemaFileLoader final {
+ public:
+  SchemaFileLoader()                                   = default;
+  SchemaFileLoader(const SchemaFileLoader&)            = delete;
+  SchemaFileLoader& operator=(const SchemaFileLoader&) = delete;
+  SchemaFileLoader(SchemaFileLoader&&)                 = delete;
+  SchemaFileLoader& operator=(SchemaFileLoader&&)      = delete;
+
+  /// @brief Index nodes of `file`, which may contain concatenated CodeGeneratorRequests
+  /// @return Number of indexed nodes
+  size_t AddFile(kj::Own<const kj::ReadableFile>&& file);
+
+  /// @brief Load the node of `id` into `loader` if it is in added files
+  /// @return false if the node is not found
+  bool Load(const capnp::SchemaLoader& loader, uint64_t id) const;
+
+  size_t size() const { return nodes_.size(); }
+
+ private:
+  // Nodes point into mapped files, which are kept with their readers
+  kj::Vector<kj::Array<const kj::byte>> mappings_;
+  kj::Vector<kj::Own<capnp::FlatArrayMessageReader>> readers_;
+  std::unordered_map<uint64_t, capnp::schema::Node::Reader> nodes_;
+};
+
+}  // namespace capnp_trace
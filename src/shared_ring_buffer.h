@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+namespace capnp_trace {
+
+/// @brief Lock-free multi-producer single-consumer ring buffer on shared memory
+/// @details Producers reserve space by CAS on `head` and publish a record by storing its size
+/// into the first word of the record at last. The consumer zero-clears consumed space before
+/// releasing it, so that a record which is not published yet always reads as 0.
+/// The consumer cannot skip a reserved record before it is published because its size is not
+/// known yet, so a producer which dies between reserving and publishing stalls all records after
+/// it. IsEmpty() lets the consumer detect it.
+/// This header must not depend on kj because it is also built into the preload library.
+class SharedRingBuffer final {
+ public:
+  enum Type : uint32_t {
+    kIn = 1,
+    kOut,
+    kOpen,   // payload is server address of fd
+    kClose,  // no payload
+
+    // Flag of `Record::type`, which tells that data of the same fd and direction was dropped
+    // before the record because the buffer was full
+    kGapFlag = 1U << 31,
+  };
+
+  struct Record {
+    int32_t pid;
+    int32_t tid;
+    int32_t fd;
+    uint32_t type;
+    uint64_t length;
+    uint64_t timestamp;  // CLOCK_MONOTONIC in microseconds
+  };
+
+  /// @brief Size of shared memory region
+  /// @param capacity size of data area in bytes, which must be power of 2
+  static size_t GetRegionSize(size_t capacity) { return sizeof(Header) + capacity; }
+
+  /// @param region zero-filled shared memory region
+  /// @param region_size size of `region` in bytes, which is returned by GetRegionSize()
+  SharedRingBuffer(void* region, size_t region_size)
+      : header_(static_cast<Header*>(region)),
+        data_(static_cast<uint8_t*>(region) + sizeof(Header)),
+        capacity_(region_size > sizeof(Header) ? region_size - sizeof(Header) : 0),
+        mask_(capacity_ - 1) {}
+  ~SharedRingBuffer()                                  = default;
+  SharedRingBuffer(const SharedRingBuffer&)            = default;
+  SharedRingBuffer& operator=(const SharedRingBuffer&) = default;
+
+  bool IsValid() const {
+    return capacity_ >= kMinCapacity && (capacity_ & mask_) == 0;
+  }
+
+  /// @brief Push `record.length` bytes gathered from `iov`
+  /// @details Large data is divided into several records.
+  /// @return false if the buffer is full and (a part of) data is dropped
+  bool Push(const Record& record, const struct iovec* iov, int iovcnt) {
+    const uint64_t max_chunk_size = capacity_ / 4 - kRecordHeaderSize;
+    uint64_t remaining            = record.length;
+    int iov_index                 = 0;
+    size_t iov_offset             = 0;
+
+    do {
+      Record chunk_record = record;
+      chunk_record.length = remaining < max_chunk_size ? remaining : max_chunk_size;
+
+      uint64_t pos;
+      const uint64_t size = kRecordHeaderSize + ((chunk_record.length + 7) & ~7ULL);
+      if (!Reserve(size, &pos)) {
+        __atomic_add_fetch(&header_->dropped, remaining, __ATOMIC_RELAXED);
+        return false;
+      }
+
+      uint8_t* dst = data_ + (pos & mask_);
+      memcpy(dst + sizeof(uint64_t), &chunk_record, sizeof(chunk_record));
+      dst += kRecordHeaderSize;
+      for (uint64_t copied = 0; copied < chunk_record.length && iov_index < iovcnt;) {
+        const auto* src   = static_cast<const uint8_t*>(iov[iov_index].iov_base) + iov_offset;
+        uint64_t copy_len = iov[iov_index].iov_len - iov_offset;
+        if (copy_len > chunk_record.length - copied) {
+          copy_len = chunk_record.length - copied;
+        }
+        memcpy(dst + copied, src, copy_len);
+        copied += copy_len;
+        iov_offset += copy_len;
+        if (iov_offset == iov[iov_index].iov_len) {
+          iov_index++;
+          iov_offset = 0;
+        }
+      }
+
+      Publish(pos, size);
+      remaining -= chunk_record.length;
+    } while (remaining > 0);
+
+    return true;
+  }
+
+  /// @brief Consume all published records
+  /// @param func callback as `void(const Record& record, char* payload)`.
+  ///             `payload` is valid until the callback returns.
+  /// @return number of consumed records
+  template <typename Func>
+  size_t Consume(Func&& func) {
+    size_t count        = 0;
+    uint64_t tail       = __atomic_load_n(&header_->tail, __ATOMIC_RELAXED);
+    const uint64_t head = __atomic_load_n(&header_->head, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+      uint8_t* pos = data_ + (tail & mask_);
+      const uint64_t commit =
+          __atomic_load_n(reinterpret_cast<uint64_t*>(pos), __ATOMIC_ACQUIRE);
+      if (commit == 0) {
+        // Reserved but not published yet
+        break;
+      }
+
+      const uint64_t size = commit & ~kPaddingFlag;
+      if ((commit & kPaddingFlag) == 0) {
+        Record record;
+        memcpy(&record, pos + sizeof(uint64_t), sizeof(record));
+        func(static_cast<const Record&>(record), reinterpret_cast<char*>(pos + kRecordHeaderSize));
+        count++;
+      }
+
+      memset(pos, 0, size);
+      tail += size;
+      __atomic_store_n(&header_->tail, tail, __ATOMIC_RELEASE);
+    }
+    return count;
+  }
+
+  /// @brief Whether all reserved records are consumed
+  bool IsEmpty() const {
+    return __atomic_load_n(&header_->head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&header_->tail, __ATOMIC_ACQUIRE);
+  }
+
+  /// @brief Total bytes which producers dropped because the buffer was full
+  uint64_t GetDroppedBytes() const { return __atomic_load_n(&header_->dropped, __ATOMIC_RELAXED); }
+
+ private:
+  struct Header {
+    alignas(64) uint64_t head;
+    alignas(64) uint64_t tail;
+    alignas(64) uint64_t dropped;
+  };
+
+  static const uint64_t kPaddingFlag      = 1ULL << 63;
+  static const uint64_t kRecordHeaderSize = sizeof(uint64_t) + sizeof(Record);
+  static const uint64_t kMinCapacity      = 4096;
+
+  bool Reserve(uint64_t size, uint64_t* pos) {
+    uint64_t head = __atomic_load_n(&header_->head, __ATOMIC_RELAXED);
+    uint64_t padding;
+    do {
+      // Records never wrap around, so fill the rest of the data area with padding
+      const uint64_t contiguous = capacity_ - (head & mask_);
+      padding                   = size > contiguous ? contiguous : 0;
+      const uint64_t tail       = __atomic_load_n(&header_->tail, __ATOMIC_ACQUIRE);
+      if (head + padding + size - tail > capacity_) {
+        return false;
+      }
+    } while (!__atomic_compare_exchange_n(&header_->head, &head, head + padding + size, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (padding) {
+      Publish(head, padding | kPaddingFlag);
+    }
+    *pos = head + padding;
+    return true;
+  }
+
+  void Publish(uint64_t pos, uint64_t commit) {
+    __atomic_store_n(reinterpret_cast<uint64_t*>(data_ + (pos & mask_)), commit, __ATOMIC_RELEASE);
+  }
+
+  Header* header_;
+  uint8_t* data_;
+  uint64_t capacity_;
+  uint64_t mask_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace capnp_trace {
+
+/// @brief Bounded lock-free single-producer single-consumer queue
+/// @details Exactly one thread may call TryPush()/Push() and exactly one other thread may call
+/// TryPop()/Pop(). Blocking variants spin for a while and then sleep, so that an idle consumer
+/// doesn't burn CPU and a busy one doesn't pay for futex wake-ups.
+template <typename T>
+class SpscQueue final {
+ public:
+  /// @param capacity maximum number of elements, which is rounded up to power of 2
+  explicit SpscQueue(size_t capacity)
+      : slots_(RoundUpPowerOf2(capacity)),
+        mask_(slots_.size() - 1),
+        head_(0),
+        tail_(0),
+        closed_(false) {}
+  ~SpscQueue()                           = default;
+  SpscQueue(const SpscQueue&)            = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+  SpscQueue(SpscQueue&&)                 = delete;
+  SpscQueue& operator=(SpscQueue&&)      = delete;
+
+  /// @return false if the queue is full. `value` is not moved in that case.
+  bool TryPush(T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+    slots_[head & mask_] = std::move(value);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief Push `value`, waiting for the consumer while the queue is full
+  void Push(T value) {
+    for (unsigned int retry = 0; !TryPush(value); retry++) {
+      Backoff(retry);
+    }
+  }
+
+  /// @return false if the queue is empty
+  bool TryPop(T& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value                = std::move(slots_[tail & mask_]);
+    slots_[tail & mask_] = T();
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief Pop an element, waiting for the producer while the queue is empty
+  /// @return false if the queue is closed and all elements have been popped
+  bool Pop(T& value) {
+    for (unsigned int retry = 0; !TryPop(value); retry++) {
+      if (closed_.load(std::memory_order_acquire)) {
+        // Elements pushed before Close() must not be lost
+        return TryPop(value);
+      }
+      Backoff(retry);
+    }
+    return true;
+  }
+
+  /// @brief Tell the consumer that no more elements will be pushed
+  void Close() { closed_.store(true, std::memory_order_release); }
+
+ private:
+  static size_t RoundUpPowerOf2(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  static void Backoff(unsigned int retry) {
+    static const unsigned int kSpinCount = 64;
+    if (retry < kSpinCount) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  std::vector<T> slots_;
+  const size_t mask_;
+
+  // Written only by the producer and the consumer respectively
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  alignas(64) std::atomic<bool> closed_;
+};
+
+}  // namespace capnp_trace
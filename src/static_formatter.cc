@@ -0,0 +1,115 @@
+#include "static_formatter.h"
+
+#include <unordered_map>
+
+namespace capnp_trace {
+
+// Registered before main() and only read after that
+static std::unordered_map<uint64_t, StaticFormatter>& GetStaticFormatters() {
+  static std::unordered_map<uint64_t, StaticFormatter> formatters;
+  return formatters;
+}
+
+StaticFormatterRegistration::StaticFormatterRegistration(uint64_t struct_id,
+                                                         StaticFormatter formatter) {
+  GetStaticFormatters().emplace(struct_id, formatter);
+}
+
+kj::Maybe<StaticFormatter> FindStaticFormatter(uint64_t struct_id) {
+  auto& formatters = GetStaticFormatters();
+  auto it          = formatters.find(struct_id);
+  if (it == formatters.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+void AppendBool(std::string& output, bool value) { output += value ? "true" : "false"; }
+
+void AppendSigned(std::string& output, int64_t value) {
+  if (value < 0) {
+    output += '-';
+    // Negate in unsigned to handle INT64_MIN
+    AppendUnsigned(output, ~static_cast<uint64_t>(value) + 1);
+    return;
+  }
+  AppendUnsigned(output, static_cast<uint64_t>(value));
+}
+
+void AppendUnsigned(std::string& output, uint64_t value, size_t width) {
+  char digits[20];
+  size_t length = 0;
+  do {
+    digits[length++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  if (width > length) {
+    output.append(width - length, '0');
+  }
+  while (length > 0) {
+    output += digits[--length];
+  }
+}
+
+void AppendText(std::string& output, capnp::Text::Reader value) {
+  output += '"';
+  for (char c : value) {
+    switch (c) {
+      case '\a':
+        output += "\\a";
+        break;
+      case '\b':
+        output += "\\b";
+        break;
+      case '\f':
+        output += "\\f";
+        break;
+      case '\n':
+        output += "\\n";
+        break;
+      case '\r':
+        output += "\\r";
+        break;
+      case '\t':
+        output += "\\t";
+        break;
+      case '\v':
+        output += "\\v";
+        break;
+      case '\'':
+        output += "\\\'";
+        break;
+      case '"':
+        output += "\\\"";
+        break;
+      case '\\':
+        output += "\\\\";
+        break;
+      default: {
+        const auto b = static_cast<uint8_t>(c);
+        if (b < 0x20 || b == 0x7f) {
+          // Octal like kj::encodeCEscape(), which never takes following digits unlike hex
+          output += '\\';
+          output += static_cast<char>('0' + b / 64);
+          output += static_cast<char>('0' + b / 8 % 8);
+          output += static_cast<char>('0' + b % 8);
+        } else {
+          output += c;
+        }
+        break;
+      }
+    }
+  }
+  output += '"';
+}
+
+void AppendEnum(std::string& output, kj::ArrayPtr<const char* const> names, uint16_t value) {
+  if (value < names.size()) {
+    output += names[value];
+  } else {
+    // Unknown enumerant is printed by its number
+    AppendUnsigned(output, value);
+  }
+}
+
+}  // namespace capnp_trace
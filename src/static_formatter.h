@@ -0,0 +1,53 @@
+#pragma once
+
+#include <capnp/dynamic.h>
+#include <kj/array.h>
+#include <kj/debug.h>
+#include <kj/string-tree.h>
+#include <kj/string.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace capnp_trace {
+
+/// @brief Function to append `value` to `output` in the same text as
+/// RpcMessageFormatter::AppendStringified()
+/// @details Static formatters are generated by capnpc_trace_formatter for structs in
+/// CAPNP_TRACE_SCHEMA_DIRS. They read fields by generated readers instead of reflection.
+using StaticFormatter = void (*)(const capnp::DynamicStruct::Reader& value, std::string& output);
+
+/// @brief Register a static formatter of a struct at static initialization
+struct StaticFormatterRegistration {
+  StaticFormatterRegistration(uint64_t struct_id, StaticFormatter formatter);
+};
+
+/// @return null if no static formatter is generated for the struct, e.g. generic struct
+kj::Maybe<StaticFormatter> FindStaticFormatter(uint64_t struct_id);
+
+// Helpers for generated formatters, which print values like capnp's stringify
+
+void AppendBool(std::string& output, bool value);
+void AppendSigned(std::string& output, int64_t value);
+// Decimal is padded with '0' to at least `width` digits
+void AppendUnsigned(std::string& output, uint64_t value, size_t width = 0);
+// Escaped in the same way as kj::encodeCEscape() without a temporary string
+void AppendText(std::string& output, capnp::Text::Reader value);
+void AppendEnum(std::string& output, kj::ArrayPtr<const char* const> names, uint16_t value);
+
+/// @brief Print other types by capnp's stringify. Failure is printed like AppendStringified() does.
+/// @details The tree of stringify is flattened into `output` directly instead of a kj::String.
+template <typename T>
+void AppendDynamic(std::string& output, T&& value) {
+  KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                 auto printed      = kj::strTree(capnp::DynamicValue::Reader(kj::fwd<T>(value)));
+                 const size_t size = output.size();
+                 output.resize(size + printed.size());
+                 printed.flattenTo(&output[size]);
+               })) {
+    KJ_LOG(INFO, *exception);
+    output += "<external capability>";
+  }
+}
+
+}  // namespace capnp_trace
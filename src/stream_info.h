@@ -5,6 +5,8 @@
 
 #include <string>
 
+#include "monotonic_clock.h"
+
 namespace capnp_trace {
 
 class StreamInfo final {
@@ -15,15 +17,21 @@ class StreamInfo final {
     kOut,
   };
 
-  StreamInfo() : pid_(0), tid_(0), direction_(Direction::kUnknown), fd_(0) {}
+  StreamInfo() : pid_(0), tid_(0), direction_(Direction::kUnknown), fd_(0), timestamp_(0) {}
   StreamInfo(pid_t pid, pid_t tid, Direction direction, int fd, std::string address)
-      : pid_(pid), tid_(tid), direction_(direction), fd_(fd), address_(kj::mv(address)) {}
+      : pid_(pid),
+        tid_(tid),
+        direction_(direction),
+        fd_(fd),
+        address_(kj::mv(address)),
+        timestamp_(0) {}
   ~StreamInfo()                            = default;
   StreamInfo(const StreamInfo&)            = default;
   StreamInfo& operator=(const StreamInfo&) = default;
   StreamInfo(StreamInfo&&)                 = default;
   StreamInfo& operator=(StreamInfo&&)      = default;
 
+  // NOTE: timestamp_ is not compared because it is not a part of stream identity
   bool operator==(const StreamInfo& rhs) const {
     return (pid_ == rhs.pid_) && (tid_ == rhs.tid_) && (direction_ == rhs.direction_) &&
            (fd_ == rhs.fd_) && (address_ == rhs.address_);
@@ -36,6 +44,9 @@ class StreamInfo final {
   Direction direction_;
   int fd_;
   std::string address_;
+
+  // CLOCK_MONOTONIC time in microseconds when the current message was captured (0 if unknown)
+  uint64_t timestamp_;
 };
 
 inline kj::StringPtr KJ_STRINGIFY(StreamInfo::Direction direction) {
@@ -53,4 +64,9 @@ inline kj::String KJ_STRINGIFY(const StreamInfo& stream_info) {
                  ",address:", stream_info.address_, "}");
 }
 
+// Time when the message was captured, in CLOCK_MONOTONIC microseconds
+inline uint64_t GetCaptureTime(const StreamInfo& stream_info) {
+  return stream_info.timestamp_ ? stream_info.timestamp_ : GetMonotonicMicroSec();
+}
+
 }  // namespace capnp_trace
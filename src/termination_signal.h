@@ -0,0 +1,33 @@
+#pragma once
+
+#include <kj/debug.h>
+#include <signal.h>
+
+#include <cstring>
+
+namespace capnp_trace {
+
+/// @brief SIGINT/SIGTERM handler which lets tracing loops return instead of killing capnp_trace
+/// @details Tracing loops check IsRaised() and return, so that buffered data is written before
+/// exit. Blocking syscalls like waitpid(2) are interrupted because SA_RESTART is not set.
+class TerminationSignal final {
+ public:
+  static void Watch() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int) { GetFlag() = 1; };
+    sigemptyset(&action.sa_mask);
+    KJ_SYSCALL(sigaction(SIGINT, &action, nullptr));
+    KJ_SYSCALL(sigaction(SIGTERM, &action, nullptr));
+  }
+
+  static bool IsRaised() { return GetFlag() != 0; }
+
+ private:
+  static volatile sig_atomic_t& GetFlag() {
+    static volatile sig_atomic_t flag = 0;
+    return flag;
+  }
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,231 @@
+#include "tracer_metrics.h"
+
+#include <kj/debug.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include "monotonic_clock.h"
+
+namespace capnp_trace {
+
+const size_t TracerMetrics::kSyscallCount;
+const uint64_t TracerMetricsReporter::kSignalCheckMsec;
+std::atomic<TracerMetrics*> TracerMetrics::enabled_metrics_(nullptr);
+
+static const char* kSyscallNames[] = {
+    "connect", "read", "readv", "write", "writev", "recvfrom", "close", "other",
+};
+
+// Set by the signal of TracerMetricsReporter::SetSignal()
+static volatile sig_atomic_t report_signal_flag = 0;
+
+// Increment a counter which may be updated by multiple threads
+static void Add(std::atomic<uint64_t>& counter, uint64_t value) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+static uint64_t Load(const std::atomic<uint64_t>& counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+TracerMetrics::TracerMetrics()
+    : stop_total_nsec_(0),
+      remote_read_calls_(0),
+      remote_read_bytes_(0),
+      carry_bytes_(0),
+      carry_max_size_(0),
+      decoded_messages_(0),
+      decoded_bytes_(0),
+      recorder_flushes_(0),
+      recorder_bytes_(0) {
+  for (auto& stop : stops_) {
+    stop.store(0, std::memory_order_relaxed);
+  }
+}
+
+TracerMetrics& TracerMetrics::Enable() {
+  static TracerMetrics metrics;
+  enabled_metrics_.store(&metrics, std::memory_order_relaxed);
+  return metrics;
+}
+
+size_t TracerMetrics::GetSyscallIndex(uint64_t syscall) {
+  switch (syscall) {
+    case SYS_connect:
+      return 0;
+    case SYS_read:
+      return 1;
+    case SYS_readv:
+      return 2;
+    case SYS_write:
+      return 3;
+    case SYS_writev:
+      return 4;
+    case SYS_recvfrom:
+      return 5;
+    case SYS_close:
+      return 6;
+    default:
+      return kSyscallCount - 1;
+  }
+}
+
+void TracerMetrics::AddStop(uint64_t syscall, uint64_t stop_nsec) {
+  Add(stops_[GetSyscallIndex(syscall)], 1);
+  Add(stop_total_nsec_, stop_nsec);
+  stop_nsec_.Record(stop_nsec);
+}
+
+void TracerMetrics::AddRemoteRead(size_t size) {
+  Add(remote_read_calls_, 1);
+  Add(remote_read_bytes_, size);
+}
+
+void TracerMetrics::AddCarry(size_t size, size_t carry_size) {
+  Add(carry_bytes_, size);
+  uint64_t max = Load(carry_max_size_);
+  while (carry_size > max &&
+         !carry_max_size_.compare_exchange_weak(max, carry_size, std::memory_order_relaxed)) {
+  }
+}
+
+void TracerMetrics::AddDecodedMessage(size_t size) {
+  Add(decoded_messages_, 1);
+  Add(decoded_bytes_, size);
+}
+
+void TracerMetrics::AddRecorderFlush(size_t size) {
+  Add(recorder_flushes_, 1);
+  Add(recorder_bytes_, size);
+}
+
+kj::String TracerMetrics::Format() const {
+  const auto stop_nsec = stop_nsec_.Snapshot();
+  uint64_t stops       = 0;
+  std::ostringstream stream;
+  stream << "ptrace stops:";
+  for (size_t i = 0; i < kSyscallCount; i++) {
+    stream << " " << kSyscallNames[i] << "=" << Load(stops_[i]);
+    stops += Load(stops_[i]);
+  }
+  stream << " total=" << stops << "\n";
+  // Time while a tracee is stopped by capnp_trace, in microseconds
+  stream << std::fixed << std::setprecision(1) << "stop time (usec): total="
+         << Load(stop_total_nsec_) / 1000.0 << " p50=" << stop_nsec.GetPercentile(50) / 1000.0
+         << " p99=" << stop_nsec.GetPercentile(99) / 1000.0
+         << " max=" << stop_nsec.max() / 1000.0 << "\n";
+  stream << "process_vm_readv: calls=" << Load(remote_read_calls_)
+         << " bytes=" << Load(remote_read_bytes_) << "\n";
+  stream << "reassembler carry: bytes=" << Load(carry_bytes_)
+         << " max_size=" << Load(carry_max_size_) << "\n";
+  stream << "decoded: messages=" << Load(decoded_messages_) << " bytes=" << Load(decoded_bytes_)
+         << "\n";
+  stream << "recorder: flushes=" << Load(recorder_flushes_)
+         << " bytes=" << Load(recorder_bytes_) << "\n";
+  return kj::str(stream.str().c_str());
+}
+
+kj::String TracerMetrics::FormatJson(uint64_t timestamp) const {
+  const auto stop_nsec = stop_nsec_.Snapshot();
+  std::ostringstream stream;
+  stream << "{\"timestamp\":" << timestamp << ",\"stops\":{";
+  for (size_t i = 0; i < kSyscallCount; i++) {
+    stream << (i == 0 ? "\"" : ",\"") << kSyscallNames[i] << "\":" << Load(stops_[i]);
+  }
+  stream << "},\"stopTotalNsec\":" << Load(stop_total_nsec_)
+         << ",\"stopP50Nsec\":" << stop_nsec.GetPercentile(50)
+         << ",\"stopP99Nsec\":" << stop_nsec.GetPercentile(99)
+         << ",\"stopMaxNsec\":" << stop_nsec.max()
+         << ",\"remoteReadCalls\":" << Load(remote_read_calls_)
+         << ",\"remoteReadBytes\":" << Load(remote_read_bytes_)
+         << ",\"carryBytes\":" << Load(carry_bytes_)
+         << ",\"carryMaxSize\":" << Load(carry_max_size_)
+         << ",\"decodedMessages\":" << Load(decoded_messages_)
+         << ",\"decodedBytes\":" << Load(decoded_bytes_)
+         << ",\"recorderFlushes\":" << Load(recorder_flushes_)
+         << ",\"recorderBytes\":" << Load(recorder_bytes_) << "}\n";
+  return kj::str(stream.str().c_str());
+}
+
+TracerMetricsReporter::TracerMetricsReporter(const TracerMetrics& metrics,
+                                             kj::Own<kj::OutputStream>&& output)
+    : metrics_(metrics), output_(kj::mv(output)), interval_msec_(0), is_stopping_(false) {}
+
+TracerMetricsReporter::~TracerMetricsReporter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopping_ = true;
+  }
+  condition_.notify_one();
+  if (report_thread_.joinable()) {
+    report_thread_.join();
+  }
+}
+
+TracerMetricsReporter& TracerMetricsReporter::SetSignal(int signal) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = [](int) { report_signal_flag = 1; };
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  KJ_SYSCALL(sigaction(signal, &action, nullptr));
+  return *this;
+}
+
+TracerMetricsReporter& TracerMetricsReporter::SetInterval(uint64_t interval_msec) {
+  interval_msec_ = interval_msec;
+  return *this;
+}
+
+void TracerMetricsReporter::Start() {
+  KJ_REQUIRE(!report_thread_.joinable(), "already started");
+  report_thread_ = std::thread(&TracerMetricsReporter::ReportLoop, this);
+}
+
+void TracerMetricsReporter::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopping_ = true;
+  }
+  condition_.notify_one();
+  if (report_thread_.joinable()) {
+    report_thread_.join();
+  }
+  WriteTable();
+}
+
+void TracerMetricsReporter::ReportLoop() {
+  uint64_t next_report = GetMonotonicMicroSec() + interval_msec_ * 1000;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!condition_.wait_for(lock, std::chrono::milliseconds(kSignalCheckMsec),
+                              [this]() { return is_stopping_; })) {
+    if (report_signal_flag) {
+      report_signal_flag = 0;
+      WriteTable();
+    }
+    const uint64_t now = GetMonotonicMicroSec();
+    if (interval_msec_ > 0 && now >= next_report) {
+      Write(metrics_.FormatJson(now));
+      next_report = now + interval_msec_ * 1000;
+    }
+  }
+}
+
+void TracerMetricsReporter::WriteTable() {
+  Write(kj::str("capnp_trace: tracer metrics\n", metrics_.Format()));
+}
+
+void TracerMetricsReporter::Write(kj::StringPtr text) {
+  KJ_IF_MAYBE (exception, kj::runCatchingExceptions([&]() {
+                 output_->write(text.begin(), text.size());
+               })) {
+    KJ_LOG(ERROR, "failed to write tracer metrics", *exception);
+  }
+}
+
+}  // namespace capnp_trace
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <kj/io.h>
+#include <kj/string.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "latency_histogram.h"
+
+namespace capnp_trace {
+
+/// @brief Counters of the overhead of capnp_trace itself
+/// @details Counters are updated by relaxed atomic operations on tracing, decoding and recording
+/// threads, and can be formatted on any thread at any time. Tracers update the instance only if
+/// it has been enabled, so that hot paths don't touch shared counters without --metrics.
+class TracerMetrics final {
+ public:
+  TracerMetrics();
+  TracerMetrics(const TracerMetrics&)            = delete;
+  TracerMetrics& operator=(const TracerMetrics&) = delete;
+  TracerMetrics(TracerMetrics&&)                 = delete;
+  TracerMetrics& operator=(TracerMetrics&&)      = delete;
+
+  /// @brief Enable the instance which is updated by all tracers in this process
+  /// @details It must be called before tracing starts, because the instance is not updated by
+  /// threads which have checked it before.
+  static TracerMetrics& Enable();
+
+  /// @brief Instance which is updated by all tracers in this process
+  /// @return nullptr unless Enable() has been called
+  static TracerMetrics* GetIfEnabled() {
+    return enabled_metrics_.load(std::memory_order_relaxed);
+  }
+
+  /// @brief Count a ptrace stop, which must be called only by the tracing thread
+  /// @param syscall Syscall number of the stop
+  /// @param stop_nsec Time from waitpid(2) return to resuming the tracee in nanoseconds
+  void AddStop(uint64_t syscall, uint64_t stop_nsec);
+
+  /// @brief Count a process_vm_readv(2) call which copied `size` bytes
+  void AddRemoteRead(size_t size);
+
+  /// @brief Count bytes copied into the carry buffer of a reassembler
+  /// @param carry_size Size of the carried message after the copy
+  void AddCarry(size_t size, size_t carry_size);
+
+  /// @brief Count a message which is decoded and passed to RpcMessageHandler
+  void AddDecodedMessage(size_t size);
+
+  /// @brief Count a write(2) of buffered records by RpcMessageRecorder
+  void AddRecorderFlush(size_t size);
+
+  /// @brief Format all counters in a human-readable table
+  kj::String Format() const;
+
+  /// @brief Format all counters as a JSON object in one line, which ends with a newline
+  /// @param timestamp CLOCK_MONOTONIC time in microseconds
+  kj::String FormatJson(uint64_t timestamp) const;
+
+ private:
+  // connect, read, readv, write, writev, recvfrom, close and others
+  static const size_t kSyscallCount = 8;
+  static size_t GetSyscallIndex(uint64_t syscall);
+
+  static std::atomic<TracerMetrics*> enabled_metrics_;
+
+  std::array<std::atomic<uint64_t>, kSyscallCount> stops_;
+  ConcurrentLatencyHistogram stop_nsec_;
+  std::atomic<uint64_t> stop_total_nsec_;
+  std::atomic<uint64_t> remote_read_calls_;
+  std::atomic<uint64_t> remote_read_bytes_;
+  std::atomic<uint64_t> carry_bytes_;
+  std::atomic<uint64_t> carry_max_size_;
+  std::atomic<uint64_t> decoded_messages_;
+  std::atomic<uint64_t> decoded_bytes_;
+  std::atomic<uint64_t> recorder_flushes_;
+  std::atomic<uint64_t> recorder_bytes_;
+};
+
+/// @brief Writer of TracerMetrics on exit, on a signal and periodically
+/// @details A thread writes the human-readable table when the signal is received, and a JSON line
+/// every interval if it is set.
+class TracerMetricsReporter final {
+ public:
+  /// @param metrics Metrics to be reported, which must outlive this reporter
+  /// @param output Stream to write the metrics, e.g. kj::FdOutputStream of stderr
+  TracerMetricsReporter(const TracerMetrics& metrics, kj::Own<kj::OutputStream>&& output);
+
+  /// @brief Stop reporting
+  ~TracerMetricsReporter();
+  TracerMetricsReporter(const TracerMetricsReporter&)            = delete;
+  TracerMetricsReporter& operator=(const TracerMetricsReporter&) = delete;
+  TracerMetricsReporter(TracerMetricsReporter&&)                 = delete;
+  TracerMetricsReporter& operator=(TracerMetricsReporter&&)      = delete;
+
+  /// @brief Write the table when `signal` is received
+  TracerMetricsReporter& SetSignal(int signal);
+
+  /// @brief Write a JSON line every `interval_msec` milliseconds. 0 disables it.
+  TracerMetricsReporter& SetInterval(uint64_t interval_msec);
+
+  /// @brief Start reporting on a thread
+  void Start();
+
+  /// @brief Stop reporting, and write the table
+  void Stop();
+
+ private:
+  // Granularity to check the signal
+  static const uint64_t kSignalCheckMsec = 100;
+
+  void ReportLoop();
+  void WriteTable();
+  void Write(kj::StringPtr text);
+
+  const TracerMetrics& metrics_;
+  kj::Own<kj::OutputStream> output_;
+  uint64_t interval_msec_;
+
+  bool is_stopping_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread report_thread_;
+};
+
+}  // namespace capnp_trace
@@ -0,0 +1,64 @@
+#include "unix_socket_address.h"
+
+#include <inttypes.h>
+#include <kj/debug.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <regex>
+#include <string>
+
+namespace capnp_trace {
+
+std::string GetUnixSocketAddress(pid_t pid, int fd) {
+  // Get socket inode from /proc/PID/fd/FD
+  //
+  //   # readlink /proc/$(pidof app_management)/fd/8
+  //   socket:[8633537]
+  //
+  std::string fd_dir_path =
+      std::string("/proc/") + std::to_string(pid) + "/fd/" + std::to_string(fd);
+  char buf[PATH_MAX] = {0};
+  readlink(fd_dir_path.c_str(), buf, sizeof(buf) - 1);
+  uint64_t inode;
+  auto count = sscanf(buf, "socket:[%" PRIu64 "]", &inode);
+  if (count != 1) {
+    // fd is not socket
+    return "";
+  }
+
+  // Get socket path from socket inode and /proc/PID/net/unix
+  //
+  //   # cat /proc/$(pidof app_management)/net/unix
+  //   Num       RefCount Protocol Flags    Type St Inode Path
+  //   ...
+  //   ffff8fc2d4492640: 00000003 00000000 00000000 0001 03 8637583
+  //   /run/arene/share/capnp.appmng.sock
+  //
+  std::string uds_path = std::string("/proc/") + std::to_string(pid) + "/net/unix";
+  std::ifstream uds_file(uds_path);
+  KJ_REQUIRE(uds_file.is_open());
+
+  std::string line;
+  std::regex re(".* " + std::to_string(inode) + R"( ([^ ]+))");
+  std::smatch m;
+  while (std::getline(uds_file, line)) {
+    if (std::regex_match(line, m, re)) {
+      return m[1].str();
+    }
+  }
+
+  return "";
+}
+
+std::string FormatUnixSocketPath(const char* path, size_t size) {
+  if (size > 0 && path[0] == '\0') {
+    return std::string("@") + std::string(path + 1, size - 1);
+  }
+  return std::string(path, strnlen(path, size));
+}
+
+}  // namespace capnp_trace
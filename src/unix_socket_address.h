@@ -0,0 +1,18 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace capnp_trace {
+
+/// @brief Get unix domain socket address bound to fd of another process
+/// @return socket path in /proc/PID/net/unix, or empty string if fd is not a named unix socket
+std::string GetUnixSocketAddress(pid_t pid, int fd);
+
+/// @brief Format sun_path of sockaddr_un in the same format as /proc/PID/net/unix
+/// @details Abstract socket address, which starts with '\0', is formatted as "@name"
+/// @param size size of `path` in the address, which may not be NUL-terminated
+std::string FormatUnixSocketPath(const char* path, size_t size);
+
+}  // namespace capnp_trace
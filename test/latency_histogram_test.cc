@@ -0,0 +1,88 @@
+#include "latency_histogram.h"
+
+#include <gtest/gtest.h>
+
+class LatencyHistogramTest : public ::testing::Test {};
+
+TEST_F(LatencyHistogramTest, GetPercentileOfSmallValuesExactly) {
+  // Arrange
+  capnp_trace::LatencyHistogram histogram;
+
+  // Act
+  for (uint64_t value = 1; value <= 10; value++) {
+    histogram.Record(value);
+  }
+
+  // Assert
+  ASSERT_EQ(10, histogram.count());
+  ASSERT_EQ(5, histogram.GetPercentile(50));
+  ASSERT_EQ(9, histogram.GetPercentile(90));
+  ASSERT_EQ(10, histogram.GetPercentile(100));
+  ASSERT_EQ(10, histogram.max());
+}
+
+TEST_F(LatencyHistogramTest, GetPercentileOfLargeValuesWithinError) {
+  // Arrange
+  capnp_trace::LatencyHistogram histogram;
+
+  // Act
+  for (uint64_t value = 1; value <= 100000; value++) {
+    histogram.Record(value * 1000);
+  }
+
+  // Assert
+  // Upper bound of a bucket is larger than the actual value by less than 1/16
+  const uint64_t p99 = histogram.GetPercentile(99);
+  ASSERT_GE(p99, 99000000u);
+  ASSERT_LT(p99, 99000000u + 99000000u / 16);
+  ASSERT_EQ(100000000u, histogram.GetPercentile(100));
+}
+
+TEST_F(LatencyHistogramTest, Merge) {
+  // Arrange
+  capnp_trace::LatencyHistogram histogram;
+  capnp_trace::LatencyHistogram other;
+  histogram.Record(1);
+  other.Record(3);
+  other.Record(UINT64_MAX);
+
+  // Act
+  histogram.Merge(other);
+
+  // Assert
+  ASSERT_EQ(3, histogram.count());
+  ASSERT_EQ(3, histogram.GetPercentile(50));
+  ASSERT_EQ(UINT64_MAX, histogram.max());
+  ASSERT_EQ(UINT64_MAX, histogram.GetPercentile(100));
+}
+
+TEST_F(LatencyHistogramTest, GetPercentileOfEmptyHistogram) {
+  // Arrange
+  capnp_trace::LatencyHistogram histogram;
+
+  // Act
+  auto p99 = histogram.GetPercentile(99);
+
+  // Assert
+  ASSERT_EQ(0, p99);
+}
+
+TEST_F(LatencyHistogramTest, SubtractSnapshotOfConcurrentHistogram) {
+  // Arrange
+  capnp_trace::ConcurrentLatencyHistogram concurrent;
+  concurrent.Record(1000);
+  auto older = concurrent.Snapshot();
+  concurrent.Record(10);
+  concurrent.Record(20);
+
+  // Act
+  auto difference = concurrent.Snapshot();
+  difference.Subtract(older);
+
+  // Assert
+  // max is reduced to the upper bound of the largest remaining bucket
+  ASSERT_EQ(2, difference.count());
+  ASSERT_EQ(10, difference.GetPercentile(50));
+  ASSERT_EQ(20, difference.GetPercentile(100));
+  ASSERT_EQ(20, difference.max());
+}
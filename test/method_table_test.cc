@@ -0,0 +1,61 @@
+#include "method_table.h"
+
+#include <capnp/schema-loader.h>
+#include <gtest/gtest.h>
+
+#include "test.capnp.h"
+
+class MethodTableTest : public ::testing::Test {
+ protected:
+  void SetUp() { loader_.loadCompiledTypeAndDependencies<capnp_trace::test::TestInterface>(); }
+
+  static uint64_t GetInterfaceId() { return capnp::typeId<capnp_trace::test::TestInterface>(); }
+
+  capnp::SchemaLoader loader_;
+};
+
+TEST_F(MethodTableTest, FindMethod) {
+  // Arrange
+  capnp_trace::MethodTable table;
+  table.AddAll(loader_);
+
+  // Act
+  auto maybe_info = table.Find(GetInterfaceId(), 0);
+
+  // Assert
+  KJ_IF_MAYBE (info, maybe_info) {
+    ASSERT_STREQ("test.capnp:TestInterface.foo", info->name.cStr());
+    ASSERT_EQ(2, info->param_type.getFields().size());
+    ASSERT_EQ(1, info->result_type.getFields().size());
+    ASSERT_EQ(0, info->capability_params.size());
+  } else {
+    FAIL() << "method is not found";
+  }
+}
+
+TEST_F(MethodTableTest, DontFindUnknownMethod) {
+  // Arrange
+  capnp_trace::MethodTable table;
+  table.AddAll(loader_);
+
+  // Act
+  auto unknown_method    = table.Find(GetInterfaceId(), 1);
+  auto unknown_interface = table.Find(GetInterfaceId() + 1, 0);
+
+  // Assert
+  ASSERT_TRUE(unknown_method == nullptr);
+  ASSERT_TRUE(unknown_interface == nullptr);
+}
+
+TEST_F(MethodTableTest, AddInterfaceOnlyOnce) {
+  // Arrange
+  capnp_trace::MethodTable table;
+  auto interface = loader_.get(GetInterfaceId()).asInterface();
+
+  // Act
+  table.Add(interface);
+  table.Add(interface);
+
+  // Assert
+  ASSERT_EQ(1, table.size());
+}
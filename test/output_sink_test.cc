@@ -0,0 +1,83 @@
+#include "output_sink.h"
+
+#include <gtest/gtest.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+
+#include <string>
+
+class OutputSinkTest : public ::testing::Test {
+ protected:
+  // Create a sink which writes to stream_
+  kj::Own<capnp_trace::OutputSink> MakeSink(size_t buffer_size) {
+    auto stream = kj::heap<kj::VectorOutputStream>();
+    stream_     = stream.get();
+    auto sink   = kj::heap<capnp_trace::OutputSink>(kj::mv(stream));
+    // Disable flush by time to make tests deterministic
+    sink->SetFlushThreshold(buffer_size, 0);
+    return sink;
+  }
+
+  std::string GetOutput() const {
+    auto array = stream_->getArray();
+    return std::string(array.asChars().begin(), array.size());
+  }
+
+  kj::VectorOutputStream* stream_ = nullptr;
+};
+
+TEST_F(OutputSinkTest, OutputIsBufferedUntilFlush) {
+  // Arrange
+  auto sink = MakeSink(1024);
+
+  // Act
+  sink->Write("hoge\n"_kj);
+  const auto output_before_flush = GetOutput();
+  sink->Flush();
+
+  // Assert
+  ASSERT_EQ("", output_before_flush);
+  ASSERT_EQ("hoge\n", GetOutput());
+}
+
+TEST_F(OutputSinkTest, OutputIsWrittenWhenBufferIsFull) {
+  // Arrange
+  auto sink = MakeSink(8);
+
+  // Act
+  sink->Write("hoge\n"_kj);
+  const auto output_before_full = GetOutput();
+  sink->Write("fuga\n"_kj);
+
+  // Assert
+  ASSERT_EQ("", output_before_full);
+  ASSERT_EQ("hoge\nfuga\n", GetOutput());
+}
+
+TEST_F(OutputSinkTest, OutputIsWrittenImmediatelyWithoutBuffer) {
+  // Arrange
+  auto sink = MakeSink(0);
+
+  // Act
+  sink->Write("hoge\n"_kj);
+
+  // Assert
+  ASSERT_EQ("hoge\n", GetOutput());
+}
+
+TEST_F(OutputSinkTest, DestructorDoesNotThrowWriteFailure) {
+  // Arrange
+  class FailingOutputStream final : public kj::OutputStream {
+   public:
+    void write(const void*, size_t) override { KJ_FAIL_REQUIRE("broken pipe"); }
+  };
+  auto sink = kj::heap<capnp_trace::OutputSink>(kj::heap<FailingOutputStream>());
+  sink->SetFlushThreshold(1024, 0);
+  sink->Write("hoge\n"_kj);
+
+  // Act
+  sink = nullptr;
+
+  // Assert
+  ASSERT_TRUE(sink == nullptr);
+}
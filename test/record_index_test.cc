@@ -0,0 +1,90 @@
+#include "record_index.h"
+
+#include <gtest/gtest.h>
+#include <kj/debug.h>
+
+#include <vector>
+
+class RecordIndexTest : public ::testing::Test {
+ protected:
+  // Serialize `index` as the footer of records which end at `index_offset`
+  static std::vector<kj::byte> MakeFile(const capnp_trace::RecordIndex& index,
+                                        uint64_t index_offset) {
+    std::vector<kj::byte> file(index_offset);
+    auto footer = index.Serialize(index_offset);
+    file.insert(file.end(), footer.begin(), footer.end());
+    return file;
+  }
+
+  using Ranges = std::vector<std::pair<uint64_t, uint64_t>>;
+};
+
+TEST_F(RecordIndexTest, DeserializeSerializedIndex) {
+  // Arrange
+  capnp_trace::RecordIndex index;
+  index.Add(8, 10, "/tmp/hoge.sock", nullptr);
+  index.Add(108, 20, "/tmp/fuga.sock", capnp_trace::MethodKey(1, 2));
+  auto file = MakeFile(index, 208);
+
+  // Act
+  auto deserialized = capnp_trace::RecordIndex::Deserialize(kj::arrayPtr(file.data(), file.size()));
+
+  // Assert
+  KJ_IF_MAYBE (result, deserialized) {
+    ASSERT_EQ(208, result->GetIndexOffset());
+    ASSERT_EQ((Ranges{{8, 208}}), result->Select({}));
+  } else {
+    FAIL() << "index is not deserialized";
+  }
+}
+
+TEST_F(RecordIndexTest, DeserializeFileWithoutIndex) {
+  // Arrange
+  std::vector<kj::byte> file(256, 0xCA);
+
+  // Act
+  auto deserialized = capnp_trace::RecordIndex::Deserialize(kj::arrayPtr(file.data(), file.size()));
+
+  // Assert
+  ASSERT_TRUE(deserialized == nullptr);
+}
+
+TEST_F(RecordIndexTest, SelectBlocksByTimeRange) {
+  // Arrange
+  capnp_trace::RecordIndex index(100);
+  index.Add(8, 10, "/tmp/hoge.sock", nullptr);
+  index.Add(108, 20, "/tmp/hoge.sock", nullptr);
+  index.Add(158, 25, "/tmp/hoge.sock", nullptr);
+  index.Add(208, 30, "/tmp/hoge.sock", nullptr);
+  auto file   = MakeFile(index, 308);
+  auto result = capnp_trace::RecordIndex::Deserialize(kj::arrayPtr(file.data(), file.size()));
+  capnp_trace::RecordFilter filter;
+  filter.since = 15;
+  filter.until = 25;
+
+  // Act
+  auto ranges = KJ_ASSERT_NONNULL(result).Select(filter);
+
+  // Assert
+  ASSERT_EQ((Ranges{{108, 208}}), ranges);
+}
+
+TEST_F(RecordIndexTest, SelectBlocksByAddressAndMethod) {
+  // Arrange
+  capnp_trace::RecordIndex index(100);
+  index.Add(8, 10, "/tmp/hoge.sock", capnp_trace::MethodKey(1, 0));
+  index.Add(108, 20, "/tmp/fuga.sock", capnp_trace::MethodKey(1, 0));
+  index.Add(208, 30, "/tmp/hoge.sock", capnp_trace::MethodKey(1, 1));
+  index.Add(308, 40, "/tmp/hoge.sock", capnp_trace::MethodKey(1, 0));
+  auto file   = MakeFile(index, 408);
+  auto result = capnp_trace::RecordIndex::Deserialize(kj::arrayPtr(file.data(), file.size()));
+  capnp_trace::RecordFilter filter;
+  filter.address = std::regex(".*hoge.*");
+  filter.method  = [](capnp_trace::MethodKey method) { return method.second == 0; };
+
+  // Act
+  auto ranges = KJ_ASSERT_NONNULL(result).Select(filter);
+
+  // Assert
+  ASSERT_EQ((Ranges{{8, 108}, {308, 408}}), ranges);
+}
@@ -0,0 +1,78 @@
+#include "remote_memory_reader.h"
+
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+class RemoteMemoryReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    // Map 2 pages and unmap the second one to make unreadable address
+    pages_ = static_cast<char*>(
+        mmap(nullptr, page_size_ * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(MAP_FAILED, pages_);
+    munmap(pages_ + page_size_, page_size_);
+    memset(pages_, 'x', page_size_);
+  }
+
+  void TearDown() { munmap(pages_, page_size_); }
+
+  static uint64_t ToAddress(const void* ptr) { return reinterpret_cast<uint64_t>(ptr); }
+
+  size_t page_size_;
+  char* pages_;
+  capnp_trace::RemoteMemoryReader reader_;
+};
+
+TEST_F(RemoteMemoryReaderTest, ReadOnlyRequestedSize) {
+  // Arrange
+  std::string data("Cap'n Proto");
+
+  // Act
+  auto read = reader_.Read(getpid(), ToAddress(data.data()), 5);
+
+  // Assert
+  ASSERT_EQ("Cap'n", std::string(read.begin(), read.size()));
+}
+
+TEST_F(RemoteMemoryReaderTest, GatherIovecTrimmedToSize) {
+  // Arrange
+  std::string first("Cap'n ");
+  std::string second("Proto RPC");
+  struct iovec iov[] = {{&first[0], first.size()}, {&second[0], second.size()}};
+
+  // Act
+  auto read = reader_.ReadIovec(getpid(), ToAddress(iov), 2, 11);
+
+  // Assert
+  ASSERT_EQ("Cap'n Proto", std::string(read.begin(), read.size()));
+}
+
+TEST_F(RemoteMemoryReaderTest, ReadPartiallyAtUnmappedPage) {
+  // Arrange
+  struct iovec iov[] = {{pages_ + page_size_ - 4, 4}, {pages_ + page_size_, 8}};
+
+  // Act
+  auto read       = reader_.Read(getpid(), ToAddress(pages_ + page_size_ - 10), 100);
+  auto read_iovec = reader_.ReadIovec(getpid(), ToAddress(iov), 2, 12);
+
+  // Assert
+  ASSERT_EQ(10u, read.size());
+  ASSERT_EQ(4u, read_iovec.size());
+}
+
+TEST_F(RemoteMemoryReaderTest, ReadNothingAtInvalidAddress) {
+  // Arrange
+
+  // Act
+  auto read       = reader_.Read(getpid(), 0, 8);
+  auto read_iovec = reader_.ReadIovec(getpid(), 0, 2, 8);
+
+  // Assert
+  ASSERT_EQ(0u, read.size());
+  ASSERT_EQ(0u, read_iovec.size());
+}
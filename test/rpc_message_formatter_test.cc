@@ -0,0 +1,146 @@
+#include "rpc_message_formatter.h"
+
+#include <capnp/message.h>
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "immutable_schema_registry.h"
+#include "test.capnp.h"
+
+class RpcMessageFormatterTest : public ::testing::Test {
+ protected:
+  void SetUp() { capnp_trace::ImmutableSchemaRegistry::Init(); }
+
+  static capnp_trace::StreamInfo MakeStreamInfo(capnp_trace::StreamInfo::Direction direction,
+                                                uint64_t timestamp) {
+    capnp_trace::StreamInfo stream_info(10, 11, direction, 3, "/tmp/test.sock");
+    stream_info.timestamp_ = timestamp;
+    return stream_info;
+  }
+
+  static void BuildFooCall(capnp::MessageBuilder& builder) {
+    auto call = builder.initRoot<capnp::rpc::Message>().initCall();
+    call.setQuestionId(1);
+    call.setInterfaceId(capnp::typeId<capnp_trace::test::TestInterface>());
+    call.setMethodId(0);
+    auto params = call.initParams()
+                      .getContent()
+                      .initAs<capnp_trace::test::TestInterface::FooParams>();
+    params.setI(1234);
+    params.setJ(true);
+  }
+
+  static void BuildFooReturn(capnp::MessageBuilder& builder, kj::StringPtr x = "bar") {
+    auto ret = builder.initRoot<capnp::rpc::Message>().initReturn();
+    ret.setAnswerId(1);
+    auto results = ret.initResults()
+                       .getContent()
+                       .initAs<capnp_trace::test::TestInterface::FooResults>();
+    results.setX(x);
+  }
+};
+
+TEST_F(RpcMessageFormatterTest, FormatCallAsText) {
+  // Arrange
+  capnp_trace::RpcMessageFormatter formatter;
+  capnp_trace::RpcMessageFormatter::State state;
+  capnp::MallocMessageBuilder builder;
+  BuildFooCall(builder);
+  std::string line;
+
+  // Act
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kOut, 1234567),
+                   builder.getRoot<capnp::rpc::Message>().asReader(), line);
+
+  // Assert
+  ASSERT_EQ(
+      "000001.2345 10/11 -> /tmp/test.sock(3) CALL(1) test.capnp:TestInterface.foo"
+      "(i = 1234, j = true)",
+      line);
+}
+
+TEST_F(RpcMessageFormatterTest, FormatCallAsJson) {
+  // Arrange
+  capnp_trace::RpcMessageFormatter formatter;
+  formatter.SetOutputFormat(capnp_trace::RpcMessageFormatter::OutputFormat::kJsonLines);
+  capnp_trace::RpcMessageFormatter::State state;
+  capnp::MallocMessageBuilder builder;
+  BuildFooCall(builder);
+  std::string line;
+
+  // Act
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kOut, 1234567),
+                   builder.getRoot<capnp::rpc::Message>().asReader(), line);
+
+  // Assert
+  ASSERT_EQ(
+      "{\"timestamp\":1234567,\"pid\":10,\"tid\":11,\"direction\":\"out\","
+      "\"address\":\"/tmp/test.sock\",\"fd\":3,\"type\":\"CALL\",\"questionId\":1,"
+      "\"interface\":\"test.capnp:TestInterface\",\"method\":\"foo\","
+      "\"params\":{\"i\":1234,\"j\":true}}",
+      line);
+}
+
+TEST_F(RpcMessageFormatterTest, AnnotateReturnWithLatency) {
+  // Arrange
+  capnp_trace::RpcMessageFormatter formatter;
+  capnp_trace::RpcMessageFormatter::State state;
+  capnp::MallocMessageBuilder call_builder;
+  BuildFooCall(call_builder);
+  capnp::MallocMessageBuilder return_builder;
+  BuildFooReturn(return_builder);
+  std::string line;
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kOut, 1000),
+                   call_builder.getRoot<capnp::rpc::Message>().asReader(), line);
+  line.clear();
+
+  // Act
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kIn, 1100),
+                   return_builder.getRoot<capnp::rpc::Message>().asReader(), line);
+
+  // Assert
+  EXPECT_NE(std::string::npos, line.find(" <- /tmp/test.sock(3) RETURN(1) "));
+  EXPECT_NE(std::string::npos, line.find("\"bar\""));
+  ASSERT_NE(std::string::npos, line.find(" (+100us)"));
+}
+
+TEST_F(RpcMessageFormatterTest, FormatReturnAsJsonWithEscape) {
+  // Arrange
+  capnp_trace::RpcMessageFormatter formatter;
+  formatter.SetOutputFormat(capnp_trace::RpcMessageFormatter::OutputFormat::kJsonLines);
+  capnp_trace::RpcMessageFormatter::State state;
+  capnp::MallocMessageBuilder call_builder;
+  BuildFooCall(call_builder);
+  capnp::MallocMessageBuilder return_builder;
+  BuildFooReturn(return_builder, "\"a\"\n\x01");
+  std::string line;
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kOut, 1000),
+                   call_builder.getRoot<capnp::rpc::Message>().asReader(), line);
+  line.clear();
+
+  // Act
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kIn, 1100),
+                   return_builder.getRoot<capnp::rpc::Message>().asReader(), line);
+
+  // Assert
+  ASSERT_NE(std::string::npos, line.find(",\"results\":{\"x\":\"\\\"a\\\"\\n\\u0001\"}}"));
+}
+
+TEST_F(RpcMessageFormatterTest, CallHookReceivesMethodName) {
+  // Arrange
+  std::string method_name;
+  capnp_trace::RpcMessageFormatter formatter;
+  formatter.SetCallHook([&method_name](kj::StringPtr name) { method_name = name.cStr(); });
+  capnp_trace::RpcMessageFormatter::State state;
+  capnp::MallocMessageBuilder builder;
+  BuildFooCall(builder);
+  std::string line;
+
+  // Act
+  formatter.Format(state, MakeStreamInfo(capnp_trace::StreamInfo::Direction::kOut, 1),
+                   builder.getRoot<capnp::rpc::Message>().asReader(), line);
+
+  // Assert
+  ASSERT_EQ("test.capnp:TestInterface.foo", method_name);
+}
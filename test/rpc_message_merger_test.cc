@@ -0,0 +1,123 @@
+#include "rpc_message_merger.h"
+
+#include <capnp/rpc.capnp.h>
+#include <gtest/gtest.h>
+#include <kj/filesystem.h>
+
+#include <string>
+#include <vector>
+
+#include "rpc_message_recorder.h"
+
+class RpcMessageMergerTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    auto fs = kj::newDiskFilesystem();
+    fs->getCurrent().tryRemove(kClientPath);
+    fs->getCurrent().tryRemove(kServerPath);
+  }
+
+  // Record messages of test data to `path` with timestamps `first`, `first + step`, ...
+  static void Record(const kj::Path& path, uint64_t first, uint64_t step,
+                     const std::string& address) {
+    auto fs = kj::newDiskFilesystem();
+    capnp_trace::RpcMessageRecorder recorder{
+        fs->getCurrent().appendFile(path, kj::WriteMode::CREATE)};
+    uint64_t timestamp = first;
+    capnp_trace::RpcMessageRecorder::Parser parser{
+        fs->getCurrent().openFile(kj::Path{"testdata", "capnp_trace.TestInterface.recorded"}),
+        [&](capnp_trace::StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+            kj::ArrayPtr<kj::byte> raw_message) {
+          stream_info.address_   = address;
+          stream_info.timestamp_ = timestamp;
+          timestamp += step;
+          recorder.Record(stream_info, kj::mv(message), raw_message);
+        }};
+    parser.ParseAll();
+    recorder.Finish();
+  }
+
+  // Handler which collects timestamps and addresses of merged messages
+  capnp_trace::RpcMessageHandler MakeHandler() {
+    return [this](capnp_trace::StreamInfo stream_info,
+                  [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                  [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+      timestamps_.push_back(stream_info.timestamp_);
+      addresses_.push_back(stream_info.address_);
+    };
+  }
+
+  const kj::Path kClientPath{"rpc_message_merger_test.client"};
+  const kj::Path kServerPath{"rpc_message_merger_test.server"};
+  std::vector<uint64_t> timestamps_;
+  std::vector<std::string> addresses_;
+};
+
+TEST_F(RpcMessageMergerTest, MergeFilesInTimestampOrder) {
+  // Arrange
+  Record(kClientPath, 1, 2, "client");
+  Record(kServerPath, 2, 2, "server");
+  auto fs = kj::newDiskFilesystem();
+  capnp_trace::RpcMessageMerger merger(MakeHandler());
+  merger.Add(fs->getCurrent().openFile(kClientPath)).Add(fs->getCurrent().openFile(kServerPath));
+
+  // Act
+  merger.MergeAll();
+
+  // Assert
+  ASSERT_FALSE(timestamps_.empty());
+  for (size_t i = 0; i < timestamps_.size(); i++) {
+    ASSERT_EQ(i + 1, timestamps_[i]);
+    ASSERT_EQ(i % 2 == 0 ? "client" : "server", addresses_[i]);
+  }
+}
+
+TEST_F(RpcMessageMergerTest, MergeFilesWithMinimumReadAhead) {
+  // Arrange
+  Record(kClientPath, 1, 1, "client");
+  Record(kServerPath, 1, 1, "server");
+  auto fs = kj::newDiskFilesystem();
+  capnp_trace::RpcMessageMerger merger(MakeHandler(), 1);
+  merger.Add(fs->getCurrent().openFile(kClientPath)).Add(fs->getCurrent().openFile(kServerPath));
+
+  // Act
+  merger.MergeAll();
+
+  // Assert
+  ASSERT_FALSE(timestamps_.empty());
+  for (size_t i = 0; i < timestamps_.size(); i++) {
+    // Messages with the same timestamp are passed in added order
+    ASSERT_EQ(i / 2 + 1, timestamps_[i]);
+    ASSERT_EQ(i % 2 == 0 ? "client" : "server", addresses_[i]);
+  }
+}
+
+TEST_F(RpcMessageMergerTest, MergeFilesWithFilter) {
+  // Arrange
+  Record(kClientPath, 1, 2, "client");
+  Record(kServerPath, 2, 2, "server");
+  auto fs = kj::newDiskFilesystem();
+  capnp_trace::RecordFilter filter;
+  filter.since = 3;
+  filter.until = 5;
+  capnp_trace::RpcMessageMerger merger(MakeHandler());
+  merger.Add(fs->getCurrent().openFile(kClientPath), filter)
+      .Add(fs->getCurrent().openFile(kServerPath), filter);
+
+  // Act
+  merger.MergeAll();
+
+  // Assert
+  ASSERT_EQ((std::vector<uint64_t>{3, 4, 5}), timestamps_);
+}
+
+TEST_F(RpcMessageMergerTest, MergeNoFile) {
+  // Arrange
+  capnp_trace::RpcMessageMerger merger(MakeHandler());
+
+  // Act
+  merger.MergeAll();
+
+  // Assert
+  ASSERT_TRUE(timestamps_.empty());
+}
@@ -2,6 +2,7 @@
 
 #include <capnp/dynamic.h>
 #include <capnp/rpc.capnp.h>
+#include <capnp/serialize.h>
 #include <gtest/gtest.h>
 #include <kj/filesystem.h>
 
@@ -118,3 +119,102 @@ TEST_F(RpcMessageReassemblerTest, ReassemblerPassesSameStreamInfo) {
   // Assert
   ASSERT_TRUE(called);
 }
+
+TEST_F(RpcMessageReassemblerTest, ReassembleTestInterfaceFooAcrossChunks) {
+  // Arrange
+  int call_count = 0;
+  capnp_trace::RpcMessageReassembler reassembler(
+      [&call_count]([[maybe_unused]] capnp_trace::StreamInfo stream_info,
+                    capnp::rpc::Message::Reader&& message,
+                    [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+        if (!message.isCall()) {
+          // Test only call message
+          return;
+        }
+        call_count++;
+        AssertTestInterfaceFooCall(kj::mv(message));
+      },
+      {});
+  auto file = kj::newDiskFilesystem()->getCurrent().openFile(
+      kj::Path({"testdata", "capnp_trace.TestInterface.in.dump"}));
+  auto bytes = file->readAllBytes();
+
+  // Act
+  // provide data in chunks which end in the middle of segment table and payload
+  const size_t chunk_size = 7;
+  for (size_t i = 0; i < bytes.size(); i += chunk_size) {
+    reassembler.Reassemble(bytes.asChars().begin() + i, kj::min(chunk_size, bytes.size() - i));
+  }
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+}
+
+TEST_F(RpcMessageReassemblerTest, ReassembleWithoutCopyWhenMessagesAreComplete) {
+  // Arrange
+  auto file = kj::newDiskFilesystem()->getCurrent().openFile(
+      kj::Path({"testdata", "capnp_trace.TestInterface.in.dump"}));
+  auto bytes     = file->readAllBytes();
+  int call_count = 0;
+  capnp_trace::RpcMessageReassembler reassembler(
+      [&call_count, &bytes]([[maybe_unused]] capnp_trace::StreamInfo stream_info,
+                            [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                            kj::ArrayPtr<kj::byte> raw_message) {
+        call_count++;
+        ASSERT_GE(raw_message.begin(), bytes.begin());
+        ASSERT_LE(raw_message.end(), bytes.end());
+      },
+      {});
+
+  // Act
+  reassembler.Reassemble(bytes.asChars().begin(), bytes.size());
+
+  // Assert
+  ASSERT_LT(0, call_count);
+}
+
+TEST_F(RpcMessageReassemblerTest, ResumeAtNextMessageAfterSkip) {
+  // Arrange
+  auto file = kj::newDiskFilesystem()->getCurrent().openFile(
+      kj::Path({"testdata", "capnp_trace.TestInterface.in.dump"}));
+  auto bytes        = file->readAllBytes();
+  int message_count = 0;
+  auto handler = [&message_count]([[maybe_unused]] capnp_trace::StreamInfo stream_info,
+                                  [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                                  [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+    message_count++;
+  };
+  capnp_trace::RpcMessageReassembler whole_reassembler(handler, {});
+  whole_reassembler.Reassemble(bytes.asChars().begin(), bytes.size());
+  const int whole_message_count = message_count;
+  message_count                 = 0;
+  const auto words = kj::arrayPtr(reinterpret_cast<const capnp::word*>(bytes.begin()),
+                                  bytes.size() / sizeof(capnp::word));
+  capnp::FlatArrayMessageReader first_message(words);
+  const size_t first_size = (first_message.getEnd() - words.begin()) * sizeof(capnp::word);
+  capnp_trace::RpcMessageReassembler reassembler(handler, {});
+
+  // Act
+  // The middle of the first message is lost
+  const size_t head_size = 16;
+  const size_t tail_size = 4;
+  reassembler.Reassemble(bytes.asChars().begin(), head_size);
+  const bool is_resumed = reassembler.Skip(first_size - head_size - tail_size);
+  reassembler.Reassemble(bytes.asChars().begin() + first_size - tail_size,
+                         bytes.size() - first_size + tail_size);
+
+  // Assert
+  EXPECT_TRUE(is_resumed);
+  ASSERT_EQ(whole_message_count - 1, message_count);
+}
+
+TEST_F(RpcMessageReassemblerTest, CannotResumeWhenSkipStartsAtMessageBoundary) {
+  // Arrange
+  capnp_trace::RpcMessageReassembler reassembler([](...) {}, {});
+
+  // Act
+  const bool is_resumed = reassembler.Skip(8);
+
+  // Assert
+  ASSERT_FALSE(is_resumed);
+}
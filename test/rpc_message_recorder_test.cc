@@ -2,9 +2,13 @@
 
 #include <capnp/dynamic.h>
 #include <capnp/rpc.capnp.h>
+#include <capnp/serialize.h>
 #include <gtest/gtest.h>
 #include <kj/filesystem.h>
 
+#include <deque>
+#include <vector>
+
 #include "immutable_schema_registry.h"
 
 class RpcMessageRecorderTest : public ::testing::Test {
@@ -100,3 +104,286 @@ TEST_F(RpcMessageRecorderTest, ParseAllCallbackHandler) {
   // Assert
   ASSERT_EQ(3, call_count);
 }
+
+TEST_F(RpcMessageRecorderTest, RecordsAreBufferedUntilFlush) {
+  // Arrange
+  auto fs          = kj::newDiskFilesystem();
+  auto output_file = fs->getCurrent().appendFile(kOutputPath, kj::WriteMode::CREATE);
+  capnp_trace::RpcMessageRecorder recorder{kj::mv(output_file)};
+  recorder.SetFlushThreshold(1024 * 1024, 0);
+  const auto header_size = fs->getCurrent().lstat(kOutputPath).size;
+
+  // Act
+  recorder.Record({}, {}, {});
+  const auto size_before_flush = fs->getCurrent().lstat(kOutputPath).size;
+  recorder.Flush();
+  const auto size_after_flush = fs->getCurrent().lstat(kOutputPath).size;
+
+  // Assert
+  ASSERT_EQ(header_size, size_before_flush);
+  ASSERT_GT(size_after_flush, header_size);
+}
+
+TEST_F(RpcMessageRecorderTest, ParseRecordedMessages) {
+  // Arrange
+  auto fs = kj::newDiskFilesystem();
+  {
+    auto output_file = fs->getCurrent().appendFile(kOutputPath, kj::WriteMode::CREATE);
+    capnp_trace::RpcMessageRecorder recorder{kj::mv(output_file)};
+    capnp_trace::RpcMessageRecorder::Parser parser{
+        fs->getCurrent().openFile(kTestDataPath),
+        [&recorder](capnp_trace::StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                    kj::ArrayPtr<kj::byte> raw_message) {
+          // odd length address needs padding
+          stream_info.address_ = "/tmp/hoge.sock0";
+          recorder.Record(stream_info, kj::mv(message), raw_message);
+        }};
+    parser.ParseAll();
+  }
+  int call_count = 0;
+  capnp_trace::RpcMessageRecorder::Parser parser{
+      fs->getCurrent().openFile(kOutputPath),
+      [&call_count](capnp_trace::StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                    [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+        ASSERT_EQ("/tmp/hoge.sock0", stream_info.address_);
+        if (!message.isCall()) {
+          // Test only call message
+          return;
+        }
+        call_count++;
+        AssertTestInterfaceFooCall(kj::mv(message));
+      }};
+
+  // Act
+  parser.ParseAll();
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+}
+
+TEST_F(RpcMessageRecorderTest, ParseRecordedMessagesInTimeRange) {
+  // Arrange
+  auto fs = kj::newDiskFilesystem();
+  {
+    auto output_file   = fs->getCurrent().appendFile(kOutputPath, kj::WriteMode::CREATE);
+    uint64_t timestamp = 0;
+    capnp_trace::RpcMessageRecorder recorder{kj::mv(output_file)};
+    capnp_trace::RpcMessageRecorder::Parser parser{
+        fs->getCurrent().openFile(kTestDataPath),
+        [&recorder, &timestamp](capnp_trace::StreamInfo stream_info,
+                                capnp::rpc::Message::Reader&& message,
+                                kj::ArrayPtr<kj::byte> raw_message) {
+          stream_info.timestamp_ = ++timestamp;
+          recorder.Record(stream_info, kj::mv(message), raw_message);
+        }};
+    parser.ParseAll();
+    recorder.Finish();
+  }
+  std::vector<uint64_t> timestamps;
+  capnp_trace::RecordFilter filter;
+  filter.since = 2;
+  filter.until = 3;
+  capnp_trace::RpcMessageRecorder::Parser parser{
+      fs->getCurrent().openFile(kOutputPath),
+      [&timestamps](capnp_trace::StreamInfo stream_info,
+                    [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                    [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+        timestamps.push_back(stream_info.timestamp_);
+      }};
+
+  // Act
+  parser.SetFilter(kj::mv(filter)).ParseAll();
+
+  // Assert
+  ASSERT_EQ((std::vector<uint64_t>{2, 3}), timestamps);
+}
+
+TEST_F(RpcMessageRecorderTest, ParseReturnInTimeRangeByMethodOfCallBeforeIt) {
+  // Arrange
+  auto fs = kj::newDiskFilesystem();
+  {
+    capnp_trace::RpcMessageRecorder recorder{
+        fs->getCurrent().appendFile(kOutputPath, kj::WriteMode::CREATE)};
+    capnp::MallocMessageBuilder call_builder;
+    auto call = call_builder.initRoot<capnp::rpc::Message>().initCall();
+    call.setQuestionId(1);
+    call.setInterfaceId(0x1234);
+    call.setMethodId(2);
+    auto call_message = capnp::messageToFlatArray(call_builder);
+    capnp_trace::StreamInfo call_info(1, 1, capnp_trace::StreamInfo::Direction::kOut, 3, "");
+    call_info.timestamp_ = 1;
+    recorder.Record(call_info, call_builder.getRoot<capnp::rpc::Message>().asReader(),
+                    call_message.asBytes());
+
+    capnp::MallocMessageBuilder return_builder;
+    return_builder.initRoot<capnp::rpc::Message>().initReturn().setAnswerId(1);
+    auto return_message = capnp::messageToFlatArray(return_builder);
+    capnp_trace::StreamInfo return_info(1, 1, capnp_trace::StreamInfo::Direction::kIn, 3, "");
+    return_info.timestamp_ = 2;
+    recorder.Record(return_info, return_builder.getRoot<capnp::rpc::Message>().asReader(),
+                    return_message.asBytes());
+    recorder.Finish();
+  }
+  std::vector<uint64_t> timestamps;
+  capnp_trace::RecordFilter filter;
+  filter.since  = 2;
+  filter.method = [](capnp_trace::MethodKey method) {
+    return method == capnp_trace::MethodKey(0x1234, 2);
+  };
+  capnp_trace::RpcMessageRecorder::Parser parser{
+      fs->getCurrent().openFile(kOutputPath),
+      [&timestamps](capnp_trace::StreamInfo stream_info,
+                    [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                    [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+        timestamps.push_back(stream_info.timestamp_);
+      }};
+
+  // Act
+  parser.SetFilter(kj::mv(filter)).ParseAll();
+
+  // Assert
+  ASSERT_EQ((std::vector<uint64_t>{2}), timestamps);
+}
+
+TEST_F(RpcMessageRecorderTest, ParseRecordedMessagesInParallel) {
+  // Arrange
+  auto fs = kj::newDiskFilesystem();
+  {
+    auto output_file   = fs->getCurrent().appendFile(kOutputPath, kj::WriteMode::CREATE);
+    uint64_t timestamp = 0;
+    capnp_trace::RpcMessageRecorder recorder{kj::mv(output_file)};
+    for (int i = 0; i < 100; i++) {
+      capnp_trace::RpcMessageRecorder::Parser parser{
+          fs->getCurrent().openFile(kTestDataPath),
+          [&recorder, &timestamp](capnp_trace::StreamInfo stream_info,
+                                  capnp::rpc::Message::Reader&& message,
+                                  kj::ArrayPtr<kj::byte> raw_message) {
+            stream_info.timestamp_ = ++timestamp;
+            recorder.Record(stream_info, kj::mv(message), raw_message);
+          }};
+      parser.ParseAll();
+    }
+    recorder.Finish();
+  }
+  size_t scan_count = 0;
+  // Handler of each chunk keeps a pointer to its element
+  std::deque<std::vector<uint64_t>> chunks;
+  std::vector<uint64_t> timestamps;
+  capnp_trace::RpcMessageRecorder::Parser parser{fs->getCurrent().openFile(kOutputPath),
+                                                 [](...) {}};
+  capnp_trace::RpcMessageRecorder::Parser::ParallelHandler handler;
+  handler.scan = [&scan_count](capnp_trace::StreamInfo, capnp::rpc::Message::Reader&&,
+                               kj::ArrayPtr<kj::byte>) { scan_count++; };
+  handler.fork = [&chunks](size_t index) -> capnp_trace::RpcMessageHandler {
+    chunks.emplace_back();
+    return [chunk = &chunks[index]](capnp_trace::StreamInfo stream_info,
+                                    [[maybe_unused]] capnp::rpc::Message::Reader&& message,
+                                    [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+      chunk->push_back(stream_info.timestamp_);
+    };
+  };
+  handler.join = [&chunks, &timestamps](size_t index) {
+    timestamps.insert(timestamps.end(), chunks[index].begin(), chunks[index].end());
+  };
+
+  // Act
+  parser.ParseParallel(4, kj::mv(handler), 1024);
+
+  // Assert
+  ASSERT_GT(chunks.size(), 1);
+  ASSERT_EQ(scan_count, timestamps.size());
+  for (size_t i = 0; i < timestamps.size(); i++) {
+    ASSERT_EQ(i + 1, timestamps[i]);
+  }
+}
+
+TEST_F(RpcMessageRecorderTest, ParsePackedRecordedMessages) {
+  // Arrange
+  auto fs = kj::newDiskFilesystem();
+  const kj::Path unpacked_path{"rpc_message_recorder_test.unpacked"};
+  fs->getCurrent().tryRemove(unpacked_path);
+  {
+    capnp_trace::RpcMessageRecorder recorder{
+        fs->getCurrent().appendFile(kOutputPath, kj::WriteMode::CREATE),
+        capnp_trace::RpcMessageRecorder::Compression::kPacked};
+    capnp_trace::RpcMessageRecorder unpacked_recorder{
+        fs->getCurrent().appendFile(unpacked_path, kj::WriteMode::CREATE)};
+    capnp_trace::RpcMessageRecorder::Parser parser{
+        fs->getCurrent().openFile(kTestDataPath),
+        [&recorder, &unpacked_recorder](capnp_trace::StreamInfo stream_info,
+                                        capnp::rpc::Message::Reader&& message,
+                                        kj::ArrayPtr<kj::byte> raw_message) {
+          recorder.Record(stream_info, capnp::rpc::Message::Reader(message), raw_message);
+          unpacked_recorder.Record(stream_info, kj::mv(message), raw_message);
+        }};
+    parser.ParseAll();
+  }
+  int call_count = 0;
+  capnp_trace::RpcMessageRecorder::Parser parser{
+      fs->getCurrent().openFile(kOutputPath),
+      [&call_count](capnp_trace::StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                    [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+        ASSERT_EQ("/tmp/hoge.sock", stream_info.address_);
+        if (!message.isCall()) {
+          // Test only call message
+          return;
+        }
+        call_count++;
+        AssertTestInterfaceFooCall(kj::mv(message));
+      }};
+
+  // Act
+  parser.ParseAll();
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+  ASSERT_LT(fs->getCurrent().lstat(kOutputPath).size,
+            fs->getCurrent().lstat(unpacked_path).size);
+}
+
+TEST_F(RpcMessageRecorderTest, ParseRotatedFilesAlone) {
+  // Arrange
+  auto fs           = kj::newDiskFilesystem();
+  auto& dir         = fs->getCurrent();
+  auto rotated_path = [](int index) {
+    return kj::Path{kj::str("rpc_message_recorder_test.rotated.", index)};
+  };
+  int file_count = 1;
+  {
+    dir.tryRemove(rotated_path(0));
+    capnp_trace::RpcMessageRecorder recorder{
+        dir.appendFile(rotated_path(0), kj::WriteMode::CREATE)};
+    // Every record is written to a new file
+    recorder.SetRotation(1, [&dir, &file_count, &rotated_path]() {
+      dir.tryRemove(rotated_path(file_count));
+      return dir.appendFile(rotated_path(file_count++), kj::WriteMode::CREATE);
+    });
+    capnp_trace::RpcMessageRecorder::Parser parser{
+        dir.openFile(kTestDataPath),
+        [&recorder](capnp_trace::StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                    kj::ArrayPtr<kj::byte> raw_message) {
+          recorder.Record(stream_info, kj::mv(message), raw_message);
+        }};
+    parser.ParseAll();
+    recorder.Finish();
+  }
+  int call_count = 0;
+
+  // Act
+  for (int i = 0; i < file_count; i++) {
+    capnp_trace::RpcMessageRecorder::Parser parser{
+        dir.openFile(rotated_path(i)),
+        [&call_count]([[maybe_unused]] capnp_trace::StreamInfo stream_info,
+                      capnp::rpc::Message::Reader&& message,
+                      [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+          if (message.isCall()) {
+            call_count++;
+          }
+        }};
+    parser.ParseAll();
+  }
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+  ASSERT_GT(file_count, 3);
+}
@@ -0,0 +1,100 @@
+#include "rpc_message_ring.h"
+
+#include <capnp/message.h>
+#include <capnp/rpc.capnp.h>
+#include <capnp/serialize.h>
+#include <gtest/gtest.h>
+
+#include <vector>
+
+class RpcMessageRingTest : public ::testing::Test {
+ protected:
+  // Push FINISH message whose question ID is `id` at `timestamp`
+  static void Push(capnp_trace::RpcMessageRing& ring, uint32_t id, uint64_t timestamp) {
+    capnp::MallocMessageBuilder builder;
+    builder.initRoot<capnp::rpc::Message>().initFinish().setQuestionId(id);
+    auto words = capnp::messageToFlatArray(builder);
+    auto bytes = words.asBytes();
+    capnp_trace::StreamInfo stream_info(1, 2, capnp_trace::StreamInfo::Direction::kOut, 3,
+                                        "/tmp/hoge.sock");
+    stream_info.timestamp_ = timestamp;
+    capnp::FlatArrayMessageReader reader(words);
+    ring.Push(stream_info, reader.getRoot<capnp::rpc::Message>(),
+              kj::arrayPtr(bytes.begin(), bytes.size()));
+  }
+
+  // Handler which collects question IDs of passed messages
+  capnp_trace::RpcMessageHandler MakeHandler() {
+    return [this](capnp_trace::StreamInfo stream_info, capnp::rpc::Message::Reader&& message,
+                  kj::ArrayPtr<kj::byte>) {
+      ASSERT_EQ("/tmp/hoge.sock", stream_info.address_);
+      ids_.push_back(message.getFinish().getQuestionId());
+    };
+  }
+
+  std::vector<uint32_t> ids_;
+};
+
+TEST_F(RpcMessageRingTest, TriggerPassesMessagesInPushedOrder) {
+  // Arrange
+  capnp_trace::RpcMessageRing ring(4096, MakeHandler());
+  Push(ring, 1, 10);
+  Push(ring, 2, 20);
+  Push(ring, 3, 30);
+
+  // Act
+  auto count = ring.Trigger();
+
+  // Assert
+  ASSERT_EQ(3, count);
+  ASSERT_EQ((std::vector<uint32_t>{1, 2, 3}), ids_);
+}
+
+TEST_F(RpcMessageRingTest, OldestMessagesAreDroppedWhenFull) {
+  // Arrange
+  capnp_trace::RpcMessageRing ring(1024, MakeHandler());
+  for (uint32_t id = 0; id < 100; id++) {
+    Push(ring, id, id);
+  }
+
+  // Act
+  ring.Trigger();
+
+  // Assert
+  ASSERT_FALSE(ids_.empty());
+  ASSERT_LT(ids_.size(), 100);
+  for (size_t i = 0; i < ids_.size(); i++) {
+    ASSERT_EQ(100 - ids_.size() + i, ids_[i]);
+  }
+}
+
+TEST_F(RpcMessageRingTest, OldMessagesAreDroppedByMaxAge) {
+  // Arrange
+  capnp_trace::RpcMessageRing ring(4096, MakeHandler());
+  ring.SetMaxAge(15);
+  Push(ring, 1, 10);
+  Push(ring, 2, 20);
+  Push(ring, 3, 30);
+
+  // Act
+  ring.Trigger();
+
+  // Assert
+  ASSERT_EQ((std::vector<uint32_t>{2, 3}), ids_);
+}
+
+TEST_F(RpcMessageRingTest, TriggeredMessagesAreNotPassedAgain) {
+  // Arrange
+  capnp_trace::RpcMessageRing ring(4096, MakeHandler());
+  Push(ring, 1, 10);
+  ring.Trigger();
+
+  // Act
+  auto count = ring.Trigger();
+  Push(ring, 2, 20);
+  ring.Trigger();
+
+  // Assert
+  ASSERT_EQ(0, count);
+  ASSERT_EQ((std::vector<uint32_t>{1, 2}), ids_);
+}
@@ -0,0 +1,70 @@
+#include "rpc_stats.h"
+
+#include <capnp/schema-loader.h>
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "test.capnp.h"
+
+class RpcStatsTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    loader_.loadCompiledTypeAndDependencies<capnp_trace::test::TestInterface>();
+    methods_.AddAll(loader_);
+  }
+
+  const capnp_trace::MethodInfo& GetFoo() {
+    KJ_IF_MAYBE (info, methods_.Find(capnp::typeId<capnp_trace::test::TestInterface>(), 0)) {
+      return *info;
+    }
+    KJ_FAIL_REQUIRE("TestInterface.foo is not found");
+  }
+
+  capnp::SchemaLoader loader_;
+  capnp_trace::MethodTable methods_;
+};
+
+TEST_F(RpcStatsTest, FormatStatsOfMethod) {
+  // Arrange
+  capnp_trace::RpcStats stats;
+  stats.AddCall(GetFoo());
+  stats.AddBytes(GetFoo(), capnp_trace::StreamInfo::Direction::kOut, 64);
+  stats.AddLatency(GetFoo(), 7);
+  stats.AddBytes(GetFoo(), capnp_trace::StreamInfo::Direction::kIn, 48);
+
+  // Act
+  std::string output = stats.Format().cStr();
+
+  // Assert
+  ASSERT_NE(std::string::npos,
+            output.find("         1         7         7         7         7            48"
+                        "            64  test.capnp:TestInterface.foo\n"));
+}
+
+TEST_F(RpcStatsTest, Merge) {
+  // Arrange
+  capnp_trace::RpcStats stats;
+  capnp_trace::RpcStats other;
+  stats.AddCall(GetFoo());
+  other.AddCall(GetFoo());
+  other.AddLatency(GetFoo(), 3);
+
+  // Act
+  stats.Merge(other);
+  std::string output = stats.Format().cStr();
+
+  // Assert
+  ASSERT_NE(std::string::npos, output.find("         2         3         3         3         3"));
+}
+
+TEST_F(RpcStatsTest, FormatEmptyStats) {
+  // Arrange
+  capnp_trace::RpcStats stats;
+
+  // Act
+  std::string output = stats.Format().cStr();
+
+  // Assert
+  ASSERT_EQ(std::string::npos, output.find("TestInterface"));
+}
@@ -0,0 +1,114 @@
+#include "rpc_stream_reassemblers.h"
+
+#include <capnp/rpc.capnp.h>
+#include <gtest/gtest.h>
+#include <kj/filesystem.h>
+
+#include "immutable_schema_registry.h"
+
+class RpcStreamReassemblersTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    capnp_trace::ImmutableSchemaRegistry::Init();
+    auto file = kj::newDiskFilesystem()->getCurrent().openFile(
+        kj::Path({"testdata", "capnp_trace.TestInterface.in.dump"}));
+    bytes_ = file->readAllBytes();
+  }
+
+  capnp_trace::RpcMessageHandler MakeCallCounter(int& call_count) {
+    return [&call_count]([[maybe_unused]] capnp_trace::StreamInfo stream_info,
+                         capnp::rpc::Message::Reader&& message,
+                         [[maybe_unused]] kj::ArrayPtr<kj::byte> raw_message) {
+      if (message.isCall()) {
+        call_count++;
+      }
+    };
+  }
+
+  static const pid_t kPid = 100;
+  static const int kFd    = 3;
+  kj::Array<kj::byte> bytes_;
+};
+
+const pid_t RpcStreamReassemblersTest::kPid;
+const int RpcStreamReassemblersTest::kFd;
+
+TEST_F(RpcStreamReassemblersTest, Reassemble) {
+  // Arrange
+  int call_count = 0;
+  capnp_trace::RpcStreamReassemblers reassemblers(MakeCallCounter(call_count));
+
+  // Act
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size(), 0);
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+}
+
+TEST_F(RpcStreamReassemblersTest, DropDataAfterShortRead) {
+  // Arrange
+  int call_count = 0;
+  capnp_trace::RpcStreamReassemblers reassemblers(MakeCallCounter(call_count));
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size() / 2, 0);
+  // The rest of the data is lost by a short read
+  reassemblers.Discard(kPid, kFd, capnp_trace::StreamInfo::Direction::kIn);
+  const int call_count_before_discard = call_count;
+
+  // Act
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size(), 0);
+
+  // Assert
+  ASSERT_EQ(call_count_before_discard, call_count);
+}
+
+TEST_F(RpcStreamReassemblersTest, ReassembleAfterClose) {
+  // Arrange
+  int call_count = 0;
+  capnp_trace::RpcStreamReassemblers reassemblers(MakeCallCounter(call_count));
+  reassemblers.Discard(kPid, kFd, capnp_trace::StreamInfo::Direction::kIn);
+  reassemblers.Close(kPid, kFd);
+
+  // Act
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size(), 0);
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+}
+
+TEST_F(RpcStreamReassemblersTest, DiscardOnlyOneDirection) {
+  // Arrange
+  int call_count = 0;
+  capnp_trace::RpcStreamReassemblers reassemblers(MakeCallCounter(call_count));
+  reassemblers.Discard(kPid, kFd, capnp_trace::StreamInfo::Direction::kOut);
+
+  // Act
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size(), 0);
+
+  // Assert
+  ASSERT_EQ(3, call_count);
+}
+
+TEST_F(RpcStreamReassemblersTest, DiscardWhenSkipCannotResume) {
+  // Arrange
+  int call_count = 0;
+  capnp_trace::RpcStreamReassemblers reassemblers(MakeCallCounter(call_count));
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size(), 0);
+  const int call_count_before_skip = call_count;
+
+  // Act
+  // The gap starts at a message boundary, so that the size of the next message is lost
+  const bool is_resumed =
+      reassemblers.Skip(kPid, kFd, capnp_trace::StreamInfo::Direction::kIn, bytes_.size());
+  reassemblers.Reassemble(kPid, kPid, capnp_trace::StreamInfo::Direction::kIn, kFd, "",
+                          bytes_.asChars().begin(), bytes_.size(), 0);
+
+  // Assert
+  EXPECT_FALSE(is_resumed);
+  ASSERT_EQ(call_count_before_skip, call_count);
+}
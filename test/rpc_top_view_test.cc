@@ -0,0 +1,94 @@
+#include "rpc_top_view.h"
+
+#include <capnp/message.h>
+#include <gtest/gtest.h>
+#include <kj/io.h>
+
+#include <string>
+
+#include "immutable_schema_registry.h"
+#include "test.capnp.h"
+
+class RpcTopViewTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    capnp_trace::ImmutableSchemaRegistry::Init();
+    view_ = kj::heap<capnp_trace::RpcTopView>(kj::heap<kj::VectorOutputStream>());
+  }
+
+  // Handle CALL of TestInterface.foo
+  void HandleCall(int fd, uint32_t question_id, uint64_t timestamp, size_t size) {
+    capnp::MallocMessageBuilder builder;
+    auto call = builder.initRoot<capnp::rpc::Message>().initCall();
+    call.setQuestionId(question_id);
+    call.setInterfaceId(capnp::typeId<capnp_trace::test::TestInterface>());
+    call.setMethodId(0);
+    Handle(builder, capnp_trace::StreamInfo::Direction::kOut, fd, timestamp, size);
+  }
+
+  void HandleReturn(int fd, uint32_t answer_id, uint64_t timestamp, size_t size) {
+    capnp::MallocMessageBuilder builder;
+    builder.initRoot<capnp::rpc::Message>().initReturn().setAnswerId(answer_id);
+    Handle(builder, capnp_trace::StreamInfo::Direction::kIn, fd, timestamp, size);
+  }
+
+  void Handle(capnp::MallocMessageBuilder& builder, capnp_trace::StreamInfo::Direction direction,
+              int fd, uint64_t timestamp, size_t size) {
+    capnp_trace::StreamInfo stream_info(1, 1, direction, fd, "/tmp/test.sock");
+    stream_info.timestamp_ = timestamp;
+    // Only the size of the raw message is used
+    auto raw_message = kj::heapArray<kj::byte>(size);
+    view_->Handle(stream_info, builder.getRoot<capnp::rpc::Message>().asReader(), raw_message);
+  }
+
+  kj::Own<capnp_trace::RpcTopView> view_;
+};
+
+TEST_F(RpcTopViewTest, RenderRatesAndLatencyOfMethod) {
+  // Arrange
+  HandleCall(3, 1, 1000, 100);
+  HandleReturn(3, 1, 1010, 50);
+
+  // Act
+  std::string output = view_->Render(1000000).cStr();
+
+  // Assert
+  ASSERT_NE(std::string::npos,
+            output.find("       1.0         150.0         0        10        10        10"
+                        "  /tmp/test.sock 3 test.capnp:TestInterface.foo\n"));
+}
+
+TEST_F(RpcTopViewTest, RenderDifferenceSincePreviousRender) {
+  // Arrange
+  HandleCall(3, 1, 1000, 100);
+  HandleReturn(3, 1, 1010, 50);
+  view_->Render(1000000);
+  HandleCall(3, 2, 2000, 100);
+
+  // Act
+  std::string output = view_->Render(2000000).cStr();
+
+  // Assert
+  // Latency is not recorded until RETURN is captured
+  ASSERT_NE(std::string::npos,
+            output.find("       0.5          50.0         1         0         0         0"
+                        "  /tmp/test.sock 3 test.capnp:TestInterface.foo\n"));
+}
+
+TEST_F(RpcTopViewTest, SortByBytes) {
+  // Arrange
+  HandleCall(3, 1, 1000, 10);
+  HandleCall(3, 2, 1000, 10);
+  HandleCall(4, 1, 1000, 100);
+  view_->SetSortKey(capnp_trace::RpcTopView::SortKey::kBytes);
+
+  // Act
+  std::string output = view_->Render(1000000).cStr();
+
+  // Assert
+  const auto fd3 = output.find("/tmp/test.sock 3 ");
+  const auto fd4 = output.find("/tmp/test.sock 4 ");
+  ASSERT_NE(std::string::npos, fd3);
+  ASSERT_NE(std::string::npos, fd4);
+  ASSERT_LT(fd4, fd3);
+}
@@ -0,0 +1,103 @@
+#include "schema_file_loader.h"
+
+#include <capnp/message.h>
+#include <gtest/gtest.h>
+#include <kj/filesystem.h>
+
+#include <vector>
+
+#include "test.capnp.h"
+
+class SchemaFileLoaderTest : public ::testing::Test {
+ protected:
+  void SetUp() { kj::newDiskFilesystem()->getCurrent().tryRemove(kSchemaPath); }
+
+  // Append a CodeGeneratorRequest which contains `schemas` to the compiled schema file
+  static void AppendRequest(const std::vector<capnp::Schema>& schemas) {
+    capnp::MallocMessageBuilder builder;
+    auto nodes = builder.initRoot<capnp::schema::CodeGeneratorRequest>().initNodes(schemas.size());
+    for (size_t i = 0; i < schemas.size(); i++) {
+      nodes.setWithCaveats(i, schemas[i].getProto());
+    }
+    auto file = kj::newDiskFilesystem()->getCurrent().appendFile(
+        kSchemaPath, kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+    capnp::writeMessage(*file, builder);
+  }
+
+  static kj::Own<const kj::ReadableFile> OpenSchemaFile() {
+    return kj::newDiskFilesystem()->getCurrent().openFile(kSchemaPath);
+  }
+
+  static capnp::InterfaceSchema GetTestInterface() {
+    return capnp::Schema::from<capnp_trace::test::TestInterface>();
+  }
+
+  const kj::Path kSchemaPath{"schema_file_loader_test.bin"};
+};
+
+// SchemaFileLoader is called by the lazy load callback of a SchemaLoader
+class FileLoadCallback final : public capnp::SchemaLoader::LazyLoadCallback {
+ public:
+  explicit FileLoadCallback(const capnp_trace::SchemaFileLoader& file_loader)
+      : file_loader_(file_loader) {}
+
+  void load(const capnp::SchemaLoader& loader, uint64_t id) const override {
+    file_loader_.Load(loader, id);
+  }
+
+ private:
+  const capnp_trace::SchemaFileLoader& file_loader_;
+};
+
+TEST_F(SchemaFileLoaderTest, LoadNodeLazily) {
+  // Arrange
+  auto method = GetTestInterface().getMethods()[0];
+  AppendRequest({GetTestInterface(), method.getParamType(), method.getResultType()});
+  capnp_trace::SchemaFileLoader file_loader;
+  FileLoadCallback callback(file_loader);
+  capnp::SchemaLoader loader(callback);
+
+  // Act
+  auto count     = file_loader.AddFile(OpenSchemaFile());
+  auto interface = loader.get(GetTestInterface().getProto().getId()).asInterface();
+
+  // Assert
+  ASSERT_EQ(3, count);
+  ASSERT_STREQ("test.capnp:TestInterface", interface.getProto().getDisplayName().cStr());
+  ASSERT_EQ(2, interface.getMethods()[0].getParamType().getFields().size());
+}
+
+TEST_F(SchemaFileLoaderTest, DontLoadUnknownNode) {
+  // Arrange
+  AppendRequest({GetTestInterface()});
+  capnp_trace::SchemaFileLoader file_loader;
+  FileLoadCallback callback(file_loader);
+  capnp::SchemaLoader loader(callback);
+  file_loader.AddFile(OpenSchemaFile());
+
+  // Act
+  auto schema = loader.tryGet(GetTestInterface().getProto().getId() + 1);
+
+  // Assert
+  ASSERT_TRUE(schema == nullptr);
+  ASSERT_EQ(0, loader.getAllLoaded().size());
+}
+
+TEST_F(SchemaFileLoaderTest, AddConcatenatedRequests) {
+  // Arrange
+  auto method = GetTestInterface().getMethods()[0];
+  AppendRequest({GetTestInterface()});
+  AppendRequest({method.getParamType(), method.getResultType()});
+  capnp_trace::SchemaFileLoader file_loader;
+  FileLoadCallback callback(file_loader);
+  capnp::SchemaLoader loader(callback);
+
+  // Act
+  auto count       = file_loader.AddFile(OpenSchemaFile());
+  auto result_type = loader.get(method.getResultType().getProto().getId()).asStruct();
+
+  // Assert
+  ASSERT_EQ(3, count);
+  ASSERT_EQ(3, file_loader.size());
+  ASSERT_EQ(1, result_type.getFields().size());
+}
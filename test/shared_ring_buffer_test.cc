@@ -0,0 +1,152 @@
+#include "shared_ring_buffer.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+class SharedRingBufferTest : public ::testing::Test {
+ protected:
+  static const size_t kCapacity = 4096;
+
+  void SetUp() { region_.assign(capnp_trace::SharedRingBuffer::GetRegionSize(kCapacity), 0); }
+
+  capnp_trace::SharedRingBuffer MakeRing() {
+    return capnp_trace::SharedRingBuffer(region_.data(), region_.size());
+  }
+
+  static capnp_trace::SharedRingBuffer::Record MakeRecord(size_t length) {
+    return {1, 2, 3, capnp_trace::SharedRingBuffer::kIn, length, 4};
+  }
+
+  std::vector<uint8_t> region_;
+};
+
+TEST_F(SharedRingBufferTest, CreateInstance) {
+  // Arrange
+
+  // Act
+  auto ring = MakeRing();
+
+  // Assert
+  ASSERT_TRUE(ring.IsValid());
+  ASSERT_EQ(0, ring.GetDroppedBytes());
+}
+
+TEST_F(SharedRingBufferTest, ConsumeNothingWhenEmpty) {
+  // Arrange
+  auto ring = MakeRing();
+  int call_count = 0;
+
+  // Act
+  auto count = ring.Consume([&call_count](...) { call_count++; });
+
+  // Assert
+  ASSERT_EQ(0, count);
+  ASSERT_EQ(0, call_count);
+}
+
+TEST_F(SharedRingBufferTest, ConsumeGatheredData) {
+  // Arrange
+  auto ring = MakeRing();
+  std::string first("Cap'n ");
+  std::string second("Proto");
+  struct iovec iov[] = {{&first[0], first.size()}, {&second[0], second.size()}};
+  std::string consumed;
+
+  // Act
+  ASSERT_TRUE(ring.Push(MakeRecord(first.size() + second.size()), iov, 2));
+  auto count = ring.Consume(
+      [&consumed](const capnp_trace::SharedRingBuffer::Record& record, char* payload) {
+        EXPECT_EQ(1, record.pid);
+        EXPECT_EQ(2, record.tid);
+        EXPECT_EQ(3, record.fd);
+        EXPECT_EQ(capnp_trace::SharedRingBuffer::kIn, record.type);
+        consumed.append(payload, record.length);
+      });
+
+  // Assert
+  ASSERT_EQ(1, count);
+  ASSERT_EQ("Cap'n Proto", consumed);
+}
+
+TEST_F(SharedRingBufferTest, PushTrimsDataToLength) {
+  // Arrange
+  auto ring = MakeRing();
+  std::string data("0123456789");
+  struct iovec iov = {&data[0], data.size()};
+  std::string consumed;
+
+  // Act
+  ASSERT_TRUE(ring.Push(MakeRecord(4), &iov, 1));
+  ring.Consume([&consumed](const capnp_trace::SharedRingBuffer::Record& record, char* payload) {
+    consumed.append(payload, record.length);
+  });
+
+  // Assert
+  ASSERT_EQ("0123", consumed);
+}
+
+TEST_F(SharedRingBufferTest, LargeDataIsDividedAndWrappedAround) {
+  // Arrange
+  auto ring = MakeRing();
+  std::string data;
+  for (auto i = 0U; i < kCapacity / 2; i++) {
+    data.push_back(static_cast<char>('a' + i % 26));
+  }
+  struct iovec iov = {&data[0], data.size()};
+  std::string consumed;
+  int record_count = 0;
+  auto consumer    = [&consumed, &record_count](const capnp_trace::SharedRingBuffer::Record& record,
+                                              char* payload) {
+    consumed.append(payload, record.length);
+    record_count++;
+  };
+
+  // Act
+  // Push and consume repeatedly to wrap around the data area
+  for (auto i = 0; i < 5; i++) {
+    ASSERT_TRUE(ring.Push(MakeRecord(data.size()), &iov, 1));
+    ring.Consume(consumer);
+  }
+
+  // Assert
+  ASSERT_GT(record_count, 5);
+  ASSERT_EQ(data.size() * 5, consumed.size());
+  for (auto i = 0U; i < 5; i++) {
+    ASSERT_EQ(data, consumed.substr(i * data.size(), data.size()));
+  }
+}
+
+TEST_F(SharedRingBufferTest, PushFailsWhenFull) {
+  // Arrange
+  auto ring = MakeRing();
+  std::string data(kCapacity / 8, 'x');
+  struct iovec iov = {&data[0], data.size()};
+
+  // Act
+  bool pushed = true;
+  for (auto i = 0; i < 16 && pushed; i++) {
+    pushed = ring.Push(MakeRecord(data.size()), &iov, 1);
+  }
+
+  // Assert
+  ASSERT_FALSE(pushed);
+  ASSERT_EQ(data.size(), ring.GetDroppedBytes());
+}
+
+TEST_F(SharedRingBufferTest, IsEmptyAfterConsume) {
+  // Arrange
+  auto ring = MakeRing();
+  std::string data("data");
+  struct iovec iov = {&data[0], data.size()};
+  ASSERT_TRUE(ring.Push(MakeRecord(data.size()), &iov, 1));
+  const bool is_empty_before_consume = ring.IsEmpty();
+
+  // Act
+  ring.Consume([](...) {});
+
+  // Assert
+  ASSERT_FALSE(is_empty_before_consume);
+  ASSERT_TRUE(ring.IsEmpty());
+}
@@ -0,0 +1,84 @@
+#include "spsc_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(SpscQueueTest, PopNothingWhenEmpty) {
+  // Arrange
+  capnp_trace::SpscQueue<int> queue(4);
+  int value = -1;
+
+  // Act
+  auto result = queue.TryPop(value);
+
+  // Assert
+  ASSERT_FALSE(result);
+  ASSERT_EQ(-1, value);
+}
+
+TEST(SpscQueueTest, PushFailsWhenFull) {
+  // Arrange
+  capnp_trace::SpscQueue<std::string> queue(2);
+  std::string first("first");
+  std::string second("second");
+  std::string third("third");
+
+  // Act
+  ASSERT_TRUE(queue.TryPush(first));
+  ASSERT_TRUE(queue.TryPush(second));
+  auto result = queue.TryPush(third);
+
+  // Assert
+  ASSERT_FALSE(result);
+  ASSERT_EQ("third", third);
+  std::string value;
+  ASSERT_TRUE(queue.TryPop(value));
+  ASSERT_EQ("first", value);
+  ASSERT_TRUE(queue.TryPush(third));
+}
+
+TEST(SpscQueueTest, PopReturnsFalseAfterClose) {
+  // Arrange
+  capnp_trace::SpscQueue<int> queue(4);
+  queue.Push(1);
+  queue.Close();
+  int value = 0;
+
+  // Act
+  auto first  = queue.Pop(value);
+  auto second = queue.Pop(value);
+
+  // Assert
+  ASSERT_TRUE(first);
+  ASSERT_EQ(1, value);
+  ASSERT_FALSE(second);
+}
+
+TEST(SpscQueueTest, KeepOrderBetweenThreads) {
+  // Arrange
+  const int kCount = 100000;
+  capnp_trace::SpscQueue<int> queue(16);
+  std::vector<int> popped;
+
+  // Act
+  std::thread consumer([&queue, &popped]() {
+    int value;
+    while (queue.Pop(value)) {
+      popped.push_back(value);
+    }
+  });
+  for (int i = 0; i < kCount; i++) {
+    queue.Push(i);
+  }
+  queue.Close();
+  consumer.join();
+
+  // Assert
+  ASSERT_EQ(kCount, popped.size());
+  for (int i = 0; i < kCount; i++) {
+    ASSERT_EQ(i, popped[i]);
+  }
+}
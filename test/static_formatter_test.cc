@@ -0,0 +1,81 @@
+#include "static_formatter.h"
+
+#include <capnp/message.h>
+#include <gtest/gtest.h>
+#include <kj/encoding.h>
+
+#include <string>
+
+#include "test.capnp.h"
+
+class StaticFormatterTest : public ::testing::Test {
+ protected:
+  template <typename T>
+  static std::string Format(typename T::Reader reader) {
+    std::string output;
+    KJ_IF_MAYBE (formatter, capnp_trace::FindStaticFormatter(capnp::typeId<T>())) {
+      (*formatter)(capnp::toDynamic(reader), output);
+    } else {
+      ADD_FAILURE() << "static formatter is not generated";
+    }
+    return output;
+  }
+};
+
+TEST_F(StaticFormatterTest, FormatParamsOfMethod) {
+  // Arrange
+  capnp::MallocMessageBuilder builder;
+  auto params = builder.initRoot<capnp_trace::test::TestInterface::FooParams>();
+  params.setI(1);
+  params.setJ(true);
+
+  // Act
+  auto output = Format<capnp_trace::test::TestInterface::FooParams>(params.asReader());
+
+  // Assert
+  ASSERT_EQ("(i = 1, j = true)", output);
+}
+
+TEST_F(StaticFormatterTest, FormatEnumListAndUnion) {
+  // Arrange
+  capnp::MallocMessageBuilder builder;
+  auto value = builder.initRoot<capnp_trace::test::TestStruct>();
+  value.setE(capnp_trace::test::TestEnum::SECOND);
+  auto list = value.initL(2);
+  list.set(0, 1);
+  list.set(1, -2);
+  value.setT("a\"b");
+
+  // Act
+  auto output = Format<capnp_trace::test::TestStruct>(value.asReader());
+
+  // Assert
+  // Inactive union member is printed like DynamicStruct::Reader::get() throws for it
+  ASSERT_EQ("(e = second, l = [1, -2], n = <external capability>, t = \"a\\\"b\")", output);
+}
+
+TEST_F(StaticFormatterTest, DontFindUnknownStruct) {
+  // Arrange
+
+  // Act
+  auto formatter = capnp_trace::FindStaticFormatter(0);
+
+  // Assert
+  ASSERT_TRUE(formatter == nullptr);
+}
+
+TEST_F(StaticFormatterTest, EscapeTextLikeEncodeCEscape) {
+  // Arrange
+  std::string text;
+  for (int c = 1; c < 0x80; c++) {
+    text += static_cast<char>(c);
+  }
+  auto expected = kj::str('"', kj::encodeCEscape(kj::arrayPtr(text.data(), text.size())), '"');
+  std::string output;
+
+  // Act
+  capnp_trace::AppendText(output, capnp::Text::Reader(text.data(), text.size()));
+
+  // Assert
+  ASSERT_EQ(expected.cStr(), output);
+}
@@ -0,0 +1,61 @@
+#include "tracer_metrics.h"
+
+#include <gtest/gtest.h>
+#include <sys/syscall.h>
+
+#include <string>
+
+class TracerMetricsTest : public ::testing::Test {};
+
+TEST_F(TracerMetricsTest, FormatStopsOfEachSyscall) {
+  // Arrange
+  capnp_trace::TracerMetrics metrics;
+
+  // Act
+  metrics.AddStop(SYS_read, 2000);
+  metrics.AddStop(SYS_writev, 4000);
+  metrics.AddStop(~uint64_t(0), 1000);
+  std::string output = metrics.Format().cStr();
+
+  // Assert
+  // Syscalls which are not handled by RpcTracer are counted as others
+  ASSERT_NE(std::string::npos,
+            output.find("ptrace stops: connect=0 read=1 readv=0 write=0 writev=1 recvfrom=0 "
+                        "close=0 other=1 total=3\n"));
+  ASSERT_NE(std::string::npos, output.find("stop time (usec): total=7.0 "));
+}
+
+TEST_F(TracerMetricsTest, KeepMaxCarrySize) {
+  // Arrange
+  capnp_trace::TracerMetrics metrics;
+
+  // Act
+  metrics.AddCarry(10, 10);
+  metrics.AddCarry(20, 30);
+  metrics.AddCarry(5, 5);
+  std::string output = metrics.Format().cStr();
+
+  // Assert
+  ASSERT_NE(std::string::npos, output.find("reassembler carry: bytes=35 max_size=30\n"));
+}
+
+TEST_F(TracerMetricsTest, FormatJson) {
+  // Arrange
+  capnp_trace::TracerMetrics metrics;
+  metrics.AddRemoteRead(100);
+  metrics.AddRemoteRead(0);
+  metrics.AddDecodedMessage(64);
+  metrics.AddRecorderFlush(128);
+
+  // Act
+  std::string output = metrics.FormatJson(5).cStr();
+
+  // Assert
+  ASSERT_EQ(
+      "{\"timestamp\":5,\"stops\":{\"connect\":0,\"read\":0,\"readv\":0,\"write\":0,"
+      "\"writev\":0,\"recvfrom\":0,\"close\":0,\"other\":0},\"stopTotalNsec\":0,"
+      "\"stopP50Nsec\":0,\"stopP99Nsec\":0,\"stopMaxNsec\":0,\"remoteReadCalls\":2,"
+      "\"remoteReadBytes\":100,\"carryBytes\":0,\"carryMaxSize\":0,\"decodedMessages\":1,"
+      "\"decodedBytes\":64,\"recorderFlushes\":1,\"recorderBytes\":128}\n",
+      output);
+}
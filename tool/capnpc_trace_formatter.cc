@@ -0,0 +1,297 @@
+// capnpc plugin which generates static formatters of structs for capnp_trace
+//
+// Usage: capnp compile -o<path/to/capnpc_trace_formatter>:<output_dir> <file.capnp>...
+//
+// `<file.capnp>.formatter.cc` is generated for each file next to `<file.capnp>.h` of capnpc-c++.
+// It registers a function for each struct which prints the struct in the same text as
+// RpcMessageFormatter::AppendStringified() by generated readers, instead of DynamicStruct
+// reflection.
+
+#include <capnp/schema.capnp.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <kj/string-tree.h>
+#include <kj/vector.h>
+#include <unistd.h>
+
+#include <unordered_map>
+
+#include "reader_options.h"
+
+namespace capnp_trace {
+
+// Annotations in /capnp/c++.capnp
+static const uint64_t kCxxNamespaceAnnotationId = 0xb9c6f99ebf805f2cull;
+static const uint64_t kCxxNameAnnotationId      = 0xf264a779fef191ceull;
+
+static kj::Maybe<capnp::Text::Reader> FindTextAnnotation(
+    capnp::List<capnp::schema::Annotation>::Reader annotations, uint64_t id) {
+  for (auto annotation : annotations) {
+    if (annotation.getId() == id) {
+      return annotation.getValue().getText();
+    }
+  }
+  return nullptr;
+}
+
+static kj::String Capitalize(kj::StringPtr name) {
+  auto capitalized = kj::str(name);
+  if (capitalized.size() > 0 && 'a' <= capitalized[0] && capitalized[0] <= 'z') {
+    capitalized[0] = static_cast<char>(capitalized[0] - 'a' + 'A');
+  }
+  return capitalized;
+}
+
+class FormatterGenerator final {
+ public:
+  explicit FormatterGenerator(capnp::schema::CodeGeneratorRequest::Reader request) {
+    for (auto node : request.getNodes()) {
+      nodes_.emplace(node.getId(), node);
+    }
+  }
+
+  kj::String Generate(capnp::schema::CodeGeneratorRequest::RequestedFile::Reader file) {
+    kj::Vector<kj::StringTree> enums;
+    kj::Vector<kj::StringTree> formatters;
+    kj::Vector<kj::StringTree> registrations;
+    file_id_ = file.getId();
+    GenerateNested(file.getId(), enums, formatters, registrations);
+
+    kj::StringTree registration_table;
+    if (registrations.size() > 0) {
+      registration_table =
+          kj::strTree("static const StaticFormatterRegistration kRegistrations[] = {\n",
+                      kj::StringTree(registrations.releaseAsArray(), ""), "};\n");
+    }
+    return kj::str("// Generated by capnpc_trace_formatter from ", file.getFilename(),
+                   ". DO NOT EDIT.\n\n",
+                   "#include \"static_formatter.h\"\n",
+                   "#include \"", file.getFilename(), ".h\"\n\n",
+                   "namespace capnp_trace {\n\n",
+                   kj::StringTree(enums.releaseAsArray(), ""),
+                   kj::StringTree(formatters.releaseAsArray(), ""), kj::mv(registration_table),
+                   "\n}  // namespace capnp_trace\n");
+  }
+
+ private:
+  // Generate formatters of structs in the scope of `id` recursively
+  void GenerateNested(uint64_t id, kj::Vector<kj::StringTree>& enums,
+                      kj::Vector<kj::StringTree>& formatters,
+                      kj::Vector<kj::StringTree>& registrations) {
+    auto it = nodes_.find(id);
+    if (it == nodes_.end()) {
+      return;
+    }
+    for (auto nested : it->second.getNestedNodes()) {
+      auto nested_it = nodes_.find(nested.getId());
+      if (nested_it == nodes_.end()) {
+        continue;
+      }
+      auto node = nested_it->second;
+      if (node.isEnum()) {
+        enums.add(GenerateEnumNames(node));
+      }
+      if (node.isStruct() && !node.getIsGeneric()) {
+        KJ_IF_MAYBE (name, GetCxxName(node.getId())) {
+          formatters.add(GenerateFormatter(node, *name));
+          registrations.add(GenerateRegistration(node.getId()));
+        }
+      }
+      if (node.isInterface() && !node.getIsGeneric()) {
+        KJ_IF_MAYBE (name, GetCxxName(node.getId())) {
+          GenerateMethods(node, *name, formatters, registrations);
+        }
+      }
+      GenerateNested(node.getId(), enums, formatters, registrations);
+    }
+  }
+
+  // Params and results of methods are implicit structs which are not nested nodes. capnpc-c++
+  // names them <Interface>::<Method>Params and <Interface>::<Method>Results.
+  void GenerateMethods(capnp::schema::Node::Reader node, kj::StringPtr interface_name,
+                       kj::Vector<kj::StringTree>& formatters,
+                       kj::Vector<kj::StringTree>& registrations) {
+    for (auto method : node.getInterface().getMethods()) {
+      kj::String method_name;
+      KJ_IF_MAYBE (name, FindTextAnnotation(method.getAnnotations(), kCxxNameAnnotationId)) {
+        method_name = Capitalize(*name);
+      } else {
+        method_name = Capitalize(method.getName());
+      }
+      const uint64_t struct_ids[] = {method.getParamStructType(), method.getResultStructType()};
+      const char* const suffixes[] = {"Params", "Results"};
+      for (size_t i = 0; i < 2; i++) {
+        auto it = nodes_.find(struct_ids[i]);
+        // Explicit struct types are generated as nested nodes, and generic methods are skipped
+        if (it == nodes_.end() || it->second.getScopeId() != 0 ||
+            method.getImplicitParameters().size() > 0) {
+          continue;
+        }
+        formatters.add(GenerateFormatter(
+            it->second, kj::str(interface_name, "::", method_name, suffixes[i])));
+        registrations.add(GenerateRegistration(struct_ids[i]));
+      }
+    }
+  }
+
+  kj::StringTree GenerateRegistration(uint64_t id) {
+    return kj::strTree("    {0x", kj::hex(id), "ull, &Format", kj::hex(id), "},\n");
+  }
+
+  // ID of the file which declares `id`
+  uint64_t GetFileId(uint64_t id) {
+    auto it = nodes_.find(id);
+    while (it != nodes_.end() && !it->second.isFile()) {
+      it = nodes_.find(it->second.getScopeId());
+    }
+    return it == nodes_.end() ? 0 : it->second.getId();
+  }
+
+  // Fully qualified C++ name of a non-generic node, or null if it has no name (e.g. group)
+  kj::Maybe<kj::String> GetCxxName(uint64_t id) {
+    auto it = nodes_.find(id);
+    if (it == nodes_.end()) {
+      return nullptr;
+    }
+    auto node = it->second;
+    if (node.isFile()) {
+      KJ_IF_MAYBE (name, FindTextAnnotation(node.getAnnotations(), kCxxNamespaceAnnotationId)) {
+        return kj::str("::", *name);
+      }
+      return kj::str("");
+    }
+
+    auto parent_it = nodes_.find(node.getScopeId());
+    if (parent_it == nodes_.end()) {
+      return nullptr;
+    }
+    kj::Maybe<kj::String> name;
+    KJ_IF_MAYBE (annotation, FindTextAnnotation(node.getAnnotations(), kCxxNameAnnotationId)) {
+      name = kj::str(*annotation);
+    } else {
+      for (auto nested : parent_it->second.getNestedNodes()) {
+        if (nested.getId() == id) {
+          name = kj::str(nested.getName());
+        }
+      }
+    }
+    KJ_IF_MAYBE (simple_name, name) {
+      KJ_IF_MAYBE (parent_name, GetCxxName(node.getScopeId())) {
+        return kj::str(*parent_name, "::", *simple_name);
+      }
+    }
+    return nullptr;
+  }
+
+  kj::StringTree GenerateEnumNames(capnp::schema::Node::Reader node) {
+    kj::Vector<kj::String> names;
+    for (auto enumerant : node.getEnum().getEnumerants()) {
+      names.add(kj::str("\"", enumerant.getName(), "\""));
+    }
+    return kj::strTree("static const char* const kEnumNames", kj::hex(node.getId()), "[] = {",
+                       kj::strArray(names, ", "), "};\n\n");
+  }
+
+  kj::StringTree GenerateFormatter(capnp::schema::Node::Reader node, kj::StringPtr name) {
+    kj::Vector<kj::StringTree> fields;
+    bool is_first = true;
+    for (auto field : node.getStruct().getFields()) {
+      auto getter                = kj::str("reader.", GetGetterName(field), "()");
+      kj::StringTree print_field = kj::strTree("    ", GeneratePrintValue(field, getter), "\n");
+      if (field.getDiscriminantValue() != capnp::schema::Field::NO_DISCRIMINANT) {
+        // get() of DynamicStruct throws for inactive union member, which AppendStringified()
+        // prints as external capability
+        print_field = kj::strTree(
+            "  if (static_cast<uint16_t>(reader.which()) == ", field.getDiscriminantValue(),
+            ") {\n", kj::mv(print_field), "  } else {\n",
+            "    output += \"<external capability>\";\n", "  }\n");
+      } else {
+        print_field = kj::strTree("  {\n", kj::mv(print_field), "  }\n");
+      }
+      fields.add(kj::strTree("  output += \"", is_first ? "" : ", ", field.getName(), " = \";\n",
+                             kj::mv(print_field)));
+      is_first = false;
+    }
+
+    // Cast via AnyStruct because the schema may be loaded from a file and not castable by as<T>()
+    auto reader = is_first ? kj::str("")
+                           : kj::str("  auto reader = value.as<capnp::AnyStruct>().as<", name,
+                                     ">();\n");
+    return kj::strTree("// ", node.getDisplayName(), "\n", "static void Format",
+                       kj::hex(node.getId()),
+                       "(const capnp::DynamicStruct::Reader& value, std::string& output) {\n",
+                       kj::mv(reader), "  output += '(';\n",
+                       kj::StringTree(fields.releaseAsArray(), ""), "  output += ')';\n",
+                       "}\n\n");
+  }
+
+  kj::String GetGetterName(capnp::schema::Field::Reader field) {
+    KJ_IF_MAYBE (annotation, FindTextAnnotation(field.getAnnotations(), kCxxNameAnnotationId)) {
+      return kj::str("get", Capitalize(*annotation));
+    }
+    return kj::str("get", Capitalize(field.getName()));
+  }
+
+  kj::String GeneratePrintValue(capnp::schema::Field::Reader field, kj::StringPtr getter) {
+    if (field.isGroup()) {
+      return kj::str("AppendDynamic(output, ", getter, ");");
+    }
+    auto type = field.getSlot().getType();
+    switch (type.which()) {
+      case capnp::schema::Type::VOID:
+        return kj::str("output += \"void\";");
+      case capnp::schema::Type::BOOL:
+        return kj::str("AppendBool(output, ", getter, ");");
+      case capnp::schema::Type::INT8:
+      case capnp::schema::Type::INT16:
+      case capnp::schema::Type::INT32:
+      case capnp::schema::Type::INT64:
+        return kj::str("AppendSigned(output, ", getter, ");");
+      case capnp::schema::Type::UINT8:
+      case capnp::schema::Type::UINT16:
+      case capnp::schema::Type::UINT32:
+      case capnp::schema::Type::UINT64:
+        return kj::str("AppendUnsigned(output, ", getter, ");");
+      case capnp::schema::Type::TEXT:
+        return kj::str("AppendText(output, ", getter, ");");
+      case capnp::schema::Type::ENUM: {
+        auto enum_id = type.getEnum().getTypeId();
+        // Names are generated only for enums in this file
+        if (GetFileId(enum_id) == file_id_) {
+          return kj::str("AppendEnum(output, kj::arrayPtr(kEnumNames", kj::hex(enum_id),
+                         "), static_cast<uint16_t>(", getter, "));");
+        }
+        return kj::str("AppendDynamic(output, ", getter, ");");
+      }
+      case capnp::schema::Type::INTERFACE:
+        return kj::str("output += \"<external capability>\";");
+      default:
+        // Float, Data, List, Struct and AnyPointer are rare or large enough to print by capnp
+        return kj::str("AppendDynamic(output, ", getter, ");");
+    }
+  }
+
+  std::unordered_map<uint64_t, capnp::schema::Node::Reader> nodes_;
+  // File which is being generated
+  uint64_t file_id_ = 0;
+};
+
+}  // namespace capnp_trace
+
+int main() {
+  const auto options = capnp_trace::GetUnlimitedReaderOptions();
+  capnp::StreamFdMessageReader message(STDIN_FILENO, options);
+  auto request = message.getRoot<capnp::schema::CodeGeneratorRequest>();
+
+  capnp_trace::FormatterGenerator generator(request);
+  auto filesystem = kj::newDiskFilesystem();
+  for (auto file : request.getRequestedFiles()) {
+    auto path     = kj::Path::parse(kj::str(file.getFilename(), ".formatter.cc"));
+    auto replacer = filesystem->getCurrent().replaceFile(
+        path, kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT);
+    replacer->get().writeAll(generator.Generate(file));
+    replacer->commit();
+  }
+  return 0;
+}
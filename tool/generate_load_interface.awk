@@ -28,6 +28,6 @@ FNR == 1 {
     interface=namespace "::" interface
   }
 
-  # Print C++ code to load interface
-  print "  loader.loadCompiledTypeAndDependencies<" interface ">();"
+  # Print an entry of the table of interface ID -> function to load interface
+  print "    {capnp::typeId<" interface ">(), &LoadCompiledInterface<" interface ">},"
 }